@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct llama_adapter_lora;
+
+namespace solus {
+
+// Per-user LoRA adapters read from <dir>/<user_id>.gguf on first use. Loaded
+// adapters are kept within a memory budget, unloading the least recently
+// used first. A file replaced on disk is reloaded on its next use and a
+// removed one is dropped, so adapters can be updated without a restart.
+// Handles are shared: an evicted adapter stays alive while a context still
+// applies it.
+class AdapterCache {
+public:
+  using Handle = std::shared_ptr<llama_adapter_lora>;
+  using Loader = std::function<Handle(const std::string &path)>;
+
+  // budget_bytes of 0 disables eviction.
+  AdapterCache(std::string dir, size_t budget_bytes, Loader loader);
+
+  AdapterCache(const AdapterCache &) = delete;
+  AdapterCache &operator=(const AdapterCache &) = delete;
+
+  // The user's adapter, loading it if needed. nullptr if the user has none
+  // or it failed to load; a failed file is not retried until it changes.
+  Handle acquire(const std::string &user_id);
+  // Whether an adapter file exists for the user, without loading it.
+  bool has_adapter(const std::string &user_id) const;
+  // Empty when the user ID cannot name a file in the directory.
+  std::string path_for(const std::string &user_id) const;
+
+  size_t loaded() const;
+  size_t loaded_bytes() const;
+
+private:
+  struct Entry {
+    Handle adapter; // null after a failed load
+    size_t size_bytes = 0;
+    std::filesystem::file_time_type mtime;
+    uint64_t last_used = 0;
+  };
+
+  void evict_for(size_t incoming_bytes, const std::string &incoming);
+  size_t loaded_bytes_locked() const;
+
+  std::string m_Dir;
+  size_t m_BudgetBytes;
+  Loader m_Loader;
+  uint64_t m_Clock = 0;
+  std::unordered_map<std::string, Entry> m_Entries;
+  mutable std::mutex m_Mutex;
+};
+
+} // namespace solus
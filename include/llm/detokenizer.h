@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace solus {
+
+// Every vocabulary piece laid out in one contiguous buffer, built once per
+// model so detokenizing is a lookup instead of a llama_token_to_piece call.
+class TokenPieceTable {
+public:
+  // Writes the piece for token into buf and returns its length, or the
+  // negated required size when buf is too small (llama_token_to_piece
+  // convention).
+  using PieceFn = std::function<int(int32_t token, char *buf, int size)>;
+
+  TokenPieceTable() = default;
+
+  void build(int n_vocab, const PieceFn &piece_fn);
+
+  std::string_view piece(int32_t token) const {
+    if (token < 0 || static_cast<size_t>(token) + 1 >= m_Offsets.size()) {
+      return {};
+    }
+    return std::string_view(m_Bytes).substr(
+        m_Offsets[token], m_Offsets[token + 1] - m_Offsets[token]);
+  }
+  size_t size() const { return m_Offsets.empty() ? 0 : m_Offsets.size() - 1; }
+  size_t bytes_used() const { return m_Bytes.size(); }
+
+private:
+  std::vector<uint32_t> m_Offsets; // n_vocab + 1 entries
+  std::string m_Bytes;
+};
+
+// Turns a token stream into text one step at a time. Bytes of a UTF-8
+// sequence that is split across tokens are held back until it completes,
+// so every delta is valid on its own.
+class IncrementalDetokenizer {
+public:
+  explicit IncrementalDetokenizer(const TokenPieceTable &table)
+      : m_Table(table) {}
+
+  // The returned view is valid until the next call.
+  std::string_view push(int32_t token);
+  // Releases any held-back bytes at the end of the stream.
+  std::string_view flush();
+
+  const std::string &text() const { return m_Text; }
+  std::string take_text() { return std::move(m_Text); }
+
+private:
+  const TokenPieceTable &m_Table;
+  std::string m_Text;
+  size_t m_Emitted = 0;
+};
+
+// Length of the longest prefix of text that does not end inside a UTF-8
+// sequence.
+size_t utf8_complete_prefix(std::string_view text);
+
+} // namespace solus
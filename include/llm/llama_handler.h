@@ -1,9 +1,15 @@
 #pragma once
 
 #include "llama.h"
+#include "llm/adapter_cache.h"
+#include "llm/detokenizer.h"
 #include "server/config.h"
+#include <functional>
+#include <memory>
+#include <optional>
 #include <mutex>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace solus {
@@ -15,6 +21,27 @@ struct GenerationParams {
   int max_tokens = 1024;
   int repeat_last_n = 64;
   float repeat_penalty = 1.1f;
+  int n_keep = 0; // prompt tokens kept when the context shifts
+  uint32_t seed = LLAMA_DEFAULT_SEED;
+  // User whose LoRA adapter to apply; the base model if empty or the user
+  // has none.
+  std::string adapter;
+};
+
+// One finished sequence of generate_batch.
+struct BatchOutput {
+  size_t index = 0; // position in the prompts passed in
+  std::string text;
+  size_t n_prompt = 0;
+  size_t n_reused = 0; // prompt tokens whose KV was shared, not decoded
+  int n_generated = 0;
+  std::string error; // empty on success
+};
+
+// Model metadata read from the GGUF header without loading weights.
+struct ModelInfo {
+  int n_embd = 0;
+  int n_vocab = 0;
 };
 
 class LlamaHandler {
@@ -27,25 +54,110 @@ public:
   LlamaHandler(LlamaHandler &&) = delete;
   LlamaHandler &operator=(LlamaHandler &&) = delete;
 
+  // Receives each generated piece of text as it is sampled; returning false
+  // stops generation early.
+  using TextCallback = std::function<bool(std::string_view)>;
+  using BatchCallback = std::function<void(BatchOutput &&)>;
+
   bool initialize();
 
+  // n_generated, if set, receives the number of tokens sampled and decoded.
   std::string generate(const std::string &prompt,
-                       const GenerationParams &params);
+                       const GenerationParams &params,
+                       const TextCallback &on_text = nullptr,
+                       int *n_generated = nullptr);
+  std::string generate(const std::vector<llama_token> &prompt_tokens,
+                       const GenerationParams &params,
+                       const TextCallback &on_text = nullptr,
+                       int *n_generated = nullptr);
+  // Waits for the decodes generate queued; on a GPU llama_decode can return
+  // before they have run.
+  void synchronize();
+  // Generates for many prompts, keeping up to n_parallel sequences in
+  // flight in one context. A new sequence copies the KV of the longest
+  // prefix it shares with any resident sequence, so feeding prompts sorted
+  // by tokens maximizes reuse. on_done runs as each sequence finishes, in
+  // completion order. Invalidates the prefix cache of generate.
+  // An adapter applies to the whole context, so all prompts of one call
+  // share params.adapter; group prompts by adapter across calls.
+  void generate_batch(const std::vector<std::vector<llama_token>> &prompts,
+                      const GenerationParams &params,
+                      const BatchCallback &on_done);
+  // Writes the KV of the prefix kept across requests (the system prompt of
+  // the last generate) so a restarted process can skip its prefill. Fails
+  // while an adapter is applied, as that KV is only valid under it.
+  bool save_prefix_state(const std::string &path);
+  // Restores a save_prefix_state file; generate then reuses it like any
+  // cached prefix. Only valid for the same model and KV cache types.
+  bool load_prefix_state(const std::string &path);
+  // Whether the user has an adapter file; nothing is loaded.
+  bool has_adapter(const std::string &user_id) const;
+  // Null when lora_dir is not set.
+  const AdapterCache *adapters() const { return m_Adapters.get(); }
+  // Embeddings always come from the base model, so memories stay in one
+  // vector space whatever adapter a user has.
   std::vector<float> get_embedding(const std::string &text);
+  // Embeds many texts, packing several sequences into each decode. Entries
+  // are empty for texts that failed.
+  std::vector<std::vector<float>>
+  get_embeddings(const std::vector<std::string> &texts);
 
-  bool is_initialized() const { return m_Model != nullptr && m_Ctx != nullptr; }
+  bool is_initialized() const {
+    return m_Model != nullptr && m_Ctx != nullptr &&
+           (m_EmbdCtx != nullptr || m_Config.embedding_batch_size <= 0);
+  }
   int get_context_size() const { return m_Config.n_ctx; }
+  // Tokens whose KV the generation context holds, in position order.
+  const std::vector<llama_token> &get_cached_tokens() const {
+    return m_CachedTokens;
+  }
   int get_embedding_dim() const;
+  int get_vocab_size() const;
 
-private:
+  // Maps "f32", "f16", "bf16", "q8_0", "q5_1", "q5_0", "q4_1" and "q4_0" to
+  // a KV cache type.
+  static bool parse_cache_type(const std::string &name, ggml_type &type);
+  static bool parse_flash_attn(const std::string &name,
+                               llama_flash_attn_type &type);
+
+  static bool read_model_info(const std::string &path, ModelInfo &info);
+  // Starts kernel readahead of the weights file so the load that follows
+  // finds it in the page cache.
+  static void prefetch_file(const std::string &path);
+
+  // parse_special turns control-token text such as <|im_start|> into the
+  // control token; leave it off for user-supplied text.
   std::vector<llama_token> tokenize(const std::string &text,
-                                    bool add_bos = true);
-  std::string detokenize(const std::vector<llama_token> &tokens);
+                                    bool add_bos = true,
+                                    bool parse_special = false);
+
+private:
+  void build_piece_table();
+  // Drops half of the tokens after n_keep from the KV cache and slides the
+  // rest back. Returns false if the cache cannot be shifted.
+  bool shift_context(size_t n_keep);
+  // Creates pinned pools when a placement is configured; thread counts are
+  // lowered to fit their CPU sets.
+  bool create_threadpools(int &n_threads, int &n_threads_batch);
+  // Makes the user's adapter the one applied to m_Ctx. A change drops the
+  // cached KV, which was computed under the previous weights.
+  void apply_adapter(const std::string &user_id);
 
   ServerConfig m_Config;
   llama_model *m_Model;
   llama_context *m_Ctx;
+  llama_context *m_EmbdCtx; // pooled embeddings, separate from generation
+  ggml_threadpool *m_Threadpool = nullptr;      // single-token decode
+  ggml_threadpool *m_ThreadpoolBatch = nullptr; // prompt prefill
+  ggml_threadpool *m_EmbdThreadpool = nullptr;  // embedding context
+  TokenPieceTable m_Pieces;
+  std::vector<llama_token> m_CachedTokens; // decoded into m_Ctx, in order
+  size_t m_PrefixTokens = 0;               // n_keep of the last generate
+  std::unique_ptr<AdapterCache> m_Adapters;
+  AdapterCache::Handle m_ActiveAdapter; // applied to m_Ctx
+  bool m_BackendAcquired = false;
   std::mutex m_InterferenceMutex;
+  std::mutex m_EmbeddingMutex;
 };
 
 } // namespace solus
\ No newline at end of file
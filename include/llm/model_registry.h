@@ -0,0 +1,83 @@
+#pragma once
+
+#include "llm/llama_handler.h"
+#include "server/config.h"
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace solus {
+
+struct ModelStatus {
+  std::string name;
+  std::string path;
+  size_t size_bytes = 0;
+  bool loaded = false;
+  bool pinned = false;
+};
+
+// Named GGUF models loaded on first use. The first model is pinned (it
+// serves embeddings and memory tokens); the others are unloaded least
+// recently used first whenever loading one would exceed the memory budget.
+// Models a request is still using are not evicted; when nothing else can
+// go, the load exceeds the budget.
+class ModelRegistry {
+public:
+  using Loader =
+      std::function<std::shared_ptr<LlamaHandler>(const ModelSpec &)>;
+
+  // budget_bytes of 0 disables eviction. Specs that point at the same file
+  // share one loaded model.
+  ModelRegistry(std::vector<ModelSpec> models, size_t budget_bytes,
+                Loader loader);
+
+  ModelRegistry(const ModelRegistry &) = delete;
+  ModelRegistry &operator=(const ModelRegistry &) = delete;
+
+  // Loads the pinned default model.
+  bool initialize();
+
+  // Loads the model if needed. Returns nullptr for unknown names or failed
+  // loads; an empty name selects the default.
+  std::shared_ptr<LlamaHandler> acquire(const std::string &name);
+  std::shared_ptr<LlamaHandler> default_model() const;
+
+  bool contains(const std::string &name) const;
+  const ModelSpec *find_spec(const std::string &name) const;
+  const std::string &default_name() const { return m_Specs.front().name; }
+  std::vector<ModelStatus> status() const;
+  size_t loaded_bytes() const;
+
+  // Builds handlers from config, giving extra models no embedding context.
+  static Loader make_loader(const ServerConfig &config);
+  // The default model followed by config.models.
+  static std::vector<ModelSpec> specs_from_config(const ServerConfig &config);
+
+private:
+  struct Slot {
+    std::string path;
+    size_t size_bytes = 0;
+    bool pinned = false;
+    bool loading = false;
+    uint64_t last_used = 0;
+    std::shared_ptr<LlamaHandler> handler;
+  };
+
+  Slot *slot_for(const std::string &name);
+  void evict_for(size_t incoming_bytes, const Slot &incoming);
+
+  std::vector<ModelSpec> m_Specs;
+  std::vector<size_t> m_SpecSlots; // spec index -> slot index
+  std::vector<Slot> m_Slots;
+  size_t m_BudgetBytes;
+  Loader m_Loader;
+  uint64_t m_Clock = 0;
+  mutable std::mutex m_Mutex;
+  std::condition_variable m_LoadCv;
+};
+
+} // namespace solus
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "llm/llama_handler.h"
+#include <nlohmann/json.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace solus {
+
+struct BenchOptions {
+  size_t prompt_tokens = 512; // prefill and time-to-first-token prompts
+  size_t decode_tokens = 128; // generated per decode run
+  size_t embed_words = 48;    // words per embedded text
+  std::vector<size_t> concurrency = {1, 2, 4, 8};
+  size_t batch_prompt_tokens = 64;
+  size_t batch_decode_tokens = 32;
+  int repetitions = 5; // each metric is the median, after one warm-up run
+  uint32_t seed = 42;
+};
+
+struct BenchMetric {
+  std::string name;
+  double value = 0.0;
+  std::string unit;
+  bool higher_is_better = true;
+};
+
+struct BenchDelta {
+  std::string name;
+  double baseline = 0.0;
+  double current = 0.0;
+  double change = 0.0;  // relative; positive is worse
+  bool missing = false; // absent from the current results
+  bool regressed = false;
+};
+
+// Measures LlamaHandler throughput: prefill and decode tokens/s, time to
+// first token, embedding latency and generated tokens/s with several
+// sequences in flight through generate_batch. Prompts are random tokens, so
+// no run reuses the KV of another.
+class ThroughputBench {
+public:
+  // The handler needs n_parallel of at least the largest concurrency and a
+  // context that holds that many prompts and replies.
+  explicit ThroughputBench(LlamaHandler &llm);
+
+  std::vector<BenchMetric> run(const BenchOptions &options);
+
+  // {"metrics": {name: {"value", "unit", "higher_is_better"}}}
+  static nlohmann::json to_json(const std::vector<BenchMetric> &metrics);
+  // One delta per baseline metric; a metric missing from current counts as
+  // a regression.
+  static std::vector<BenchDelta> compare(const nlohmann::json &current,
+                                         const nlohmann::json &baseline,
+                                         double threshold);
+
+private:
+  std::vector<llama_token> random_prompt(size_t n_tokens);
+  std::string random_text(size_t n_words);
+
+  LlamaHandler &m_Llama;
+  std::mt19937 m_Rng;
+};
+
+} // namespace solus
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "ggml.h"
+#include <cstdint>
+#include <string>
+
+namespace solus {
+
+// Shape of a random-weight llama-architecture model. Dimensions must be
+// multiples of the weight type's block size (256 covers every type).
+struct TinyModelSpec {
+  int n_vocab = 512; // at least 384: 259 special and byte tokens come first
+  int n_embd = 256;
+  int n_layer = 4;
+  int n_head = 4;
+  int n_head_kv = 4;
+  int n_ff = 768;
+  int n_ctx_train = 4096;
+  ggml_type weight_type = GGML_TYPE_Q4_0; // norms stay f32
+  uint32_t seed = 42;
+};
+
+// Writes a GGUF model with random weights and a byte-fallback SentencePiece
+// vocabulary, so LlamaHandler can be exercised without downloading a model.
+// The output rows of special and byte tokens are zero, which keeps them out
+// of top-k sampling: generation runs to max_tokens and every sampled token
+// is printable text.
+bool write_tiny_model(const std::string &path, const TinyModelSpec &spec);
+
+} // namespace solus
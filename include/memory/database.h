@@ -1,10 +1,20 @@
 #pragma once
 
+#include "memory/ivf_pq.h"
+#include "memory/mapped_hnsw.h"
+#include "memory/string_arena.h"
+#include "memory/vector_file.h"
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <hnswlib.h>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 namespace solus {
@@ -14,18 +24,97 @@ struct MemoryEntry {
   std::string conversation_id;
   std::string text;
   int64_t timestamp;
+  uint32_t hit_count; // times a near-duplicate was merged into this entry
+  std::vector<int32_t> tokens; // token IDs of text, no special tokens
 
-  MemoryEntry() : timestamp(0) {}
+  MemoryEntry() : timestamp(0), hit_count(1) {}
 
   MemoryEntry(const std::string &uid, const std::string &cid,
               const std::string &txt, int64_t ts)
-      : user_id(uid), conversation_id(cid), text(txt), timestamp(ts) {}
+      : user_id(uid), conversation_id(cid), text(txt), timestamp(ts),
+        hit_count(1) {}
+};
+
+// Read-only view of a stored memory. The strings point into the database's
+// append-only storage and stay valid for the lifetime of the database.
+struct MemoryView {
+  std::string_view user_id;
+  std::string_view conversation_id;
+  std::string_view text;
+  int64_t timestamp = 0;
+  uint32_t hit_count = 1;
+  std::span<const int32_t> tokens; // empty if not tokenized at insert
+
+  MemoryView() = default;
+
+  MemoryView(std::string_view uid, std::string_view cid, std::string_view txt,
+             int64_t ts, uint32_t hits, std::span<const int32_t> toks)
+      : user_id(uid), conversation_id(cid), text(txt), timestamp(ts),
+        hit_count(hits), tokens(toks) {}
+
+  explicit MemoryView(const MemoryEntry &entry)
+      : user_id(entry.user_id), conversation_id(entry.conversation_id),
+        text(entry.text), timestamp(entry.timestamp),
+        hit_count(entry.hit_count), tokens(entry.tokens) {}
+};
+
+// A group of one user's old, closely related memories that can be replaced
+// by a single condensed entry.
+struct MemoryCluster {
+  std::string user_id;
+  std::vector<size_t> ids;
+  std::vector<std::string> texts; // same order as ids, oldest first
+  int64_t timestamp = 0;          // newest member
+  uint32_t hit_count = 0;         // summed over members
+};
+
+struct MemoryDatabaseOptions {
+  // Users with at most this many memories are searched with an exact scan
+  // over their own vector block; heavier users go through the HNSW graph.
+  size_t brute_force_threshold = 4096;
+  // New memories whose cosine similarity to the user's nearest existing
+  // memory is at or above this merge into it instead of adding a node.
+  // Zero or less disables the check.
+  float dedup_threshold = 0.97f;
+  // HNSW graph parameters. M and ef_construction only apply when a new
+  // index is built; a loaded index keeps the values it was built with.
+  size_t hnsw_m = 16;
+  size_t hnsw_ef_construction = 200;
+  size_t hnsw_ef_search = 64;
+  // enqueue_entry hands graph insertion to a background thread; until then
+  // queued memories are found by an exact scan. Off makes it add_entry.
+  bool background_indexing = false;
+  // Keep vectors and level-0 links in a file mapping (level0.bin) that is
+  // paged in on demand instead of reading index.bin into memory. An existing
+  // index.bin is migrated on load. A database already in the mapped format
+  // is opened that way regardless.
+  bool mmap_storage = false;
+  // Search heavy users through an IVF-PQ index instead of HNSW. Full
+  // vectors stay in a file mapping (vectors.bin) for exact scans and
+  // reranking; only the 4-bit codes are held in memory. The index is
+  // trained from the stored vectors once ivf_train_size exist (0 = 39 *
+  // nlist) and heavy users are scanned exactly until then. An existing
+  // index.bin is migrated on load; a database already in this format is
+  // opened that way regardless.
+  bool ivf_pq = false;
+  IvfPqParams ivf;
+  size_t ivf_train_size = 0;
+  // Open the database for searches only. Files are mapped without write
+  // access and nothing is saved back; inserts and removals are refused.
+  // Format migrations are skipped, and a missing database opens empty.
+  bool read_only = false;
+  // Identifies the vocabulary stored token IDs belong to. Persisted tokens
+  // are discarded on load when it does not match.
+  std::string tokenizer_id;
 };
 
 class MemoryDatabase {
 public:
+  enum class EInsertResult { ADDED, MERGED, FAILED };
+
   MemoryDatabase(const std::string &db_path, int dimension,
-                 int max_elements = 1000000);
+                 int max_elements = 1000000,
+                 const MemoryDatabaseOptions &options = {});
   ~MemoryDatabase();
 
   // Delete copy/move constructors
@@ -37,25 +126,155 @@ public:
   bool initialize();
 
   void add_entry(const MemoryEntry &entry, const std::vector<float> &embedding);
+  // Stores the entry and returns without touching the graph. It is visible
+  // to searches immediately; dedup runs when the indexer picks it up.
+  void enqueue_entry(const MemoryEntry &entry,
+                     const std::vector<float> &embedding);
+  // Indexes everything queued before returning, unless an insert fails.
+  void flush();
+  // Bulk insert. HNSW insertion is spread across n_threads (0 = all cores)
+  // and the lock is released between chunks of entries.
+  std::vector<EInsertResult>
+  add_entries(const std::vector<MemoryEntry> &entries,
+              const std::vector<std::vector<float>> &embeddings,
+              int n_threads = 0);
 
-  std::vector<MemoryEntry>
+  std::vector<MemoryView>
   search_entries(const std::vector<float> &query_embedding,
                  const std::string &user_id, int k = 5);
 
+  // Live memories of one user with their stored unit vectors, e.g. to move
+  // the user to another shard.
+  std::vector<std::pair<MemoryEntry, std::vector<float>>>
+  export_user(const std::string &user_id);
+  // Tombstones the user's memories: graph nodes are marked deleted and the
+  // rows stay (labels are row indexes) but are no longer searched or
+  // counted. Returns how many were removed.
+  size_t remove_user(const std::string &user_id);
+
+  // Next cluster of min_size to max_size live memories of one user, all
+  // older than older_than and at least similarity (cosine) from the
+  // cluster's seed. Each call resumes where the last stopped and looks at a
+  // bounded number of seeds, so it is cheap enough to poll.
+  std::optional<MemoryCluster> find_cluster(int64_t older_than,
+                                            float similarity,
+                                            size_t min_size, size_t max_size);
+  // Adds summary and tombstones the cluster under one lock hold, so a
+  // search sees either the members or the summary. Returns false, changing
+  // nothing, if a member was removed or merged into since find_cluster.
+  bool replace_cluster(const MemoryCluster &cluster,
+                       const MemoryEntry &summary,
+                       const std::vector<float> &embedding);
+
   void save_index();
+  // Writes the same files as save_index into dir, e.g. for a capture.
+  bool save_snapshot(const std::string &dir);
   void load_index();
 
-  size_t get_entry_count() const { return m_Entries.size(); }
+  size_t get_entry_count() const;
+  size_t get_pending_count() const { return m_PendingCount; }
+
+  // Embedding size of the database saved under db_path, read from its index
+  // files; 0 when there is none.
+  static int stored_dimension(const std::string &db_path);
+  // IDs of the memories that are stored and not removed.
+  std::vector<size_t> live_ids() const;
+  // Stored unit vector of id; false for a row with none, e.g. a failed
+  // insert.
+  bool get_vector(size_t id, std::vector<float> &out) const;
 
 private:
+  // Compact row of the entry table: IDs are interned, text lives in the
+  // arena.
+  struct EntryRecord {
+    uint32_t user;
+    uint32_t conversation;
+    std::string_view text;
+    std::span<const int32_t> tokens;
+    int64_t timestamp;
+    uint32_t hit_count;
+    bool removed = false;
+  };
+
+  // Contiguous copy of one user's vectors, scanned exactly while the user is
+  // below the brute-force threshold. Released once the user turns heavy.
+  struct UserBlock {
+    std::vector<float> vectors;
+    std::vector<size_t> ids;
+    size_t count = 0;
+    bool heavy = false;
+    bool loaded = true; // false: ids known, vectors still in the mapping
+  };
+
+  // Queued for the indexer. The row is already in the arenas so views of it
+  // stay valid after it moves into m_Entries.
+  struct PendingEntry {
+    EntryRecord record;
+    std::vector<float> vector; // unit length
+  };
+
+  // (distance, id) pairs, closest first. Distance is 1 - cosine.
+  using Hits = std::vector<std::pair<float, size_t>>;
+
+  bool writable() const; // logs when the database is read-only
+  bool merge_duplicate(const MemoryEntry &entry, const float *normalized);
+  bool merge_duplicate(uint32_t user, uint32_t hit_count, int64_t timestamp,
+                       const float *normalized);
+  void ensure_capacity(size_t additional);
+  // Inserts count vectors as labels first_id...; returns which succeeded.
+  std::vector<char> add_points(const float *vectors, size_t count,
+                               size_t first_id, int n_threads);
+  EntryRecord make_record(const MemoryEntry &entry);
+  void append_record(const MemoryEntry &entry);
+  void append_to_user_block(uint32_t user, size_t id, const float *embedding);
+  void load_user_block(UserBlock &block);
+  void remove_from_user_block(uint32_t user, const std::vector<size_t> &ids);
+  // Unit vector stored for id; false for a row whose insert failed.
+  bool stored_vector(size_t id, std::vector<float> &out) const;
+  void create_ivf();
+  // Trains the IVF-PQ index from the stored vectors and adds all of them.
+  void train_ivf();
+  void migrate_to_ivf(); // HNSW rows into vectors.bin, m_DbMutex held
+  // Indexes up to max queued entries. False when the queue was empty or
+  // the insert failed, in which case the entries stay queued.
+  bool index_pending(size_t max);
+  void indexer_loop();
+  void stop_indexer();
+  MemoryView view(size_t id) const;
+  MemoryView view(const EntryRecord &record) const;
+  bool save_files(const std::string &dir); // m_DbMutex held
+  void save_tokens(const std::string &path) const;
+  void load_tokens(const std::string &path);
+  Hits search_user(const float *query, uint32_t user, int k);
+  Hits search_exact(const UserBlock &block, const float *query, int k) const;
+  Hits search_index(const float *query, uint32_t user, int k) const;
+
   std::string m_DbPath;
   int m_Dimension;
   int m_MaxElements;
+  MemoryDatabaseOptions m_Options;
 
   std::unique_ptr<hnswlib::HierarchicalNSW<float>> m_Index;
+  MappedHnswIndex *m_Mapped = nullptr; // m_Index when it is file-backed
   std::unique_ptr<hnswlib::InnerProductSpace> m_Space;
+  // IVF-PQ mode, instead of m_Index: row i of m_Vectors is ID i, and once
+  // trained every row is in m_Ivf.
+  std::unique_ptr<VectorFile> m_Vectors;
+  std::unique_ptr<IvfPqIndex> m_Ivf;
 
-  std::vector<MemoryEntry> m_Entries;
-  std::mutex m_DbMutex;
+  std::vector<EntryRecord> m_Entries;
+  size_t m_Removed = 0; // tombstoned rows in m_Entries
+  size_t m_ClusterCursor = 0; // next seed row for find_cluster
+  std::vector<UserBlock> m_UserBlocks; // indexed by interned user ID
+  StringInterner m_UserIds;
+  StringInterner m_ConversationIds;
+  StringArena m_TextArena;
+  TokenArena m_TokenArena;
+  mutable std::mutex m_DbMutex;
+  std::vector<PendingEntry> m_Pending; // m_DbMutex
+  std::atomic<size_t> m_PendingCount{0};
+  std::thread m_Indexer;
+  std::condition_variable m_PendingCv;
+  bool m_StopIndexer = false; // m_DbMutex
 };
-} // namespace solus
\ No newline at end of file
+} // namespace solus
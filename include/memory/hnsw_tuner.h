@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace solus {
+
+struct HnswTuneOptions {
+  std::vector<size_t> m_values = {8, 12, 16, 24, 32};
+  std::vector<size_t> ef_values = {10, 16, 32, 64, 128, 256};
+  size_t ef_construction = 200;
+  int k = 5;
+};
+
+struct HnswTuneResult {
+  size_t m = 0;
+  size_t ef = 0;
+  double recall = 0.0; // recall@k against the exact scan
+  double p50_us = 0.0;
+  double p99_us = 0.0;
+  double build_ms = 0.0;
+};
+
+// Sweeps HNSW parameters over a sample of stored vectors and measures
+// recall@k and query latency against exact inner-product ground truth.
+// Vectors are row-major and should be unit length, as stored by
+// MemoryDatabase.
+class HnswTuner {
+public:
+  HnswTuner(int dimension, std::vector<float> base, std::vector<float> queries);
+
+  std::vector<HnswTuneResult> run(const HnswTuneOptions &options);
+
+  // Cheapest setting (lowest p50, then smallest M) reaching target_recall,
+  // or nullptr if none does.
+  static const HnswTuneResult *
+  recommend(const std::vector<HnswTuneResult> &results, double target_recall);
+
+  size_t base_count() const { return m_Base.size() / m_Dimension; }
+  size_t query_count() const { return m_Queries.size() / m_Dimension; }
+
+private:
+  void compute_ground_truth(int k);
+
+  size_t m_Dimension;
+  std::vector<float> m_Base;
+  std::vector<float> m_Queries;
+  std::vector<std::vector<size_t>> m_GroundTruth;
+};
+
+} // namespace solus
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace solus {
+
+struct IvfPqParams {
+  size_t nlist = 256;   // coarse k-means lists
+  size_t m = 64;        // PQ sub-quantizers, rounded down to divide dim
+  size_t nprobe = 16;   // lists scanned per query
+  size_t rerank = 4;    // exact rescoring of k * rerank candidates, 0 = off
+};
+
+// Inverted-file index with 4-bit product quantization for unit vectors under
+// inner product. Each vector is assigned to its nearest coarse centroid and
+// its residual is stored as m 4-bit codes, so an entry costs m / 2 bytes
+// plus its ID instead of dim floats and graph links.
+//
+// Codes are kept in blocks of 32 vectors with two sub-quantizers per byte,
+// the layout the AVX2 scan needs to look up 32 distances per shuffle. The
+// lookup tables are quantized to 8 bits per query, so scan distances are
+// approximate; rerank rescores the best candidates from exact vectors.
+//
+// Not thread-safe; MemoryDatabase serializes access.
+class IvfPqIndex {
+public:
+  // Candidate filter; only IDs it accepts are returned.
+  using Filter = std::function<bool(size_t)>;
+  // Exact unit vector of an ID, or nullptr. Used for reranking.
+  using VectorSource = std::function<const float *(size_t)>;
+  // (distance, id) pairs, closest first. Distance is 1 - inner product.
+  using Hits = std::vector<std::pair<float, size_t>>;
+
+  IvfPqIndex(size_t dim, const IvfPqParams &params);
+
+  // k-means over n vectors for the coarse centroids, then per sub-quantizer
+  // over their residuals. Clears anything added before.
+  bool train(const float *vectors, size_t n, uint32_t seed = 42);
+  bool trained() const { return m_Trained; }
+
+  void add(size_t id, const float *vector);
+  Hits search(const float *query, size_t k, const Filter &filter,
+              const VectorSource &exact) const;
+
+  size_t size() const { return m_Count; }
+  size_t dim() const { return m_Dim; }
+  size_t sub_quantizers() const { return m_M; }
+  // Codes and IDs held in memory, excluding centroids and codebooks.
+  size_t code_bytes() const;
+
+  bool save(const std::string &path) const;
+  // Takes nlist and m from the file; nprobe and rerank stay as constructed.
+  bool load(const std::string &path);
+  // Vector size a saved index was built for; 0 if the file is unreadable.
+  static size_t stored_dimension(const std::string &path);
+
+private:
+  struct List {
+    std::vector<uint64_t> ids;
+    std::vector<uint8_t> codes; // [block][m / 2][32]
+  };
+
+  static constexpr size_t kCodes = 16; // centroids per sub-quantizer
+  static constexpr size_t kBlock = 32; // vectors per code block
+
+  size_t nearest_list(const float *vector) const;
+  void encode(const float *residual, uint8_t *codes) const;
+  // Adds the distances of one block's codes to acc, 32 lanes.
+  void scan_block(const uint8_t *block, const uint8_t *lut,
+                  uint16_t *acc) const;
+
+  size_t m_Dim;
+  IvfPqParams m_Params;
+  size_t m_M;      // sub-quantizers actually used
+  size_t m_SubDim; // m_Dim / m_M
+  bool m_Trained = false;
+  size_t m_Count = 0;
+  std::vector<float> m_Centroids; // nlist x dim
+  std::vector<float> m_Codebooks; // m x 16 x sub_dim
+  std::vector<List> m_Lists;
+};
+
+} // namespace solus
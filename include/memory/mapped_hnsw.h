@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <hnswlib.h>
+#include <memory>
+#include <string>
+
+namespace solus {
+
+// HNSW index whose level-0 block (every element's base-layer links, vector
+// and label) lives in a shared file mapping, dir/level0.bin, instead of
+// anonymous memory. Pages are read on demand, so opening a large index costs
+// only the upper layers and labels in dir/graph.bin, and processes opening
+// the same directory share the page cache. The writer holds an exclusive
+// flock on level0.bin and readers a shared one, so a directory has either
+// one writer or any number of readers; a conflicting open fails.
+//
+// Base-layer edits reach the file as they happen; graph.bin is written by
+// save(). After a crash between the two, opening drops links to elements
+// graph.bin does not know about and searches new neighbours for the nodes
+// that had them.
+class MappedHnswIndex : public hnswlib::HierarchicalNSW<float> {
+public:
+  ~MappedHnswIndex() override;
+
+  static std::unique_ptr<MappedHnswIndex>
+  create(const std::string &dir, hnswlib::SpaceInterface<float> *space,
+         size_t capacity, size_t m, size_t ef_construction);
+  static std::unique_ptr<MappedHnswIndex>
+  open(const std::string &dir, hnswlib::SpaceInterface<float> *space);
+  // Maps level0.bin without write access. Inserts throw, and save() only
+  // writes to other directories.
+  static std::unique_ptr<MappedHnswIndex>
+  open_readonly(const std::string &dir, hnswlib::SpaceInterface<float> *space);
+  // Copies an in-memory index into a new mapping under dir.
+  static std::unique_ptr<MappedHnswIndex>
+  adopt(const std::string &dir, hnswlib::SpaceInterface<float> *space,
+        const hnswlib::HierarchicalNSW<float> &source);
+  static bool exists(const std::string &dir);
+  // Vector size of the index under dir, from graph.bin; 0 if unreadable.
+  static size_t stored_dimension(const std::string &dir);
+  static void remove_files(const std::string &dir);
+
+  void addPoint(const void *data_point, hnswlib::labeltype label,
+                bool replace_deleted = false) override;
+  // Replaces resizeIndex, which would realloc the mapping.
+  bool grow(size_t capacity);
+  // Syncs the mapping and writes graph.bin into dir; another directory also
+  // gets a copy of level0.bin.
+  bool save(const std::string &dir);
+
+  size_t mapped_bytes() const { return m_Bytes; }
+  bool read_only() const { return m_ReadOnly; }
+
+private:
+  enum class EAccess {
+    CREATE,       // emptied, then sized
+    WRITE,        // existing file, shared mapping
+    READ,         // read-only mapping
+    READ_PRIVATE, // read-only file, copy-on-write mapping for repairs
+  };
+
+  MappedHnswIndex(hnswlib::SpaceInterface<float> *space, size_t capacity,
+                  size_t m, size_t ef_construction);
+
+  static std::unique_ptr<MappedHnswIndex>
+  open_dir(const std::string &dir, hnswlib::SpaceInterface<float> *space,
+           bool read_only);
+  bool map_file(const std::string &path, size_t bytes, EAccess access);
+  void repair_links();
+  void mark_dirty();
+
+  std::string m_Dir;
+  int m_Fd = -1;
+  char *m_Data = nullptr;
+  size_t m_Bytes = 0;
+  bool m_ReadOnly = false;
+  std::atomic<bool> m_Dirty{false}; // level 0 changed since graph.bin
+};
+
+} // namespace solus
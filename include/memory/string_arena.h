@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+namespace solus {
+
+// Append-only storage for trivially copyable items. Returned spans stay
+// valid for the lifetime of the arena because chunks are never moved or
+// freed.
+template <typename T> class ChunkedArena {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+  explicit ChunkedArena(size_t chunk_size = (1 << 20) / sizeof(T))
+      : m_ChunkSize(chunk_size), m_Cursor(nullptr), m_Remaining(0),
+        m_Used(0) {}
+
+  ChunkedArena(const ChunkedArena &) = delete;
+  ChunkedArena &operator=(const ChunkedArena &) = delete;
+
+  std::span<const T> append(std::span<const T> items) {
+    if (items.empty()) {
+      return {};
+    }
+    m_Used += items.size();
+    if (items.size() > m_Remaining) {
+      // Oversized runs get a chunk of their own; the current chunk keeps
+      // serving the small ones.
+      if (items.size() > m_ChunkSize) {
+        m_Chunks.push_back(std::make_unique<T[]>(items.size()));
+        std::memcpy(m_Chunks.back().get(), items.data(), items.size_bytes());
+        return {m_Chunks.back().get(), items.size()};
+      }
+      m_Chunks.push_back(std::make_unique<T[]>(m_ChunkSize));
+      m_Cursor = m_Chunks.back().get();
+      m_Remaining = m_ChunkSize;
+    }
+    std::memcpy(m_Cursor, items.data(), items.size_bytes());
+    std::span<const T> stored(m_Cursor, items.size());
+    m_Cursor += items.size();
+    m_Remaining -= items.size();
+    return stored;
+  }
+
+  size_t used() const { return m_Used; }
+
+private:
+  size_t m_ChunkSize;
+  std::vector<std::unique_ptr<T[]>> m_Chunks;
+  T *m_Cursor;
+  size_t m_Remaining;
+  size_t m_Used;
+};
+
+using TokenArena = ChunkedArena<int32_t>;
+
+class StringArena {
+public:
+  explicit StringArena(size_t chunk_size = 1 << 20) : m_Storage(chunk_size) {}
+
+  std::string_view append(std::string_view str) {
+    auto stored = m_Storage.append(std::span<const char>(str));
+    return {stored.data(), stored.size()};
+  }
+
+  size_t bytes_used() const { return m_Storage.used(); }
+
+private:
+  ChunkedArena<char> m_Storage;
+};
+
+// Maps repeated strings (user and conversation IDs) to dense integer IDs.
+class StringInterner {
+public:
+  static constexpr uint32_t kInvalidId = UINT32_MAX;
+
+  StringInterner() : m_Arena(64 * 1024) {}
+
+  uint32_t intern(std::string_view str);
+  uint32_t find(std::string_view str) const;
+  std::string_view get(uint32_t id) const { return m_Strings[id]; }
+  size_t size() const { return m_Strings.size(); }
+
+private:
+  StringArena m_Arena;
+  std::vector<std::string_view> m_Strings;
+  std::unordered_map<std::string_view, uint32_t> m_Ids;
+};
+
+} // namespace solus
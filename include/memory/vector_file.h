@@ -0,0 +1,48 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+
+namespace solus {
+
+// Append-only array of fixed-size float rows in a shared file mapping. Row
+// i is the vector of memory ID i; pages are read on demand, so a store much
+// larger than RAM costs only what searches touch. The file is grown in
+// place and may hold rows past size() left by a crash; open() is told how
+// many are valid.
+class VectorFile {
+public:
+  explicit VectorFile(size_t dim) : m_Dim(dim) {}
+  ~VectorFile();
+
+  VectorFile(const VectorFile &) = delete;
+  VectorFile &operator=(const VectorFile &) = delete;
+
+  // Maps path, creating it if missing, and keeps its first rows rows. A
+  // read-only file must exist and cannot grow.
+  bool open(const std::string &path, size_t rows, bool read_only = false);
+  // Grows the file so rows rows fit without remapping.
+  bool reserve(size_t rows);
+  bool append(const float *row);
+  // Forgets the rows from rows on, e.g. those of a failed batch.
+  void truncate(size_t rows) { m_Rows = std::min(m_Rows, rows); }
+
+  const float *row(size_t i) const { return m_Data + i * m_Dim; }
+  size_t size() const { return m_Rows; }
+  size_t dim() const { return m_Dim; }
+
+  bool sync();
+  // Writes the valid rows to another file.
+  bool copy_to(const std::string &path) const;
+
+private:
+  size_t m_Dim;
+  int m_Fd = -1;
+  float *m_Data = nullptr;
+  size_t m_Rows = 0;
+  size_t m_Capacity = 0; // rows the mapping holds
+  bool m_ReadOnly = false;
+};
+
+} // namespace solus
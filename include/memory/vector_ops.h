@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace solus {
+
+inline float dot_product(const float *a, const float *b, size_t n) {
+  // Four independent accumulators so the compiler can vectorize the loop
+  // without reassociating a single running sum.
+  float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 += a[i] * b[i];
+    s1 += a[i + 1] * b[i + 1];
+    s2 += a[i + 2] * b[i + 2];
+    s3 += a[i + 3] * b[i + 3];
+  }
+  for (; i < n; i++) {
+    s0 += a[i] * b[i];
+  }
+  return (s0 + s1) + (s2 + s3);
+}
+
+inline void l2_normalize(float *v, size_t n) {
+  const float norm = std::sqrt(dot_product(v, v, n));
+  if (norm > 0.0f) {
+    const float inv = 1.0f / norm;
+    for (size_t i = 0; i < n; i++) {
+      v[i] *= inv;
+    }
+  }
+}
+
+inline std::vector<float> l2_normalized(const std::vector<float> &v) {
+  std::vector<float> out(v);
+  l2_normalize(out.data(), out.size());
+  return out;
+}
+
+} // namespace solus
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "llm/llama_handler.h"
+#include "memory/database.h"
+#include "server/config.h"
+#include "server/prompt_builder.h"
+#include <iosfwd>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+namespace solus {
+
+// Offline inference without the HTTP server. Reads JSONL requests
+// {"id", "text", "user_id"?}, builds chat prompts the way /chat does
+// (retrieving memories when a database and user_id are present), and writes
+// {"id", "response", "action", ...} lines in completion order.
+class BatchRunner {
+public:
+  explicit BatchRunner(const ServerConfig &config);
+
+  bool initialize();
+  bool run(const std::string &input_path, const std::string &output_path);
+
+private:
+  struct Job {
+    nlohmann::json id;
+    std::string text;
+    std::string user_id;
+    std::string adapter; // user_id if that user has a LoRA adapter
+    std::vector<llama_token> tokens;
+  };
+
+  struct Totals {
+    size_t jobs = 0;
+    size_t failed = 0;
+    size_t prompt_tokens = 0;
+    size_t reused_tokens = 0;
+    size_t generated_tokens = 0;
+  };
+
+  void run_chunk(std::vector<Job> &jobs, std::ostream &out, Totals &totals);
+
+  ServerConfig m_Config;
+  std::unique_ptr<LlamaHandler> m_Llama;
+  std::unique_ptr<MemoryDatabase> m_MemoryDb; // null without a database
+  PromptBuilder m_Prompts;
+  PromptBuilder::EPromptFormat m_Format = PromptBuilder::EPromptFormat::QWEN;
+};
+
+} // namespace solus
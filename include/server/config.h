@@ -2,16 +2,48 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 
 namespace solus {
 
+// An additional model requests can select by name. Loaded on first use.
+struct ModelSpec {
+  std::string name;
+  std::string path;
+  std::string prompt_format = "qwen";
+};
+
 struct ServerConfig {
   // Model settings
   std::string model_path = "./models/qwen2.5-14b-instruct-q4_k_m.gguf";
   int n_ctx = 4096;
-  int n_threads = 16;
+  int n_threads = 16;       // single-token decode
+  int n_threads_batch = 0;  // prompt prefill and embeddings, 0 = n_threads
+  // CPU placement: a cpu list such as "0-15" or "node:N"; empty is unpinned.
+  std::string cpus_decode;
+  std::string cpus_batch; // defaults to cpus_decode
+  std::string cpus_http;  // HTTP workers; compute avoids these CPUs
   int n_gpu_layers = 33;
   int n_batch = 512;
+  std::string prompt_format = "qwen"; // qwen, chatml, llama3, mistral
+  std::string cache_type_k = "f16";   // f16, q8_0, q4_0, ...
+  std::string cache_type_v = "f16";   // quantized types need flash_attn
+  std::string flash_attn = "auto";    // auto, on, off
+  bool context_shift = true; // slide past n_ctx, keeping the system prompt
+  int n_parallel = 1; // sequences sharing n_ctx, decoded together (--batch)
+  int embedding_ctx_size = 2048;   // token capacity of one embedding batch
+  int embedding_batch_size = 16;   // sequences embedded per decode, 0 = none
+  std::string model_name = "default"; // name of model_path in requests
+  std::vector<ModelSpec> models;      // extra models, loaded lazily
+  size_t model_memory_budget_mb = 0;  // evict idle models above this, 0 = off
+  // Per-user LoRA adapters, lora_dir/<user_id>.gguf, applied to the
+  // default model and loaded on first use. Empty disables.
+  std::string lora_dir;
+  size_t lora_budget_mb = 512; // unload idle adapters above this, 0 = off
+  float lora_scale = 1.0f;
+  bool mlock = false;            // lock weights in RAM
+  bool prefetch_weights = false; // start readahead of the default model
+  bool warm_up = true;           // decode the system prompt before ready
 
   // Generation settings
   float temperature = 0.7f;
@@ -25,14 +57,64 @@ struct ServerConfig {
   uint16_t port = 8000;
   std::string host = "0.0.0.0";
   int worker_threads = 4;
+  int drain_grace_s = 30; // in-flight requests get this long on SIGTERM
+  // Prefix KV and response cache persisted at shutdown and restored at
+  // startup. Empty disables.
+  std::string warm_state_dir = "./warm_state";
+  // With shards > 1 this process is a front that routes each user to one
+  // of that many worker processes by consistent hash. Worker N keeps its
+  // memory database in memory_db_path/shard-N; the sockets and the shard
+  // map live in shard_dir.
+  int shards = 1;
+  std::string shard_dir = "./shards";
+  std::string shard_socket; // set in workers: serve it instead of HTTP
+  int import_batch_size = 256; // records per /memory/import index batch
+  int import_threads = 0;      // parallel HNSW inserts, 0 = all cores
+  // Reuse action-free replies to near-identical queries from the same user
+  // and coalesce identical concurrent requests. Requests can opt out with
+  // "cache": false.
+  bool response_cache = false;
+  float response_cache_threshold = 0.95f; // cosine similarity
+  int response_cache_ttl_s = 300;
+  int response_cache_max_per_user = 64;
 
   // Memory database settings
   std::string memory_db_path = "./memory_db";
   int embedding_dim = 4096; // Qwen2.5 embedding size
   int max_memories = 1000;
+  int memory_brute_force_threshold = 4096; // exact scan below this many
+  float memory_dedup_threshold = 0.97f;    // cosine; <= 0 disables merging
+  int hnsw_m = 16;                 // graph degree, new indexes only
+  int hnsw_ef_construction = 200;  // build beam width, new indexes only
+  int hnsw_ef_search = 64;         // query beam width
+  bool memory_background_index = true; // graph inserts off the reply path
+  bool memory_mmap = false; // vectors and level-0 links paged from a file
+  // "hnsw", or "ivfpq" for a compressed index over file-backed vectors
+  std::string memory_index = "hnsw";
+  int ivf_nlist = 256; // coarse lists
+  int ivf_m = 64;      // 4-bit PQ codes per vector
+  int ivf_nprobe = 16; // lists scanned per search
+  int ivf_rerank = 4;  // exact rescoring of k * this candidates, 0 = off
+  // Summarize clusters of a user's old, related memories into single
+  // entries while no requests have arrived for consolidate_idle_s.
+  bool memory_consolidation = false;
+  int consolidate_idle_s = 60;
+  int consolidate_min_age_h = 168; // memories younger than this are kept
+  float consolidate_similarity = 0.8f; // cosine within a cluster
+  int consolidate_min_cluster = 3;
+  int consolidate_max_cluster = 8;
 
   // Logging
   bool verbose = true;
+  // Record /chat traffic for solus_replay; the memory DB is snapshotted to
+  // capture_path + ".memory" at startup.
+  std::string capture_path;
+  // Per-request span timelines in Chrome trace format, written to trace_path
+  // on POST /traces/dump and at shutdown. Empty disables tracing.
+  std::string trace_path;
+  float trace_sample_rate = 0.01f; // fraction of requests kept
+  int trace_slow_ms = 1000;        // always keep slower requests; 0 = off
+  int trace_buffer = 256;          // traces retained
   std::string log_file = "./solus.log";
 };
 } // namespace solus
\ No newline at end of file
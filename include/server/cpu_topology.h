@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace solus {
+
+// Parses a Linux cpu list such as "0-7,16-23" into sorted, unique CPU ids.
+bool parse_cpu_list(std::string_view list, std::vector<int> &cpus);
+
+// Resolves a placement spec: "node:N" for every CPU of NUMA node N, or a
+// cpu list. An empty spec resolves to an empty set, meaning unpinned.
+bool resolve_cpu_set(const std::string &spec, std::vector<int> &cpus);
+
+// The inverse of parse_cpu_list: sorted cpus as "0-3,8".
+std::string format_cpu_list(const std::vector<int> &cpus);
+
+// Slice part of parts of cpus, contiguous and as equal as possible, e.g. a
+// shard's share of a placement. Empty when cpus has fewer than parts CPUs.
+std::vector<int> cpu_set_slice(const std::vector<int> &cpus, size_t part,
+                               size_t parts);
+
+// CPUs of a NUMA node as reported by sysfs; empty if unknown.
+std::vector<int> numa_node_cpus(int node);
+
+// CPUs currently online, from sysfs.
+std::vector<int> online_cpus();
+
+// cpus without any of exclude; both sorted.
+std::vector<int> cpu_set_difference(const std::vector<int> &cpus,
+                                    const std::vector<int> &exclude);
+
+// Restricts the calling thread, and threads it creates afterwards, to cpus.
+// The previous set is stored in previous when given.
+bool pin_current_thread(const std::vector<int> &cpus,
+                        std::vector<int> *previous = nullptr);
+
+// CPUs the calling thread may run on.
+std::vector<int> current_thread_cpus();
+
+// Puts the calling thread's CPU affinity back when it goes out of scope.
+// ggml runs the thread that calls decode as compute thread 0 and pins it
+// along with the pool.
+class ScopedThreadAffinity {
+public:
+  ScopedThreadAffinity() : m_Cpus(current_thread_cpus()) {}
+  ~ScopedThreadAffinity();
+
+  ScopedThreadAffinity(const ScopedThreadAffinity &) = delete;
+  ScopedThreadAffinity &operator=(const ScopedThreadAffinity &) = delete;
+
+private:
+  std::vector<int> m_Cpus;
+};
+
+} // namespace solus
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "memory/database.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace solus {
+
+struct ConsolidationOptions {
+  // Foreground traffic must have been quiet this long before a run starts.
+  std::chrono::milliseconds idle_for{60000};
+  int64_t min_age_s = 7 * 24 * 3600; // only memories older than this
+  float similarity = 0.8f;           // cosine to the cluster's seed
+  size_t min_cluster = 3;
+  size_t max_cluster = 8;
+};
+
+// Background job that condenses clusters of a user's old, related memories
+// into single summaries while the server is idle. Each run finds one
+// cluster, has the model summarize it and swaps the summary in with
+// MemoryDatabase::replace_cluster.
+//
+// Foreground work always wins: touch() as a request starts cancels a
+// summary in progress at its next token, and touch() as it ends restarts
+// the idle timer. The timer alone would let a run start under a request
+// that has lasted longer than idle_for, so is_idle is checked as well. A
+// cancelled cluster is picked up again on a later run.
+class MemoryConsolidator {
+public:
+  // Polled between generated tokens; false means stop now.
+  using KeepGoing = std::function<bool()>;
+  // Condensed text for the cluster, or nullopt if cancelled or failed.
+  using Summarize = std::function<std::optional<std::string>(
+      const MemoryCluster &, const KeepGoing &)>;
+  // Embedding of entry.text; may also fill entry.tokens. Empty on failure.
+  using Encode = std::function<std::vector<float>(MemoryEntry &)>;
+  // True while no foreground request is in flight; empty means always.
+  using IsIdle = std::function<bool()>;
+  using Clock = std::chrono::steady_clock;
+
+  MemoryConsolidator(MemoryDatabase &db, const ConsolidationOptions &options,
+                     Summarize summarize, Encode encode, IsIdle is_idle = {});
+  ~MemoryConsolidator();
+
+  MemoryConsolidator(const MemoryConsolidator &) = delete;
+  MemoryConsolidator &operator=(const MemoryConsolidator &) = delete;
+
+  void start();
+  void stop();
+  // Marks foreground activity; call as each request starts and ends.
+  void touch();
+  // Condenses one cluster now, ignoring the idle timer but not is_idle.
+  // False if none was found, it was cancelled or the swap lost a race.
+  bool run_once();
+
+  size_t consolidated() const { return m_Consolidated; }
+  size_t replaced() const { return m_Replaced; }
+
+private:
+  void loop();
+  bool idle() const { return !m_IsIdle || m_IsIdle(); }
+
+  MemoryDatabase &m_Db;
+  ConsolidationOptions m_Options;
+  Summarize m_Summarize;
+  Encode m_Encode;
+  IsIdle m_IsIdle;
+  std::atomic<uint64_t> m_Touches{0};
+  std::atomic<int64_t> m_LastTouch; // Clock ticks
+  std::atomic<size_t> m_Consolidated{0}; // summaries added
+  std::atomic<size_t> m_Replaced{0};     // memories they replaced
+  std::mutex m_Mutex;
+  std::condition_variable m_Cv;
+  bool m_Stop = false; // m_Mutex
+  std::thread m_Thread;
+};
+
+} // namespace solus
@@ -1,21 +1,78 @@
 #pragma once
 
 #include "memory/database.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace solus {
 
 class PromptBuilder {
 public:
-  enum class EPromptFormat { QWEN };
+  // QWEN and CHATML share the ChatML markup.
+  enum class EPromptFormat { QWEN, CHATML, LLAMA3, MISTRAL };
+
+  // (text, add_special, parse_special) -> token IDs
+  using TokenizeFn = std::function<std::vector<int32_t>(
+      const std::string &, bool, bool)>;
+
+  struct TokenPrompt {
+    std::vector<int32_t> tokens;
+    size_t memories_used = 0;
+    bool truncated = false; // user message was cut to fit the budget
+    size_t n_keep = 0;      // system prompt tokens, kept on context shift
+    bool fits = true;       // false: the template alone exceeds the budget
+  };
 
   PromptBuilder() = default;
 
+  std::string build_chat_prompt(const std::string &user_message,
+                                const std::vector<MemoryView> &memories,
+                                EPromptFormat format) const;
+  // Renders into out, reusing its capacity. Templates are compiled once per
+  // system prompt, so this is a sequence of appends.
+  void render_chat_prompt(std::string &out, const std::string &user_message,
+                          const std::vector<MemoryView> &memories,
+                          EPromptFormat format) const;
   std::string build_chat_prompt(const std::string &user_message,
                                 const std::vector<MemoryEntry> &memories,
                                 EPromptFormat format) const;
 
+  // Assembles the prompt directly as tokens, fitting it into token_budget.
+  // Template text is tokenized once and cached; memories use their stored
+  // tokens and are packed in the given (relevance) order while they fit.
+  // When even the template does not fit, no tokens are returned and fits is
+  // false.
+  TokenPrompt build_chat_tokens(const std::string &user_message,
+                                const std::vector<MemoryView> &memories,
+                                EPromptFormat format,
+                                const TokenizeFn &tokenize,
+                                int token_budget) const;
+
+  // Thread-safe; takes effect for prompts built after it returns.
   static void set_system_prompt(std::string prompt);
+  // Accepts "qwen", "chatml", "llama3" and "mistral".
+  static bool parse_format(std::string_view name, EPromptFormat &format);
+
+private:
+  struct TemplateTokens {
+    uint64_t version = 0;
+    bool has_memories = false;
+    std::vector<int32_t> head;          // up to the memories slot
+    std::vector<int32_t> separator;     // between memories
+    std::vector<int32_t> no_memories;   // when none are packed
+    std::vector<int32_t> before_user;   // after memories, up to user text
+    std::vector<int32_t> after_user;    // closes the turn, opens assistant
+  };
+
+  std::shared_ptr<const TemplateTokens>
+  template_tokens(EPromptFormat format, const TokenizeFn &tokenize) const;
+
+  mutable std::mutex m_CacheMutex;
+  mutable std::vector<std::shared_ptr<const TemplateTokens>> m_TokenCache;
 };
 } // namespace solus
\ No newline at end of file
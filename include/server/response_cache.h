@@ -0,0 +1,89 @@
+#pragma once
+
+#include "server/response_parser.h"
+#include <chrono>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace solus {
+
+// Per-user cache of conversational replies keyed on query embedding
+// similarity. Only action-free replies are stored, since replaying an action
+// would repeat a side effect on the client.
+class ResponseCache {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  ResponseCache(float threshold, std::chrono::seconds ttl,
+                size_t max_per_user);
+
+  // Best unexpired reply for this user and model whose query has cosine
+  // similarity >= threshold.
+  std::optional<std::string> lookup(const std::string &user_id,
+                                    const std::string &model,
+                                    const std::vector<float> &embedding,
+                                    Clock::time_point now = Clock::now());
+  // Ignored when the reply carries an action.
+  void insert(const std::string &user_id, const std::string &model,
+              const std::vector<float> &embedding,
+              const ParsedResponse &reply,
+              Clock::time_point now = Clock::now());
+
+  size_t size() const;
+
+  // Binary snapshot of the unexpired entries with their remaining lifetime,
+  // so a restarted server keeps answering from the cache. load merges into
+  // the current contents.
+  bool save(const std::string &path, Clock::time_point now = Clock::now());
+  bool load(const std::string &path, Clock::time_point now = Clock::now());
+
+private:
+  struct Entry {
+    std::string model;
+    std::vector<float> embedding; // unit length
+    std::string response;
+    Clock::time_point expires;
+  };
+
+  float m_Threshold;
+  std::chrono::seconds m_Ttl;
+  size_t m_MaxPerUser;
+  mutable std::mutex m_Mutex;
+  std::unordered_map<std::string, std::deque<Entry>> m_Users;
+  size_t m_Size = 0;
+};
+
+// Collapses identical concurrent requests onto one computation: the first
+// caller for a key becomes the leader and the rest wait for its result.
+class RequestCoalescer {
+public:
+  struct Ticket {
+    bool leader = false;
+    std::shared_future<ParsedResponse> result; // followers only
+  };
+
+  Ticket join(const std::string &key);
+  // Leader only; wakes followers with the result or the error.
+  void complete(const std::string &key, const ParsedResponse &result);
+  void fail(const std::string &key, std::exception_ptr error);
+
+  size_t in_flight() const;
+
+private:
+  struct Flight {
+    std::promise<ParsedResponse> promise;
+    std::shared_future<ParsedResponse> future;
+  };
+
+  std::unique_ptr<Flight> take(const std::string &key);
+
+  mutable std::mutex m_Mutex;
+  std::unordered_map<std::string, std::unique_ptr<Flight>> m_Flights;
+};
+
+} // namespace solus
@@ -1,18 +1,85 @@
 #pragma once
 
+#include <functional>
 #include <nlohmann/json.hpp>
 #include <string>
+#include <string_view>
 
 namespace solus {
 
 struct ParsedResponse {
-  std::string action; // JSON string or empty
+  nlohmann::json action; // null when the model did not request one
   std::string response;
 };
 
+// Incremental parser for model output. Text is fed in chunks as it is
+// generated; the first top-level object carrying an "action" key is tracked
+// field by field, so the action and response are reported as soon as each
+// value closes rather than after generation ends.
+class ResponseStreamParser {
+public:
+  using ActionCallback = std::function<void(const nlohmann::json &)>;
+  using ResponseCallback = std::function<void(const std::string &)>;
+
+  void on_action(ActionCallback callback) { m_OnAction = std::move(callback); }
+  void on_response(ResponseCallback callback) {
+    m_OnResponse = std::move(callback);
+  }
+
+  void feed(std::string_view chunk);
+  ParsedResponse finish();
+
+  bool has_action() const { return m_ActionSeen; }
+
+private:
+  enum class EState {
+    OUTSIDE,
+    KEY,
+    IN_KEY,
+    COLON,
+    VALUE,
+    IN_STRING_VALUE,
+    IN_CONTAINER,
+    IN_PRIMITIVE,
+    AFTER_VALUE,
+    DONE
+  };
+
+  void process();
+  void step(char c);
+  void complete_value(size_t end);
+  void end_object(size_t end);
+  void abandon_object();
+  void maybe_emit_response();
+
+  std::string m_Text;
+  size_t m_Pos = 0;
+  EState m_State = EState::OUTSIDE;
+  int m_Depth = 0;
+  bool m_InString = false;
+  bool m_Escape = false;
+  size_t m_ObjStart = 0;
+  size_t m_ObjEnd = 0;
+  size_t m_KeyStart = 0;
+  size_t m_ValueStart = 0;
+  std::string m_Key;
+
+  bool m_ActionSeen = false;
+  nlohmann::json m_Action;
+  bool m_ResponseSeen = false;
+  bool m_ResponseEmitted = false;
+  std::string m_Response;
+
+  ActionCallback m_OnAction;
+  ResponseCallback m_OnResponse;
+};
+
 class ResponseParser {
 public:
   static ParsedResponse parse_response(const std::string &response_text);
+  // The action's "type", or its JSON text when the model emitted an action
+  // that is not an object.
+  static std::string action_type(const nlohmann::json &action);
 };
 
-} // namespace solus
\ No newline at end of file
+} // namespace solus
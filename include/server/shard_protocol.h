@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace solus {
+
+// Messages between the front process, its shard workers and solus_shards.
+// Requests carry a JSON or NDJSON body; every request is answered with one
+// REPLY whose status is an HTTP status code.
+enum class EShardOp : uint8_t {
+  REPLY = 0,
+  CHAT = 1,          // body: /chat request
+  IMPORT = 2,        // body: /memory/import NDJSON
+  HEALTH = 3,        // body empty
+  EXPORT_USER = 4,   // user_id; reply body: NDJSON with embeddings
+  IMPORT_USER = 5,   // body: EXPORT_USER output
+  DROP_USER = 6,     // user_id; tombstones the user's memories
+  PLACEMENT = 7,     // front only; reply body: shard map and worker health
+  MOVE_USER = 8,     // front only; user_id, body: {"shard": N}
+};
+
+struct ShardFrame {
+  EShardOp op = EShardOp::REPLY;
+  uint16_t status = 0;
+  std::string user_id;
+  std::string body;
+};
+
+// Wire format: u32 body size, u16 user_id size, u16 status, u8 op, then the
+// user_id and body bytes. Host byte order; both ends run on one machine.
+std::string encode_frame(const ShardFrame &frame);
+bool write_frame(int fd, const ShardFrame &frame);
+// False on EOF, a malformed header or a body above the size limit.
+bool read_frame(int fd, ShardFrame &frame);
+
+// -1 on failure, with the reason logged.
+int connect_unix(const std::string &path);
+int listen_unix(const std::string &path);
+
+// Sends one request on a fresh connection and waits for the reply; a
+// failed exchange comes back as a 502 REPLY.
+ShardFrame shard_request(const std::string &path, const ShardFrame &request);
+
+// Accepts connections on a Unix socket and answers each frame with the
+// handler's reply. Every connection gets its own thread, so a slow request
+// only holds up its own connection.
+class ShardListener {
+public:
+  using Handler = std::function<ShardFrame(const ShardFrame &)>;
+
+  ShardListener(std::string path, Handler handler);
+  ~ShardListener();
+
+  ShardListener(const ShardListener &) = delete;
+  ShardListener &operator=(const ShardListener &) = delete;
+
+  bool start();
+  // Closes the socket and every connection, then joins their threads.
+  void stop();
+
+private:
+  struct Connection {
+    int fd = -1; // m_Mutex; -1 once closed
+    std::atomic<bool> done{false};
+    std::thread thread;
+  };
+
+  void accept_loop();
+  void serve(Connection *connection);
+  void reap(); // m_Mutex held
+
+  std::string m_Path;
+  Handler m_Handler;
+  int m_ListenFd = -1;
+  std::atomic<bool> m_Stopping{false};
+  std::thread m_Acceptor;
+  std::mutex m_Mutex;
+  std::vector<std::unique_ptr<Connection>> m_Connections; // m_Mutex
+};
+
+// Consistent hash of user IDs onto shards: each shard owns `replicas`
+// points on a 64-bit ring and a user goes to the first point at or after
+// its hash. Adding a shard moves only about 1/N of the users.
+class HashRing {
+public:
+  explicit HashRing(size_t shards, size_t replicas = 64);
+
+  size_t shard_for(std::string_view user_id) const;
+  size_t shards() const { return m_Shards; }
+
+  static uint64_t hash(std::string_view key);
+
+private:
+  size_t m_Shards;
+  std::vector<std::pair<uint64_t, uint32_t>> m_Points; // sorted by hash
+};
+
+// Ring placement plus per-user overrides left by rebalancing. Not
+// thread-safe.
+class ShardMap {
+public:
+  explicit ShardMap(size_t shards) : m_Ring(shards) {}
+
+  size_t shard_for(std::string_view user_id) const;
+  size_t shards() const { return m_Ring.shards(); }
+  // Records that user_id now lives on shard; an override that matches the
+  // ring is dropped.
+  void assign(const std::string &user_id, size_t shard);
+  const std::unordered_map<std::string, size_t> &overrides() const {
+    return m_Overrides;
+  }
+
+  // JSON {"shards": N, "overrides": {user: shard}}. Overrides naming a
+  // shard that no longer exists are skipped on load.
+  bool save(const std::string &path) const;
+  bool load(const std::string &path);
+
+private:
+  HashRing m_Ring;
+  std::unordered_map<std::string, size_t> m_Overrides;
+};
+
+} // namespace solus
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "server/config.h"
+#include "server/shard_protocol.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <net/http.h>
+#include <shared_mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace solus {
+
+// Front process of a sharded deployment. Spawns one worker process per
+// shard (this binary with --shard-worker N), serves the HTTP API and
+// forwards each request to the worker owning its user_id. Workers map the
+// same model file, so the weights are shared through the page cache.
+//
+// solus_shards talks to the control socket, shard_dir/front.sock, to list
+// the placement and move a user between shards.
+class ShardRouter {
+public:
+  // worker_args is the command line workers are started with, argv[0]
+  // first; --shard-worker N is appended.
+  ShardRouter(const ServerConfig &config, std::vector<std::string> worker_args);
+  ~ShardRouter();
+
+  ShardRouter(const ShardRouter &) = delete;
+  ShardRouter &operator=(const ShardRouter &) = delete;
+
+  bool initialize();
+  void run();
+  // Refuses new requests, stops the workers (each drains its own requests)
+  // and then the HTTP server.
+  void shutdown();
+
+  static std::string socket_path(const ServerConfig &config, size_t shard);
+  // Settings worker `shard` runs with: its own socket, database and output
+  // files, and an equal share of the threads and of each CPU set. False,
+  // with a message, when there are fewer threads or CPUs than shards.
+  static bool worker_config(const ServerConfig &config, size_t shard,
+                            ServerConfig &worker);
+
+private:
+  struct Worker {
+    pid_t pid = -1;
+    int restarts = 0;
+  };
+
+  bool spawn(size_t shard); // m_WorkersMutex held
+  void supervise();
+  ShardFrame forward(size_t shard, const ShardFrame &request) const;
+  static http::Response to_response(const ShardFrame &reply);
+  static http::Response error_response(int status, const std::string &error);
+
+  // Route user_id to its shard and count the request against the user, so
+  // a move can wait for it. False while the user is being moved.
+  bool begin_user(const std::string &user_id, size_t &shard);
+  void end_user(const std::string &user_id);
+
+  http::Response handle_health(const http::Request &req);
+  http::Response handle_chat(const http::Request &req);
+  http::Response handle_memory_import(const http::Request &req);
+  ShardFrame handle_control(const ShardFrame &frame);
+  ShardFrame placement();
+  ShardFrame move_user(const std::string &user_id, size_t target);
+
+  ServerConfig m_Config;
+  std::vector<std::string> m_WorkerArgs;
+  size_t m_Shards;
+  std::string m_MapPath;
+
+  std::mutex m_WorkersMutex;
+  std::vector<Worker> m_Workers; // m_WorkersMutex
+  std::thread m_Supervisor;
+
+  std::mutex m_MapMutex;
+  std::condition_variable m_MapCv;
+  ShardMap m_Map;                                      // m_MapMutex
+  std::unordered_map<std::string, int> m_UserInFlight; // m_MapMutex
+  std::unordered_set<std::string> m_Moving;            // m_MapMutex
+  // A move holds it exclusively; imports share it so none splits a user
+  // across shards mid-move.
+  std::shared_mutex m_MoveMutex;
+
+  std::unique_ptr<http::Server> m_HttpServer;
+  std::unique_ptr<ShardListener> m_Control;
+  std::atomic<bool> m_Draining{false};
+  std::atomic<bool> m_Stopped{false};
+};
+
+} // namespace solus
@@ -1,11 +1,22 @@
 #pragma once
 
 #include "llm/llama_handler.h"
+#include "llm/model_registry.h"
 #include "memory/database.h"
 #include "server/config.h"
+#include "server/memory_consolidator.h"
 #include "server/prompt_builder.h"
+#include "server/response_cache.h"
+#include "server/shard_protocol.h"
+#include "server/traffic_capture.h"
+#include "utils/tracing.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <net/http.h>
+#include <unordered_map>
 
 namespace solus {
 
@@ -22,20 +33,80 @@ public:
 
   bool initialize();
   void run();
+  // Refuses new requests, waits up to drain_grace_s for in-flight ones
+  // (then cuts their generation short) and stops, saving memory and warm
+  // state. Safe to call from another thread while run() blocks.
+  void shutdown();
   void stop();
 
+  // Memory database settings for a model with vocab_size tokens.
+  static MemoryDatabaseOptions memory_options(const ServerConfig &config,
+                                              int vocab_size);
+
 private:
+  struct StartupTimings {
+    int64_t model_ms = 0;
+    int64_t memory_ms = 0;
+    int64_t warm_up_ms = 0;
+    int64_t total_ms = 0;
+    bool parallel = false;
+    bool warm_state = false; // prefix KV or caches restored from disk
+  };
+
   void setup_routes();
+  bool initialize_memory(int vocab_size);
+  void warm_up();
+  nlohmann::json warm_state_identity() const;
+  bool restore_warm_state();
+  void save_warm_state();
+  // 503 with {"status": status}, while starting or draining.
+  http::Response unavailable_response(const char *status) const;
 
   http::Response handle_health(const http::Request &req);
   http::Response handle_chat(const http::Request &req);
+  // capture, when set, is filled in with the request and its reply.
+  http::Response process_chat(const http::Request &req,
+                              CaptureRecord *capture);
   http::Response handle_memory_clear(const http::Request &req);
+  http::Response handle_memory_import(const http::Request &req);
+  http::Response handle_traces_dump(const http::Request &req);
+  // Summary of an idle-time consolidation cluster, generated with the
+  // default model.
+  std::optional<std::string>
+  summarize_memories(const MemoryCluster &cluster,
+                     const MemoryConsolidator::KeepGoing &keep_going);
+  // Shard worker side of the front process's protocol.
+  ShardFrame handle_shard_frame(const ShardFrame &frame);
+  ShardFrame handle_user_export(const std::string &user_id);
+  ShardFrame handle_user_import(const std::string &body);
+
+  // Prompt assembly for one model. Template tokens are cached per builder,
+  // so each vocabulary gets its own.
+  struct ModelRoute {
+    PromptBuilder::EPromptFormat format = PromptBuilder::EPromptFormat::QWEN;
+    std::unique_ptr<PromptBuilder> prompts;
+  };
 
   ServerConfig m_Config;
-  std::unique_ptr<LlamaHandler> m_Llama;
+  std::unique_ptr<ModelRegistry> m_Models;
+  std::shared_ptr<LlamaHandler> m_Llama; // default model, pinned
+  std::unordered_map<std::string, ModelRoute> m_Routes;
   std::unique_ptr<MemoryDatabase> m_MemoryDb;
-  std::unique_ptr<PromptBuilder> m_PromptBuilder;
-  std::unique_ptr<http::Server> m_HttpServer;
+  std::unique_ptr<ResponseCache> m_ResponseCache; // null when disabled
+  std::unique_ptr<RequestCoalescer> m_Coalescer;
+  std::unique_ptr<TrafficCapture> m_Capture; // null unless capturing
+  std::unique_ptr<Tracer> m_Tracer;          // null unless tracing
+  std::unique_ptr<MemoryConsolidator> m_Consolidator; // null when disabled
+  std::unique_ptr<http::Server> m_HttpServer;      // null in shard workers
+  std::unique_ptr<ShardListener> m_ShardListener; // shard workers only
+  std::mutex m_StopMutex;
+  std::condition_variable m_StopCv; // a worker's run() waits for stop()
+  std::atomic<bool> m_Ready{false};
+  std::atomic<bool> m_Draining{false};
+  std::atomic<bool> m_Abort{false}; // grace period over, stop generating
+  std::atomic<bool> m_Stopped{false};
+  std::atomic<int> m_InFlight{0};
+  StartupTimings m_Startup;
 };
 
 } // namespace solus
\ No newline at end of file
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+namespace solus {
+
+// One /chat request as seen by the server, with what it produced.
+struct CaptureRecord {
+  int64_t arrival_ms = 0; // since the capture started
+  std::string user_id;
+  std::string conversation_id;
+  std::string model;
+  std::string text;
+  uint32_t seed = 0;
+  bool use_cache = true;
+  int status = 0;
+  int64_t latency_ms = 0;
+  std::string response;
+  nlohmann::json action;
+};
+
+struct CaptureHeader {
+  int version = 1;
+  int64_t started_ms = 0; // unix epoch
+  std::string model_path;
+  std::string memory_snapshot; // memory DB directory at capture start
+};
+
+// Append-only NDJSON log of /chat traffic: a header line, then one compact
+// record per completed request. Records are written in completion order;
+// readers sort by arrival.
+class TrafficCapture {
+public:
+  TrafficCapture() = default;
+
+  bool open(const std::string &path, CaptureHeader header);
+  bool is_open() const { return m_Out.is_open(); }
+  int64_t elapsed_ms() const;
+  void write(const CaptureRecord &record);
+
+  // Reads a capture, returning records sorted by arrival time.
+  static bool load(const std::string &path, CaptureHeader &header,
+                   std::vector<CaptureRecord> &records);
+
+private:
+  std::ofstream m_Out;
+  std::chrono::steady_clock::time_point m_Start;
+  std::mutex m_Mutex;
+};
+
+} // namespace solus
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace solus {
+
+struct SpanRecord {
+  const char *name = ""; // static string
+  int64_t start_us = 0;
+  int64_t duration_us = 0;
+  int64_t count = -1; // optional size, e.g. tokens decoded; -1 when unset
+  uint32_t thread = 0;
+};
+
+struct TraceRecord {
+  uint64_t id = 0;
+  std::vector<SpanRecord> spans;
+};
+
+// Keeps the most recent kept traces in a ring buffer and writes them out in
+// Chrome trace-event format (chrome://tracing, Perfetto).
+//
+// Every request is recorded; whether it is kept is decided when it ends:
+// a sample_rate fraction is kept at random, and anything slower than
+// slow_ms is always kept so tail outliers are never sampled away.
+class Tracer {
+public:
+  Tracer(double sample_rate, int64_t slow_ms, size_t capacity);
+
+  uint64_t next_id() { return m_IdBase + m_NextId.fetch_add(1); }
+  void finish(TraceRecord &&trace, int64_t duration_us);
+
+  size_t kept() const;
+  std::string to_chrome_json() const;
+  bool dump(const std::string &path) const;
+
+  static int64_t now_us();
+  static std::string format_id(uint64_t id);
+
+private:
+  double m_SampleRate;
+  int64_t m_SlowUs;
+  uint64_t m_IdBase;
+  std::atomic<uint64_t> m_NextId{0};
+  mutable std::mutex m_Mutex;
+  std::vector<TraceRecord> m_Ring;
+  size_t m_Next = 0;
+  std::minstd_rand m_Rng;
+};
+
+// Collects the spans of one request on the handling thread. Spans opened on
+// that thread while it is alive, including inside the LLM and the memory
+// database, attach to it. A null tracer makes it inert.
+class RequestTrace {
+public:
+  explicit RequestTrace(Tracer *tracer);
+  ~RequestTrace();
+
+  RequestTrace(const RequestTrace &) = delete;
+  RequestTrace &operator=(const RequestTrace &) = delete;
+
+  bool active() const { return m_Tracer != nullptr; }
+  uint64_t id() const { return m_Trace.id; }
+  std::string id_string() const { return Tracer::format_id(m_Trace.id); }
+
+  static RequestTrace *current();
+  void add(const SpanRecord &span) { m_Trace.spans.push_back(span); }
+
+private:
+  Tracer *m_Tracer;
+  RequestTrace *m_Previous;
+  TraceRecord m_Trace;
+  int64_t m_StartUs = 0;
+};
+
+// Times a scope as a span of the current request, if any.
+class TraceSpan {
+public:
+  explicit TraceSpan(const char *name);
+  ~TraceSpan() { end(); }
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+  void set_count(int64_t count) { m_Span.count = count; }
+  void end();
+
+private:
+  RequestTrace *m_Trace;
+  SpanRecord m_Span;
+};
+
+// Locks mutex, recording a span named name only when it had to wait.
+template <typename Mutex>
+std::unique_lock<Mutex> traced_lock(Mutex &mutex, const char *name) {
+  std::unique_lock<Mutex> lock(mutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    TraceSpan wait(name);
+    lock.lock();
+  }
+  return lock;
+}
+
+} // namespace solus
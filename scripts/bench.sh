@@ -0,0 +1,8 @@
+#!/bin/bash
+# Throughput benchmark on a generated tiny model, results in build/bench.json.
+# Pass --baseline FILE to fail on regressions, e.g. after a llama.cpp bump.
+
+cd "$(dirname "$0")/.."
+mkdir -p build
+(cd build && cmake .. -DCMAKE_BUILD_TYPE=Release && cmake --build . --config Release --target solus_bench -j $(nproc))
+./build/solus_bench --out build/bench.json "$@"
@@ -0,0 +1,131 @@
+#include "llm/adapter_cache.h"
+#include <iostream>
+
+namespace solus {
+
+AdapterCache::AdapterCache(std::string dir, size_t budget_bytes,
+                           Loader loader)
+    : m_Dir(std::move(dir)), m_BudgetBytes(budget_bytes),
+      m_Loader(std::move(loader)) {}
+
+std::string AdapterCache::path_for(const std::string &user_id) const {
+  // User IDs come from requests; only plain names may reach the filesystem.
+  if (user_id.empty() || user_id.front() == '.') {
+    return "";
+  }
+  for (char c : user_id) {
+    const bool plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                       (c >= '0' && c <= '9') || c == '-' || c == '_' ||
+                       c == '.' || c == '@';
+    if (!plain) {
+      return "";
+    }
+  }
+  return m_Dir + "/" + user_id + ".gguf";
+}
+
+bool AdapterCache::has_adapter(const std::string &user_id) const {
+  const std::string path = path_for(user_id);
+  std::error_code ec;
+  return !path.empty() && std::filesystem::is_regular_file(path, ec);
+}
+
+AdapterCache::Handle AdapterCache::acquire(const std::string &user_id) {
+  const std::string path = path_for(user_id);
+  if (path.empty()) {
+    return nullptr;
+  }
+  // One stat per request is what makes hot replacement work; it is noise
+  // next to a generation.
+  std::error_code ec;
+  const auto mtime = std::filesystem::last_write_time(path, ec);
+  const size_t size =
+      ec ? 0 : static_cast<size_t>(std::filesystem::file_size(path, ec));
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  auto it = m_Entries.find(user_id);
+  if (ec) {
+    if (it != m_Entries.end()) {
+      m_Entries.erase(it);
+    }
+    return nullptr;
+  }
+  if (it != m_Entries.end() && it->second.mtime == mtime &&
+      it->second.size_bytes == size) {
+    it->second.last_used = ++m_Clock;
+    return it->second.adapter;
+  }
+  if (it != m_Entries.end()) {
+    std::cout << "Reloading LoRA adapter " << path << std::endl;
+    m_Entries.erase(it);
+  }
+  evict_for(size, user_id);
+  // Loads run under the lock; the handler already serializes its callers.
+  Entry entry;
+  entry.size_bytes = size;
+  entry.mtime = mtime;
+  entry.last_used = ++m_Clock;
+  try {
+    entry.adapter = m_Loader(path);
+  } catch (const std::exception &e) {
+    std::cerr << "Failed to load LoRA adapter " << path << ": " << e.what()
+              << std::endl;
+  }
+  if (!entry.adapter) {
+    std::cerr << "LoRA adapter " << path << " is unusable" << std::endl;
+  }
+  Handle adapter = entry.adapter;
+  m_Entries.emplace(user_id, std::move(entry));
+  return adapter;
+}
+
+void AdapterCache::evict_for(size_t incoming_bytes,
+                             const std::string &incoming) {
+  if (m_BudgetBytes == 0) {
+    return;
+  }
+  size_t used = loaded_bytes_locked();
+  while (used + incoming_bytes > m_BudgetBytes) {
+    auto victim = m_Entries.end();
+    for (auto it = m_Entries.begin(); it != m_Entries.end(); ++it) {
+      if (it->first == incoming || !it->second.adapter) {
+        continue;
+      }
+      if (victim == m_Entries.end() ||
+          it->second.last_used < victim->second.last_used) {
+        victim = it;
+      }
+    }
+    if (victim == m_Entries.end()) {
+      return; // a single adapter over budget still loads
+    }
+    std::cout << "Unloading LoRA adapter of " << victim->first << std::endl;
+    used -= victim->second.size_bytes;
+    m_Entries.erase(victim);
+  }
+}
+
+size_t AdapterCache::loaded_bytes_locked() const {
+  size_t used = 0;
+  for (const auto &[user_id, entry] : m_Entries) {
+    if (entry.adapter) {
+      used += entry.size_bytes;
+    }
+  }
+  return used;
+}
+
+size_t AdapterCache::loaded() const {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  size_t count = 0;
+  for (const auto &[user_id, entry] : m_Entries) {
+    count += entry.adapter ? 1 : 0;
+  }
+  return count;
+}
+
+size_t AdapterCache::loaded_bytes() const {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return loaded_bytes_locked();
+}
+
+} // namespace solus
@@ -0,0 +1,65 @@
+#include "llm/detokenizer.h"
+
+namespace solus {
+
+void TokenPieceTable::build(int n_vocab, const PieceFn &piece_fn) {
+  m_Offsets.assign(1, 0);
+  m_Offsets.reserve(static_cast<size_t>(n_vocab) + 1);
+  m_Bytes.clear();
+  m_Bytes.reserve(static_cast<size_t>(n_vocab) * 8);
+  char buf[256];
+  std::string large;
+  for (int32_t token = 0; token < n_vocab; token++) {
+    int n = piece_fn(token, buf, sizeof(buf));
+    if (n < 0) {
+      large.resize(-n);
+      n = piece_fn(token, large.data(), static_cast<int>(large.size()));
+      if (n > 0) {
+        m_Bytes.append(large.data(), n);
+      }
+    } else {
+      m_Bytes.append(buf, n);
+    }
+    m_Offsets.push_back(static_cast<uint32_t>(m_Bytes.size()));
+  }
+  m_Bytes.shrink_to_fit();
+}
+
+size_t utf8_complete_prefix(std::string_view text) {
+  const size_t size = text.size();
+  // A sequence is at most 4 bytes, so only the tail can be incomplete.
+  for (size_t back = 1; back <= 4 && back <= size; back++) {
+    const auto byte = static_cast<unsigned char>(text[size - back]);
+    if ((byte & 0xC0) == 0x80) {
+      continue; // continuation byte
+    }
+    size_t needed = 1;
+    if ((byte & 0xE0) == 0xC0) {
+      needed = 2;
+    } else if ((byte & 0xF0) == 0xE0) {
+      needed = 3;
+    } else if ((byte & 0xF8) == 0xF0) {
+      needed = 4;
+    }
+    return needed > back ? size - back : size;
+  }
+  // Stray continuation bytes; nothing to wait for.
+  return size;
+}
+
+std::string_view IncrementalDetokenizer::push(int32_t token) {
+  m_Text.append(m_Table.piece(token));
+  const size_t start = m_Emitted;
+  const size_t end =
+      start + utf8_complete_prefix(std::string_view(m_Text).substr(start));
+  m_Emitted = end;
+  return std::string_view(m_Text).substr(start, end - start);
+}
+
+std::string_view IncrementalDetokenizer::flush() {
+  const size_t start = m_Emitted;
+  m_Emitted = m_Text.size();
+  return std::string_view(m_Text).substr(start);
+}
+
+} // namespace solus
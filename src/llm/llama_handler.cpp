@@ -1,29 +1,79 @@
 #include "llm/llama_handler.h"
+#include "ggml-cpu.h"
+#include "gguf.h"
 #include "llama.h"
+#include "server/cpu_topology.h"
+#include "utils/tracing.h"
+#include <algorithm>
+#include <fcntl.h>
 #include <iostream>
+#include <unistd.h>
 
 namespace solus {
 
+namespace {
+
+// The backend is process-wide while handlers come and go with the model
+// registry; initialize it with the first handler and free it with the last.
+std::mutex s_BackendMutex;
+int s_BackendRefs = 0;
+
+void acquire_backend() {
+  std::lock_guard<std::mutex> lock(s_BackendMutex);
+  if (s_BackendRefs++ == 0) {
+    llama_backend_init();
+  }
+}
+
+void release_backend() {
+  std::lock_guard<std::mutex> lock(s_BackendMutex);
+  if (--s_BackendRefs == 0) {
+    llama_backend_free();
+  }
+}
+
+} // namespace
+
 LlamaHandler::LlamaHandler(const ServerConfig &config)
-    : m_Config(config), m_Model(nullptr), m_Ctx(nullptr) {}
+    : m_Config(config), m_Model(nullptr), m_Ctx(nullptr), m_EmbdCtx(nullptr) {}
 
 LlamaHandler::~LlamaHandler() {
+  if (m_EmbdCtx) {
+    llama_free(m_EmbdCtx);
+    m_EmbdCtx = nullptr;
+  }
   if (m_Ctx) {
     llama_free(m_Ctx);
     m_Ctx = nullptr;
   }
+  // Adapters belong to the model and must go before it.
+  m_ActiveAdapter.reset();
+  m_Adapters.reset();
   if (m_Model) {
     llama_model_free(m_Model);
     m_Model = nullptr;
   }
-  llama_backend_free();
+  for (ggml_threadpool *pool :
+       {m_Threadpool, m_ThreadpoolBatch, m_EmbdThreadpool}) {
+    if (pool) {
+      ggml_threadpool_free(pool);
+    }
+  }
+  if (m_BackendAcquired) {
+    release_backend();
+  }
 }
 
 bool LlamaHandler::initialize() {
   std::cout << "Initializing llama.cpp backend..." << std::endl;
-  llama_backend_init();
+  acquire_backend();
+  m_BackendAcquired = true;
   llama_model_params model_params = llama_model_default_params();
   model_params.n_gpu_layers = m_Config.n_gpu_layers;
+  model_params.use_mlock = m_Config.mlock;
+  // Mapped weights live once in the page cache, however many shard workers
+  // load the same file.
+  model_params.use_mmap = true;
   std::cout << "Loading model from: " << m_Config.model_path << std::endl;
   m_Model =
       llama_model_load_from_file(m_Config.model_path.c_str(), model_params);
@@ -36,89 +86,214 @@ bool LlamaHandler::initialize() {
   llama_context_params ctx_params = llama_context_default_params();
   ctx_params.n_ctx = m_Config.n_ctx;
   ctx_params.n_batch = m_Config.n_batch;
+  // Parallel sequences share one KV pool so a common prefix is stored once
+  // and any sequence may use the whole context.
+  ctx_params.n_seq_max = static_cast<uint32_t>(
+      std::clamp(m_Config.n_parallel, 1, std::max(m_Config.n_batch, 1)));
+  ctx_params.kv_unified = ctx_params.n_seq_max > 1;
   ctx_params.n_threads = m_Config.n_threads;
-  ctx_params.n_threads_batch = m_Config.n_threads;
-  ctx_params.embeddings = true;
-  ctx_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+  ctx_params.n_threads_batch = m_Config.n_threads_batch > 0
+                                   ? m_Config.n_threads_batch
+                                   : m_Config.n_threads;
+  if (!create_threadpools(ctx_params.n_threads, ctx_params.n_threads_batch)) {
+    return false;
+  }
+  if (!parse_cache_type(m_Config.cache_type_k, ctx_params.type_k) ||
+      !parse_cache_type(m_Config.cache_type_v, ctx_params.type_v)) {
+    std::cerr << "Unknown KV cache type: " << m_Config.cache_type_k << "/"
+              << m_Config.cache_type_v << std::endl;
+    return false;
+  }
+  if (!parse_flash_attn(m_Config.flash_attn, ctx_params.flash_attn_type)) {
+    std::cerr << "Unknown flash attention mode: " << m_Config.flash_attn
+              << std::endl;
+    return false;
+  }
+  // A quantized V cache is only supported by the flash attention kernels.
+  if (ctx_params.type_v != GGML_TYPE_F16 &&
+      ctx_params.type_v != GGML_TYPE_F32 &&
+      ctx_params.type_v != GGML_TYPE_BF16 &&
+      ctx_params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_DISABLED) {
+    std::cerr << "Quantized V cache requires flash attention" << std::endl;
+    return false;
+  }
   m_Ctx = llama_init_from_model(m_Model, ctx_params);
   if (!m_Ctx) {
     std::cerr << "Failed to create llama context" << std::endl;
     return false;
   }
+  if (m_Threadpool) {
+    llama_attach_threadpool(m_Ctx, m_Threadpool, m_ThreadpoolBatch);
+  }
+  if (!m_Config.lora_dir.empty()) {
+    m_Adapters = std::make_unique<AdapterCache>(
+        m_Config.lora_dir, m_Config.lora_budget_mb * 1024 * 1024,
+        [model = m_Model](const std::string &path) -> AdapterCache::Handle {
+          llama_adapter_lora *adapter =
+              llama_adapter_lora_init(model, path.c_str());
+          if (!adapter) {
+            return nullptr;
+          }
+          return AdapterCache::Handle(adapter, llama_adapter_lora_free);
+        });
+  }
+  // Embeddings get their own small context so they neither clear the
+  // generation KV cache nor wait on a running generation. Its sequences
+  // share one KV pool and a whole batch is a single ubatch, which pooling
+  // requires. Models that are only used for generation skip it.
+  if (m_Config.embedding_batch_size > 0) {
+    llama_context_params embd_params = llama_context_default_params();
+    embd_params.n_ctx = m_Config.embedding_ctx_size;
+    embd_params.n_batch = m_Config.embedding_ctx_size;
+    embd_params.n_ubatch = m_Config.embedding_ctx_size;
+    embd_params.n_seq_max = m_Config.embedding_batch_size;
+    embd_params.kv_unified = true;
+    embd_params.n_threads = ctx_params.n_threads;
+    embd_params.n_threads_batch = ctx_params.n_threads_batch;
+    embd_params.embeddings = true;
+    embd_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+    m_EmbdCtx = llama_init_from_model(m_Model, embd_params);
+    if (!m_EmbdCtx) {
+      std::cerr << "Failed to create embedding context" << std::endl;
+      return false;
+    }
+    if (m_EmbdThreadpool) {
+      llama_attach_threadpool(m_EmbdCtx, m_EmbdThreadpool, m_EmbdThreadpool);
+    }
+  }
+  build_piece_table();
   std::cout << "Model loaded successfully!" << std::endl;
   std::cout << "  Context size: " << m_Config.n_ctx << std::endl;
+  std::cout << "  KV cache: " << m_Config.cache_type_k << "/"
+            << m_Config.cache_type_v << ", flash attention "
+            << m_Config.flash_attn << std::endl;
   std::cout << "  Embedding size: " << llama_model_n_embd(m_Model) << std::endl;
   std::cout << "  GPU layers: " << m_Config.n_gpu_layers << std::endl;
+  std::cout << "  Vocabulary pieces: " << m_Pieces.bytes_used() << " bytes"
+            << std::endl;
   return true;
 }
 
+void LlamaHandler::build_piece_table() {
+  const llama_vocab *vocab = llama_model_get_vocab(m_Model);
+  m_Pieces.build(llama_vocab_n_tokens(vocab),
+                 [vocab](int32_t token, char *buf, int size) {
+                   return llama_token_to_piece(vocab, token, buf, size, 0,
+                                               false);
+                 });
+}
+
 std::vector<llama_token> LlamaHandler::tokenize(const std::string &text,
-                                                bool add_bos) {
+                                                bool add_bos,
+                                                bool parse_special) {
   const llama_vocab *vocab = llama_model_get_vocab(m_Model);
-  const int n_tokens_max = text.size() + (add_bos ? 1 : 0) + 1;
-  std::vector<llama_token> tokens(n_tokens_max);
+  // Every token covers at least one input byte, except an added space
+  // prefix and the BOS/EOS specials, so this bound always fits.
+  std::vector<llama_token> tokens(text.size() + 1 + (add_bos ? 2 : 0));
   const int n_tokens =
       llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(),
-                     tokens.size(), add_bos, false);
+                     tokens.size(), add_bos, parse_special);
   if (n_tokens < 0) {
-    tokens.resize(-n_tokens);
-    const int check =
-        llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(),
-                       tokens.size(), add_bos, false);
-    if (check < 0) {
-      std::cerr << "Tokenization failed" << std::endl;
-      return {};
-    }
+    std::cerr << "Tokenization failed" << std::endl;
+    return {};
   }
-  tokens.resize(n_tokens < 0 ? -n_tokens : n_tokens);
+  tokens.resize(n_tokens);
   return tokens;
 }
 
-std::string LlamaHandler::detokenize(const std::vector<llama_token> &tokens) {
-  const llama_vocab *vocab = llama_model_get_vocab(m_Model);
-  std::string result;
-  result.reserve(tokens.size() * 4);
-  for (const auto &token : tokens) {
-    char buf[128];
-    int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, false);
-    if (n > 0 && n < static_cast<int>(sizeof(buf))) {
-      result.append(buf, n);
-    }
-  }
-  return result;
-}
-
 std::string LlamaHandler::generate(const std::string &prompt,
-                                   const GenerationParams &params) {
-  std::lock_guard<std::mutex> lock(m_InterferenceMutex);
-  // Tokenize prompt
+                                   const GenerationParams &params,
+                                   const TextCallback &on_text,
+                                   int *n_generated) {
+  if (n_generated) {
+    *n_generated = 0;
+  }
   auto tokens = tokenize(prompt, true);
   if (tokens.empty()) {
     std::cerr << "Failed to tokenize prompt" << std::endl;
     return "";
   }
-  // Check context size
-  if (static_cast<int>(tokens.size()) >= m_Config.n_ctx) {
-    std::cerr << "Prompt too long: " << tokens.size()
-              << " tokens (max: " << m_Config.n_ctx << ")" << std::endl;
+  return generate(tokens, params, on_text, n_generated);
+}
+
+std::string
+LlamaHandler::generate(const std::vector<llama_token> &prompt_tokens,
+                       const GenerationParams &params,
+                       const TextCallback &on_text, int *n_generated) {
+  if (n_generated) {
+    *n_generated = 0;
+  }
+  auto lock = traced_lock(m_InterferenceMutex, "llm.lock_wait");
+  std::optional<ScopedThreadAffinity> affinity;
+  if (m_Threadpool) {
+    affinity.emplace();
+  }
+  std::vector<llama_token> tokens = prompt_tokens;
+  if (tokens.empty()) {
+    std::cerr << "Empty prompt" << std::endl;
     return "";
   }
+  apply_adapter(params.adapter);
+  const size_t n_ctx = static_cast<size_t>(m_Config.n_ctx);
+  const size_t n_keep =
+      std::min(static_cast<size_t>(std::max(params.n_keep, 0)), n_ctx / 2);
+  m_PrefixTokens = n_keep;
+  if (tokens.size() >= n_ctx) {
+    if (!m_Config.context_shift) {
+      std::cerr << "Prompt too long: " << tokens.size()
+                << " tokens (max: " << m_Config.n_ctx << ")" << std::endl;
+      return "";
+    }
+    // Keep the prefix and the newest tokens, leaving a quarter of the
+    // context for the reply.
+    const size_t n_tail = n_ctx - n_keep - n_ctx / 4;
+    tokens.erase(tokens.begin() + n_keep, tokens.end() - n_tail);
+    std::cerr << "Prompt too long; dropped " << prompt_tokens.size() -
+                                                    tokens.size()
+              << " tokens after the first " << n_keep << std::endl;
+  }
+  // Reuse the KV entries of the longest prefix shared with the previous
+  // prompt (usually the system prompt) and decode only the rest. At least
+  // one token is decoded so there are fresh logits to sample from.
   llama_memory_t mem = llama_get_memory(m_Ctx);
-  llama_memory_clear(mem, false);
-  llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
-  if (llama_decode(m_Ctx, batch) != 0) {
-    std::cerr << "Failed to decode prompt" << std::endl;
-    return "";
+  size_t n_past = 0;
+  const size_t max_reuse = std::min(m_CachedTokens.size(), tokens.size() - 1);
+  while (n_past < max_reuse && m_CachedTokens[n_past] == tokens[n_past]) {
+    n_past++;
+  }
+  if (n_past == 0) {
+    llama_memory_clear(mem, false);
+  } else if (!llama_memory_seq_rm(mem, 0, static_cast<llama_pos>(n_past),
+                                  -1)) {
+    llama_memory_clear(mem, false);
+    n_past = 0;
+  }
+  m_CachedTokens.resize(n_past);
+  TraceSpan prefill("llm.prefill");
+  prefill.set_count(static_cast<int64_t>(tokens.size() - n_past));
+  // Decode in n_batch sized chunks; llama_decode rejects larger batches.
+  const size_t n_batch = std::max<size_t>(llama_n_batch(m_Ctx), 1);
+  for (size_t i = n_past; i < tokens.size(); i += n_batch) {
+    const size_t n = std::min(n_batch, tokens.size() - i);
+    llama_batch batch = llama_batch_get_one(tokens.data() + i, n);
+    if (llama_decode(m_Ctx, batch) != 0) {
+      std::cerr << "Failed to decode prompt" << std::endl;
+      llama_memory_clear(mem, false);
+      m_CachedTokens.clear();
+      return "";
+    }
   }
+  m_CachedTokens = tokens;
+  prefill.end();
+  TraceSpan decode("llm.decode");
   auto sparams = llama_sampler_chain_default_params();
   llama_sampler *smpl = llama_sampler_chain_init(sparams);
   llama_sampler_chain_add(
       smpl, llama_sampler_init_top_k(static_cast<int>(params.top_k)));
   llama_sampler_chain_add(smpl, llama_sampler_init_top_p(params.top_p, 1));
   llama_sampler_chain_add(smpl, llama_sampler_init_temp(params.temperature));
-  llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-  std::vector<llama_token> generated_tokens;
-  generated_tokens.reserve(params.max_tokens);
+  llama_sampler_chain_add(smpl, llama_sampler_init_dist(params.seed));
+  IncrementalDetokenizer detok(m_Pieces);
   int n_decode = 0;
   const llama_vocab *vocab = llama_model_get_vocab(m_Model);
   while (n_decode < params.max_tokens) {
@@ -126,40 +301,593 @@ std::string LlamaHandler::generate(const std::string &prompt,
     if (llama_vocab_is_eog(vocab, new_token)) {
       break;
     }
-    generated_tokens.push_back(new_token);
+    std::string_view delta = detok.push(new_token);
+    if (on_text && !delta.empty() && !on_text(delta)) {
+      break;
+    }
+    if (m_CachedTokens.size() + 1 > n_ctx &&
+        (!m_Config.context_shift || !shift_context(n_keep))) {
+      std::cerr << "Context full after " << n_decode << " tokens"
+                << std::endl;
+      break;
+    }
     llama_token new_token_mut = new_token;
     llama_batch batch_next = llama_batch_get_one(&new_token_mut, 1);
     if (llama_decode(m_Ctx, batch_next) != 0) {
       std::cerr << "Failed to decode token" << std::endl;
       break;
     }
+    m_CachedTokens.push_back(new_token);
     n_decode++;
   }
   llama_sampler_free(smpl);
-  return detokenize(generated_tokens);
+  decode.set_count(n_decode);
+  decode.end();
+  if (n_generated) {
+    *n_generated = n_decode;
+  }
+  std::string_view tail = detok.flush();
+  if (on_text && !tail.empty()) {
+    on_text(tail);
+  }
+  return detok.take_text();
 }
 
-std::vector<float> LlamaHandler::get_embedding(const std::string &text) {
-  std::lock_guard<std::mutex> lock(m_InterferenceMutex);
-  auto tokens = tokenize(text, true);
-  if (tokens.empty()) {
-    return {};
+void LlamaHandler::generate_batch(
+    const std::vector<std::vector<llama_token>> &prompts,
+    const GenerationParams &params, const BatchCallback &on_done) {
+  struct Slot {
+    bool active = false;
+    size_t index = 0;
+    std::vector<llama_token> tokens; // prompt, then sampled tokens
+    size_t n_past = 0;               // tokens in this sequence's KV
+    size_t n_prompt = 0;
+    size_t n_reused = 0;
+    int max_tokens = 0;
+    int n_generated = 0;
+    int i_batch = -1; // batch row with this sequence's logits
+    llama_sampler *smpl = nullptr;
+    std::optional<IncrementalDetokenizer> detok;
+  };
+  auto lock = traced_lock(m_InterferenceMutex, "llm.lock_wait");
+  std::optional<ScopedThreadAffinity> affinity;
+  if (m_Threadpool) {
+    affinity.emplace();
   }
+  apply_adapter(params.adapter);
   llama_memory_t mem = llama_get_memory(m_Ctx);
   llama_memory_clear(mem, false);
-  llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
-  if (llama_decode(m_Ctx, batch) != 0) {
-    std::cerr << "Failed to decode for embeddings" << std::endl;
-    return {};
+  m_CachedTokens.clear();
+  const size_t n_ctx = llama_n_ctx(m_Ctx);
+  const size_t n_batch = std::max<size_t>(llama_n_batch(m_Ctx), 1);
+  const size_t n_seq = std::min<size_t>(llama_n_seq_max(m_Ctx), n_batch);
+  const llama_vocab *vocab = llama_model_get_vocab(m_Model);
+  std::vector<Slot> slots(n_seq);
+  llama_batch batch = llama_batch_init(static_cast<int32_t>(n_batch), 0, 1);
+  // Cells a slot may occupy: an idle slot keeps its prompt for reuse, an
+  // active one is charged for its longest possible reply up front so the
+  // shared pool can never run out mid-decode.
+  auto cells = [](const Slot &slot) {
+    return slot.active ? slot.n_prompt + slot.max_tokens : slot.n_past;
+  };
+  auto release = [&](Slot &slot, size_t seq) {
+    if (slot.smpl) {
+      llama_sampler_free(slot.smpl);
+      slot.smpl = nullptr;
+    }
+    slot.detok.reset();
+    slot.active = false;
+    // Keep the prompt KV; the next prompts likely share it.
+    slot.n_past = std::min(slot.n_past, slot.n_prompt);
+    if (!llama_memory_seq_rm(mem, static_cast<llama_seq_id>(seq),
+                             static_cast<llama_pos>(slot.n_past), -1)) {
+      llama_memory_seq_rm(mem, static_cast<llama_seq_id>(seq), -1, -1);
+      slot.n_past = 0;
+    }
+    slot.tokens.resize(slot.n_past);
+  };
+  auto finish = [&](Slot &slot, size_t seq, std::string error) {
+    BatchOutput out;
+    out.index = slot.index;
+    out.n_prompt = slot.n_prompt;
+    out.n_reused = slot.n_reused;
+    out.n_generated = slot.n_generated;
+    out.error = std::move(error);
+    if (out.error.empty()) {
+      slot.detok->flush();
+      out.text = slot.detok->take_text();
+    }
+    release(slot, seq);
+    on_done(std::move(out));
+  };
+  auto fail = [&](size_t index, const char *error) {
+    BatchOutput out;
+    out.index = index;
+    out.error = error;
+    on_done(std::move(out));
+  };
+  size_t next = 0;
+  size_t n_active = 0;
+  while (next < prompts.size() || n_active > 0) {
+    // Admit prompts while there are free sequences and KV cells.
+    while (next < prompts.size() && n_active < n_seq) {
+      const auto &prompt = prompts[next];
+      if (prompt.empty() || prompt.size() >= n_ctx) {
+        fail(next++, prompt.empty() ? "Empty prompt" : "Prompt too long");
+        continue;
+      }
+      auto shared = [&prompt](const Slot &slot) {
+        const size_t limit = std::min(slot.n_past, prompt.size() - 1);
+        size_t n = 0;
+        while (n < limit && slot.tokens[n] == prompt[n]) {
+          n++;
+        }
+        return n;
+      };
+      size_t target = n_seq;
+      size_t source = n_seq;
+      size_t target_shared = 0;
+      size_t source_shared = 0;
+      for (size_t s = 0; s < n_seq; s++) {
+        const size_t n = shared(slots[s]);
+        if (!slots[s].active && (target == n_seq || n > target_shared)) {
+          target = s;
+          target_shared = n;
+        }
+        if (n > source_shared) {
+          source = s;
+          source_shared = n;
+        }
+      }
+      const int max_tokens = static_cast<int>(std::min<size_t>(
+          std::max(params.max_tokens, 1), n_ctx - prompt.size()));
+      auto cells_free = [&]() {
+        size_t used = 0;
+        for (size_t s = 0; s < n_seq; s++) {
+          used += s == target ? 0 : cells(slots[s]);
+        }
+        return used >= n_ctx ? 0 : n_ctx - used;
+      };
+      if (prompt.size() + max_tokens > cells_free()) {
+        if (n_active > 0) {
+          break; // wait for a running sequence to free its cells
+        }
+        // Nothing is running: drop idle prefixes except the one reused.
+        for (size_t s = 0; s < n_seq; s++) {
+          if (s != source && s != target && slots[s].n_past > 0) {
+            llama_memory_seq_rm(mem, static_cast<llama_seq_id>(s), -1, -1);
+            slots[s].n_past = 0;
+            slots[s].tokens.clear();
+          }
+        }
+        if (prompt.size() + max_tokens > cells_free()) {
+          source = n_seq;
+          source_shared = 0;
+          target_shared = 0;
+          llama_memory_clear(mem, false);
+          for (auto &slot : slots) {
+            slot.n_past = 0;
+            slot.tokens.clear();
+          }
+        }
+      }
+      Slot &slot = slots[target];
+      const auto seq = static_cast<llama_seq_id>(target);
+      size_t n_reused = 0;
+      if (source != n_seq && source_shared > target_shared) {
+        llama_memory_seq_rm(mem, seq, -1, -1);
+        llama_memory_seq_cp(mem, static_cast<llama_seq_id>(source), seq, 0,
+                            static_cast<llama_pos>(source_shared));
+        n_reused = source_shared;
+      } else if (target_shared > 0 &&
+                 llama_memory_seq_rm(mem, seq,
+                                     static_cast<llama_pos>(target_shared),
+                                     -1)) {
+        n_reused = target_shared;
+      } else {
+        llama_memory_seq_rm(mem, seq, -1, -1);
+      }
+      slot.active = true;
+      slot.index = next++;
+      slot.tokens = prompt;
+      slot.n_past = n_reused;
+      slot.n_prompt = prompt.size();
+      slot.n_reused = n_reused;
+      slot.max_tokens = max_tokens;
+      slot.n_generated = 0;
+      auto sparams = llama_sampler_chain_default_params();
+      slot.smpl = llama_sampler_chain_init(sparams);
+      llama_sampler_chain_add(
+          slot.smpl, llama_sampler_init_top_k(static_cast<int>(params.top_k)));
+      llama_sampler_chain_add(slot.smpl,
+                              llama_sampler_init_top_p(params.top_p, 1));
+      llama_sampler_chain_add(slot.smpl,
+                              llama_sampler_init_temp(params.temperature));
+      llama_sampler_chain_add(slot.smpl, llama_sampler_init_dist(params.seed));
+      slot.detok.emplace(m_Pieces);
+      n_active++;
+    }
+    if (n_active == 0) {
+      continue;
+    }
+    // One row per generating sequence, then prompt chunks in the space
+    // left, so replies keep streaming while new prompts prefill.
+    batch.n_tokens = 0;
+    auto add = [&batch](llama_token token, size_t pos, size_t seq,
+                        bool logits) {
+      const int i = batch.n_tokens++;
+      batch.token[i] = token;
+      batch.pos[i] = static_cast<llama_pos>(pos);
+      batch.n_seq_id[i] = 1;
+      batch.seq_id[i][0] = static_cast<llama_seq_id>(seq);
+      batch.logits[i] = logits;
+      return i;
+    };
+    std::vector<size_t> added(n_seq, 0);
+    for (size_t s = 0; s < n_seq; s++) {
+      Slot &slot = slots[s];
+      slot.i_batch = -1;
+      if (slot.active && slot.n_past >= slot.n_prompt) {
+        slot.i_batch = add(slot.tokens[slot.n_past], slot.n_past, s, true);
+        added[s] = 1;
+      }
+    }
+    for (size_t s = 0; s < n_seq; s++) {
+      Slot &slot = slots[s];
+      if (!slot.active || slot.n_past >= slot.n_prompt) {
+        continue;
+      }
+      const size_t room = n_batch - static_cast<size_t>(batch.n_tokens);
+      const size_t n = std::min(room, slot.n_prompt - slot.n_past);
+      for (size_t j = 0; j < n; j++) {
+        const size_t pos = slot.n_past + j;
+        const int i = add(slot.tokens[pos], pos, s, pos + 1 == slot.n_prompt);
+        if (pos + 1 == slot.n_prompt) {
+          slot.i_batch = i;
+        }
+      }
+      added[s] = n;
+    }
+    if (llama_decode(m_Ctx, batch) != 0) {
+      std::cerr << "Failed to decode batch" << std::endl;
+      for (size_t s = 0; s < n_seq; s++) {
+        if (slots[s].active) {
+          finish(slots[s], s, "Decode failed");
+          n_active--;
+        }
+      }
+      llama_memory_clear(mem, false);
+      for (auto &slot : slots) {
+        slot.n_past = 0;
+        slot.tokens.clear();
+      }
+      continue;
+    }
+    for (size_t s = 0; s < n_seq; s++) {
+      Slot &slot = slots[s];
+      slot.n_past += added[s];
+      if (slot.i_batch < 0) {
+        continue;
+      }
+      const llama_token token =
+          llama_sampler_sample(slot.smpl, m_Ctx, slot.i_batch);
+      if (llama_vocab_is_eog(vocab, token)) {
+        finish(slot, s, "");
+        n_active--;
+        continue;
+      }
+      slot.detok->push(token);
+      slot.n_generated++;
+      if (slot.n_generated >= slot.max_tokens) {
+        finish(slot, s, "");
+        n_active--;
+        continue;
+      }
+      slot.tokens.push_back(token);
+    }
+  }
+  llama_batch_free(batch);
+  llama_memory_clear(mem, false);
+}
+
+bool LlamaHandler::save_prefix_state(const std::string &path) {
+  std::lock_guard<std::mutex> lock(m_InterferenceMutex);
+  const size_t n_prefix = std::min(m_PrefixTokens, m_CachedTokens.size());
+  if (n_prefix == 0 || m_ActiveAdapter) {
+    return false;
+  }
+  llama_memory_t mem = llama_get_memory(m_Ctx);
+  if (llama_memory_seq_rm(mem, 0, static_cast<llama_pos>(n_prefix), -1)) {
+    m_CachedTokens.resize(n_prefix);
   }
+  if (llama_state_seq_save_file(m_Ctx, path.c_str(), 0, m_CachedTokens.data(),
+                                m_CachedTokens.size()) == 0) {
+    std::cerr << "Failed to save prefix state to " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool LlamaHandler::load_prefix_state(const std::string &path) {
+  std::lock_guard<std::mutex> lock(m_InterferenceMutex);
+  apply_adapter(""); // the saved KV is the base model's
+  llama_memory_t mem = llama_get_memory(m_Ctx);
+  llama_memory_seq_rm(mem, 0, -1, -1);
+  m_CachedTokens.clear();
+  std::vector<llama_token> tokens(static_cast<size_t>(m_Config.n_ctx));
+  size_t n_tokens = 0;
+  if (llama_state_seq_load_file(m_Ctx, path.c_str(), 0, tokens.data(),
+                                tokens.size(), &n_tokens) == 0) {
+    llama_memory_seq_rm(mem, 0, -1, -1);
+    return false;
+  }
+  tokens.resize(n_tokens);
+  m_CachedTokens = std::move(tokens);
+  m_PrefixTokens = m_CachedTokens.size();
+  return true;
+}
+
+void LlamaHandler::apply_adapter(const std::string &user_id) {
+  AdapterCache::Handle adapter;
+  if (m_Adapters && !user_id.empty()) {
+    adapter = m_Adapters->acquire(user_id);
+  }
+  if (adapter == m_ActiveAdapter) {
+    return;
+  }
+  llama_memory_clear(llama_get_memory(m_Ctx), false);
+  m_CachedTokens.clear();
+  llama_clear_adapter_lora(m_Ctx);
+  m_ActiveAdapter.reset();
+  if (adapter &&
+      llama_set_adapter_lora(m_Ctx, adapter.get(), m_Config.lora_scale) != 0) {
+    std::cerr << "Failed to apply the LoRA adapter of " << user_id
+              << "; using the base model" << std::endl;
+    return;
+  }
+  m_ActiveAdapter = std::move(adapter);
+}
+
+bool LlamaHandler::has_adapter(const std::string &user_id) const {
+  return m_Adapters && m_Adapters->has_adapter(user_id);
+}
+
+bool LlamaHandler::create_threadpools(int &n_threads, int &n_threads_batch) {
+  std::vector<int> decode_cpus, batch_cpus, http_cpus;
+  if (!resolve_cpu_set(m_Config.cpus_decode, decode_cpus) ||
+      !resolve_cpu_set(m_Config.cpus_batch, batch_cpus) ||
+      !resolve_cpu_set(m_Config.cpus_http, http_cpus)) {
+    std::cerr << "Invalid CPU placement" << std::endl;
+    return false;
+  }
+  if (decode_cpus.empty() && batch_cpus.empty() && http_cpus.empty()) {
+    return true; // llama.cpp's own unpinned threads
+  }
+  // Compute threads inherit the affinity of the HTTP thread that calls
+  // decode, so with HTTP confined every pool needs an explicit set.
+  const std::vector<int> compute = cpu_set_difference(online_cpus(), http_cpus);
+  if (decode_cpus.empty()) {
+    decode_cpus = compute;
+  }
+  if (batch_cpus.empty()) {
+    batch_cpus = decode_cpus;
+  }
+  // Pinned pools run one thread per CPU, so thread counts are capped at
+  // the size of their set.
+  auto make_pool = [](int &n_threads, const std::vector<int> &cpus,
+                      const char *name, bool strict) -> ggml_threadpool * {
+    if (cpus.empty()) {
+      std::cerr << "No CPUs left for " << name << " threads" << std::endl;
+      return nullptr;
+    }
+    if (n_threads > static_cast<int>(cpus.size())) {
+      std::cout << "Limiting " << name << " threads to " << cpus.size()
+                << " pinned CPUs" << std::endl;
+      n_threads = static_cast<int>(cpus.size());
+    }
+    ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+    std::fill(std::begin(params.cpumask), std::end(params.cpumask), false);
+    for (int cpu : cpus) {
+      if (cpu < GGML_MAX_N_THREADS) {
+        params.cpumask[cpu] = true;
+      }
+    }
+    params.strict_cpu = strict;
+    if (!strict) {
+      params.poll = 0; // sleep rather than spin between graphs
+    }
+    ggml_threadpool *pool = ggml_threadpool_new(&params);
+    if (!pool) {
+      std::cerr << "Failed to create " << name << " threadpool" << std::endl;
+    }
+    return pool;
+  };
+  m_Threadpool = make_pool(n_threads, decode_cpus, "decode", true);
+  m_ThreadpoolBatch = make_pool(n_threads_batch, batch_cpus, "batch", true);
+  if (m_Config.embedding_batch_size > 0) {
+    // Embeddings run concurrently with generation on the same CPUs, so
+    // their pool floats over the set and does not poll; two pools spinning
+    // on one core would starve each other.
+    m_EmbdThreadpool =
+        make_pool(n_threads_batch, batch_cpus, "embedding", false);
+    if (!m_EmbdThreadpool) {
+      return false;
+    }
+  }
+  return m_Threadpool && m_ThreadpoolBatch;
+}
+
+bool LlamaHandler::shift_context(size_t n_keep) {
+  llama_memory_t mem = llama_get_memory(m_Ctx);
+  if (!llama_memory_can_shift(mem)) {
+    return false;
+  }
+  const size_t n_past = m_CachedTokens.size();
+  const size_t n_discard = (n_past - n_keep) / 2;
+  if (n_discard == 0) {
+    return false;
+  }
+  const auto keep = static_cast<llama_pos>(n_keep);
+  const auto discard = static_cast<llama_pos>(n_discard);
+  llama_memory_seq_rm(mem, 0, keep, keep + discard);
+  llama_memory_seq_add(mem, 0, keep + discard,
+                       static_cast<llama_pos>(n_past), -discard);
+  m_CachedTokens.erase(m_CachedTokens.begin() + n_keep,
+                       m_CachedTokens.begin() + n_keep + n_discard);
+  return true;
+}
+
+bool LlamaHandler::parse_cache_type(const std::string &name, ggml_type &type) {
+  static const std::pair<const char *, ggml_type> kTypes[] = {
+      {"f32", GGML_TYPE_F32},   {"f16", GGML_TYPE_F16},
+      {"bf16", GGML_TYPE_BF16}, {"q8_0", GGML_TYPE_Q8_0},
+      {"q5_1", GGML_TYPE_Q5_1}, {"q5_0", GGML_TYPE_Q5_0},
+      {"q4_1", GGML_TYPE_Q4_1}, {"q4_0", GGML_TYPE_Q4_0}};
+  for (const auto &[type_name, value] : kTypes) {
+    if (name == type_name) {
+      type = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool LlamaHandler::parse_flash_attn(const std::string &name,
+                                    llama_flash_attn_type &type) {
+  if (name == "auto") {
+    type = LLAMA_FLASH_ATTN_TYPE_AUTO;
+  } else if (name == "on") {
+    type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+  } else if (name == "off") {
+    type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::vector<float> LlamaHandler::get_embedding(const std::string &text) {
+  auto embeddings = get_embeddings({text});
+  return embeddings.empty() ? std::vector<float>{} : std::move(embeddings[0]);
+}
+
+std::vector<std::vector<float>>
+LlamaHandler::get_embeddings(const std::vector<std::string> &texts) {
+  auto lock = traced_lock(m_EmbeddingMutex, "embed.lock_wait");
+  std::optional<ScopedThreadAffinity> affinity;
+  if (m_EmbdThreadpool) {
+    affinity.emplace();
+  }
+  std::vector<std::vector<float>> results(texts.size());
+  if (!m_EmbdCtx) {
+    std::cerr << "Model has no embedding context" << std::endl;
+    return results;
+  }
+  const int capacity = static_cast<int>(llama_n_batch(m_EmbdCtx));
+  const int max_seqs = static_cast<int>(llama_n_seq_max(m_EmbdCtx));
   const int n_embd = llama_model_n_embd(m_Model);
-  const float *embd = llama_get_embeddings_seq(m_Ctx, 0);
-  if (!embd) {
-    std::cerr << "Failed to get embeddings" << std::endl;
-    return {};
+  llama_memory_t mem = llama_get_memory(m_EmbdCtx);
+  llama_batch batch = llama_batch_init(capacity, 0, 1);
+  std::vector<llama_token> tokens;
+  size_t next = 0;
+  while (next < texts.size()) {
+    // Pack as many whole texts as fit; an oversized text is truncated and
+    // embedded on its own. A text that does not fit is carried over.
+    batch.n_tokens = 0;
+    std::vector<size_t> seq_texts;
+    while (next < texts.size() &&
+           static_cast<int>(seq_texts.size()) < max_seqs) {
+      if (tokens.empty()) {
+        tokens = tokenize(texts[next], true);
+        if (tokens.empty()) {
+          next++;
+          continue;
+        }
+        if (static_cast<int>(tokens.size()) > capacity) {
+          tokens.resize(capacity);
+        }
+      }
+      if (batch.n_tokens + static_cast<int>(tokens.size()) > capacity) {
+        break;
+      }
+      const llama_seq_id seq = static_cast<llama_seq_id>(seq_texts.size());
+      for (size_t pos = 0; pos < tokens.size(); pos++) {
+        const int i = batch.n_tokens++;
+        batch.token[i] = tokens[pos];
+        batch.pos[i] = static_cast<llama_pos>(pos);
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = seq;
+        batch.logits[i] = true;
+      }
+      tokens.clear();
+      seq_texts.push_back(next++);
+    }
+    if (seq_texts.empty()) {
+      continue;
+    }
+    llama_memory_clear(mem, false);
+    if (llama_decode(m_EmbdCtx, batch) != 0) {
+      std::cerr << "Failed to decode for embeddings" << std::endl;
+      continue;
+    }
+    for (size_t seq = 0; seq < seq_texts.size(); seq++) {
+      const float *embd = llama_get_embeddings_seq(m_EmbdCtx, seq);
+      if (!embd) {
+        std::cerr << "Failed to get embeddings" << std::endl;
+        continue;
+      }
+      results[seq_texts[seq]].assign(embd, embd + n_embd);
+    }
   }
-  std::vector<float> embedding(embd, embd + n_embd);
-  return embedding;
+  llama_batch_free(batch);
+  return results;
+}
+
+bool LlamaHandler::read_model_info(const std::string &path, ModelInfo &info) {
+  gguf_init_params params = {true, nullptr};
+  gguf_context *ctx = gguf_init_from_file(path.c_str(), params);
+  if (!ctx) {
+    return false;
+  }
+  bool ok = false;
+  const int64_t arch_key = gguf_find_key(ctx, "general.architecture");
+  if (arch_key >= 0) {
+    const std::string embd_name =
+        std::string(gguf_get_val_str(ctx, arch_key)) + ".embedding_length";
+    const int64_t embd_key = gguf_find_key(ctx, embd_name.c_str());
+    const int64_t vocab_key = gguf_find_key(ctx, "tokenizer.ggml.tokens");
+    if (embd_key >= 0 && vocab_key >= 0 &&
+        gguf_get_kv_type(ctx, embd_key) == GGUF_TYPE_UINT32) {
+      info.n_embd = static_cast<int>(gguf_get_val_u32(ctx, embd_key));
+      info.n_vocab = static_cast<int>(gguf_get_arr_n(ctx, vocab_key));
+      ok = info.n_embd > 0 && info.n_vocab > 0;
+    }
+  }
+  gguf_free(ctx);
+  return ok;
+}
+
+void LlamaHandler::prefetch_file(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+}
+
+void LlamaHandler::synchronize() {
+  std::lock_guard<std::mutex> lock(m_InterferenceMutex);
+  if (m_Ctx) {
+    llama_synchronize(m_Ctx);
+  }
+}
+
+int LlamaHandler::get_vocab_size() const {
+  if (m_Model) {
+    return llama_vocab_n_tokens(llama_model_get_vocab(m_Model));
+  }
+  return 0;
 }
 
 int LlamaHandler::get_embedding_dim() const {
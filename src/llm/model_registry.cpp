@@ -0,0 +1,196 @@
+#include "llm/model_registry.h"
+#include <filesystem>
+#include <iostream>
+
+namespace solus {
+
+ModelRegistry::ModelRegistry(std::vector<ModelSpec> models,
+                             size_t budget_bytes, Loader loader)
+    : m_Specs(std::move(models)), m_BudgetBytes(budget_bytes),
+      m_Loader(std::move(loader)) {
+  m_SpecSlots.reserve(m_Specs.size());
+  for (size_t i = 0; i < m_Specs.size(); i++) {
+    const std::string &path = m_Specs[i].path;
+    size_t slot = 0;
+    while (slot < m_Slots.size() && m_Slots[slot].path != path) {
+      slot++;
+    }
+    if (slot == m_Slots.size()) {
+      Slot s;
+      s.path = path;
+      std::error_code ec;
+      s.size_bytes = static_cast<size_t>(std::filesystem::file_size(path, ec));
+      if (ec) {
+        s.size_bytes = 0;
+      }
+      s.pinned = i == 0;
+      m_Slots.push_back(std::move(s));
+    }
+    m_SpecSlots.push_back(slot);
+  }
+}
+
+std::vector<ModelSpec>
+ModelRegistry::specs_from_config(const ServerConfig &config) {
+  std::vector<ModelSpec> specs;
+  specs.reserve(config.models.size() + 1);
+  specs.push_back({config.model_name, config.model_path, config.prompt_format});
+  for (const auto &spec : config.models) {
+    if (spec.name == config.model_name) {
+      std::cerr << "Ignoring model with the default name: " << spec.name
+                << std::endl;
+      continue;
+    }
+    specs.push_back(spec);
+  }
+  return specs;
+}
+
+ModelRegistry::Loader ModelRegistry::make_loader(const ServerConfig &config) {
+  return [config](const ModelSpec &spec) -> std::shared_ptr<LlamaHandler> {
+    ServerConfig model_config = config;
+    model_config.model_path = spec.path;
+    if (spec.path != config.model_path) {
+      // Adapters are trained against the default model's weights.
+      model_config.embedding_batch_size = 0;
+      model_config.lora_dir.clear();
+    }
+    auto handler = std::make_shared<LlamaHandler>(model_config);
+    if (!handler->initialize()) {
+      return nullptr;
+    }
+    return handler;
+  };
+}
+
+bool ModelRegistry::initialize() {
+  if (m_Specs.empty()) {
+    std::cerr << "No models configured" << std::endl;
+    return false;
+  }
+  return acquire(default_name()) != nullptr;
+}
+
+ModelRegistry::Slot *ModelRegistry::slot_for(const std::string &name) {
+  if (name.empty()) {
+    return &m_Slots[m_SpecSlots.front()];
+  }
+  for (size_t i = 0; i < m_Specs.size(); i++) {
+    if (m_Specs[i].name == name) {
+      return &m_Slots[m_SpecSlots[i]];
+    }
+  }
+  return nullptr;
+}
+
+std::shared_ptr<LlamaHandler>
+ModelRegistry::acquire(const std::string &name) {
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  Slot *slot = slot_for(name);
+  if (!slot) {
+    return nullptr;
+  }
+  m_LoadCv.wait(lock, [slot] { return !slot->loading; });
+  slot->last_used = ++m_Clock;
+  if (slot->handler) {
+    return slot->handler;
+  }
+  evict_for(slot->size_bytes, *slot);
+  slot->loading = true;
+  const ModelSpec *spec = find_spec(name.empty() ? default_name() : name);
+  // Load outside the lock so requests for loaded models are not held up.
+  lock.unlock();
+  std::cout << "Loading model '" << spec->name << "'" << std::endl;
+  std::shared_ptr<LlamaHandler> handler;
+  try {
+    handler = m_Loader(*spec);
+  } catch (const std::exception &e) {
+    std::cerr << "Failed to load model '" << spec->name << "': " << e.what()
+              << std::endl;
+  }
+  lock.lock();
+  slot->loading = false;
+  slot->handler = handler;
+  m_LoadCv.notify_all();
+  if (!handler) {
+    std::cerr << "Model '" << spec->name << "' is unavailable" << std::endl;
+  }
+  return handler;
+}
+
+void ModelRegistry::evict_for(size_t incoming_bytes, const Slot &incoming) {
+  if (m_BudgetBytes == 0) {
+    return;
+  }
+  size_t used = 0;
+  for (const auto &slot : m_Slots) {
+    if (slot.handler || slot.loading) {
+      used += slot.size_bytes;
+    }
+  }
+  while (used + incoming_bytes > m_BudgetBytes) {
+    Slot *victim = nullptr;
+    for (auto &slot : m_Slots) {
+      // A handler a request still holds would stay in memory after the
+      // reset, so evicting it frees nothing.
+      if (&slot == &incoming || slot.pinned || !slot.handler ||
+          slot.handler.use_count() > 1) {
+        continue;
+      }
+      if (!victim || slot.last_used < victim->last_used) {
+        victim = &slot;
+      }
+    }
+    if (!victim) {
+      std::cerr << "Model memory budget exceeded; nothing left to evict"
+                << std::endl;
+      return;
+    }
+    std::cout << "Unloading model " << victim->path << std::endl;
+    victim->handler.reset();
+    used -= victim->size_bytes;
+  }
+}
+
+std::shared_ptr<LlamaHandler> ModelRegistry::default_model() const {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Slots[m_SpecSlots.front()].handler;
+}
+
+bool ModelRegistry::contains(const std::string &name) const {
+  return find_spec(name) != nullptr;
+}
+
+const ModelSpec *ModelRegistry::find_spec(const std::string &name) const {
+  for (const auto &spec : m_Specs) {
+    if (spec.name == name) {
+      return &spec;
+    }
+  }
+  return nullptr;
+}
+
+std::vector<ModelStatus> ModelRegistry::status() const {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  std::vector<ModelStatus> result;
+  result.reserve(m_Specs.size());
+  for (size_t i = 0; i < m_Specs.size(); i++) {
+    const Slot &slot = m_Slots[m_SpecSlots[i]];
+    result.push_back({m_Specs[i].name, slot.path, slot.size_bytes,
+                      slot.handler != nullptr, slot.pinned});
+  }
+  return result;
+}
+
+size_t ModelRegistry::loaded_bytes() const {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  size_t used = 0;
+  for (const auto &slot : m_Slots) {
+    if (slot.handler) {
+      used += slot.size_bytes;
+    }
+  }
+  return used;
+}
+
+} // namespace solus
@@ -0,0 +1,188 @@
+#include "llm/throughput_bench.h"
+#include <algorithm>
+#include <chrono>
+
+using json = nlohmann::json;
+
+namespace solus {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+double median(std::vector<double> values) {
+  if (values.empty()) {
+    return 0.0;
+  }
+  std::sort(values.begin(), values.end());
+  const size_t mid = values.size() / 2;
+  return values.size() % 2 ? values[mid]
+                           : (values[mid - 1] + values[mid]) / 2.0;
+}
+
+} // namespace
+
+ThroughputBench::ThroughputBench(LlamaHandler &llm) : m_Llama(llm) {}
+
+std::vector<llama_token> ThroughputBench::random_prompt(size_t n_tokens) {
+  std::uniform_int_distribution<llama_token> token(
+      0, std::max(m_Llama.get_vocab_size(), 1) - 1);
+  std::vector<llama_token> prompt(std::max<size_t>(n_tokens, 1));
+  for (auto &t : prompt) {
+    t = token(m_Rng);
+  }
+  return prompt;
+}
+
+std::string ThroughputBench::random_text(size_t n_words) {
+  std::uniform_int_distribution<int> letter('a', 'z');
+  std::uniform_int_distribution<int> length(2, 8);
+  std::string text;
+  for (size_t i = 0; i < n_words; i++) {
+    if (i > 0) {
+      text += ' ';
+    }
+    for (int n = length(m_Rng); n > 0; n--) {
+      text += static_cast<char>(letter(m_Rng));
+    }
+  }
+  return text;
+}
+
+std::vector<BenchMetric> ThroughputBench::run(const BenchOptions &options) {
+  m_Rng.seed(options.seed);
+  const int runs = std::max(options.repetitions, 1) + 1;
+  GenerationParams params;
+  std::vector<double> prefill, ttft, decode, embed;
+  for (int run = 0; run < runs; run++) {
+    const bool warm_up = run == 0;
+    // Prefill alone: no token is sampled with max_tokens 0.
+    params.max_tokens = 0;
+    auto prompt = random_prompt(options.prompt_tokens);
+    auto start = Clock::now();
+    m_Llama.generate(prompt, params);
+    m_Llama.synchronize();
+    const double prefill_rate =
+        prompt.size() / std::max(seconds_since(start), 1e-9);
+    // A fresh prompt again. The first text piece arrives after the first
+    // sample; every token from then on is decoded before generate returns.
+    params.max_tokens = static_cast<int>(options.decode_tokens);
+    prompt = random_prompt(options.prompt_tokens);
+    Clock::time_point first;
+    bool sampled = false;
+    int n_generated = 0;
+    start = Clock::now();
+    m_Llama.generate(
+        prompt, params,
+        [&](std::string_view) {
+          if (!sampled) {
+            first = Clock::now();
+            sampled = true;
+          }
+          return true;
+        },
+        &n_generated);
+    m_Llama.synchronize();
+    const double decode_s = seconds_since(first);
+    const std::string text = random_text(options.embed_words);
+    auto embed_start = Clock::now();
+    const bool embedded = !m_Llama.get_embedding(text).empty();
+    const double embed_s = seconds_since(embed_start);
+    if (warm_up) {
+      continue;
+    }
+    prefill.push_back(prefill_rate);
+    if (sampled) {
+      ttft.push_back(
+          std::chrono::duration<double, std::milli>(first - start).count());
+      decode.push_back(n_generated / std::max(decode_s, 1e-9));
+    }
+    if (embedded) {
+      embed.push_back(embed_s * 1000.0);
+    }
+  }
+  std::vector<BenchMetric> metrics = {
+      {"prefill_tok_s", median(prefill), "tok/s", true},
+      {"decode_tok_s", median(decode), "tok/s", true},
+      {"ttft_ms", median(ttft), "ms", false},
+      {"embed_ms", median(embed), "ms", false},
+  };
+  // Generated tokens per second across all sequences of one batch, prompt
+  // prefill included, as the offline batch runner sees it.
+  params.max_tokens = static_cast<int>(options.batch_decode_tokens);
+  double single = 0.0;
+  for (size_t concurrency : options.concurrency) {
+    std::vector<double> rates;
+    for (int run = 0; run < runs; run++) {
+      std::vector<std::vector<llama_token>> prompts;
+      for (size_t i = 0; i < concurrency; i++) {
+        prompts.push_back(random_prompt(options.batch_prompt_tokens));
+      }
+      size_t generated = 0;
+      const auto start = Clock::now();
+      m_Llama.generate_batch(prompts, params, [&](BatchOutput &&out) {
+        generated += static_cast<size_t>(out.n_generated);
+      });
+      const double elapsed = seconds_since(start);
+      if (run > 0) {
+        rates.push_back(generated / std::max(elapsed, 1e-9));
+      }
+    }
+    const double rate = median(rates);
+    metrics.push_back({"batch" + std::to_string(concurrency) + "_tok_s", rate,
+                       "tok/s", true});
+    if (concurrency == 1) {
+      single = rate;
+    } else if (single > 0.0) {
+      metrics.push_back({"batch" + std::to_string(concurrency) + "_scaling",
+                         rate / single, "x", true});
+    }
+  }
+  return metrics;
+}
+
+json ThroughputBench::to_json(const std::vector<BenchMetric> &metrics) {
+  json values = json::object();
+  for (const auto &metric : metrics) {
+    values[metric.name] = {{"value", metric.value},
+                           {"unit", metric.unit},
+                           {"higher_is_better", metric.higher_is_better}};
+  }
+  return {{"metrics", values}};
+}
+
+std::vector<BenchDelta> ThroughputBench::compare(const json &current,
+                                                 const json &baseline,
+                                                 double threshold) {
+  const json none = json::object();
+  const json &base = baseline.contains("metrics") ? baseline["metrics"] : none;
+  const json &now = current.contains("metrics") ? current["metrics"] : none;
+  std::vector<BenchDelta> deltas;
+  for (const auto &[name, metric] : base.items()) {
+    BenchDelta delta;
+    delta.name = name;
+    delta.baseline = metric.value("value", 0.0);
+    if (!now.contains(name)) {
+      delta.missing = true;
+      delta.regressed = true;
+      deltas.push_back(delta);
+      continue;
+    }
+    delta.current = now[name].value("value", 0.0);
+    if (delta.baseline > 0.0) {
+      const double diff = metric.value("higher_is_better", true)
+                              ? delta.baseline - delta.current
+                              : delta.current - delta.baseline;
+      delta.change = diff / delta.baseline;
+    }
+    delta.regressed = delta.change > threshold;
+    deltas.push_back(delta);
+  }
+  return deltas;
+}
+
+} // namespace solus
@@ -0,0 +1,211 @@
+#include "llm/tiny_model.h"
+#include "gguf.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace solus {
+
+namespace {
+
+// <unk>, <s> and </s>, then one token per byte for byte fallback.
+constexpr int kFirstText = 3 + 256;
+constexpr int kMinVocab = 384;
+
+// llama.cpp token types.
+constexpr int32_t kTypeNormal = 1;
+constexpr int32_t kTypeUnknown = 2;
+constexpr int32_t kTypeControl = 3;
+constexpr int32_t kTypeByte = 6;
+
+struct Vocab {
+  std::vector<std::string> tokens;
+  std::vector<float> scores;
+  std::vector<int32_t> types;
+};
+
+// Text pieces after the byte tokens: printable ASCII, then word starts and
+// letter pairs, so ordinary English tokenizes into a few pieces per word.
+std::vector<std::string> text_pieces() {
+  const std::string space = "\xe2\x96\x81"; // SentencePiece word boundary
+  std::vector<std::string> pieces;
+  pieces.push_back(space);
+  for (char c = '!'; c <= '~'; c++) {
+    pieces.emplace_back(1, c);
+  }
+  for (char c = 'a'; c <= 'z'; c++) {
+    pieces.push_back(space + c);
+  }
+  for (const std::string &prefix : {std::string(), space}) {
+    for (char a = 'a'; a <= 'z'; a++) {
+      for (char b = 'a'; b <= 'z'; b++) {
+        pieces.push_back(prefix + a + b);
+      }
+    }
+  }
+  return pieces;
+}
+
+Vocab build_vocab(size_t n_vocab, const std::vector<std::string> &pieces) {
+  Vocab vocab;
+  auto add = [&vocab](std::string text, float score, int32_t type) {
+    vocab.tokens.push_back(std::move(text));
+    vocab.scores.push_back(score);
+    vocab.types.push_back(type);
+  };
+  add("<unk>", 0.0f, kTypeUnknown);
+  add("<s>", 0.0f, kTypeControl);
+  add("</s>", 0.0f, kTypeControl);
+  for (int byte = 0; byte < 256; byte++) {
+    char name[8];
+    std::snprintf(name, sizeof(name), "<0x%02X>", byte);
+    add(name, 0.0f, kTypeByte);
+  }
+  for (size_t i = 0; vocab.tokens.size() < n_vocab; i++) {
+    // Longer pieces come later and score lower, as merges would.
+    add(pieces[i], -static_cast<float>(i), kTypeNormal);
+  }
+  return vocab;
+}
+
+struct TensorShape {
+  std::string name;
+  int64_t ne0 = 0;
+  int64_t ne1 = 1; // 1 for norms, which stay f32 and are all ones
+};
+
+std::vector<TensorShape> tensor_shapes(const TinyModelSpec &spec) {
+  const int64_t n_embd_kv =
+      static_cast<int64_t>(spec.n_embd) / spec.n_head * spec.n_head_kv;
+  std::vector<TensorShape> shapes = {
+      {"token_embd.weight", spec.n_embd, spec.n_vocab},
+      {"output_norm.weight", spec.n_embd},
+      {"output.weight", spec.n_embd, spec.n_vocab},
+  };
+  for (int i = 0; i < spec.n_layer; i++) {
+    const std::string blk = "blk." + std::to_string(i) + ".";
+    shapes.push_back({blk + "attn_norm.weight", spec.n_embd});
+    shapes.push_back({blk + "attn_q.weight", spec.n_embd, spec.n_embd});
+    shapes.push_back({blk + "attn_k.weight", spec.n_embd, n_embd_kv});
+    shapes.push_back({blk + "attn_v.weight", spec.n_embd, n_embd_kv});
+    shapes.push_back({blk + "attn_output.weight", spec.n_embd, spec.n_embd});
+    shapes.push_back({blk + "ffn_norm.weight", spec.n_embd});
+    shapes.push_back({blk + "ffn_gate.weight", spec.n_embd, spec.n_ff});
+    shapes.push_back({blk + "ffn_down.weight", spec.n_ff, spec.n_embd});
+    shapes.push_back({blk + "ffn_up.weight", spec.n_embd, spec.n_ff});
+  }
+  return shapes;
+}
+
+} // namespace
+
+bool write_tiny_model(const std::string &path, const TinyModelSpec &spec) {
+  const std::vector<std::string> pieces = text_pieces();
+  const size_t max_vocab = kFirstText + pieces.size();
+  if (spec.n_vocab < kMinVocab ||
+      static_cast<size_t>(spec.n_vocab) > max_vocab) {
+    std::cerr << "Tiny model vocabulary must be " << kMinVocab << " to "
+              << max_vocab << " tokens" << std::endl;
+    return false;
+  }
+  if (spec.n_head <= 0 || spec.n_head_kv <= 0 ||
+      spec.n_embd % spec.n_head != 0 || spec.n_head % spec.n_head_kv != 0) {
+    std::cerr << "Tiny model heads must divide the embedding size"
+              << std::endl;
+    return false;
+  }
+  const std::vector<TensorShape> shapes = tensor_shapes(spec);
+  size_t mem_size = 0;
+  for (const auto &shape : shapes) {
+    const ggml_type type = shape.ne1 == 1 ? GGML_TYPE_F32 : spec.weight_type;
+    if (shape.ne0 % ggml_blck_size(type) != 0) {
+      std::cerr << shape.name << " rows do not fit "
+                << ggml_type_name(type) << " blocks" << std::endl;
+      return false;
+    }
+    mem_size += ggml_tensor_overhead() + GGML_MEM_ALIGN +
+                ggml_row_size(type, shape.ne0) * shape.ne1;
+  }
+  ggml_init_params params = {mem_size, nullptr, false};
+  ggml_context *ctx = ggml_init(params);
+  if (!ctx) {
+    std::cerr << "Failed to allocate tiny model tensors" << std::endl;
+    return false;
+  }
+  gguf_context *gguf = gguf_init_empty();
+  gguf_set_val_str(gguf, "general.architecture", "llama");
+  gguf_set_val_str(gguf, "general.name", "solus-tiny");
+  gguf_set_val_u32(gguf, "llama.context_length", spec.n_ctx_train);
+  gguf_set_val_u32(gguf, "llama.embedding_length", spec.n_embd);
+  gguf_set_val_u32(gguf, "llama.block_count", spec.n_layer);
+  gguf_set_val_u32(gguf, "llama.feed_forward_length", spec.n_ff);
+  gguf_set_val_u32(gguf, "llama.attention.head_count", spec.n_head);
+  gguf_set_val_u32(gguf, "llama.attention.head_count_kv", spec.n_head_kv);
+  gguf_set_val_u32(gguf, "llama.rope.dimension_count",
+                   spec.n_embd / spec.n_head);
+  gguf_set_val_f32(gguf, "llama.rope.freq_base", 10000.0f);
+  gguf_set_val_f32(gguf, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+  gguf_set_val_u32(gguf, "llama.vocab_size", spec.n_vocab);
+
+  const Vocab vocab = build_vocab(spec.n_vocab, pieces);
+  std::vector<const char *> token_text;
+  token_text.reserve(vocab.tokens.size());
+  for (const auto &token : vocab.tokens) {
+    token_text.push_back(token.c_str());
+  }
+  gguf_set_val_str(gguf, "tokenizer.ggml.model", "llama");
+  gguf_set_arr_str(gguf, "tokenizer.ggml.tokens", token_text.data(),
+                   token_text.size());
+  gguf_set_arr_data(gguf, "tokenizer.ggml.scores", GGUF_TYPE_FLOAT32,
+                    vocab.scores.data(), vocab.scores.size());
+  gguf_set_arr_data(gguf, "tokenizer.ggml.token_type", GGUF_TYPE_INT32,
+                    vocab.types.data(), vocab.types.size());
+  gguf_set_val_u32(gguf, "tokenizer.ggml.unknown_token_id", 0);
+  gguf_set_val_u32(gguf, "tokenizer.ggml.bos_token_id", 1);
+  gguf_set_val_u32(gguf, "tokenizer.ggml.eos_token_id", 2);
+  gguf_set_val_bool(gguf, "tokenizer.ggml.add_bos_token", true);
+  gguf_set_val_bool(gguf, "tokenizer.ggml.add_eos_token", false);
+
+  // Unit-variance activations after each norm give logits of roughly unit
+  // spread, so sampling behaves like a real model's rather than uniformly.
+  std::mt19937 rng(spec.seed);
+  std::normal_distribution<float> normal(
+      0.0f, 1.0f / std::sqrt(static_cast<float>(spec.n_embd)));
+  std::vector<float> values;
+  for (const auto &shape : shapes) {
+    const bool norm = shape.ne1 == 1;
+    values.resize(static_cast<size_t>(shape.ne0 * shape.ne1));
+    ggml_tensor *tensor;
+    if (norm) {
+      tensor = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, shape.ne0);
+      std::fill(values.begin(), values.end(), 1.0f);
+      std::memcpy(tensor->data, values.data(), ggml_nbytes(tensor));
+    } else {
+      tensor = ggml_new_tensor_2d(ctx, spec.weight_type, shape.ne0, shape.ne1);
+      for (float &v : values) {
+        v = normal(rng);
+      }
+      if (shape.name == "output.weight") {
+        std::fill(values.begin(), values.begin() + kFirstText * shape.ne0,
+                  0.0f);
+      }
+      ggml_quantize_chunk(spec.weight_type, values.data(), tensor->data, 0,
+                          shape.ne1, shape.ne0, nullptr);
+    }
+    ggml_set_name(tensor, shape.name.c_str());
+    gguf_add_tensor(gguf, tensor);
+  }
+  const bool ok = gguf_write_to_file(gguf, path.c_str(), false);
+  if (!ok) {
+    std::cerr << "Failed to write tiny model to " << path << std::endl;
+  }
+  gguf_free(gguf);
+  ggml_free(ctx);
+  return ok;
+}
+
+} // namespace solus
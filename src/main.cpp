@@ -1,30 +1,140 @@
+#include "server/batch_runner.h"
 #include "server/config.h"
+#include "server/shard_router.h"
+#include <algorithm>
 #include <csignal>
 #include <iostream>
 #include <net/http.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <thread>
+#include <unistd.h>
 #include "server/solus_server.h"
 
-void signal_handler(int signal) {
-  if (signal == SIGINT || signal == SIGTERM) {
-    std::cout << "\nShutting down gracefully..." << std::endl;
-    exit(0);
-  }
-}
-
 void print_usage(const char *program_name) {
   std::cout << "Usage: " << program_name << " [options]\n"
             << "Options:\n"
             << "  --model PATH         Path to GGUF model file\n"
             << "  --port PORT          Server port (default: 8000)\n"
             << "  --threads N          Number of CPU threads (default: 16)\n"
+            << "  --threads-batch N    Prefill/embedding threads (default: "
+               "--threads)\n"
+            << "  --cpus-decode SET    Pin decode threads, e.g. 0-15 or "
+               "node:0\n"
+            << "  --cpus-batch SET     Pin prefill threads (default: "
+               "--cpus-decode)\n"
+            << "  --cpus-http SET      Confine HTTP workers; compute avoids "
+               "them\n"
             << "  --gpu-layers N       GPU layers to offload (default: 33)\n"
             << "  --ctx-size N         Context size (default: 4096)\n"
             << "  --temperature F      Generation temperature (default: 0.7)\n"
+            << "  --prompt-format F    qwen, chatml, llama3 or mistral "
+               "(default: qwen)\n"
+            << "  --model-name NAME    Name requests use for --model "
+               "(default: default)\n"
+            << "  --add-model N=PATH[,FORMAT]\n"
+            << "                       Extra model loaded on first use\n"
+            << "  --model-budget-mb N  Unload idle models above this "
+               "(default: 0, off)\n"
+            << "  --lora-dir DIR       Per-user LoRA adapters, "
+               "DIR/<user_id>.gguf\n"
+            << "  --lora-budget-mb N   Unload idle adapters above this "
+               "(default: 512)\n"
+            << "  --lora-scale F       Adapter strength (default: 1.0)\n"
+            << "  --cache-type-k T     KV cache type for K: f16, q8_0, q4_0 "
+               "(default: f16)\n"
+            << "  --cache-type-v T     KV cache type for V; quantized needs "
+               "flash attention (default: f16)\n"
+            << "  --flash-attn MODE    auto, on or off (default: auto)\n"
+            << "  --no-context-shift   Stop at n_ctx instead of sliding\n"
+            << "  --response-cache     Reuse replies to near-identical "
+               "queries\n"
+            << "  --cache-threshold F  Similarity for a cache hit "
+               "(default: 0.95)\n"
+            << "  --cache-ttl N        Seconds a cached reply lives "
+               "(default: 300)\n"
+            << "  --memory-db PATH     Memory database directory (default: "
+               "./memory_db)\n"
+            << "  --sync-memory-index  Insert memories into the graph before "
+               "replying\n"
+            << "  --mmap-memory        Page memory vectors from a file mapping "
+               "(migrates\n"
+            << "                       index.bin)\n"
+            << "  --memory-index TYPE  hnsw, or ivfpq for compressed codes "
+               "over file-backed\n"
+            << "                       vectors (default: hnsw)\n"
+            << "  --ivf-nlist N        IVF-PQ coarse lists (default: 256)\n"
+            << "  --ivf-nprobe N       IVF-PQ lists scanned per search "
+               "(default: 16)\n"
+            << "  --consolidate-memories\n"
+            << "                       Summarize related old memories while "
+               "idle\n"
+            << "  --consolidate-idle N Idle seconds before consolidating "
+               "(default: 60, min: 1)\n"
+            << "  --consolidate-age-h N\n"
+            << "                       Only memories older than N hours "
+               "(default: 168)\n"
+            << "  --capture FILE       Record /chat traffic for solus_replay\n"
+            << "  --trace FILE         Write request timelines (Chrome trace "
+               "format)\n"
+            << "  --trace-sample F     Fraction of requests traced (default: "
+               "0.01)\n"
+            << "  --trace-slow-ms N    Always trace slower requests (default: "
+               "1000)\n"
+            << "  --batch FILE         Run JSONL requests offline instead of "
+               "serving\n"
+            << "  --out FILE           Batch results (default: FILE.out."
+               "jsonl)\n"
+            << "  --parallel N         Sequences in flight (default: 1, "
+               "8 with --batch)\n"
+            << "  --drain-grace N      Seconds in-flight requests get on "
+               "SIGTERM (default: 30)\n"
+            << "  --warm-state DIR     Prefix KV and caches kept across "
+               "restarts (default:\n"
+            << "                       ./warm_state, empty to disable)\n"
+            << "  --shards N           Route users to N worker processes "
+               "(default: 1);\n"
+            << "                       threads and CPU sets are split "
+               "between them\n"
+            << "  --shard-dir DIR      Shard sockets and map (default: "
+               "./shards)\n"
+            << "  --mlock              Lock model weights in RAM\n"
+            << "  --prefetch           Read ahead the weights file at start\n"
+            << "  --no-warm-up         Skip the warm-up decode\n"
             << "  --help               Show this help message\n";
 }
 
+// Runs server until SIGINT or SIGTERM, which must already be blocked in
+// signals, then shuts it down.
+template <typename Server> int serve(Server &server, sigset_t &signals) {
+  // Signals are taken synchronously on a dedicated thread so shutdown can
+  // drain requests and save state.
+  std::thread signal_thread([&server, &signals]() {
+    int signal = 0;
+    sigwait(&signals, &signal);
+    std::cout << "\nShutting down gracefully..." << std::endl;
+    server.shutdown();
+  });
+  int status = 0;
+  try {
+    server.run();
+  } catch (const std::exception &e) {
+    std::cerr << "Fatal error: " << e.what() << std::endl;
+    status = 1;
+  }
+  // run() may also return without a signal; wake the thread so it shuts
+  // down and can be joined.
+  pthread_kill(signal_thread.native_handle(), SIGTERM);
+  signal_thread.join();
+  return status;
+}
+
 int main(int argc, char **argv) {
   solus::ServerConfig config;
+  std::string batch_input;
+  std::string batch_output;
+  bool parallel_set = false;
+  int shard_worker = -1;
   // Parse command line arguments
   for (int i = 1; i < argc; i++) {
     std::string arg = argv[i];
@@ -38,12 +148,120 @@ int main(int argc, char **argv) {
       config.port = std::stoi(argv[++i]);
     } else if (arg == "--threads" && i + 1 < argc) {
       config.n_threads = std::stoi(argv[++i]);
+    } else if (arg == "--threads-batch" && i + 1 < argc) {
+      config.n_threads_batch = std::stoi(argv[++i]);
+    } else if (arg == "--cpus-decode" && i + 1 < argc) {
+      config.cpus_decode = argv[++i];
+    } else if (arg == "--cpus-batch" && i + 1 < argc) {
+      config.cpus_batch = argv[++i];
+    } else if (arg == "--cpus-http" && i + 1 < argc) {
+      config.cpus_http = argv[++i];
     } else if (arg == "--gpu-layers" && i + 1 < argc) {
       config.n_gpu_layers = std::stoi(argv[++i]);
     } else if (arg == "--ctx-size" && i + 1 < argc) {
       config.n_ctx = std::stoi(argv[++i]);
     } else if (arg == "--temperature" && i + 1 < argc) {
       config.temperature = std::stof(argv[++i]);
+    } else if (arg == "--prompt-format" && i + 1 < argc) {
+      config.prompt_format = argv[++i];
+    } else if (arg == "--model-name" && i + 1 < argc) {
+      config.model_name = argv[++i];
+    } else if (arg == "--add-model" && i + 1 < argc) {
+      std::string value = argv[++i];
+      size_t eq = value.find('=');
+      if (eq == std::string::npos || eq == 0) {
+        std::cerr << "Expected NAME=PATH[,FORMAT]: " << value << std::endl;
+        return 1;
+      }
+      solus::ModelSpec spec;
+      spec.name = value.substr(0, eq);
+      spec.path = value.substr(eq + 1);
+      size_t comma = spec.path.rfind(',');
+      if (comma != std::string::npos) {
+        spec.prompt_format = spec.path.substr(comma + 1);
+        spec.path.resize(comma);
+      }
+      config.models.push_back(std::move(spec));
+    } else if (arg == "--model-budget-mb" && i + 1 < argc) {
+      config.model_memory_budget_mb = std::stoul(argv[++i]);
+    } else if (arg == "--lora-dir" && i + 1 < argc) {
+      config.lora_dir = argv[++i];
+    } else if (arg == "--lora-budget-mb" && i + 1 < argc) {
+      config.lora_budget_mb = std::stoul(argv[++i]);
+    } else if (arg == "--lora-scale" && i + 1 < argc) {
+      config.lora_scale = std::stof(argv[++i]);
+    } else if (arg == "--cache-type-k" && i + 1 < argc) {
+      config.cache_type_k = argv[++i];
+    } else if (arg == "--cache-type-v" && i + 1 < argc) {
+      config.cache_type_v = argv[++i];
+    } else if (arg == "--flash-attn" && i + 1 < argc) {
+      config.flash_attn = argv[++i];
+    } else if (arg == "--no-context-shift") {
+      config.context_shift = false;
+    } else if (arg == "--response-cache") {
+      config.response_cache = true;
+    } else if (arg == "--cache-threshold" && i + 1 < argc) {
+      config.response_cache_threshold = std::stof(argv[++i]);
+    } else if (arg == "--cache-ttl" && i + 1 < argc) {
+      config.response_cache_ttl_s = std::stoi(argv[++i]);
+    } else if (arg == "--memory-db" && i + 1 < argc) {
+      config.memory_db_path = argv[++i];
+    } else if (arg == "--sync-memory-index") {
+      config.memory_background_index = false;
+    } else if (arg == "--mmap-memory") {
+      config.memory_mmap = true;
+    } else if (arg == "--memory-index" && i + 1 < argc) {
+      config.memory_index = argv[++i];
+      if (config.memory_index != "hnsw" && config.memory_index != "ivfpq") {
+        std::cerr << "Unknown memory index: " << config.memory_index
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "--ivf-nlist" && i + 1 < argc) {
+      config.ivf_nlist = std::stoi(argv[++i]);
+      if (config.ivf_nlist < 1) {
+        std::cerr << "--ivf-nlist must be at least 1" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--ivf-nprobe" && i + 1 < argc) {
+      config.ivf_nprobe = std::stoi(argv[++i]);
+    } else if (arg == "--consolidate-memories") {
+      config.memory_consolidation = true;
+    } else if (arg == "--consolidate-idle" && i + 1 < argc) {
+      config.consolidate_idle_s = std::stoi(argv[++i]);
+    } else if (arg == "--consolidate-age-h" && i + 1 < argc) {
+      config.consolidate_min_age_h = std::stoi(argv[++i]);
+    } else if (arg == "--capture" && i + 1 < argc) {
+      config.capture_path = argv[++i];
+    } else if (arg == "--trace" && i + 1 < argc) {
+      config.trace_path = argv[++i];
+    } else if (arg == "--trace-sample" && i + 1 < argc) {
+      config.trace_sample_rate = std::stof(argv[++i]);
+    } else if (arg == "--trace-slow-ms" && i + 1 < argc) {
+      config.trace_slow_ms = std::stoi(argv[++i]);
+    } else if (arg == "--batch" && i + 1 < argc) {
+      batch_input = argv[++i];
+    } else if (arg == "--out" && i + 1 < argc) {
+      batch_output = argv[++i];
+    } else if (arg == "--parallel" && i + 1 < argc) {
+      config.n_parallel = std::stoi(argv[++i]);
+      parallel_set = true;
+    } else if (arg == "--drain-grace" && i + 1 < argc) {
+      config.drain_grace_s = std::stoi(argv[++i]);
+    } else if (arg == "--warm-state" && i + 1 < argc) {
+      config.warm_state_dir = argv[++i];
+    } else if (arg == "--shards" && i + 1 < argc) {
+      config.shards = std::stoi(argv[++i]);
+    } else if (arg == "--shard-dir" && i + 1 < argc) {
+      config.shard_dir = argv[++i];
+    } else if (arg == "--shard-worker" && i + 1 < argc) {
+      shard_worker = std::stoi(argv[++i]);
+    } else if (arg == "--mlock") {
+      config.mlock = true;
+    } else if (arg == "--prefetch") {
+      config.prefetch_weights = true;
+    } else if (arg == "--no-warm-up") {
+      config.warm_up = false;
     } else {
       std::cerr << "Unknown option: " << arg << std::endl;
       print_usage(argv[0]);
@@ -54,16 +272,70 @@ int main(int argc, char **argv) {
     std::cerr << "Error: Model path is required (--model)" << std::endl;
     return 1;
   }
-  std::signal(SIGINT, signal_handler);
-  std::signal(SIGTERM, signal_handler);
+  // The reply budget comes out of the context; past half of it the prompt
+  // has too little room left for the system frame.
+  if (config.max_tokens > config.n_ctx / 2) {
+    config.max_tokens = std::max(config.n_ctx / 2, 1);
+    std::cerr << "Limiting replies to " << config.max_tokens
+              << " tokens, half the context size" << std::endl;
+  }
+  if (!batch_input.empty()) {
+    if (!parallel_set) {
+      config.n_parallel = 8;
+    }
+    if (batch_output.empty()) {
+      batch_output = batch_input + ".out.jsonl";
+    }
+    solus::BatchRunner runner(config);
+    if (!runner.initialize()) {
+      std::cerr << "Failed to initialize batch mode" << std::endl;
+      return 1;
+    }
+    return runner.run(batch_input, batch_output) ? 0 : 1;
+  }
+  // Blocked before any thread starts so every thread inherits the mask.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  if (shard_worker >= 0) {
+    // A worker goes down with its front process rather than lingering.
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1) {
+      return 1;
+    }
+    solus::ServerConfig worker;
+    if (!solus::ShardRouter::worker_config(
+            config, static_cast<size_t>(shard_worker), worker)) {
+      return 1;
+    }
+    config = std::move(worker);
+  } else if (config.shards > 1) {
+    std::vector<std::string> worker_args(argv, argv + argc);
+    try {
+      solus::ShardRouter router(config, std::move(worker_args));
+      if (!router.initialize()) {
+        std::cerr << "Failed to start shard workers" << std::endl;
+        return 1;
+      }
+      return serve(router, signals);
+    } catch (const std::exception &e) {
+      std::cerr << "Fatal error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
   std::cout << "========================================\n"
             << "Solus AI Assistant Server\n"
             << "========================================\n"
             << "Model: " << config.model_path << "\n"
+            << "Extra models: " << config.models.size() << "\n"
             << "Port: " << config.port << "\n"
             << "Threads: " << config.n_threads << "\n"
             << "GPU Layers: " << config.n_gpu_layers << "\n"
             << "Context Size: " << config.n_ctx << "\n"
+            << "KV Cache: " << config.cache_type_k << "/" << config.cache_type_v
+            << "\n"
             << "Temperature: " << config.temperature << "\n"
             << "========================================\n"
             << std::endl;
@@ -73,7 +345,7 @@ int main(int argc, char **argv) {
       std::cerr << "Failed to initialize server" << std::endl;
       return 1;
     }
-    server.run();
+    return serve(server, signals);
   } catch (const std::exception &e) {
     std::cerr << "Fatal error: " << e.what() << std::endl;
     return 1;
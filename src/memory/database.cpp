@@ -1,114 +1,1047 @@
 #include "memory/database.h"
+#include "memory/vector_ops.h"
+#include "utils/tracing.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <thread>
 
 using json = nlohmann::json;
 namespace fs = std::filesystem;
 
 namespace solus {
 
+namespace {
+
+// Entries the background indexer inserts per lock hold; searches wait for
+// at most one batch.
+constexpr size_t kIndexBatch = 16;
+// Bulk-insert entries per lock hold.
+constexpr size_t kImportChunk = 64;
+// How long the indexer waits before retrying entries whose insert failed.
+constexpr auto kIndexRetry = std::chrono::seconds(1);
+// Seeds find_cluster tries per call before giving up until the next one.
+constexpr size_t kClusterSeeds = 256;
+
+template <typename Record> class UserFilter : public hnswlib::BaseFilterFunctor {
+public:
+  UserFilter(const std::vector<Record> &entries, uint32_t user)
+      : m_Entries(entries), m_User(user) {}
+
+  bool operator()(hnswlib::labeltype id) override {
+    return id < m_Entries.size() && m_Entries[id].user == m_User;
+  }
+
+private:
+  const std::vector<Record> &m_Entries;
+  uint32_t m_User;
+};
+
+size_t ivf_train_size(const MemoryDatabaseOptions &options) {
+  // Fewer than ~39 vectors per list leaves k-means badly underfit.
+  return options.ivf_train_size > 0 ? options.ivf_train_size
+                                    : 39 * options.ivf.nlist;
+}
+
+} // namespace
+
 MemoryDatabase::MemoryDatabase(const std::string &db_path, int dimension,
-                               int max_elements)
-    : m_DbPath(db_path), m_Dimension(dimension), m_MaxElements(max_elements) {
-  fs::create_directories(m_DbPath);
+                               int max_elements,
+                               const MemoryDatabaseOptions &options)
+    : m_DbPath(db_path), m_Dimension(dimension), m_MaxElements(max_elements),
+      m_Options(options) {
+  if (!m_Options.read_only) {
+    fs::create_directories(m_DbPath);
+  }
 }
 
-MemoryDatabase::~MemoryDatabase() { save_index(); }
+MemoryDatabase::~MemoryDatabase() {
+  stop_indexer();
+  save_index();
+}
 
 bool MemoryDatabase::initialize() {
   std::cout << "Initializing memory database..." << std::endl;
   m_Space = std::make_unique<hnswlib::InnerProductSpace>(m_Dimension);
   std::string index_path = m_DbPath + "/index.bin";
   std::string entries_path = m_DbPath + "/entries.json";
-  if (fs::exists(index_path) && fs::exists(entries_path)) {
+  // A database already in IVF-PQ format uses the parameters without the
+  // option, and 0 lists would mean the index is never trained.
+  if ((m_Options.ivf_pq || fs::exists(m_DbPath + "/vectors.bin")) &&
+      (m_Options.ivf.nlist == 0 || m_Options.ivf.m == 0 ||
+       m_Dimension % m_Options.ivf.m != 0)) {
+    std::cerr << "Invalid IVF-PQ parameters: need at least one list and a "
+              << "code count dividing the embedding size " << m_Dimension
+              << " (got " << m_Options.ivf.nlist << " lists, "
+              << m_Options.ivf.m << " codes)" << std::endl;
+    return false;
+  }
+  if ((fs::exists(index_path) || MappedHnswIndex::exists(m_DbPath) ||
+       fs::exists(m_DbPath + "/vectors.bin")) &&
+      fs::exists(entries_path)) {
     std::cout << "Loading existing memory index..." << std::endl;
     load_index();
+  } else if (m_Options.ivf_pq && !m_Options.read_only) {
+    std::cout << "Creating new IVF-PQ memory index..." << std::endl;
+    create_ivf();
+  } else if (m_Options.mmap_storage && !m_Options.read_only) {
+    std::cout << "Creating new mapped memory index..." << std::endl;
+    auto mapped = MappedHnswIndex::create(m_DbPath, m_Space.get(),
+                                          m_MaxElements, m_Options.hnsw_m,
+                                          m_Options.hnsw_ef_construction);
+    m_Mapped = mapped.get();
+    m_Index = std::move(mapped);
   } else {
     std::cout << "Creating new memory index..." << std::endl;
     m_Index = std::make_unique<hnswlib::HierarchicalNSW<float>>(
-        m_Space.get(), m_MaxElements, 16, 200);
+        m_Space.get(), m_MaxElements, m_Options.hnsw_m,
+        m_Options.hnsw_ef_construction);
+  }
+  if (!m_Index && !(m_Vectors && m_Ivf)) {
+    std::cerr << "Memory index is unavailable" << std::endl;
+    return false;
+  }
+  if (m_Index) {
+    m_Index->setEf(m_Options.hnsw_ef_search);
   }
   std::cout << "Memory database initialized with " << m_Entries.size()
             << " entries" << std::endl;
+  if (m_Options.background_indexing && !m_Options.read_only &&
+      !m_Indexer.joinable()) {
+    m_Indexer = std::thread(&MemoryDatabase::indexer_loop, this);
+  }
   return true;
 }
 
 void MemoryDatabase::add_entry(const MemoryEntry &entry,
                                const std::vector<float> &embedding) {
-  std::lock_guard<std::mutex> lock(m_DbMutex);
+  if (!writable()) {
+    return;
+  }
+  auto lock = traced_lock(m_DbMutex, "memory.lock_wait");
   if (embedding.size() != static_cast<size_t>(m_Dimension)) {
     std::cerr << "Embedding dimension mismatch: expected " << m_Dimension
               << ", got " << embedding.size() << std::endl;
     return;
   }
+  // Stored vectors are unit length so inner product is cosine similarity.
+  std::vector<float> normalized = l2_normalized(embedding);
+  if (merge_duplicate(entry, normalized.data())) {
+    return;
+  }
   size_t id = m_Entries.size();
-  m_Entries.push_back(entry);
   try {
-    m_Index->addPoint(embedding.data(), id);
+    ensure_capacity(1);
+    if (!add_points(normalized.data(), 1, id, 1)[0]) {
+      return;
+    }
   } catch (const std::exception &e) {
-    std::cerr << "Failed to add memory to index: " << e.what() << std::endl;
-    m_Entries.pop_back();
+    std::cerr << "Failed to add memory: " << e.what() << std::endl;
+    return;
+  }
+  append_record(entry);
+  append_to_user_block(m_Entries.back().user, id, normalized.data());
+}
+
+std::vector<MemoryDatabase::EInsertResult>
+MemoryDatabase::add_entries(const std::vector<MemoryEntry> &entries,
+                            const std::vector<std::vector<float>> &embeddings,
+                            int n_threads) {
+  std::vector<EInsertResult> results(entries.size(), EInsertResult::FAILED);
+  if (!writable()) {
+    return results;
+  }
+  // The lock is taken per chunk so searches from chats wait for one chunk
+  // of inserts, not the whole import.
+  for (size_t begin = 0; begin < entries.size(); begin += kImportChunk) {
+    const size_t end = std::min(entries.size(), begin + kImportChunk);
+    auto lock = traced_lock(m_DbMutex, "memory.lock_wait");
+    // Dedup runs serially against what is already stored; duplicates within
+    // the same chunk are not merged with each other.
+    std::vector<float> vectors;
+    std::vector<size_t> pending;
+    for (size_t i = begin; i < end; i++) {
+      if (i >= embeddings.size() ||
+          embeddings[i].size() != static_cast<size_t>(m_Dimension)) {
+        continue;
+      }
+      std::vector<float> normalized = l2_normalized(embeddings[i]);
+      if (merge_duplicate(entries[i], normalized.data())) {
+        results[i] = EInsertResult::MERGED;
+        continue;
+      }
+      vectors.insert(vectors.end(), normalized.begin(), normalized.end());
+      pending.push_back(i);
+    }
+    if (pending.empty()) {
+      continue;
+    }
+    const size_t first_id = m_Entries.size();
+    std::vector<char> inserted;
+    try {
+      ensure_capacity(pending.size());
+      inserted =
+          add_points(vectors.data(), pending.size(), first_id, n_threads);
+    } catch (const std::exception &e) {
+      // Nothing of the chunk was stored; its entries stay FAILED.
+      std::cerr << "Failed to add " << pending.size()
+                << " memories: " << e.what() << std::endl;
+      continue;
+    }
+    // Labels were handed out before insertion, so every pending entry keeps
+    // its row; a failed one is tombstoned at once.
+    for (size_t j = 0; j < pending.size(); j++) {
+      append_record(entries[pending[j]]);
+      if (!inserted[j]) {
+        m_Entries.back().removed = true;
+        m_Removed++;
+        continue;
+      }
+      append_to_user_block(m_Entries.back().user, first_id + j,
+                           vectors.data() + j * m_Dimension);
+      results[pending[j]] = EInsertResult::ADDED;
+    }
+  }
+  return results;
+}
+
+std::vector<char> MemoryDatabase::add_points(const float *vectors,
+                                             size_t count, size_t first_id,
+                                             int n_threads) {
+  if (m_Vectors) {
+    // Rows are IDs, so they go in order; encoding is cheap enough to stay
+    // on this thread. Codes are added once every row is in, so a failed
+    // append leaves neither the file nor the index with part of the batch.
+    for (size_t j = 0; j < count; j++) {
+      if (m_Vectors->size() != first_id + j ||
+          !m_Vectors->append(vectors + j * m_Dimension)) {
+        m_Vectors->truncate(first_id);
+        throw std::runtime_error("Failed to append to memory vector file");
+      }
+    }
+    for (size_t j = 0; j < count; j++) {
+      m_Ivf->add(first_id + j, vectors + j * m_Dimension);
+    }
+    if (!m_Ivf->trained() && m_Vectors->size() >= ivf_train_size(m_Options)) {
+      train_ivf();
+    }
+    return std::vector<char>(count, 1);
+  }
+  // hnswlib supports concurrent addPoint for distinct labels.
+  std::vector<char> inserted(count, 0);
+  std::atomic<size_t> cursor{0};
+  auto worker = [&]() {
+    for (size_t j = cursor++; j < count; j = cursor++) {
+      try {
+        m_Index->addPoint(vectors + j * m_Dimension, first_id + j);
+        inserted[j] = 1;
+      } catch (const std::exception &e) {
+        std::cerr << "Failed to add memory to index: " << e.what()
+                  << std::endl;
+      }
+    }
+  };
+  size_t thread_count = n_threads > 0
+                            ? static_cast<size_t>(n_threads)
+                            : std::max(1u, std::thread::hardware_concurrency());
+  thread_count = std::min(thread_count, count);
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < thread_count; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  return inserted;
+}
+
+void MemoryDatabase::enqueue_entry(const MemoryEntry &entry,
+                                   const std::vector<float> &embedding) {
+  if (!m_Options.background_indexing || !writable()) {
+    add_entry(entry, embedding);
+    return;
+  }
+  if (embedding.size() != static_cast<size_t>(m_Dimension)) {
+    std::cerr << "Embedding dimension mismatch: expected " << m_Dimension
+              << ", got " << embedding.size() << std::endl;
+    return;
+  }
+  PendingEntry pending;
+  pending.vector = l2_normalized(embedding);
+  {
+    auto lock = traced_lock(m_DbMutex, "memory.lock_wait");
+    pending.record = make_record(entry);
+    m_Pending.push_back(std::move(pending));
+    m_PendingCount = m_Pending.size();
+  }
+  m_PendingCv.notify_one();
+}
+
+size_t MemoryDatabase::get_entry_count() const {
+  std::lock_guard<std::mutex> lock(m_DbMutex);
+  return m_Entries.size() - m_Removed;
+}
+
+int MemoryDatabase::stored_dimension(const std::string &db_path) {
+  if (fs::exists(db_path + "/vectors.bin")) {
+    return static_cast<int>(
+        IvfPqIndex::stored_dimension(db_path + "/ivfpq.bin"));
+  }
+  if (MappedHnswIndex::exists(db_path)) {
+    return static_cast<int>(MappedHnswIndex::stored_dimension(db_path));
+  }
+  // hnswlib does not store the vector size; the label follows the vector
+  // in each element, so it is the gap between their header offsets.
+  std::ifstream in(db_path + "/index.bin", std::ios::binary);
+  size_t header[6] = {};
+  in.read(reinterpret_cast<char *>(header), sizeof(header));
+  if (!in.good() || header[4] <= header[5]) {
+    return 0;
+  }
+  return static_cast<int>((header[4] - header[5]) / sizeof(float));
+}
+
+std::vector<size_t> MemoryDatabase::live_ids() const {
+  std::lock_guard<std::mutex> lock(m_DbMutex);
+  std::vector<size_t> ids;
+  ids.reserve(m_Entries.size() - m_Removed);
+  for (size_t id = 0; id < m_Entries.size(); id++) {
+    if (!m_Entries[id].removed) {
+      ids.push_back(id);
+    }
+  }
+  return ids;
+}
+
+bool MemoryDatabase::get_vector(size_t id, std::vector<float> &out) const {
+  std::lock_guard<std::mutex> lock(m_DbMutex);
+  return id < m_Entries.size() && !m_Entries[id].removed &&
+         stored_vector(id, out);
+}
+
+void MemoryDatabase::flush() {
+  while (index_pending(kIndexBatch)) {
+  }
+}
+
+bool MemoryDatabase::index_pending(size_t max) {
+  std::lock_guard<std::mutex> lock(m_DbMutex);
+  if (m_Pending.empty()) {
+    return false;
+  }
+  const size_t n = std::min(max, m_Pending.size());
+  // Same order as add_entries: dedup against what is indexed, then insert
+  // the rest. Unlike a bulk import, a batch here is a few chat turns, where
+  // repeats are common, so entries also merge into earlier ones of the same
+  // batch.
+  std::vector<float> vectors;
+  std::vector<size_t> fresh;
+  for (size_t i = 0; i < n; i++) {
+    const PendingEntry &pending = m_Pending[i];
+    if (merge_duplicate(pending.record.user, pending.record.hit_count,
+                        pending.record.timestamp, pending.vector.data())) {
+      continue;
+    }
+    if (m_Options.dedup_threshold > 0.0f) {
+      auto earlier = std::find_if(fresh.begin(), fresh.end(), [&](size_t j) {
+        return m_Pending[j].record.user == pending.record.user &&
+               dot_product(m_Pending[j].vector.data(), pending.vector.data(),
+                           m_Dimension) >= m_Options.dedup_threshold;
+      });
+      if (earlier != fresh.end()) {
+        EntryRecord &kept = m_Pending[*earlier].record;
+        kept.hit_count += pending.record.hit_count;
+        kept.timestamp = std::max(kept.timestamp, pending.record.timestamp);
+        continue;
+      }
+    }
+    vectors.insert(vectors.end(), pending.vector.begin(),
+                   pending.vector.end());
+    fresh.push_back(i);
+  }
+  if (!fresh.empty()) {
+    const size_t first_id = m_Entries.size();
+    std::vector<char> inserted;
+    try {
+      ensure_capacity(fresh.size());
+      // One thread: the indexer should not compete with generation for
+      // cores.
+      inserted = add_points(vectors.data(), fresh.size(), first_id, 1);
+    } catch (const std::exception &e) {
+      // Merged entries are already counted; the rest stay queued, and
+      // searchable, for a retry.
+      std::cerr << "Failed to index " << fresh.size()
+                << " queued memories: " << e.what() << std::endl;
+      std::vector<PendingEntry> kept;
+      kept.reserve(m_Pending.size() - n + fresh.size());
+      for (size_t i : fresh) {
+        kept.push_back(std::move(m_Pending[i]));
+      }
+      std::move(m_Pending.begin() + n, m_Pending.end(),
+                std::back_inserter(kept));
+      m_Pending = std::move(kept);
+      m_PendingCount = m_Pending.size();
+      return false;
+    }
+    for (size_t j = 0; j < fresh.size(); j++) {
+      m_Entries.push_back(m_Pending[fresh[j]].record);
+      if (!inserted[j]) {
+        m_Entries.back().removed = true;
+        m_Removed++;
+        continue;
+      }
+      append_to_user_block(m_Entries.back().user, first_id + j,
+                           vectors.data() + j * m_Dimension);
+    }
+  }
+  m_Pending.erase(m_Pending.begin(), m_Pending.begin() + n);
+  m_PendingCount = m_Pending.size();
+  return true;
+}
+
+void MemoryDatabase::indexer_loop() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m_DbMutex);
+      m_PendingCv.wait(
+          lock, [this] { return m_StopIndexer || !m_Pending.empty(); });
+      if (m_StopIndexer) {
+        return;
+      }
+    }
+    if (!index_pending(kIndexBatch)) {
+      // A failed batch stays queued; retry later rather than spin on it.
+      std::unique_lock<std::mutex> lock(m_DbMutex);
+      m_PendingCv.wait_for(lock, kIndexRetry,
+                           [this] { return m_StopIndexer; });
+    }
+  }
+}
+
+void MemoryDatabase::stop_indexer() {
+  if (!m_Indexer.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_DbMutex);
+    m_StopIndexer = true;
+  }
+  m_PendingCv.notify_all();
+  m_Indexer.join();
+}
+
+bool MemoryDatabase::writable() const {
+  if (m_Options.read_only) {
+    std::cerr << "Memory database is open read-only" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool MemoryDatabase::merge_duplicate(const MemoryEntry &entry,
+                                     const float *normalized) {
+  uint32_t user = m_UserIds.find(entry.user_id);
+  if (user == StringInterner::kInvalidId) {
+    return false;
+  }
+  return merge_duplicate(user, entry.hit_count, entry.timestamp, normalized);
+}
+
+bool MemoryDatabase::merge_duplicate(uint32_t user, uint32_t hit_count,
+                                     int64_t timestamp,
+                                     const float *normalized) {
+  if (m_Options.dedup_threshold <= 0.0f) {
+    return false;
+  }
+  Hits nearest = search_user(normalized, user, 1);
+  if (nearest.empty() ||
+      1.0f - nearest[0].first < m_Options.dedup_threshold) {
+    return false;
+  }
+  EntryRecord &existing = m_Entries[nearest[0].second];
+  existing.hit_count += hit_count;
+  existing.timestamp = std::max(existing.timestamp, timestamp);
+  return true;
+}
+
+void MemoryDatabase::ensure_capacity(size_t additional) {
+  if (m_Vectors) {
+    if (!m_Vectors->reserve(m_Vectors->size() + additional)) {
+      throw std::runtime_error("Failed to grow memory vector file");
+    }
+    return;
+  }
+  const size_t needed = m_Index->getCurrentElementCount() + additional;
+  const size_t capacity = m_Index->getMaxElements();
+  if (needed <= capacity) {
+    return;
+  }
+  // max_elements is the initial capacity; grow geometrically rather than
+  // failing inserts once it is reached.
+  const size_t new_capacity = std::max(needed, capacity * 2);
+  std::cout << "Growing memory index capacity to " << new_capacity
+            << std::endl;
+  if (!m_Mapped) {
+    m_Index->resizeIndex(new_capacity);
+  } else if (!m_Mapped->grow(new_capacity)) {
+    throw std::runtime_error("Failed to grow mapped memory index");
+  }
+}
+
+MemoryDatabase::EntryRecord
+MemoryDatabase::make_record(const MemoryEntry &entry) {
+  EntryRecord record;
+  record.user = m_UserIds.intern(entry.user_id);
+  record.conversation = m_ConversationIds.intern(entry.conversation_id);
+  record.text = m_TextArena.append(entry.text);
+  record.tokens = m_TokenArena.append(entry.tokens);
+  record.timestamp = entry.timestamp;
+  record.hit_count = entry.hit_count;
+  return record;
+}
+
+void MemoryDatabase::append_record(const MemoryEntry &entry) {
+  m_Entries.push_back(make_record(entry));
+}
+
+MemoryView MemoryDatabase::view(size_t id) const { return view(m_Entries[id]); }
+
+MemoryView MemoryDatabase::view(const EntryRecord &record) const {
+  return MemoryView(m_UserIds.get(record.user),
+                    m_ConversationIds.get(record.conversation), record.text,
+                    record.timestamp, record.hit_count, record.tokens);
+}
+
+void MemoryDatabase::append_to_user_block(uint32_t user, size_t id,
+                                          const float *embedding) {
+  if (user >= m_UserBlocks.size()) {
+    m_UserBlocks.resize(user + 1);
+  }
+  UserBlock &block = m_UserBlocks[user];
+  if (!block.loaded && !block.heavy) {
+    load_user_block(block);
+  }
+  block.count++;
+  if (block.heavy) {
+    return;
+  }
+  if (block.count > m_Options.brute_force_threshold) {
+    // Past the threshold the graph wins; drop the exact-scan copy.
+    block.heavy = true;
+    std::vector<float>().swap(block.vectors);
+    std::vector<size_t>().swap(block.ids);
+    return;
+  }
+  block.vectors.insert(block.vectors.end(), embedding,
+                       embedding + m_Dimension);
+  block.ids.push_back(id);
+}
+
+void MemoryDatabase::load_user_block(UserBlock &block) {
+  // First touch of this user's vectors since a mapped load; reading them
+  // earlier would page in the whole file.
+  std::vector<size_t> ids;
+  ids.swap(block.ids);
+  block.loaded = true;
+  block.vectors.reserve(ids.size() * m_Dimension);
+  block.ids.reserve(ids.size());
+  std::vector<float> vec;
+  for (size_t id : ids) {
+    if (stored_vector(id, vec)) {
+      block.vectors.insert(block.vectors.end(), vec.begin(), vec.end());
+      block.ids.push_back(id);
+    } else {
+      // Row whose insert failed; it has no vector to search.
+      block.count--;
+    }
+  }
+}
+
+bool MemoryDatabase::stored_vector(size_t id, std::vector<float> &out) const {
+  if (m_Vectors) {
+    if (id >= m_Vectors->size()) {
+      return false;
+    }
+    const float *row = m_Vectors->row(id);
+    out.assign(row, row + m_Dimension);
+    return true;
+  }
+  try {
+    out = m_Index->getDataByLabel<float>(id);
+    return true;
+  } catch (const std::exception &) {
+    return false;
+  }
+}
+
+void MemoryDatabase::create_ivf() {
+  m_Ivf = std::make_unique<IvfPqIndex>(m_Dimension, m_Options.ivf);
+  m_Vectors = std::make_unique<VectorFile>(m_Dimension);
+  if (!m_Vectors->open(m_DbPath + "/vectors.bin", 0)) {
+    m_Vectors.reset();
+  }
+}
+
+void MemoryDatabase::migrate_to_ivf() {
+  std::cout << "Migrating memory index to IVF-PQ..." << std::endl;
+  create_ivf();
+  if (!m_Vectors || !m_Vectors->reserve(m_Entries.size())) {
+    std::cerr << "Keeping the HNSW memory index" << std::endl;
+    m_Vectors.reset();
+    m_Ivf.reset();
+    return;
+  }
+  const std::vector<float> zero(m_Dimension, 0.0f);
+  for (size_t id = 0; id < m_Entries.size(); id++) {
+    try {
+      auto vec = m_Index->getDataByLabel<float>(id);
+      m_Vectors->append(vec.data());
+    } catch (const std::exception &) {
+      // Failed inserts were never searchable; keep the row as a tombstone
+      // so IDs still line up.
+      m_Vectors->append(zero.data());
+      if (!m_Entries[id].removed) {
+        m_Entries[id].removed = true;
+        m_Removed++;
+      }
+    }
+  }
+  if (m_Vectors->size() >= ivf_train_size(m_Options)) {
+    train_ivf();
+  }
+  m_Index.reset();
+  m_Mapped = nullptr;
+  // The old files go only once the new ones are complete on disk.
+  if (save_files(m_DbPath)) {
+    fs::remove(m_DbPath + "/index.bin");
+    MappedHnswIndex::remove_files(m_DbPath);
   }
 }
 
-std::vector<MemoryEntry>
+void MemoryDatabase::train_ivf() {
+  const auto start = std::chrono::steady_clock::now();
+  const size_t rows = m_Vectors->size();
+  // k-means needs a few dozen vectors per list; an evenly strided sample
+  // keeps training time flat however large the store has grown.
+  const size_t sample = std::min(rows, 64 * m_Options.ivf.nlist);
+  std::vector<float> vectors(sample * m_Dimension);
+  for (size_t i = 0; i < sample; i++) {
+    const float *row = m_Vectors->row(i * rows / sample);
+    std::copy(row, row + m_Dimension, vectors.begin() + i * m_Dimension);
+  }
+  if (!m_Ivf->train(vectors.data(), sample)) {
+    return;
+  }
+  for (size_t id = 0; id < rows; id++) {
+    m_Ivf->add(id, m_Vectors->row(id));
+  }
+  const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  std::cout << "Trained IVF-PQ memory index on " << sample << " of " << rows
+            << " vectors in " << ms << " ms (" << (m_Ivf->code_bytes() >> 20)
+            << " MB of codes)" << std::endl;
+}
+
+std::vector<MemoryView>
 MemoryDatabase::search_entries(const std::vector<float> &query_embedding,
                                const std::string &user_id, int k) {
-  std::lock_guard<std::mutex> lock(m_DbMutex);
-  if (m_Entries.empty()) {
+  auto lock = traced_lock(m_DbMutex, "memory.lock_wait");
+  if ((m_Entries.empty() && m_Pending.empty()) || k <= 0) {
     return {};
   }
   if (query_embedding.size() != static_cast<size_t>(m_Dimension)) {
     std::cerr << "Query embedding dimension mismatch" << std::endl;
     return {};
   }
-  // Search for k*2 to account for filtering
-  int search_k = std::min(k * 2, static_cast<int>(m_Entries.size()));
+  uint32_t user = m_UserIds.find(user_id);
+  if (user == StringInterner::kInvalidId) {
+    return {};
+  }
+  std::vector<float> query = l2_normalized(query_embedding);
+  Hits hits = search_user(query.data(), user, k);
+  if (m_Pending.empty()) {
+    std::vector<MemoryView> results;
+    results.reserve(hits.size());
+    for (const auto &[dist, id] : hits) {
+      results.push_back(view(id));
+    }
+    return results;
+  }
+  // Queued memories are not in the graph yet; scan them exactly so a
+  // user's latest turn is visible to their next request.
+  std::vector<std::pair<float, MemoryView>> scored;
+  for (const auto &[dist, id] : hits) {
+    scored.emplace_back(dist, view(id));
+  }
+  hnswlib::DISTFUNC<float> dist = m_Space->get_dist_func();
+  void *dist_param = m_Space->get_dist_func_param();
+  for (const auto &pending : m_Pending) {
+    if (pending.record.user == user) {
+      scored.emplace_back(
+          dist(query.data(), pending.vector.data(), dist_param),
+          view(pending.record));
+    }
+  }
+  const size_t top = std::min(static_cast<size_t>(k), scored.size());
+  std::partial_sort(
+      scored.begin(), scored.begin() + top, scored.end(),
+      [](const auto &a, const auto &b) { return a.first < b.first; });
+  std::vector<MemoryView> results;
+  results.reserve(top);
+  for (size_t i = 0; i < top; i++) {
+    results.push_back(scored[i].second);
+  }
+  return results;
+}
+
+MemoryDatabase::Hits MemoryDatabase::search_user(const float *query,
+                                                 uint32_t user, int k) {
+  if (user >= m_UserBlocks.size()) {
+    return {};
+  }
+  UserBlock &block = m_UserBlocks[user];
+  if (!block.heavy) {
+    if (!block.loaded) {
+      load_user_block(block);
+    }
+    return search_exact(block, query, k);
+  }
+  return search_index(query, user, k);
+}
+
+MemoryDatabase::Hits MemoryDatabase::search_exact(const UserBlock &block,
+                                                  const float *query,
+                                                  int k) const {
+  // hnswlib's inner-product kernel is SIMD-dispatched for the build target,
+  // so reuse it for the scan. Distance is 1 - dot, smaller is closer.
+  hnswlib::DISTFUNC<float> dist = m_Space->get_dist_func();
+  void *dist_param = m_Space->get_dist_func_param();
+  const size_t n = block.ids.size();
+  Hits scored(n);
+  const float *vec = block.vectors.data();
+  for (size_t i = 0; i < n; i++, vec += m_Dimension) {
+    scored[i] = {dist(query, vec, dist_param), block.ids[i]};
+  }
+  const size_t top = std::min(static_cast<size_t>(k), n);
+  std::partial_sort(scored.begin(), scored.begin() + top, scored.end());
+  scored.resize(top);
+  return scored;
+}
+
+MemoryDatabase::Hits MemoryDatabase::search_index(const float *query,
+                                                  uint32_t user, int k) const {
+  if (m_Vectors) {
+    auto filter = [this, user](size_t id) {
+      return id < m_Entries.size() && m_Entries[id].user == user &&
+             !m_Entries[id].removed;
+    };
+    if (m_Ivf->trained()) {
+      return m_Ivf->search(query, static_cast<size_t>(k), filter,
+                           [this](size_t id) -> const float * {
+                             return id < m_Vectors->size() ? m_Vectors->row(id)
+                                                           : nullptr;
+                           });
+    }
+    // Too few vectors to train on yet; every row is cheap to scan.
+    hnswlib::DISTFUNC<float> dist = m_Space->get_dist_func();
+    void *dist_param = m_Space->get_dist_func_param();
+    Hits scored;
+    for (size_t id = 0; id < m_Vectors->size(); id++) {
+      if (filter(id)) {
+        scored.emplace_back(dist(query, m_Vectors->row(id), dist_param), id);
+      }
+    }
+    const size_t top = std::min(static_cast<size_t>(k), scored.size());
+    std::partial_sort(scored.begin(), scored.begin() + top, scored.end());
+    scored.resize(top);
+    return scored;
+  }
   try {
-    auto result = m_Index->searchKnn(query_embedding.data(), search_k);
-    std::vector<MemoryEntry> results;
-    results.reserve(k);
-    // Extract results and filter by user_id
-    while (!result.empty() && results.size() < static_cast<size_t>(k)) {
-      auto [dist, id] = result.top();
+    // Filter inside the graph walk instead of over-fetching and discarding
+    // other users' hits afterwards.
+    UserFilter<EntryRecord> filter(m_Entries, user);
+    auto result = m_Index->searchKnn(query, k, &filter);
+    // The queue pops farthest first; fill from the back to return closest
+    // first.
+    Hits hits(result.size());
+    for (size_t i = hits.size(); i-- > 0;) {
+      hits[i] = {result.top().first, result.top().second};
       result.pop();
-      if (id < m_Entries.size() && m_Entries[id].user_id == user_id) {
-        results.push_back(m_Entries[id]);
-      }
     }
-    return results;
+    return hits;
   } catch (const std::exception &e) {
     std::cerr << "Memory search failed: " << e.what() << std::endl;
     return {};
   }
 }
 
-void MemoryDatabase::save_index() {
+std::vector<std::pair<MemoryEntry, std::vector<float>>>
+MemoryDatabase::export_user(const std::string &user_id) {
+  flush();
   std::lock_guard<std::mutex> lock(m_DbMutex);
-  if (!m_Index || m_Entries.empty()) {
+  std::vector<std::pair<MemoryEntry, std::vector<float>>> result;
+  const uint32_t user = m_UserIds.find(user_id);
+  if (user == StringInterner::kInvalidId) {
+    return result;
+  }
+  for (size_t id = 0; id < m_Entries.size(); id++) {
+    const EntryRecord &record = m_Entries[id];
+    if (record.user != user || record.removed) {
+      continue;
+    }
+    std::vector<float> vec;
+    if (!stored_vector(id, vec)) {
+      continue; // never made it into the graph
+    }
+    MemoryEntry entry(user_id, std::string(m_ConversationIds.get(
+                                   record.conversation)),
+                      std::string(record.text), record.timestamp);
+    entry.hit_count = record.hit_count;
+    entry.tokens.assign(record.tokens.begin(), record.tokens.end());
+    result.emplace_back(std::move(entry), std::move(vec));
+  }
+  return result;
+}
+
+size_t MemoryDatabase::remove_user(const std::string &user_id) {
+  if (!writable()) {
+    return 0;
+  }
+  flush();
+  std::lock_guard<std::mutex> lock(m_DbMutex);
+  const uint32_t user = m_UserIds.find(user_id);
+  if (user == StringInterner::kInvalidId) {
+    return 0;
+  }
+  size_t removed = 0;
+  for (size_t id = 0; id < m_Entries.size(); id++) {
+    EntryRecord &record = m_Entries[id];
+    if (record.user != user || record.removed) {
+      continue;
+    }
+    try {
+      if (m_Index) {
+        m_Index->markDelete(id);
+      }
+    } catch (const std::exception &) {
+      // Row whose insert failed; there is no node to delete.
+    }
+    record.removed = true;
+    removed++;
+  }
+  m_Removed += removed;
+  if (user < m_UserBlocks.size()) {
+    m_UserBlocks[user] = UserBlock();
+  }
+  return removed;
+}
+
+std::optional<MemoryCluster>
+MemoryDatabase::find_cluster(int64_t older_than, float similarity,
+                             size_t min_size, size_t max_size) {
+  std::lock_guard<std::mutex> lock(m_DbMutex);
+  const size_t n = m_Entries.size();
+  if (n == 0 || min_size == 0 || max_size < min_size) {
+    return std::nullopt;
+  }
+  std::vector<float> seed_vec;
+  for (size_t step = 0; step < std::min(n, kClusterSeeds); step++) {
+    const size_t seed = m_ClusterCursor % n;
+    m_ClusterCursor = seed + 1;
+    const EntryRecord &record = m_Entries[seed];
+    if (record.removed || record.timestamp >= older_than ||
+        !stored_vector(seed, seed_vec)) {
+      continue;
+    }
+    // The seed is its own nearest neighbour, so it leads the hits.
+    Hits hits = search_user(seed_vec.data(), record.user,
+                            static_cast<int>(max_size));
+    std::vector<size_t> ids;
+    for (const auto &[dist, id] : hits) {
+      const EntryRecord &member = m_Entries[id];
+      if (!member.removed && member.timestamp < older_than &&
+          1.0f - dist >= similarity) {
+        ids.push_back(id);
+      }
+    }
+    if (ids.size() < min_size) {
+      continue;
+    }
+    std::sort(ids.begin(), ids.end(), [this](size_t a, size_t b) {
+      return m_Entries[a].timestamp < m_Entries[b].timestamp;
+    });
+    MemoryCluster cluster;
+    cluster.user_id = std::string(m_UserIds.get(record.user));
+    for (size_t id : ids) {
+      const EntryRecord &member = m_Entries[id];
+      cluster.ids.push_back(id);
+      cluster.texts.emplace_back(member.text);
+      cluster.timestamp = std::max(cluster.timestamp, member.timestamp);
+      cluster.hit_count += member.hit_count;
+    }
+    return cluster;
+  }
+  return std::nullopt;
+}
+
+bool MemoryDatabase::replace_cluster(const MemoryCluster &cluster,
+                                     const MemoryEntry &summary,
+                                     const std::vector<float> &embedding) {
+  if (!writable() || embedding.size() != static_cast<size_t>(m_Dimension) ||
+      cluster.ids.empty() || summary.user_id != cluster.user_id) {
+    return false;
+  }
+  std::vector<float> normalized = l2_normalized(embedding);
+  auto lock = traced_lock(m_DbMutex, "memory.lock_wait");
+  const uint32_t user = m_UserIds.find(cluster.user_id);
+  if (user == StringInterner::kInvalidId) {
+    return false;
+  }
+  // Summarizing takes a while; a member merged into or removed meanwhile
+  // would lose that change, so the cluster is retried later instead.
+  int64_t timestamp = 0;
+  uint32_t hit_count = 0;
+  for (size_t id : cluster.ids) {
+    if (id >= m_Entries.size() || m_Entries[id].removed ||
+        m_Entries[id].user != user) {
+      return false;
+    }
+    timestamp = std::max(timestamp, m_Entries[id].timestamp);
+    hit_count += m_Entries[id].hit_count;
+  }
+  if (timestamp != cluster.timestamp || hit_count != cluster.hit_count) {
+    return false;
+  }
+  // Insert first: if it fails the members are still there.
+  const size_t id = m_Entries.size();
+  try {
+    ensure_capacity(1);
+    if (!add_points(normalized.data(), 1, id, 1)[0]) {
+      return false;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Failed to add memory summary: " << e.what() << std::endl;
+    return false;
+  }
+  append_record(summary);
+  append_to_user_block(user, id, normalized.data());
+  for (size_t member : cluster.ids) {
+    try {
+      if (m_Index) {
+        m_Index->markDelete(member);
+      }
+    } catch (const std::exception &) {
+      // Row whose insert failed; there is no node to delete.
+    }
+    m_Entries[member].removed = true;
+  }
+  m_Removed += cluster.ids.size();
+  remove_from_user_block(user, cluster.ids);
+  return true;
+}
+
+void MemoryDatabase::remove_from_user_block(uint32_t user,
+                                            const std::vector<size_t> &ids) {
+  if (user >= m_UserBlocks.size()) {
+    return;
+  }
+  UserBlock &block = m_UserBlocks[user];
+  block.count -= std::min(block.count, ids.size());
+  if (block.heavy) {
     return;
   }
+  // Scan order does not matter, so fill each hole with the last row.
+  for (size_t i = 0; i < block.ids.size();) {
+    if (std::find(ids.begin(), ids.end(), block.ids[i]) == ids.end()) {
+      i++;
+      continue;
+    }
+    const size_t last = block.ids.size() - 1;
+    block.ids[i] = block.ids[last];
+    block.ids.pop_back();
+    if (block.loaded) {
+      std::copy_n(block.vectors.begin() + last * m_Dimension, m_Dimension,
+                  block.vectors.begin() + i * m_Dimension);
+      block.vectors.resize(last * m_Dimension);
+    }
+  }
+}
+
+void MemoryDatabase::save_index() {
+  if (m_Options.read_only) {
+    return;
+  }
+  flush();
+  std::lock_guard<std::mutex> lock(m_DbMutex);
+  save_files(m_DbPath);
+}
+
+bool MemoryDatabase::save_snapshot(const std::string &dir) {
+  flush();
+  std::lock_guard<std::mutex> lock(m_DbMutex);
+  fs::create_directories(dir);
+  return save_files(dir);
+}
+
+bool MemoryDatabase::save_files(const std::string &dir) {
+  if ((!m_Index && !m_Vectors) || m_Entries.empty()) {
+    return true;
+  }
+  std::error_code ec;
+  const bool in_place =
+      fs::weakly_canonical(dir, ec) == fs::weakly_canonical(m_DbPath, ec);
+  if (m_Options.read_only && in_place) {
+    std::cerr << "Memory database is open read-only" << std::endl;
+    return false;
+  }
   try {
     std::cout << "Saving memory database..." << std::endl;
-    std::string index_path = m_DbPath + "/index.bin";
-    m_Index->saveIndex(index_path);
-    std::string entries_path = m_DbPath + "/entries.json";
+    if (m_Vectors) {
+      if (!m_Vectors->sync() ||
+          (!in_place && !m_Vectors->copy_to(dir + "/vectors.bin")) ||
+          !m_Ivf->save(dir + "/ivfpq.bin")) {
+        return false;
+      }
+    } else if (m_Mapped) {
+      if (!m_Mapped->save(dir)) {
+        return false;
+      }
+    } else {
+      m_Index->saveIndex(dir + "/index.bin");
+    }
+    std::string entries_path = dir + "/entries.json";
     std::ofstream out(entries_path);
     json j = json::array();
     for (const auto &entry : m_Entries) {
-      j.push_back({{"user_id", entry.user_id},
-                   {"conversation_id", entry.conversation_id},
-                   {"text", entry.text},
-                   {"timestamp", entry.timestamp}});
+      json row = {{"user_id", m_UserIds.get(entry.user)},
+                  {"conversation_id",
+                   m_ConversationIds.get(entry.conversation)},
+                  {"text", entry.text},
+                  {"timestamp", entry.timestamp},
+                  {"hit_count", entry.hit_count}};
+      if (entry.removed) {
+        row["removed"] = true;
+      }
+      j.push_back(std::move(row));
     }
     out << j.dump(2);
     out.close();
+    save_tokens(dir + "/tokens.bin");
     std::cout << "Memory database saved (" << m_Entries.size() << " entries)"
               << std::endl;
+    return true;
   } catch (const std::exception &e) {
     std::cerr << "Failed to save memory database: " << e.what() << std::endl;
+    return false;
   }
 }
 
@@ -116,8 +1049,39 @@ void MemoryDatabase::load_index() {
   std::lock_guard<std::mutex> lock(m_DbMutex);
   try {
     std::string index_path = m_DbPath + "/index.bin";
-    m_Index = std::make_unique<hnswlib::HierarchicalNSW<float>>(m_Space.get(),
-                                                                index_path);
+    const bool ivf_files = fs::exists(m_DbPath + "/vectors.bin");
+    if (ivf_files) {
+      // Opened once the entries say how many rows are valid.
+    } else if (MappedHnswIndex::exists(m_DbPath)) {
+      auto mapped =
+          m_Options.read_only
+              ? MappedHnswIndex::open_readonly(m_DbPath, m_Space.get())
+              : MappedHnswIndex::open(m_DbPath, m_Space.get());
+      if (!mapped) {
+        return;
+      }
+      std::cout << "Mapped " << (mapped->mapped_bytes() >> 20)
+                << " MB of memory index" << std::endl;
+      m_Mapped = mapped.get();
+      m_Index = std::move(mapped);
+    } else {
+      m_Index = std::make_unique<hnswlib::HierarchicalNSW<float>>(
+          m_Space.get(), index_path);
+      if (m_Options.mmap_storage && !m_Options.ivf_pq &&
+          !m_Options.read_only) {
+        std::cout << "Migrating memory index to mapped storage..."
+                  << std::endl;
+        auto mapped = MappedHnswIndex::adopt(m_DbPath, m_Space.get(), *m_Index);
+        if (mapped) {
+          m_Mapped = mapped.get();
+          m_Index = std::move(mapped);
+          fs::remove(index_path);
+        }
+      }
+    }
+    if (m_Index) {
+      m_Index->setEf(m_Options.hnsw_ef_search);
+    }
     std::string entries_path = m_DbPath + "/entries.json";
     std::ifstream in(entries_path);
     if (!in.good()) {
@@ -128,6 +1092,7 @@ void MemoryDatabase::load_index() {
     in >> j;
     in.close();
     m_Entries.clear();
+    m_Removed = 0;
     m_Entries.reserve(j.size());
     for (const auto &item : j) {
       MemoryEntry entry;
@@ -135,7 +1100,64 @@ void MemoryDatabase::load_index() {
       entry.conversation_id = item["conversation_id"].get<std::string>();
       entry.text = item["text"].get<std::string>();
       entry.timestamp = item["timestamp"].get<int64_t>();
-      m_Entries.push_back(entry);
+      entry.hit_count = item.value("hit_count", 1u);
+      append_record(entry);
+      if (item.value("removed", false)) {
+        m_Entries.back().removed = true;
+        m_Removed++;
+      }
+    }
+    load_tokens(m_DbPath + "/tokens.bin");
+    if (ivf_files) {
+      m_Ivf = std::make_unique<IvfPqIndex>(m_Dimension, m_Options.ivf);
+      m_Vectors = std::make_unique<VectorFile>(m_Dimension);
+      if (!m_Vectors->open(m_DbPath + "/vectors.bin", m_Entries.size(),
+                           m_Options.read_only)) {
+        m_Vectors.reset();
+        return;
+      }
+      // A trained index always holds every row; anything else is stale.
+      const std::string ivf_path = m_DbPath + "/ivfpq.bin";
+      if (!fs::exists(ivf_path) || !m_Ivf->load(ivf_path) ||
+          (m_Ivf->trained() && m_Ivf->size() != m_Entries.size())) {
+        m_Ivf = std::make_unique<IvfPqIndex>(m_Dimension, m_Options.ivf);
+      }
+      if (!m_Ivf->trained() &&
+          m_Vectors->size() >= ivf_train_size(m_Options)) {
+        train_ivf();
+      }
+    } else if (m_Options.ivf_pq && !m_Options.read_only) {
+      migrate_to_ivf();
+    }
+    m_UserBlocks.clear();
+    std::vector<size_t> per_user(m_UserIds.size(), 0);
+    for (const auto &entry : m_Entries) {
+      per_user[entry.user] += entry.removed ? 0 : 1;
+    }
+    for (size_t id = 0; id < m_Entries.size(); id++) {
+      if (m_Entries[id].removed) {
+        continue;
+      }
+      const uint32_t user = m_Entries[id].user;
+      const bool heavy = per_user[user] > m_Options.brute_force_threshold;
+      if (heavy || m_Mapped || m_Vectors) {
+        if (user >= m_UserBlocks.size()) {
+          m_UserBlocks.resize(user + 1);
+        }
+        UserBlock &block = m_UserBlocks[user];
+        block.count++;
+        block.heavy = heavy;
+        if (!heavy) {
+          // Vectors are read from the mapping on the user's first search.
+          block.loaded = false;
+          block.ids.push_back(id);
+        }
+        continue;
+      }
+      std::vector<float> vec;
+      if (stored_vector(id, vec)) {
+        append_to_user_block(user, id, vec.data());
+      }
     }
     std::cout << "Loaded " << m_Entries.size() << " memory entries"
               << std::endl;
@@ -144,4 +1166,103 @@ void MemoryDatabase::load_index() {
   }
 }
 
+// tokens.bin: magic, tokenizer ID, entry count, then per entry a length
+// followed by that many int32 token IDs. Kept out of entries.json so the
+// text stays human-readable and the IDs load without JSON parsing.
+static constexpr uint32_t kTokensMagic = 0x4b544c53; // "SLTK"
+
+void MemoryDatabase::save_tokens(const std::string &path) const {
+  // Written aside and renamed so a crash mid-save leaves the old cache.
+  const std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    auto write_u64 = [&out](uint64_t v) {
+      out.write(reinterpret_cast<const char *>(&v), sizeof(v));
+    };
+    out.write(reinterpret_cast<const char *>(&kTokensMagic),
+              sizeof(kTokensMagic));
+    write_u64(m_Options.tokenizer_id.size());
+    out.write(m_Options.tokenizer_id.data(), m_Options.tokenizer_id.size());
+    write_u64(m_Entries.size());
+    for (const auto &entry : m_Entries) {
+      uint32_t n = static_cast<uint32_t>(entry.tokens.size());
+      out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+      out.write(reinterpret_cast<const char *>(entry.tokens.data()),
+                entry.tokens.size_bytes());
+    }
+    if (!out) {
+      std::cerr << "Failed to write " << tmp << std::endl;
+      return;
+    }
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    std::cerr << "Failed to replace " << path << std::endl;
+  }
+}
+
+void MemoryDatabase::load_tokens(const std::string &path) {
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if (!in.good()) {
+    return;
+  }
+  // The cache is only an optimization: anything unexpected drops it and
+  // entries are re-tokenized on use.
+  try {
+    uint64_t remaining = static_cast<uint64_t>(in.tellg());
+    in.seekg(0);
+    auto read = [&](void *dst, uint64_t size) {
+      if (size > remaining) {
+        return false;
+      }
+      in.read(static_cast<char *>(dst), static_cast<std::streamsize>(size));
+      remaining -= size;
+      return in.good();
+    };
+    uint32_t magic = 0;
+    uint64_t id_size = 0;
+    uint64_t count = 0;
+    if (!read(&magic, sizeof(magic)) || magic != kTokensMagic ||
+        !read(&id_size, sizeof(id_size)) || id_size > remaining) {
+      std::cerr << "Ignoring invalid memory token cache" << std::endl;
+      return;
+    }
+    std::string tokenizer_id(id_size, '\0');
+    if (!read(tokenizer_id.data(), id_size) || !read(&count, sizeof(count)) ||
+        count != m_Entries.size()) {
+      std::cerr << "Ignoring stale memory token cache" << std::endl;
+      return;
+    }
+    if (tokenizer_id != m_Options.tokenizer_id) {
+      std::cout << "Memory tokens were built for a different vocabulary; "
+                   "they will be re-tokenized on use"
+                << std::endl;
+      return;
+    }
+    // Read everything before touching an entry, so a truncated file leaves
+    // all of them untokenized rather than some.
+    std::vector<uint32_t> lengths(m_Entries.size());
+    std::vector<int32_t> tokens;
+    for (uint32_t &n : lengths) {
+      bool ok = read(&n, sizeof(n)) && n <= remaining / sizeof(int32_t);
+      if (ok) {
+        const size_t offset = tokens.size();
+        tokens.resize(offset + n);
+        ok = read(tokens.data() + offset, n * sizeof(int32_t));
+      }
+      if (!ok) {
+        std::cerr << "Truncated memory token cache" << std::endl;
+        return;
+      }
+    }
+    size_t offset = 0;
+    for (size_t id = 0; id < m_Entries.size(); id++) {
+      m_Entries[id].tokens = m_TokenArena.append(
+          std::span<const int32_t>(tokens.data() + offset, lengths[id]));
+      offset += lengths[id];
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Ignoring memory token cache: " << e.what() << std::endl;
+  }
+}
+
 } // namespace solus
\ No newline at end of file
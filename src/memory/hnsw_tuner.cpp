@@ -0,0 +1,120 @@
+#include "memory/hnsw_tuner.h"
+#include "memory/vector_ops.h"
+#include <algorithm>
+#include <chrono>
+#include <hnswlib.h>
+#include <iostream>
+#include <unordered_set>
+
+namespace solus {
+
+namespace {
+
+double percentile(std::vector<double> samples, double p) {
+  if (samples.empty()) {
+    return 0.0;
+  }
+  size_t idx = static_cast<size_t>(p * (samples.size() - 1));
+  std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+  return samples[idx];
+}
+
+} // namespace
+
+HnswTuner::HnswTuner(int dimension, std::vector<float> base,
+                     std::vector<float> queries)
+    : m_Dimension(static_cast<size_t>(dimension)), m_Base(std::move(base)),
+      m_Queries(std::move(queries)) {}
+
+void HnswTuner::compute_ground_truth(int k) {
+  const size_t n_base = base_count();
+  const size_t n_queries = query_count();
+  const size_t top = std::min(static_cast<size_t>(k), n_base);
+  m_GroundTruth.assign(n_queries, {});
+  std::vector<std::pair<float, size_t>> scored(n_base);
+  for (size_t q = 0; q < n_queries; q++) {
+    const float *query = m_Queries.data() + q * m_Dimension;
+    for (size_t i = 0; i < n_base; i++) {
+      scored[i] = {-dot_product(query, m_Base.data() + i * m_Dimension,
+                                m_Dimension),
+                   i};
+    }
+    std::partial_sort(scored.begin(), scored.begin() + top, scored.end());
+    for (size_t i = 0; i < top; i++) {
+      m_GroundTruth[q].push_back(scored[i].second);
+    }
+  }
+}
+
+std::vector<HnswTuneResult> HnswTuner::run(const HnswTuneOptions &options) {
+  using clock = std::chrono::steady_clock;
+  std::vector<HnswTuneResult> results;
+  const size_t n_base = base_count();
+  const size_t n_queries = query_count();
+  if (n_base == 0 || n_queries == 0) {
+    return results;
+  }
+  compute_ground_truth(options.k);
+  hnswlib::InnerProductSpace space(m_Dimension);
+  for (size_t m : options.m_values) {
+    auto build_start = clock::now();
+    hnswlib::HierarchicalNSW<float> index(&space, n_base, m,
+                                          options.ef_construction);
+    for (size_t i = 0; i < n_base; i++) {
+      index.addPoint(m_Base.data() + i * m_Dimension, i);
+    }
+    double build_ms = std::chrono::duration<double, std::milli>(
+                          clock::now() - build_start)
+                          .count();
+    for (size_t ef : options.ef_values) {
+      index.setEf(ef);
+      std::vector<double> latencies;
+      latencies.reserve(n_queries);
+      size_t found = 0;
+      size_t expected = 0;
+      for (size_t q = 0; q < n_queries; q++) {
+        auto start = clock::now();
+        auto knn = index.searchKnn(m_Queries.data() + q * m_Dimension,
+                                   options.k);
+        latencies.push_back(
+            std::chrono::duration<double, std::micro>(clock::now() - start)
+                .count());
+        const auto &truth = m_GroundTruth[q];
+        std::unordered_set<size_t> truth_set(truth.begin(), truth.end());
+        while (!knn.empty()) {
+          found += truth_set.count(knn.top().second);
+          knn.pop();
+        }
+        expected += truth.size();
+      }
+      HnswTuneResult result;
+      result.m = m;
+      result.ef = ef;
+      result.recall =
+          expected ? static_cast<double>(found) / expected : 1.0;
+      result.p50_us = percentile(latencies, 0.50);
+      result.p99_us = percentile(latencies, 0.99);
+      result.build_ms = build_ms;
+      results.push_back(result);
+    }
+  }
+  return results;
+}
+
+const HnswTuneResult *
+HnswTuner::recommend(const std::vector<HnswTuneResult> &results,
+                     double target_recall) {
+  const HnswTuneResult *best = nullptr;
+  for (const auto &result : results) {
+    if (result.recall < target_recall) {
+      continue;
+    }
+    if (!best || result.p50_us < best->p50_us ||
+        (result.p50_us == best->p50_us && result.m < best->m)) {
+      best = &result;
+    }
+  }
+  return best;
+}
+
+} // namespace solus
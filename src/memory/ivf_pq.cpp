@@ -0,0 +1,497 @@
+#include "memory/ivf_pq.h"
+#include "memory/vector_ops.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <random>
+#include <thread>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace solus {
+
+namespace {
+
+// ivfpq.bin: this header, centroids, codebooks, then per list its size,
+// IDs and code blocks.
+constexpr uint32_t kIvfMagic = 0x46564953; // "SIVF"
+constexpr uint32_t kIvfVersion = 1;
+constexpr int kTrainIterations = 10;
+// u16 accumulators hold m * 255 without wrapping.
+constexpr size_t kMaxSubQuantizers = 256;
+
+struct IvfHeader {
+  uint32_t magic = kIvfMagic;
+  uint32_t version = kIvfVersion;
+  uint64_t dim = 0;
+  uint64_t nlist = 0;
+  uint64_t m = 0;
+  uint64_t count = 0;
+  uint64_t trained = 0;
+};
+
+float squared_l2(const float *a, const float *b, size_t n) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < n; i++) {
+    const float d = a[i] - b[i];
+    sum += d * d;
+  }
+  return sum;
+}
+
+// Runs fn(begin, end) over [0, n) on all cores.
+template <typename Fn> void parallel_for(size_t n, Fn fn) {
+  const size_t threads = std::min<size_t>(
+      std::max(1u, std::thread::hardware_concurrency()), (n + 255) / 256);
+  if (threads <= 1) {
+    fn(size_t{0}, n);
+    return;
+  }
+  std::vector<std::thread> pool;
+  const size_t chunk = (n + threads - 1) / threads;
+  for (size_t t = 0; t < threads; t++) {
+    const size_t begin = t * chunk;
+    const size_t end = std::min(n, begin + chunk);
+    if (begin < end) {
+      pool.emplace_back(fn, begin, end);
+    }
+  }
+  for (auto &thread : pool) {
+    thread.join();
+  }
+}
+
+// Lloyd's k-means over n rows of d floats. Spherical assigns by inner
+// product and keeps centroids unit length; otherwise squared L2.
+std::vector<float> kmeans(const float *data, size_t n, size_t d, size_t k,
+                          bool spherical, std::mt19937 &rng) {
+  std::vector<float> centroids(k * d);
+  std::uniform_int_distribution<size_t> pick(0, n - 1);
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), rng);
+  for (size_t c = 0; c < k; c++) {
+    const float *row = data + order[c % n] * d;
+    std::copy(row, row + d, centroids.begin() + c * d);
+  }
+  std::vector<uint32_t> assign(n, 0);
+  for (int iter = 0; iter < kTrainIterations; iter++) {
+    parallel_for(n, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        const float *row = data + i * d;
+        float best = std::numeric_limits<float>::max();
+        for (size_t c = 0; c < k; c++) {
+          const float *centroid = centroids.data() + c * d;
+          const float dist = spherical ? -dot_product(row, centroid, d)
+                                       : squared_l2(row, centroid, d);
+          if (dist < best) {
+            best = dist;
+            assign[i] = static_cast<uint32_t>(c);
+          }
+        }
+      }
+    });
+    std::vector<float> sums(k * d, 0.0f);
+    std::vector<size_t> counts(k, 0);
+    for (size_t i = 0; i < n; i++) {
+      const float *row = data + i * d;
+      float *sum = sums.data() + assign[i] * d;
+      for (size_t j = 0; j < d; j++) {
+        sum[j] += row[j];
+      }
+      counts[assign[i]]++;
+    }
+    for (size_t c = 0; c < k; c++) {
+      float *centroid = centroids.data() + c * d;
+      if (counts[c] == 0) {
+        // Empty cluster: restart it on a random point.
+        const float *row = data + pick(rng) * d;
+        std::copy(row, row + d, centroid);
+        continue;
+      }
+      const float inv = 1.0f / static_cast<float>(counts[c]);
+      for (size_t j = 0; j < d; j++) {
+        centroid[j] = sums[c * d + j] * inv;
+      }
+      if (spherical) {
+        l2_normalize(centroid, d);
+      }
+    }
+  }
+  return centroids;
+}
+
+} // namespace
+
+IvfPqIndex::IvfPqIndex(size_t dim, const IvfPqParams &params)
+    : m_Dim(dim), m_Params(params) {
+  // Sub-quantizers must split the vector evenly.
+  m_M = std::clamp<size_t>(params.m, 1, std::min(dim, kMaxSubQuantizers));
+  while (dim % m_M != 0) {
+    m_M--;
+  }
+  m_SubDim = dim / m_M;
+}
+
+bool IvfPqIndex::train(const float *vectors, size_t n, uint32_t seed) {
+  if (n == 0) {
+    return false;
+  }
+  std::mt19937 rng(seed);
+  const size_t nlist = std::clamp<size_t>(m_Params.nlist, 1, n);
+  m_Centroids = kmeans(vectors, n, m_Dim, nlist, true, rng);
+  m_Lists.assign(nlist, List());
+  m_Count = 0;
+
+  std::vector<float> residuals(n * m_Dim);
+  parallel_for(n, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const float *row = vectors + i * m_Dim;
+      const float *centroid = m_Centroids.data() + nearest_list(row) * m_Dim;
+      for (size_t j = 0; j < m_Dim; j++) {
+        residuals[i * m_Dim + j] = row[j] - centroid[j];
+      }
+    }
+  });
+  m_Codebooks.assign(m_M * kCodes * m_SubDim, 0.0f);
+  std::vector<float> slice(n * m_SubDim);
+  for (size_t sub = 0; sub < m_M; sub++) {
+    for (size_t i = 0; i < n; i++) {
+      const float *from = residuals.data() + i * m_Dim + sub * m_SubDim;
+      std::copy(from, from + m_SubDim, slice.begin() + i * m_SubDim);
+    }
+    std::vector<float> codebook =
+        kmeans(slice.data(), n, m_SubDim, kCodes, false, rng);
+    std::copy(codebook.begin(), codebook.end(),
+              m_Codebooks.begin() + sub * kCodes * m_SubDim);
+  }
+  m_Trained = true;
+  return true;
+}
+
+size_t IvfPqIndex::nearest_list(const float *vector) const {
+  size_t best = 0;
+  float best_ip = -std::numeric_limits<float>::max();
+  const size_t nlist = m_Centroids.size() / m_Dim;
+  for (size_t l = 0; l < nlist; l++) {
+    const float ip = dot_product(vector, m_Centroids.data() + l * m_Dim, m_Dim);
+    if (ip > best_ip) {
+      best_ip = ip;
+      best = l;
+    }
+  }
+  return best;
+}
+
+void IvfPqIndex::encode(const float *residual, uint8_t *codes) const {
+  for (size_t sub = 0; sub < m_M; sub++) {
+    const float *part = residual + sub * m_SubDim;
+    const float *codebook = m_Codebooks.data() + sub * kCodes * m_SubDim;
+    float best = std::numeric_limits<float>::max();
+    codes[sub] = 0;
+    for (size_t c = 0; c < kCodes; c++) {
+      const float dist = squared_l2(part, codebook + c * m_SubDim, m_SubDim);
+      if (dist < best) {
+        best = dist;
+        codes[sub] = static_cast<uint8_t>(c);
+      }
+    }
+  }
+}
+
+void IvfPqIndex::add(size_t id, const float *vector) {
+  if (!m_Trained) {
+    return;
+  }
+  const size_t l = nearest_list(vector);
+  const float *centroid = m_Centroids.data() + l * m_Dim;
+  std::vector<float> residual(m_Dim);
+  for (size_t j = 0; j < m_Dim; j++) {
+    residual[j] = vector[j] - centroid[j];
+  }
+  std::vector<uint8_t> codes(m_M + 1, 0);
+  encode(residual.data(), codes.data());
+
+  List &list = m_Lists[l];
+  const size_t pairs = (m_M + 1) / 2;
+  const size_t slot = list.ids.size() % kBlock;
+  if (slot == 0) {
+    list.codes.resize(list.codes.size() + pairs * kBlock, 0);
+  }
+  uint8_t *block = list.codes.data() + list.codes.size() - pairs * kBlock;
+  for (size_t p = 0; p < pairs; p++) {
+    // An odd m leaves the last high nibble as code 0 of a zero table.
+    block[p * kBlock + slot] =
+        static_cast<uint8_t>(codes[2 * p] | (codes[2 * p + 1] << 4));
+  }
+  list.ids.push_back(id);
+  m_Count++;
+}
+
+void IvfPqIndex::scan_block(const uint8_t *block, const uint8_t *lut,
+                            uint16_t *acc) const {
+  const size_t pairs = (m_M + 1) / 2;
+#if defined(__AVX2__)
+  // Each byte holds two codes; the 16-entry tables fit a shuffle, so one
+  // instruction looks up a sub-quantizer for all 32 vectors.
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc_lo = zero;
+  __m256i acc_hi = zero;
+  for (size_t p = 0; p < pairs; p++) {
+    const __m256i codes = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(block + p * kBlock));
+    const __m256i lo = _mm256_and_si256(codes, mask);
+    const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(codes, 4), mask);
+    const __m256i table_lo = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(lut + 2 * p * 16)));
+    const __m256i table_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(lut + (2 * p + 1) * 16)));
+    const __m256i d_lo = _mm256_shuffle_epi8(table_lo, lo);
+    const __m256i d_hi = _mm256_shuffle_epi8(table_hi, hi);
+    acc_lo = _mm256_add_epi16(acc_lo, _mm256_unpacklo_epi8(d_lo, zero));
+    acc_lo = _mm256_add_epi16(acc_lo, _mm256_unpacklo_epi8(d_hi, zero));
+    acc_hi = _mm256_add_epi16(acc_hi, _mm256_unpackhi_epi8(d_lo, zero));
+    acc_hi = _mm256_add_epi16(acc_hi, _mm256_unpackhi_epi8(d_hi, zero));
+  }
+  // Unpacking works per 128-bit lane: acc_lo holds vectors 0-7 and 16-23,
+  // acc_hi 8-15 and 24-31.
+  alignas(32) uint16_t lo_out[16];
+  alignas(32) uint16_t hi_out[16];
+  _mm256_store_si256(reinterpret_cast<__m256i *>(lo_out), acc_lo);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(hi_out), acc_hi);
+  for (size_t i = 0; i < 8; i++) {
+    acc[i] = lo_out[i];
+    acc[8 + i] = hi_out[i];
+    acc[16 + i] = lo_out[8 + i];
+    acc[24 + i] = hi_out[8 + i];
+  }
+#else
+  std::fill(acc, acc + kBlock, uint16_t{0});
+  for (size_t p = 0; p < pairs; p++) {
+    const uint8_t *codes = block + p * kBlock;
+    const uint8_t *table_lo = lut + 2 * p * 16;
+    const uint8_t *table_hi = lut + (2 * p + 1) * 16;
+    for (size_t v = 0; v < kBlock; v++) {
+      acc[v] += table_lo[codes[v] & 0x0f] + table_hi[codes[v] >> 4];
+    }
+  }
+#endif
+}
+
+IvfPqIndex::Hits IvfPqIndex::search(const float *query, size_t k,
+                                    const Filter &filter,
+                                    const VectorSource &exact) const {
+  if (!m_Trained || k == 0 || m_Count == 0) {
+    return {};
+  }
+  const size_t nlist = m_Lists.size();
+  std::vector<std::pair<float, size_t>> coarse(nlist);
+  for (size_t l = 0; l < nlist; l++) {
+    coarse[l] = {dot_product(query, m_Centroids.data() + l * m_Dim, m_Dim), l};
+  }
+  const size_t nprobe = std::clamp<size_t>(m_Params.nprobe, 1, nlist);
+  std::partial_sort(coarse.begin(), coarse.begin() + nprobe, coarse.end(),
+                    std::greater<>());
+
+  // Residual codebooks are shared by every list, so one table per query
+  // scores all of them: <q, x> = <q, centroid> + sum of <q_sub, codeword>.
+  const size_t pairs = (m_M + 1) / 2;
+  std::vector<float> table(2 * pairs * kCodes, 0.0f);
+  std::vector<float> table_max(2 * pairs, 0.0f);
+  float range = 0.0f;
+  for (size_t sub = 0; sub < m_M; sub++) {
+    const float *part = query + sub * m_SubDim;
+    const float *codebook = m_Codebooks.data() + sub * kCodes * m_SubDim;
+    float lo = std::numeric_limits<float>::max();
+    float hi = -std::numeric_limits<float>::max();
+    for (size_t c = 0; c < kCodes; c++) {
+      const float ip = dot_product(part, codebook + c * m_SubDim, m_SubDim);
+      table[sub * kCodes + c] = ip;
+      lo = std::min(lo, ip);
+      hi = std::max(hi, ip);
+    }
+    table_max[sub] = hi;
+    range = std::max(range, hi - lo);
+  }
+  // Quantize the shortfall from each table's best code to 8 bits; the
+  // larger the sum, the farther the vector.
+  const float scale = range > 0.0f ? 255.0f / range : 0.0f;
+  std::vector<uint8_t> lut(table.size(), 0);
+  float best_sum = 0.0f;
+  for (size_t sub = 0; sub < m_M; sub++) {
+    best_sum += table_max[sub];
+    for (size_t c = 0; c < kCodes; c++) {
+      const float gap = table_max[sub] - table[sub * kCodes + c];
+      lut[sub * kCodes + c] =
+          static_cast<uint8_t>(std::min(255.0f, std::round(gap * scale)));
+    }
+  }
+  const float unscale = scale > 0.0f ? 1.0f / scale : 0.0f;
+
+  const bool rerank = m_Params.rerank > 0 && exact;
+  const size_t keep = rerank ? k * m_Params.rerank : k;
+  std::priority_queue<std::pair<float, size_t>> heap; // farthest on top
+  alignas(32) uint16_t acc[kBlock];
+  for (size_t probe = 0; probe < nprobe; probe++) {
+    const List &list = m_Lists[coarse[probe].second];
+    const float base = 1.0f - coarse[probe].first - best_sum;
+    const size_t n = list.ids.size();
+    for (size_t start = 0; start < n; start += kBlock) {
+      scan_block(list.codes.data() + (start / kBlock) * pairs * kBlock,
+                 lut.data(), acc);
+      const size_t end = std::min(n, start + kBlock);
+      for (size_t i = start; i < end; i++) {
+        const float dist = base + acc[i - start] * unscale;
+        if (heap.size() >= keep && dist >= heap.top().first) {
+          continue;
+        }
+        const size_t id = static_cast<size_t>(list.ids[i]);
+        if (filter && !filter(id)) {
+          continue;
+        }
+        heap.emplace(dist, id);
+        if (heap.size() > keep) {
+          heap.pop();
+        }
+      }
+    }
+  }
+
+  Hits hits;
+  hits.reserve(heap.size());
+  while (!heap.empty()) {
+    hits.push_back(heap.top());
+    heap.pop();
+  }
+  if (rerank) {
+    for (auto &[dist, id] : hits) {
+      if (const float *vector = exact(id)) {
+        dist = 1.0f - dot_product(query, vector, m_Dim);
+      }
+    }
+  }
+  const size_t top = std::min(k, hits.size());
+  std::partial_sort(hits.begin(), hits.begin() + top, hits.end());
+  hits.resize(top);
+  return hits;
+}
+
+size_t IvfPqIndex::code_bytes() const {
+  size_t bytes = 0;
+  for (const List &list : m_Lists) {
+    bytes += list.ids.size() * sizeof(uint64_t) + list.codes.size();
+  }
+  return bytes;
+}
+
+bool IvfPqIndex::save(const std::string &path) const {
+  const std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    IvfHeader header;
+    header.dim = m_Dim;
+    header.nlist = m_Lists.size();
+    header.m = m_M;
+    header.count = m_Count;
+    header.trained = m_Trained ? 1 : 0;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    auto write_floats = [&out](const std::vector<float> &v) {
+      out.write(reinterpret_cast<const char *>(v.data()),
+                static_cast<std::streamsize>(v.size() * sizeof(float)));
+    };
+    write_floats(m_Centroids);
+    write_floats(m_Codebooks);
+    for (const List &list : m_Lists) {
+      const uint64_t n = list.ids.size();
+      out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+      out.write(reinterpret_cast<const char *>(list.ids.data()),
+                static_cast<std::streamsize>(n * sizeof(uint64_t)));
+      out.write(reinterpret_cast<const char *>(list.codes.data()),
+                static_cast<std::streamsize>(list.codes.size()));
+    }
+    if (!out) {
+      std::cerr << "Failed to write " << tmp << std::endl;
+      return false;
+    }
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    std::cerr << "Failed to replace " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool IvfPqIndex::load(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  IvfHeader header;
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in || header.magic != kIvfMagic || header.version != kIvfVersion) {
+    std::cerr << "Invalid IVF-PQ index file " << path << std::endl;
+    return false;
+  }
+  if (header.dim != m_Dim || header.m == 0 || m_Dim % header.m != 0 ||
+      header.m > kMaxSubQuantizers) {
+    std::cerr << "IVF-PQ index " << path
+              << " was built for a different dimension" << std::endl;
+    return false;
+  }
+  m_M = header.m;
+  m_SubDim = m_Dim / m_M;
+  auto read_floats = [&in](std::vector<float> &v, size_t n) {
+    v.resize(n);
+    in.read(reinterpret_cast<char *>(v.data()),
+            static_cast<std::streamsize>(n * sizeof(float)));
+  };
+  const size_t pairs = (m_M + 1) / 2;
+  read_floats(m_Centroids, header.nlist * m_Dim);
+  read_floats(m_Codebooks, header.trained ? m_M * kCodes * m_SubDim : 0);
+  m_Lists.assign(header.nlist, List());
+  for (List &list : m_Lists) {
+    uint64_t n = 0;
+    in.read(reinterpret_cast<char *>(&n), sizeof(n));
+    if (n > header.count) {
+      in.setstate(std::ios::failbit);
+    }
+    if (!in) {
+      break;
+    }
+    list.ids.resize(n);
+    in.read(reinterpret_cast<char *>(list.ids.data()),
+            static_cast<std::streamsize>(n * sizeof(uint64_t)));
+    list.codes.resize((n + kBlock - 1) / kBlock * pairs * kBlock);
+    in.read(reinterpret_cast<char *>(list.codes.data()),
+            static_cast<std::streamsize>(list.codes.size()));
+  }
+  if (!in) {
+    std::cerr << "Truncated IVF-PQ index file " << path << std::endl;
+    m_Lists.clear();
+    m_Centroids.clear();
+    m_Trained = false;
+    m_Count = 0;
+    return false;
+  }
+  m_Trained = header.trained != 0;
+  m_Count = header.count;
+  return true;
+}
+
+size_t IvfPqIndex::stored_dimension(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  IvfHeader header;
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in || header.magic != kIvfMagic || header.version != kIvfVersion) {
+    return 0;
+  }
+  return header.dim;
+}
+
+} // namespace solus
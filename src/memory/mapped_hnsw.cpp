@@ -0,0 +1,497 @@
+#include "memory/mapped_hnsw.h"
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace solus {
+
+namespace {
+
+// graph.bin: this header, then per element its label, level and, above
+// level 0, the upper-layer link lists.
+constexpr uint32_t kGraphMagic = 0x31474853; // "SHG1"
+constexpr uint32_t kGraphVersion = 1;
+
+struct GraphHeader {
+  uint32_t magic = kGraphMagic;
+  uint32_t version = kGraphVersion;
+  uint64_t capacity = 0;
+  uint64_t count = 0;
+  uint64_t size_data_per_element = 0;
+  uint64_t m = 0;
+  uint64_t ef_construction = 0;
+  int32_t max_level = 0;
+  uint32_t entry_point = 0;
+  uint64_t num_deleted = 0;
+};
+
+bool read_header(std::istream &in, GraphHeader &header) {
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  return in.good() && header.magic == kGraphMagic &&
+         header.version == kGraphVersion && header.count <= header.capacity;
+}
+
+std::string level0_path(const std::string &dir) { return dir + "/level0.bin"; }
+std::string graph_path(const std::string &dir) { return dir + "/graph.bin"; }
+std::string dirty_path(const std::string &dir) { return dir + "/level0.dirty"; }
+
+} // namespace
+
+MappedHnswIndex::MappedHnswIndex(hnswlib::SpaceInterface<float> *space,
+                                 size_t capacity, size_t m,
+                                 size_t ef_construction)
+    : hnswlib::HierarchicalNSW<float>(space, capacity, m, ef_construction) {
+  // The base layer comes from the mapping; the constructor's allocation is
+  // never touched, so returning it costs nothing.
+  free(data_level0_memory_);
+  data_level0_memory_ = nullptr;
+}
+
+MappedHnswIndex::~MappedHnswIndex() {
+  // The base destructor frees data_level0_memory_; it must not see the
+  // mapping.
+  data_level0_memory_ = nullptr;
+  if (m_Data) {
+    munmap(m_Data, m_Bytes);
+  }
+  if (m_Fd >= 0) {
+    close(m_Fd);
+  }
+}
+
+bool MappedHnswIndex::exists(const std::string &dir) {
+  return fs::exists(graph_path(dir)) && fs::exists(level0_path(dir));
+}
+
+size_t MappedHnswIndex::stored_dimension(const std::string &dir) {
+  std::ifstream in(graph_path(dir), std::ios::binary);
+  GraphHeader header;
+  if (!read_header(in, header)) {
+    return 0;
+  }
+  // An element is its level-0 links (count plus 2 * M slots), the vector
+  // and the label.
+  const size_t links = sizeof(hnswlib::linklistsizeint) +
+                       2 * header.m * sizeof(hnswlib::tableint);
+  const size_t fixed = links + sizeof(hnswlib::labeltype);
+  if (header.size_data_per_element <= fixed) {
+    return 0;
+  }
+  return (header.size_data_per_element - fixed) / sizeof(float);
+}
+
+void MappedHnswIndex::remove_files(const std::string &dir) {
+  std::error_code ec;
+  fs::remove(level0_path(dir), ec);
+  fs::remove(graph_path(dir), ec);
+  fs::remove(dirty_path(dir), ec);
+}
+
+bool MappedHnswIndex::map_file(const std::string &path, size_t bytes,
+                               EAccess access) {
+  const bool writable = access == EAccess::CREATE || access == EAccess::WRITE;
+  m_Fd = ::open(path.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  if (m_Fd < 0) {
+    std::cerr << "Failed to open " << path << ": " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  // Taken before anything is truncated, so a second writer cannot empty
+  // the file under the first.
+  if (flock(m_Fd, (writable ? LOCK_EX : LOCK_SH) | LOCK_NB) != 0) {
+    if (errno == EWOULDBLOCK) {
+      std::cerr << path << " is open for "
+                << (writable ? "reading or writing" : "writing")
+                << " by another process" << std::endl;
+    } else {
+      std::cerr << "Failed to lock " << path << ": " << std::strerror(errno)
+                << std::endl;
+    }
+    return false;
+  }
+  struct stat st {};
+  if (access == EAccess::CREATE && ftruncate(m_Fd, 0) != 0) {
+    std::cerr << "Failed to reset " << path << ": " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  if (fstat(m_Fd, &st) != 0) {
+    std::cerr << "Failed to stat " << path << ": " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  if (static_cast<size_t>(st.st_size) < bytes) {
+    if (!writable) {
+      std::cerr << "Truncated HNSW level-0 file " << path << std::endl;
+      return false;
+    }
+    if (ftruncate(m_Fd, static_cast<off_t>(bytes)) != 0) {
+      std::cerr << "Failed to size " << path << ": " << std::strerror(errno)
+                << std::endl;
+      return false;
+    }
+  }
+  const int prot =
+      access == EAccess::READ ? PROT_READ : PROT_READ | PROT_WRITE;
+  const int flags = access == EAccess::READ_PRIVATE ? MAP_PRIVATE : MAP_SHARED;
+  void *data = mmap(nullptr, bytes, prot, flags, m_Fd, 0);
+  if (data == MAP_FAILED) {
+    std::cerr << "Failed to map " << path << ": " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  // Graph walks touch elements in no particular order; readahead would
+  // mostly fetch pages nobody asked for.
+  madvise(data, bytes, MADV_RANDOM);
+  m_Data = static_cast<char *>(data);
+  m_Bytes = bytes;
+  m_ReadOnly = !writable;
+  data_level0_memory_ = m_Data;
+  return true;
+}
+
+std::unique_ptr<MappedHnswIndex>
+MappedHnswIndex::create(const std::string &dir,
+                        hnswlib::SpaceInterface<float> *space,
+                        size_t capacity, size_t m, size_t ef_construction) {
+  fs::create_directories(dir);
+  std::unique_ptr<MappedHnswIndex> index(
+      new MappedHnswIndex(space, capacity, m, ef_construction));
+  index->m_Dir = dir;
+  if (!index->map_file(level0_path(dir),
+                       capacity * index->size_data_per_element_,
+                       EAccess::CREATE) ||
+      !index->save(dir)) {
+    return nullptr;
+  }
+  return index;
+}
+
+std::unique_ptr<MappedHnswIndex>
+MappedHnswIndex::open(const std::string &dir,
+                      hnswlib::SpaceInterface<float> *space) {
+  return open_dir(dir, space, false);
+}
+
+std::unique_ptr<MappedHnswIndex>
+MappedHnswIndex::open_readonly(const std::string &dir,
+                               hnswlib::SpaceInterface<float> *space) {
+  return open_dir(dir, space, true);
+}
+
+std::unique_ptr<MappedHnswIndex>
+MappedHnswIndex::open_dir(const std::string &dir,
+                          hnswlib::SpaceInterface<float> *space,
+                          bool read_only) {
+  std::ifstream in(graph_path(dir), std::ios::binary);
+  GraphHeader header;
+  if (!read_header(in, header)) {
+    std::cerr << "Invalid HNSW graph file in " << dir << std::endl;
+    return nullptr;
+  }
+  std::unique_ptr<MappedHnswIndex> index(new MappedHnswIndex(
+      space, header.capacity, header.m, header.ef_construction));
+  index->m_Dir = dir;
+  if (index->size_data_per_element_ != header.size_data_per_element) {
+    std::cerr << "HNSW graph in " << dir
+              << " was built for a different dimension" << std::endl;
+    return nullptr;
+  }
+  std::error_code ec;
+  const size_t used = header.count * header.size_data_per_element;
+  if (fs::file_size(level0_path(dir), ec) < used || ec) {
+    std::cerr << "Truncated HNSW level-0 file in " << dir << std::endl;
+    return nullptr;
+  }
+  // A reader repairing after a crash does so in a private copy; the file
+  // is fixed by the next writer.
+  const bool dirty = fs::exists(dirty_path(dir));
+  const EAccess access = !read_only ? EAccess::WRITE
+                         : dirty    ? EAccess::READ_PRIVATE
+                                    : EAccess::READ;
+  if (!index->map_file(level0_path(dir),
+                       header.capacity * header.size_data_per_element,
+                       access)) {
+    return nullptr;
+  }
+  index->cur_element_count = header.count;
+  index->maxlevel_ = header.max_level;
+  index->enterpoint_node_ = header.entry_point;
+  index->num_deleted_ = header.num_deleted;
+  for (size_t i = 0; i < header.count; i++) {
+    uint64_t label = 0;
+    int32_t level = 0;
+    in.read(reinterpret_cast<char *>(&label), sizeof(label));
+    in.read(reinterpret_cast<char *>(&level), sizeof(level));
+    index->element_levels_[i] = level;
+    index->label_lookup_[label] = static_cast<hnswlib::tableint>(i);
+    if (level > 0) {
+      const size_t size = index->size_links_per_element_ * level;
+      index->linkLists_[i] = static_cast<char *>(malloc(size));
+      in.read(index->linkLists_[i], static_cast<std::streamsize>(size));
+    }
+    if (!in.good()) {
+      std::cerr << "Truncated HNSW graph file in " << dir << std::endl;
+      return nullptr;
+    }
+  }
+  if (dirty) {
+    std::cout << "Memory index was not saved cleanly; repairing links"
+              << std::endl;
+    index->repair_links();
+    if (!read_only) {
+      fs::remove(dirty_path(dir), ec);
+    }
+  }
+  return index;
+}
+
+std::unique_ptr<MappedHnswIndex>
+MappedHnswIndex::adopt(const std::string &dir,
+                       hnswlib::SpaceInterface<float> *space,
+                       const hnswlib::HierarchicalNSW<float> &source) {
+  fs::create_directories(dir);
+  std::unique_ptr<MappedHnswIndex> index(new MappedHnswIndex(
+      space, source.max_elements_, source.M_, source.ef_construction_));
+  index->m_Dir = dir;
+  const size_t count = source.cur_element_count;
+  if (index->size_data_per_element_ != source.size_data_per_element_ ||
+      !index->map_file(level0_path(dir),
+                       source.max_elements_ * index->size_data_per_element_,
+                       EAccess::CREATE)) {
+    return nullptr;
+  }
+  std::memcpy(index->m_Data, source.data_level0_memory_,
+              count * index->size_data_per_element_);
+  index->cur_element_count = count;
+  index->maxlevel_ = source.maxlevel_;
+  index->enterpoint_node_ = source.enterpoint_node_;
+  index->num_deleted_ = source.num_deleted_.load();
+  index->label_lookup_ = source.label_lookup_;
+  for (size_t i = 0; i < count; i++) {
+    const int level = source.element_levels_[i];
+    index->element_levels_[i] = level;
+    if (level > 0) {
+      const size_t size = index->size_links_per_element_ * level;
+      index->linkLists_[i] = static_cast<char *>(malloc(size));
+      std::memcpy(index->linkLists_[i], source.linkLists_[i], size);
+    }
+  }
+  if (!index->save(dir)) {
+    return nullptr;
+  }
+  return index;
+}
+
+void MappedHnswIndex::addPoint(const void *data_point,
+                               hnswlib::labeltype label,
+                               bool replace_deleted) {
+  if (m_ReadOnly) {
+    throw std::runtime_error("Memory index is open read-only");
+  }
+  mark_dirty();
+  hnswlib::HierarchicalNSW<float>::addPoint(data_point, label,
+                                            replace_deleted);
+}
+
+void MappedHnswIndex::mark_dirty() {
+  if (m_Dirty.exchange(true)) {
+    return;
+  }
+  std::ofstream(dirty_path(m_Dir)).put('\n');
+}
+
+bool MappedHnswIndex::grow(size_t capacity) {
+  if (capacity <= max_elements_) {
+    return true;
+  }
+  if (m_ReadOnly) {
+    std::cerr << "Memory index is open read-only" << std::endl;
+    return false;
+  }
+  const size_t bytes = capacity * size_data_per_element_;
+  if (ftruncate(m_Fd, static_cast<off_t>(bytes)) != 0) {
+    std::cerr << "Failed to grow memory index file: " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  void *data = mremap(m_Data, m_Bytes, bytes, MREMAP_MAYMOVE);
+  if (data == MAP_FAILED) {
+    std::cerr << "Failed to remap memory index: " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  m_Data = static_cast<char *>(data);
+  m_Bytes = bytes;
+  madvise(m_Data, m_Bytes, MADV_RANDOM);
+  // resizeIndex grows the per-element arrays but reallocs the base layer;
+  // hand it nothing, then swap the mapping back in for what it allocated.
+  data_level0_memory_ = nullptr;
+  try {
+    resizeIndex(capacity);
+  } catch (const std::exception &e) {
+    std::cerr << "Failed to grow memory index: " << e.what() << std::endl;
+    data_level0_memory_ = m_Data;
+    return false;
+  }
+  free(data_level0_memory_);
+  data_level0_memory_ = m_Data;
+  return true;
+}
+
+bool MappedHnswIndex::save(const std::string &dir) {
+  std::error_code ec;
+  const bool in_place =
+      fs::weakly_canonical(dir, ec) == fs::weakly_canonical(m_Dir, ec);
+  if (m_ReadOnly && in_place) {
+    std::cerr << "Memory index is open read-only" << std::endl;
+    return false;
+  }
+  if (!m_ReadOnly && msync(m_Data, m_Bytes, MS_SYNC) != 0) {
+    std::cerr << "Failed to sync memory index: " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  const size_t count = cur_element_count;
+  // Labels come from the lookup table so saving does not fault in every
+  // element's page.
+  std::vector<hnswlib::labeltype> labels(count);
+  std::vector<char> labelled(count, 0);
+  for (const auto &[label, id] : label_lookup_) {
+    if (id < count) {
+      labels[id] = label;
+      labelled[id] = 1;
+    }
+  }
+  GraphHeader header;
+  header.capacity = max_elements_;
+  header.count = count;
+  header.size_data_per_element = size_data_per_element_;
+  header.m = M_;
+  header.ef_construction = ef_construction_;
+  header.max_level = maxlevel_;
+  header.entry_point = enterpoint_node_;
+  header.num_deleted = num_deleted_;
+  const std::string tmp = graph_path(dir) + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (size_t i = 0; i < count; i++) {
+      const uint64_t label = labelled[i] ? labels[i] : getExternalLabel(i);
+      const int32_t level = element_levels_[i];
+      out.write(reinterpret_cast<const char *>(&label), sizeof(label));
+      out.write(reinterpret_cast<const char *>(&level), sizeof(level));
+      if (level > 0) {
+        out.write(linkLists_[i], static_cast<std::streamsize>(
+                                     size_links_per_element_ * level));
+      }
+    }
+    if (!out) {
+      std::cerr << "Failed to write " << tmp << std::endl;
+      return false;
+    }
+  }
+  if (!in_place) {
+    std::ofstream out(level0_path(dir), std::ios::binary | std::ios::trunc);
+    out.write(m_Data,
+              static_cast<std::streamsize>(count * size_data_per_element_));
+    if (!out) {
+      std::cerr << "Failed to copy memory index to " << dir << std::endl;
+      return false;
+    }
+  }
+  fs::rename(tmp, graph_path(dir), ec);
+  if (ec) {
+    std::cerr << "Failed to replace " << graph_path(dir) << ": "
+              << ec.message() << std::endl;
+    return false;
+  }
+  if (in_place && m_Dirty.exchange(false)) {
+    fs::remove(dirty_path(m_Dir), ec);
+  }
+  return true;
+}
+
+void MappedHnswIndex::repair_links() {
+  // Inserts lost in the crash left links to elements past count in the
+  // nodes they connected to, and pruned those nodes' lists to make room.
+  // Dropping the dangling links alone would leave the pruned nodes poorly
+  // connected, so each of them gets its neighbours searched again.
+  const size_t count = cur_element_count;
+  std::vector<hnswlib::tableint> touched;
+  for (size_t i = 0; i < count; i++) {
+    const auto id = static_cast<hnswlib::tableint>(i);
+    hnswlib::linklistsizeint *list = get_linklist0(id);
+    auto *links = reinterpret_cast<hnswlib::tableint *>(list + 1);
+    const unsigned short n = getListCount(list);
+    unsigned short kept = 0;
+    for (unsigned short j = 0; j < n; j++) {
+      if (links[j] < count) {
+        links[kept++] = links[j];
+      }
+    }
+    setListCount(list, kept);
+    if (kept < n) {
+      touched.push_back(id);
+    }
+  }
+  if (count < 2) {
+    return;
+  }
+  for (hnswlib::tableint id : touched) {
+    const char *point = getDataByInternalId(id);
+    // Greedy descent through the upper layers, which graph.bin kept
+    // intact, then a construction-width search of the base layer.
+    hnswlib::tableint entry = enterpoint_node_;
+    float entry_dist =
+        fstdistfunc_(point, getDataByInternalId(entry), dist_func_param_);
+    for (int level = maxlevel_; level > 0; level--) {
+      bool moved = true;
+      while (moved) {
+        moved = false;
+        hnswlib::linklistsizeint *upper = get_linklist(entry, level);
+        auto *next = reinterpret_cast<hnswlib::tableint *>(upper + 1);
+        for (unsigned short j = 0; j < getListCount(upper); j++) {
+          const float d = fstdistfunc_(point, getDataByInternalId(next[j]),
+                                       dist_func_param_);
+          if (d < entry_dist) {
+            entry_dist = d;
+            entry = next[j];
+            moved = true;
+          }
+        }
+      }
+    }
+    auto found = searchBaseLayer(entry, point, 0);
+    decltype(found) candidates;
+    while (!found.empty()) {
+      if (found.top().second != id) {
+        candidates.push(found.top());
+      }
+      found.pop();
+    }
+    getNeighborsByHeuristic2(candidates, maxM0_);
+    hnswlib::linklistsizeint *list = get_linklist0(id);
+    auto *links = reinterpret_cast<hnswlib::tableint *>(list + 1);
+    unsigned short n = 0;
+    while (!candidates.empty()) {
+      links[n++] = candidates.top().second;
+      candidates.pop();
+    }
+    setListCount(list, n);
+  }
+  std::cout << "Re-linked " << touched.size() << " memory index nodes"
+            << std::endl;
+}
+
+} // namespace solus
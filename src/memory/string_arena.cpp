@@ -0,0 +1,22 @@
+#include "memory/string_arena.h"
+
+namespace solus {
+
+uint32_t StringInterner::intern(std::string_view str) {
+  auto it = m_Ids.find(str);
+  if (it != m_Ids.end()) {
+    return it->second;
+  }
+  uint32_t id = static_cast<uint32_t>(m_Strings.size());
+  std::string_view stored = m_Arena.append(str);
+  m_Strings.push_back(stored);
+  m_Ids.emplace(stored, id);
+  return id;
+}
+
+uint32_t StringInterner::find(std::string_view str) const {
+  auto it = m_Ids.find(str);
+  return it == m_Ids.end() ? kInvalidId : it->second;
+}
+
+} // namespace solus
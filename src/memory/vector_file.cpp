@@ -0,0 +1,136 @@
+#include "memory/vector_file.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace solus {
+
+namespace {
+
+constexpr size_t kMinRows = 1024;
+
+} // namespace
+
+VectorFile::~VectorFile() {
+  if (m_Data) {
+    munmap(m_Data, m_Capacity * m_Dim * sizeof(float));
+  }
+  if (m_Fd >= 0) {
+    close(m_Fd);
+  }
+}
+
+bool VectorFile::open(const std::string &path, size_t rows, bool read_only) {
+  m_ReadOnly = read_only;
+  m_Fd = ::open(path.c_str(), read_only ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+  if (m_Fd < 0) {
+    std::cerr << "Failed to open " << path << ": " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  struct stat st {};
+  if (fstat(m_Fd, &st) != 0) {
+    return false;
+  }
+  const size_t row_bytes = m_Dim * sizeof(float);
+  const size_t file_rows = static_cast<size_t>(st.st_size) / row_bytes;
+  if (file_rows < rows) {
+    std::cerr << path << " holds " << file_rows << " vectors, expected "
+              << rows << std::endl;
+    return false;
+  }
+  m_Rows = rows;
+  if (read_only) {
+    if (file_rows == 0) {
+      return true;
+    }
+    void *data = mmap(nullptr, file_rows * row_bytes, PROT_READ, MAP_SHARED,
+                      m_Fd, 0);
+    if (data == MAP_FAILED) {
+      std::cerr << "Failed to map vector file: " << std::strerror(errno)
+                << std::endl;
+      return false;
+    }
+    madvise(data, file_rows * row_bytes, MADV_RANDOM);
+    m_Data = static_cast<float *>(data);
+    m_Capacity = file_rows;
+    return true;
+  }
+  return reserve(std::max(file_rows, kMinRows));
+}
+
+bool VectorFile::reserve(size_t rows) {
+  if (rows <= m_Capacity) {
+    return true;
+  }
+  if (m_ReadOnly) {
+    std::cerr << "Vector file is open read-only" << std::endl;
+    return false;
+  }
+  // Double so appends remap a logarithmic number of times.
+  const size_t capacity = std::max(rows, m_Capacity * 2);
+  const size_t row_bytes = m_Dim * sizeof(float);
+  struct stat st {};
+  if (fstat(m_Fd, &st) != 0 ||
+      (static_cast<size_t>(st.st_size) < capacity * row_bytes &&
+       ftruncate(m_Fd, static_cast<off_t>(capacity * row_bytes)) != 0)) {
+    std::cerr << "Failed to grow vector file: " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  void *data =
+      m_Data ? mremap(m_Data, m_Capacity * row_bytes, capacity * row_bytes,
+                      MREMAP_MAYMOVE)
+             : mmap(nullptr, capacity * row_bytes, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, m_Fd, 0);
+  if (data == MAP_FAILED) {
+    std::cerr << "Failed to map vector file: " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  // Reranking and exact scans read scattered rows.
+  madvise(data, capacity * row_bytes, MADV_RANDOM);
+  m_Data = static_cast<float *>(data);
+  m_Capacity = capacity;
+  return true;
+}
+
+bool VectorFile::append(const float *row) {
+  if (!reserve(m_Rows + 1)) {
+    return false;
+  }
+  std::copy(row, row + m_Dim, m_Data + m_Rows * m_Dim);
+  m_Rows++;
+  return true;
+}
+
+bool VectorFile::sync() {
+  if (!m_Data || m_ReadOnly) {
+    return true;
+  }
+  if (msync(m_Data, m_Rows * m_Dim * sizeof(float), MS_SYNC) != 0) {
+    std::cerr << "Failed to sync vector file: " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool VectorFile::copy_to(const std::string &path) const {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(m_Data),
+            static_cast<std::streamsize>(m_Rows * m_Dim * sizeof(float)));
+  if (!out) {
+    std::cerr << "Failed to copy vectors to " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+} // namespace solus
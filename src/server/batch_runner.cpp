@@ -0,0 +1,200 @@
+#include "server/batch_runner.h"
+#include "server/response_parser.h"
+#include "server/solus_server.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <tuple>
+
+using json = nlohmann::json;
+
+namespace solus {
+
+namespace {
+
+// Requests read, prompted and sorted together; bounds memory on large files
+// while leaving enough prompts to group by shared prefix.
+constexpr size_t kChunkSize = 4096;
+
+} // namespace
+
+BatchRunner::BatchRunner(const ServerConfig &config) : m_Config(config) {}
+
+bool BatchRunner::initialize() {
+  if (!PromptBuilder::parse_format(m_Config.prompt_format, m_Format)) {
+    std::cerr << "Unknown prompt format: " << m_Config.prompt_format
+              << std::endl;
+    return false;
+  }
+  m_Llama = std::make_unique<LlamaHandler>(m_Config);
+  if (!m_Llama->initialize()) {
+    std::cerr << "Failed to initialize LLM" << std::endl;
+    return false;
+  }
+  // Retrieval only: the database is opened read-only so a batch never
+  // rewrites the files of a server sharing the path. Without an existing
+  // database prompts are built without memories rather than creating one.
+  if (std::filesystem::exists(m_Config.memory_db_path)) {
+    m_Config.embedding_dim = m_Llama->get_embedding_dim();
+    MemoryDatabaseOptions options =
+        SolusServer::memory_options(m_Config, m_Llama->get_vocab_size());
+    options.read_only = true;
+    m_MemoryDb = std::make_unique<MemoryDatabase>(
+        m_Config.memory_db_path, m_Config.embedding_dim,
+        m_Config.max_memories, options);
+    if (!m_MemoryDb->initialize()) {
+      std::cerr << "Failed to initialize memory database" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool BatchRunner::run(const std::string &input_path,
+                      const std::string &output_path) {
+  std::ifstream in(input_path);
+  if (!in) {
+    std::cerr << "Failed to open batch input: " << input_path << std::endl;
+    return false;
+  }
+  std::ofstream out(output_path, std::ios::out | std::ios::trunc);
+  if (!out) {
+    std::cerr << "Failed to open batch output: " << output_path << std::endl;
+    return false;
+  }
+  const auto start_time = std::chrono::steady_clock::now();
+  Totals totals;
+  std::vector<Job> jobs;
+  jobs.reserve(kChunkSize);
+  std::string line;
+  size_t line_no = 0;
+  while (std::getline(in, line)) {
+    line_no++;
+    if (line.find_first_not_of(" \t\r") == std::string::npos) {
+      continue;
+    }
+    totals.jobs++;
+    Job job;
+    try {
+      json request = json::parse(line);
+      job.id = request.contains("id") ? request["id"] : json(line_no);
+      job.text = request.at("text").get<std::string>();
+      job.user_id = request.value("user_id", std::string());
+    } catch (const json::exception &e) {
+      totals.failed++;
+      out << json({{"id", line_no}, {"error", e.what()}}).dump() << '\n';
+      continue;
+    }
+    jobs.push_back(std::move(job));
+    if (jobs.size() == kChunkSize) {
+      run_chunk(jobs, out, totals);
+    }
+  }
+  run_chunk(jobs, out, totals);
+  out.flush();
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                    start_time)
+          .count();
+  std::cout << "Batch complete: " << totals.jobs << " requests ("
+            << totals.failed << " failed) in " << seconds << "s, "
+            << totals.generated_tokens / std::max(seconds, 1e-9)
+            << " tokens/s generated, "
+            << (totals.prompt_tokens
+                    ? 100.0 * totals.reused_tokens / totals.prompt_tokens
+                    : 0.0)
+            << "% of prompt tokens reused" << std::endl;
+  return static_cast<bool>(out);
+}
+
+void BatchRunner::run_chunk(std::vector<Job> &jobs, std::ostream &out,
+                            Totals &totals) {
+  if (jobs.empty()) {
+    return;
+  }
+  std::vector<std::vector<float>> embeddings(jobs.size());
+  if (m_MemoryDb) {
+    std::vector<std::string> texts;
+    std::vector<size_t> owners;
+    for (size_t i = 0; i < jobs.size(); i++) {
+      if (!jobs[i].user_id.empty()) {
+        texts.push_back(jobs[i].text);
+        owners.push_back(i);
+      }
+    }
+    auto results = m_Llama->get_embeddings(texts);
+    for (size_t i = 0; i < results.size(); i++) {
+      embeddings[owners[i]] = std::move(results[i]);
+    }
+  }
+  auto tokenize = [this](const std::string &str, bool add_special,
+                         bool parse_special) {
+    return m_Llama->tokenize(str, add_special, parse_special);
+  };
+  for (size_t i = 0; i < jobs.size(); i++) {
+    if (m_Llama->has_adapter(jobs[i].user_id)) {
+      jobs[i].adapter = jobs[i].user_id;
+    }
+    std::vector<MemoryView> memories;
+    if (!embeddings[i].empty()) {
+      memories = m_MemoryDb->search_entries(embeddings[i], jobs[i].user_id, 5);
+    }
+    jobs[i].tokens = m_Prompts
+                         .build_chat_tokens(jobs[i].text, memories, m_Format,
+                                            tokenize,
+                                            m_Llama->get_context_size() -
+                                                m_Config.max_tokens)
+                         .tokens;
+  }
+  // An adapter applies to the whole context, so prompts are grouped by
+  // adapter and each group runs as one batch. Within a group, adjacent
+  // prompts in token order share the longest prefixes.
+  std::vector<size_t> order(jobs.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&jobs](size_t a, size_t b) {
+    return std::tie(jobs[a].adapter, jobs[a].tokens) <
+           std::tie(jobs[b].adapter, jobs[b].tokens);
+  });
+  GenerationParams params;
+  params.temperature = m_Config.temperature;
+  params.top_p = m_Config.top_p;
+  params.top_k = m_Config.top_k;
+  params.max_tokens = m_Config.max_tokens;
+  size_t begin = 0;
+  auto on_done = [&](BatchOutput &&result) {
+    const Job &job = jobs[order[begin + result.index]];
+    json line;
+    if (!result.error.empty()) {
+      totals.failed++;
+      line = {{"id", job.id}, {"error", result.error}};
+    } else {
+      auto parsed = ResponseParser::parse_response(result.text);
+      line = {{"id", job.id},
+              {"response", parsed.response},
+              {"action", parsed.action},
+              {"prompt_tokens", result.n_prompt},
+              {"reused_tokens", result.n_reused},
+              {"generated_tokens", result.n_generated}};
+    }
+    totals.prompt_tokens += result.n_prompt;
+    totals.reused_tokens += result.n_reused;
+    totals.generated_tokens += static_cast<size_t>(result.n_generated);
+    out << line.dump() << '\n';
+  };
+  while (begin < order.size()) {
+    params.adapter = jobs[order[begin]].adapter;
+    std::vector<std::vector<llama_token>> prompts;
+    for (size_t i = begin;
+         i < order.size() && jobs[order[i]].adapter == params.adapter; i++) {
+      prompts.push_back(std::move(jobs[order[i]].tokens));
+    }
+    m_Llama->generate_batch(prompts, params, on_done);
+    begin += prompts.size();
+  }
+  jobs.clear();
+}
+
+} // namespace solus
@@ -0,0 +1,173 @@
+#include "server/cpu_topology.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <fstream>
+#include <iterator>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+
+namespace solus {
+
+namespace {
+
+bool parse_int(std::string_view text, int &value) {
+  const char *end = text.data() + text.size();
+  auto [ptr, ec] = std::from_chars(text.data(), end, value);
+  return ec == std::errc() && ptr == end && value >= 0;
+}
+
+} // namespace
+
+bool parse_cpu_list(std::string_view list, std::vector<int> &cpus) {
+  cpus.clear();
+  while (!list.empty() &&
+         std::isspace(static_cast<unsigned char>(list.back()))) {
+    list.remove_suffix(1);
+  }
+  while (!list.empty()) {
+    size_t comma = list.find(',');
+    std::string_view item = list.substr(0, comma);
+    list.remove_prefix(comma == std::string_view::npos ? list.size()
+                                                       : comma + 1);
+    size_t dash = item.find('-');
+    int first = 0;
+    int last = 0;
+    if (dash == std::string_view::npos) {
+      if (!parse_int(item, first)) {
+        return false;
+      }
+      last = first;
+    } else if (!parse_int(item.substr(0, dash), first) ||
+               !parse_int(item.substr(dash + 1), last) || last < first) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return true;
+}
+
+std::string format_cpu_list(const std::vector<int> &cpus) {
+  std::string list;
+  for (size_t i = 0; i < cpus.size();) {
+    size_t end = i + 1;
+    while (end < cpus.size() && cpus[end] == cpus[end - 1] + 1) {
+      end++;
+    }
+    if (!list.empty()) {
+      list += ',';
+    }
+    list += std::to_string(cpus[i]);
+    if (end - i > 1) {
+      list += '-' + std::to_string(cpus[end - 1]);
+    }
+    i = end;
+  }
+  return list;
+}
+
+std::vector<int> cpu_set_slice(const std::vector<int> &cpus, size_t part,
+                               size_t parts) {
+  if (parts == 0 || part >= parts || cpus.size() < parts) {
+    return {};
+  }
+  // The first size % parts slices take one extra CPU.
+  const size_t base = cpus.size() / parts;
+  const size_t extra = cpus.size() % parts;
+  const size_t begin = part * base + std::min(part, extra);
+  const size_t count = base + (part < extra ? 1 : 0);
+  return std::vector<int>(cpus.begin() + begin, cpus.begin() + begin + count);
+}
+
+std::vector<int> numa_node_cpus(int node) {
+  std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) +
+                   "/cpulist");
+  std::string list;
+  std::vector<int> cpus;
+  if (!in || !std::getline(in, list) || !parse_cpu_list(list, cpus)) {
+    cpus.clear();
+  }
+  return cpus;
+}
+
+bool resolve_cpu_set(const std::string &spec, std::vector<int> &cpus) {
+  cpus.clear();
+  if (spec.empty()) {
+    return true;
+  }
+  constexpr std::string_view kNodePrefix = "node:";
+  if (std::string_view(spec).starts_with(kNodePrefix)) {
+    int node = 0;
+    if (!parse_int(std::string_view(spec).substr(kNodePrefix.size()), node)) {
+      return false;
+    }
+    cpus = numa_node_cpus(node);
+    return !cpus.empty();
+  }
+  return parse_cpu_list(spec, cpus) && !cpus.empty();
+}
+
+std::vector<int> online_cpus() {
+  std::ifstream in("/sys/devices/system/cpu/online");
+  std::string list;
+  std::vector<int> cpus;
+  if (!in || !std::getline(in, list) || !parse_cpu_list(list, cpus)) {
+    cpus.clear();
+  }
+  return cpus;
+}
+
+std::vector<int> cpu_set_difference(const std::vector<int> &cpus,
+                                    const std::vector<int> &exclude) {
+  std::vector<int> result;
+  std::set_difference(cpus.begin(), cpus.end(), exclude.begin(),
+                      exclude.end(), std::back_inserter(result));
+  return result;
+}
+
+std::vector<int> current_thread_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t current;
+  CPU_ZERO(&current);
+  if (pthread_getaffinity_np(pthread_self(), sizeof(current), &current) ==
+      0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &current)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  return cpus;
+}
+
+ScopedThreadAffinity::~ScopedThreadAffinity() {
+  if (!m_Cpus.empty() && current_thread_cpus() != m_Cpus) {
+    pin_current_thread(m_Cpus);
+  }
+}
+
+bool pin_current_thread(const std::vector<int> &cpus,
+                        std::vector<int> *previous) {
+  if (previous) {
+    *previous = current_thread_cpus();
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    std::cerr << "Failed to set thread affinity" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+} // namespace solus
@@ -0,0 +1,114 @@
+#include "server/memory_consolidator.h"
+#include <algorithm>
+#include <ctime>
+#include <iostream>
+
+namespace solus {
+
+namespace {
+
+// Conversation the summaries are filed under.
+constexpr const char *kConsolidatedConversation = "consolidated";
+
+} // namespace
+
+MemoryConsolidator::MemoryConsolidator(MemoryDatabase &db,
+                                       const ConsolidationOptions &options,
+                                       Summarize summarize, Encode encode,
+                                       IsIdle is_idle)
+    : m_Db(db), m_Options(options), m_Summarize(std::move(summarize)),
+      m_Encode(std::move(encode)), m_IsIdle(std::move(is_idle)),
+      m_LastTouch(Clock::now().time_since_epoch().count()) {}
+
+MemoryConsolidator::~MemoryConsolidator() { stop(); }
+
+void MemoryConsolidator::start() {
+  if (!m_Thread.joinable()) {
+    m_Thread = std::thread(&MemoryConsolidator::loop, this);
+  }
+}
+
+void MemoryConsolidator::stop() {
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Stop = true;
+  }
+  m_Cv.notify_all();
+  if (m_Thread.joinable()) {
+    m_Thread.join();
+  }
+}
+
+void MemoryConsolidator::touch() {
+  m_Touches++;
+  m_LastTouch = Clock::now().time_since_epoch().count();
+}
+
+bool MemoryConsolidator::run_once() {
+  if (!idle()) {
+    return false;
+  }
+  const int64_t older_than =
+      static_cast<int64_t>(std::time(nullptr)) - m_Options.min_age_s;
+  auto cluster =
+      m_Db.find_cluster(older_than, m_Options.similarity,
+                        m_Options.min_cluster, m_Options.max_cluster);
+  if (!cluster) {
+    return false;
+  }
+  const uint64_t touches = m_Touches;
+  KeepGoing keep_going = [this, touches] {
+    if (m_Touches != touches || !idle()) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return !m_Stop;
+  };
+  std::optional<std::string> text = m_Summarize(*cluster, keep_going);
+  if (!text || text->empty() || !keep_going()) {
+    return false;
+  }
+  MemoryEntry summary(cluster->user_id, kConsolidatedConversation, *text,
+                      cluster->timestamp);
+  summary.hit_count = cluster->hit_count;
+  std::vector<float> embedding = m_Encode(summary);
+  if (embedding.empty() ||
+      !m_Db.replace_cluster(*cluster, summary, embedding)) {
+    return false;
+  }
+  m_Consolidated++;
+  m_Replaced += cluster->ids.size();
+  std::cout << "Consolidated " << cluster->ids.size() << " memories of "
+            << cluster->user_id << std::endl;
+  return true;
+}
+
+void MemoryConsolidator::loop() {
+  // Floored so an idle_for of zero does not turn the wait into a spin.
+  const auto poll = std::clamp<Clock::duration>(
+      m_Options.idle_for, std::chrono::milliseconds(100),
+      std::chrono::seconds(1));
+  auto next_try = Clock::now();
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  while (!m_Stop) {
+    m_Cv.wait_for(lock, poll, [this] { return m_Stop; });
+    if (m_Stop) {
+      break;
+    }
+    const auto now = Clock::now();
+    const auto last = Clock::time_point(Clock::duration(m_LastTouch));
+    if (now - last < m_Options.idle_for || now < next_try || !idle()) {
+      continue;
+    }
+    lock.unlock();
+    const bool found = run_once();
+    lock.lock();
+    if (!found) {
+      // Nothing to do or interrupted; an empty pass over the store is not
+      // worth repeating every second.
+      next_try = Clock::now() + m_Options.idle_for;
+    }
+  }
+}
+
+} // namespace solus
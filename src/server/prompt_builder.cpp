@@ -1,9 +1,11 @@
 #include "server/prompt_builder.h"
-#include <sstream>
+#include <algorithm>
+#include <array>
+#include <atomic>
 
 namespace solus {
 
-static std::string s_SystemPrompt = R"(You are Solus, an advanced AI companion
+static const char *kDefaultSystemPrompt = R"(You are Solus, an advanced AI companion
 When the user requests an action (like "add a TODO"), you MUST output a JSON object with this structure:
 {
   "action": {
@@ -39,39 +41,283 @@ Relevant memories:
 {memories})
 )";
 
+namespace {
+
+constexpr size_t kFormatCount = 4;
+
+// Chat frames per format. {system} is replaced by the system prompt, which
+// itself carries the {memories} slot. BOS is left to the tokenizer.
+const char *frame_for(PromptBuilder::EPromptFormat format) {
+  switch (format) {
+  case PromptBuilder::EPromptFormat::QWEN:
+  case PromptBuilder::EPromptFormat::CHATML:
+    return "<|im_start|>system\n{system}<|im_end|>\n"
+           "<|im_start|>user\n{user}<|im_end|>\n"
+           "<|im_start|>assistant\n";
+  case PromptBuilder::EPromptFormat::LLAMA3:
+    return "<|start_header_id|>system<|end_header_id|>\n\n{system}<|eot_id|>"
+           "<|start_header_id|>user<|end_header_id|>\n\n{user}<|eot_id|>"
+           "<|start_header_id|>assistant<|end_header_id|>\n\n";
+  case PromptBuilder::EPromptFormat::MISTRAL:
+    return "[INST] {system}\n\n{user} [/INST]";
+  }
+  return "";
+}
+
+enum class ESegment { LITERAL, MEMORIES, USER };
+
+struct Segment {
+  ESegment kind;
+  std::string text; // LITERAL only
+};
+
+struct CompiledTemplate {
+  std::vector<Segment> segments;
+  size_t literal_size = 0;
+};
+
+// Immutable snapshot of the system prompt and every format compiled
+// against it. Replaced wholesale by set_system_prompt.
+struct SystemPromptState {
+  uint64_t version = 0;
+  std::array<CompiledTemplate, kFormatCount> templates;
+};
+
+void append_literal(CompiledTemplate &out, std::string_view text) {
+  if (text.empty()) {
+    return;
+  }
+  out.literal_size += text.size();
+  if (!out.segments.empty() && out.segments.back().kind == ESegment::LITERAL) {
+    out.segments.back().text.append(text);
+  } else {
+    out.segments.push_back({ESegment::LITERAL, std::string(text)});
+  }
+}
+
+// Splits text on the first occurrence of each placeholder, in order of
+// appearance.
+void compile_into(CompiledTemplate &out, std::string_view text,
+                  std::string_view system_prompt) {
+  static constexpr std::string_view kSystem = "{system}";
+  static constexpr std::string_view kMemories = "{memories}";
+  static constexpr std::string_view kUser = "{user}";
+  bool memories_seen = false;
+  while (!text.empty()) {
+    size_t pos = text.find('{');
+    if (pos == std::string_view::npos) {
+      append_literal(out, text);
+      break;
+    }
+    append_literal(out, text.substr(0, pos));
+    text.remove_prefix(pos);
+    if (text.starts_with(kSystem)) {
+      text.remove_prefix(kSystem.size());
+      compile_into(out, system_prompt, {});
+    } else if (!memories_seen && text.starts_with(kMemories)) {
+      text.remove_prefix(kMemories.size());
+      out.segments.push_back({ESegment::MEMORIES, {}});
+      memories_seen = true;
+    } else if (text.starts_with(kUser)) {
+      text.remove_prefix(kUser.size());
+      out.segments.push_back({ESegment::USER, {}});
+    } else {
+      append_literal(out, text.substr(0, 1));
+      text.remove_prefix(1);
+    }
+  }
+}
+
+std::shared_ptr<const SystemPromptState>
+compile_state(std::string_view system_prompt, uint64_t version) {
+  auto state = std::make_shared<SystemPromptState>();
+  state->version = version;
+  for (size_t i = 0; i < kFormatCount; i++) {
+    auto format = static_cast<PromptBuilder::EPromptFormat>(i);
+    compile_into(state->templates[i], frame_for(format), system_prompt);
+  }
+  return state;
+}
+
+std::atomic<uint64_t> s_StateVersion{1};
+std::atomic<std::shared_ptr<const SystemPromptState>> s_State{
+    compile_state(kDefaultSystemPrompt, 1)};
+
+constexpr std::string_view kSeparator = "\n---\n";
+constexpr std::string_view kNoMemories = "No previous context.";
+
+} // namespace
+
+bool PromptBuilder::parse_format(std::string_view name, EPromptFormat &format) {
+  if (name == "qwen") {
+    format = EPromptFormat::QWEN;
+  } else if (name == "chatml") {
+    format = EPromptFormat::CHATML;
+  } else if (name == "llama3") {
+    format = EPromptFormat::LLAMA3;
+  } else if (name == "mistral") {
+    format = EPromptFormat::MISTRAL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 std::string
 PromptBuilder::build_chat_prompt(const std::string &user_message,
                                  const std::vector<MemoryEntry> &memories,
                                  PromptBuilder::EPromptFormat format) const {
-  std::ostringstream memory_context;
-  if (memories.empty()) {
-    memory_context << "No previous context.";
-  } else {
-    for (const auto &mem : memories) {
-      memory_context << mem.text << "\n---\n";
+  std::vector<MemoryView> views;
+  views.reserve(memories.size());
+  for (const auto &mem : memories) {
+    views.emplace_back(mem);
+  }
+  return build_chat_prompt(user_message, views, format);
+}
+
+std::string
+PromptBuilder::build_chat_prompt(const std::string &user_message,
+                                 const std::vector<MemoryView> &memories,
+                                 PromptBuilder::EPromptFormat format) const {
+  std::string prompt;
+  render_chat_prompt(prompt, user_message, memories, format);
+  return prompt;
+}
+
+void PromptBuilder::render_chat_prompt(
+    std::string &out, const std::string &user_message,
+    const std::vector<MemoryView> &memories,
+    PromptBuilder::EPromptFormat format) const {
+  auto state = s_State.load();
+  const CompiledTemplate &tmpl = state->templates[static_cast<size_t>(format)];
+  size_t memory_size = memories.empty() ? kNoMemories.size() : 0;
+  for (const auto &mem : memories) {
+    memory_size += mem.text.size() + kSeparator.size();
+  }
+  out.clear();
+  out.reserve(tmpl.literal_size + memory_size + user_message.size());
+  for (const auto &segment : tmpl.segments) {
+    switch (segment.kind) {
+    case ESegment::LITERAL:
+      out.append(segment.text);
+      break;
+    case ESegment::MEMORIES:
+      if (memories.empty()) {
+        out.append(kNoMemories);
+      }
+      for (const auto &mem : memories) {
+        out.append(mem.text);
+        out.append(kSeparator);
+      }
+      break;
+    case ESegment::USER:
+      out.append(user_message);
+      break;
     }
   }
-  // Build system prompt with memories
-  std::string system_prompt = s_SystemPrompt;
-  size_t pos = system_prompt.find("{memories}");
-  if (pos != std::string::npos) {
-    system_prompt.replace(pos, 10, memory_context.str());
+}
+
+std::shared_ptr<const PromptBuilder::TemplateTokens>
+PromptBuilder::template_tokens(PromptBuilder::EPromptFormat format,
+                               const TokenizeFn &tokenize) const {
+  auto state = s_State.load();
+  const size_t index = static_cast<size_t>(format);
+  std::lock_guard<std::mutex> lock(m_CacheMutex);
+  if (m_TokenCache.size() != kFormatCount) {
+    m_TokenCache.resize(kFormatCount);
   }
-  std::ostringstream prompt;
-  switch (format) {
-  case EPromptFormat::QWEN:
-    prompt << "<|im_start|>system\n"
-           << system_prompt << "<|im_end|>\n"
-           << "<|im_start|>user\n"
-           << user_message << "<|im_end|>\n"
-           << "<|im_start|>assistant\n";
-    break;
-  }
-  return prompt.str();
+  auto &cached = m_TokenCache[index];
+  if (cached && cached->version == state->version) {
+    return cached;
+  }
+  // Literal text before the memories slot, between it and the user slot,
+  // and after the user slot. Without a memories slot everything before the
+  // user text is the head.
+  std::string parts[3];
+  int part = 0;
+  bool has_memories = false;
+  for (const auto &segment : state->templates[index].segments) {
+    if (segment.kind == ESegment::LITERAL) {
+      parts[part].append(segment.text);
+    } else if (segment.kind == ESegment::MEMORIES) {
+      has_memories = true;
+      part = 1;
+    } else {
+      part = 2;
+    }
+  }
+  auto tokens = std::make_shared<TemplateTokens>();
+  tokens->version = state->version;
+  tokens->has_memories = has_memories;
+  tokens->head = tokenize(parts[0], true, true);
+  tokens->before_user = tokenize(parts[1], false, true);
+  tokens->after_user = tokenize(parts[2], false, true);
+  tokens->separator = tokenize(std::string(kSeparator), false, false);
+  tokens->no_memories = tokenize(std::string(kNoMemories), false, false);
+  cached = tokens;
+  return tokens;
+}
+
+PromptBuilder::TokenPrompt PromptBuilder::build_chat_tokens(
+    const std::string &user_message, const std::vector<MemoryView> &memories,
+    PromptBuilder::EPromptFormat format, const TokenizeFn &tokenize,
+    int token_budget) const {
+  auto tmpl = template_tokens(format, tokenize);
+  TokenPrompt prompt;
+  // User text never gets special-token parsing, so it cannot inject
+  // template markers.
+  std::vector<int32_t> user_tokens = tokenize(user_message, false, false);
+  const size_t budget = static_cast<size_t>(std::max(token_budget, 0));
+  const size_t no_memories =
+      tmpl->has_memories ? tmpl->no_memories.size() : 0;
+  const size_t frame = tmpl->head.size() + tmpl->before_user.size() +
+                       tmpl->after_user.size() + no_memories;
+  if (frame > budget) {
+    prompt.fits = false;
+    return prompt;
+  }
+  if (frame + user_tokens.size() > budget) {
+    user_tokens.resize(budget - frame);
+    prompt.truncated = true;
+  }
+  size_t remaining = budget > frame + user_tokens.size()
+                         ? budget - frame - user_tokens.size() + no_memories
+                         : no_memories;
+  auto &out = prompt.tokens;
+  out.reserve(std::min(budget, frame + user_tokens.size() + remaining));
+  out.insert(out.end(), tmpl->head.begin(), tmpl->head.end());
+  prompt.n_keep = tmpl->head.size();
+  std::vector<int32_t> scratch;
+  const size_t n_memories = tmpl->has_memories ? memories.size() : 0;
+  for (size_t i = 0; i < n_memories; i++) {
+    const MemoryView &mem = memories[i];
+    std::span<const int32_t> mem_tokens = mem.tokens;
+    if (mem_tokens.empty() && !mem.text.empty()) {
+      scratch = tokenize(std::string(mem.text), false, false);
+      mem_tokens = scratch;
+    }
+    const size_t cost = mem_tokens.size() + tmpl->separator.size();
+    if (cost > remaining) {
+      continue;
+    }
+    out.insert(out.end(), mem_tokens.begin(), mem_tokens.end());
+    out.insert(out.end(), tmpl->separator.begin(), tmpl->separator.end());
+    remaining -= cost;
+    prompt.memories_used++;
+  }
+  if (tmpl->has_memories && prompt.memories_used == 0) {
+    out.insert(out.end(), tmpl->no_memories.begin(), tmpl->no_memories.end());
+  }
+  out.insert(out.end(), tmpl->before_user.begin(), tmpl->before_user.end());
+  out.insert(out.end(), user_tokens.begin(), user_tokens.end());
+  out.insert(out.end(), tmpl->after_user.begin(), tmpl->after_user.end());
+  return prompt;
 }
 
 void PromptBuilder::set_system_prompt(std::string prompt) {
-  s_SystemPrompt = std::move(prompt);
+  // Compile outside any lock and publish atomically; renders in flight keep
+  // the snapshot they loaded.
+  s_State.store(compile_state(prompt, ++s_StateVersion));
 }
 
 } // namespace solus
\ No newline at end of file
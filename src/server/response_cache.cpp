@@ -0,0 +1,219 @@
+#include "server/response_cache.h"
+#include "memory/vector_ops.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace solus {
+
+ResponseCache::ResponseCache(float threshold, std::chrono::seconds ttl,
+                             size_t max_per_user)
+    : m_Threshold(threshold), m_Ttl(ttl),
+      m_MaxPerUser(std::max<size_t>(max_per_user, 1)) {}
+
+std::optional<std::string>
+ResponseCache::lookup(const std::string &user_id, const std::string &model,
+                      const std::vector<float> &embedding,
+                      Clock::time_point now) {
+  const std::vector<float> query = l2_normalized(embedding);
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  auto it = m_Users.find(user_id);
+  if (it == m_Users.end()) {
+    return std::nullopt;
+  }
+  auto &entries = it->second;
+  // Entries are in insertion order with a fixed TTL, so expired ones are
+  // at the front.
+  while (!entries.empty() && entries.front().expires <= now) {
+    entries.pop_front();
+    m_Size--;
+  }
+  const Entry *best = nullptr;
+  float best_score = m_Threshold;
+  for (const auto &entry : entries) {
+    if (entry.model != model || entry.embedding.size() != query.size()) {
+      continue;
+    }
+    float score =
+        dot_product(entry.embedding.data(), query.data(), query.size());
+    if (score >= best_score) {
+      best_score = score;
+      best = &entry;
+    }
+  }
+  if (entries.empty()) {
+    m_Users.erase(it);
+  }
+  if (!best) {
+    return std::nullopt;
+  }
+  return best->response;
+}
+
+void ResponseCache::insert(const std::string &user_id,
+                           const std::string &model,
+                           const std::vector<float> &embedding,
+                           const ParsedResponse &reply,
+                           Clock::time_point now) {
+  if (!reply.action.is_null() || reply.response.empty()) {
+    return;
+  }
+  Entry entry{model, l2_normalized(embedding), reply.response, now + m_Ttl};
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  auto &entries = m_Users[user_id];
+  if (entries.size() >= m_MaxPerUser) {
+    entries.pop_front();
+    m_Size--;
+  }
+  entries.push_back(std::move(entry));
+  m_Size++;
+}
+
+size_t ResponseCache::size() const {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Size;
+}
+
+namespace {
+
+constexpr char kCacheMagic[4] = {'S', 'R', 'C', '1'};
+
+template <typename T> void write_pod(std::ostream &out, const T &value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T> bool read_pod(std::istream &in, T &value) {
+  return static_cast<bool>(
+      in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+}
+
+void write_string(std::ostream &out, const std::string &text) {
+  write_pod(out, static_cast<uint32_t>(text.size()));
+  out.write(text.data(), static_cast<std::streamsize>(text.size()));
+}
+
+bool read_string(std::istream &in, std::string &text) {
+  uint32_t size = 0;
+  if (!read_pod(in, size)) {
+    return false;
+  }
+  text.resize(size);
+  return static_cast<bool>(in.read(text.data(), size));
+}
+
+} // namespace
+
+bool ResponseCache::save(const std::string &path, Clock::time_point now) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    std::cerr << "Failed to write response cache: " << path << std::endl;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  out.write(kCacheMagic, sizeof(kCacheMagic));
+  for (const auto &[user, entries] : m_Users) {
+    for (const auto &entry : entries) {
+      if (entry.expires <= now) {
+        continue;
+      }
+      const int64_t remaining_ms =
+          std::chrono::duration_cast<std::chrono::milliseconds>(entry.expires -
+                                                                now)
+              .count();
+      write_string(out, user);
+      write_string(out, entry.model);
+      write_string(out, entry.response);
+      write_pod(out, remaining_ms);
+      write_pod(out, static_cast<uint32_t>(entry.embedding.size()));
+      out.write(reinterpret_cast<const char *>(entry.embedding.data()),
+                static_cast<std::streamsize>(entry.embedding.size() *
+                                             sizeof(float)));
+    }
+  }
+  return static_cast<bool>(out);
+}
+
+bool ResponseCache::load(const std::string &path, Clock::time_point now) {
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(kCacheMagic)] = {};
+  if (!in || !in.read(magic, sizeof(magic)) ||
+      std::memcmp(magic, kCacheMagic, sizeof(magic)) != 0) {
+    return false;
+  }
+  std::string user;
+  Entry entry;
+  int64_t remaining_ms = 0;
+  uint32_t dim = 0;
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  while (read_string(in, user)) {
+    if (!read_string(in, entry.model) || !read_string(in, entry.response) ||
+        !read_pod(in, remaining_ms) || !read_pod(in, dim)) {
+      return false;
+    }
+    entry.embedding.resize(dim);
+    if (!in.read(reinterpret_cast<char *>(entry.embedding.data()),
+                 static_cast<std::streamsize>(dim * sizeof(float)))) {
+      return false;
+    }
+    // Never extend a lifetime past the current TTL.
+    entry.expires =
+        now + std::min<Clock::duration>(std::chrono::milliseconds(remaining_ms),
+                                        m_Ttl);
+    auto &entries = m_Users[user];
+    if (entries.size() >= m_MaxPerUser) {
+      entries.pop_front();
+      m_Size--;
+    }
+    entries.push_back(entry);
+    m_Size++;
+  }
+  return true;
+}
+
+RequestCoalescer::Ticket RequestCoalescer::join(const std::string &key) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  Ticket ticket;
+  auto it = m_Flights.find(key);
+  if (it != m_Flights.end()) {
+    ticket.result = it->second->future;
+    return ticket;
+  }
+  auto flight = std::make_unique<Flight>();
+  flight->future = flight->promise.get_future().share();
+  m_Flights.emplace(key, std::move(flight));
+  ticket.leader = true;
+  return ticket;
+}
+
+std::unique_ptr<RequestCoalescer::Flight>
+RequestCoalescer::take(const std::string &key) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  auto it = m_Flights.find(key);
+  if (it == m_Flights.end()) {
+    return nullptr;
+  }
+  auto flight = std::move(it->second);
+  m_Flights.erase(it);
+  return flight;
+}
+
+void RequestCoalescer::complete(const std::string &key,
+                                const ParsedResponse &result) {
+  if (auto flight = take(key)) {
+    flight->promise.set_value(result);
+  }
+}
+
+void RequestCoalescer::fail(const std::string &key, std::exception_ptr error) {
+  if (auto flight = take(key)) {
+    flight->promise.set_exception(error);
+  }
+}
+
+size_t RequestCoalescer::in_flight() const {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Flights.size();
+}
+
+} // namespace solus
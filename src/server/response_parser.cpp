@@ -1,34 +1,224 @@
 #include "server/response_parser.h"
+#include <cctype>
 
 namespace solus {
 
-ParsedResponse ResponseParser::parse_response(const std::string &response_text) {
-  ParsedResponse result;
-  result.response = response_text;
-  // Try to extract JSON
-  size_t json_start = response_text.find('{');
-  size_t json_end = response_text.rfind('}');
-  if (json_start != std::string::npos && json_end != std::string::npos &&
-      json_end > json_start) {
-    try {
-      std::string json_str =
-          response_text.substr(json_start, json_end - json_start + 1);
-      auto parsed = nlohmann::json::parse(json_str);
-      if (parsed.contains("action") && parsed.contains("response")) {
-        result.action = parsed["action"].dump();
-        result.response = parsed["response"].get<std::string>();
-      } else if (parsed.contains("action")) {
-        result.action = parsed["action"].dump();
-        // Response is text outside JSON
-        std::string text_response = response_text.substr(0, json_start) +
-                                    response_text.substr(json_end + 1);
-        result.response = text_response.empty() ? "Done." : text_response;
+void ResponseStreamParser::feed(std::string_view chunk) {
+  m_Text.append(chunk);
+  process();
+}
+
+void ResponseStreamParser::process() {
+  for (; m_Pos < m_Text.size() && m_State != EState::DONE; m_Pos++) {
+    step(m_Text[m_Pos]);
+  }
+}
+
+void ResponseStreamParser::step(char c) {
+  if (m_State == EState::OUTSIDE) {
+    if (c == '{') {
+      m_ObjStart = m_Pos;
+      m_Depth = 1;
+      m_State = EState::KEY;
+    }
+    return;
+  }
+  if (m_InString) {
+    if (m_Escape) {
+      m_Escape = false;
+    } else if (c == '\\') {
+      m_Escape = true;
+    } else if (c == '"') {
+      m_InString = false;
+      if (m_State == EState::IN_KEY) {
+        m_Key.assign(m_Text, m_KeyStart, m_Pos - m_KeyStart);
+        m_State = EState::COLON;
+      } else if (m_State == EState::IN_STRING_VALUE) {
+        complete_value(m_Pos + 1);
       }
-    } catch (const nlohmann::json::exception &) {
-      // JSON parsing failed, treat entire response as text
+    }
+    return;
+  }
+  // Inside a nested value only strings and nesting matter; the value is
+  // validated when its slice is parsed.
+  if (m_Depth > 1) {
+    if (c == '"') {
+      m_InString = true;
+    } else if (c == '{' || c == '[') {
+      m_Depth++;
+    } else if (c == '}' || c == ']') {
+      if (--m_Depth == 1) {
+        complete_value(m_Pos + 1);
+      }
+    }
+    return;
+  }
+  const bool space = std::isspace(static_cast<unsigned char>(c));
+  if (m_State == EState::IN_PRIMITIVE) {
+    if (!space && c != ',' && c != '}') {
+      return;
+    }
+    complete_value(m_Pos);
+    if (m_State == EState::DONE || m_State == EState::OUTSIDE) {
+      return;
+    }
+  }
+  if (space) {
+    return;
+  }
+  switch (c) {
+  case '"':
+    if (m_State == EState::KEY) {
+      m_InString = true;
+      m_KeyStart = m_Pos + 1;
+      m_State = EState::IN_KEY;
+      return;
+    }
+    if (m_State == EState::VALUE) {
+      m_InString = true;
+      m_ValueStart = m_Pos;
+      m_State = EState::IN_STRING_VALUE;
+      return;
+    }
+    break;
+  case '{':
+  case '[':
+    if (m_State == EState::VALUE) {
+      m_ValueStart = m_Pos;
+      m_Depth++;
+      m_State = EState::IN_CONTAINER;
+      return;
+    }
+    break;
+  case ':':
+    if (m_State == EState::COLON) {
+      m_State = EState::VALUE;
+      return;
+    }
+    break;
+  case ',':
+    if (m_State == EState::AFTER_VALUE) {
+      m_State = EState::KEY;
+      return;
+    }
+    break;
+  case '}':
+    if (m_State == EState::AFTER_VALUE || m_State == EState::KEY) {
+      end_object(m_Pos + 1);
+      return;
+    }
+    break;
+  default:
+    if (m_State == EState::VALUE) {
+      m_ValueStart = m_Pos;
+      m_State = EState::IN_PRIMITIVE;
+      return;
+    }
+    break;
+  }
+  abandon_object();
+}
+
+void ResponseStreamParser::complete_value(size_t end) {
+  m_State = EState::AFTER_VALUE;
+  if (m_Key != "action" && m_Key != "response") {
+    return;
+  }
+  try {
+    auto value = nlohmann::json::parse(m_Text.begin() + m_ValueStart,
+                                       m_Text.begin() + end);
+    if (m_Key == "action") {
+      m_ActionSeen = true;
+      m_Action = std::move(value);
+      if (m_OnAction && !m_Action.is_null()) {
+        m_OnAction(m_Action);
+      }
+    } else if (value.is_string()) {
+      m_ResponseSeen = true;
+      m_Response = value.get<std::string>();
+    }
+    maybe_emit_response();
+  } catch (const nlohmann::json::exception &) {
+    abandon_object();
+  }
+}
+
+void ResponseStreamParser::end_object(size_t end) {
+  if (!m_ActionSeen) {
+    // Not an action object; keep scanning for one.
+    m_State = EState::OUTSIDE;
+    m_Depth = 0;
+    m_ResponseSeen = false;
+    m_Response.clear();
+    return;
+  }
+  m_ObjEnd = end;
+  m_State = EState::DONE;
+}
+
+void ResponseStreamParser::abandon_object() {
+  if (m_ActionSeen) {
+    // The action was already handed out; treat the rest as part of the
+    // broken object rather than retracting it.
+    m_ObjEnd = std::string::npos;
+    m_State = EState::DONE;
+    return;
+  }
+  m_State = EState::OUTSIDE;
+  m_Depth = 0;
+  m_InString = false;
+  m_Escape = false;
+  m_ResponseSeen = false;
+  m_Response.clear();
+  // Rescan from just after the opening brace; process() advances past it.
+  m_Pos = m_ObjStart;
+}
+
+void ResponseStreamParser::maybe_emit_response() {
+  if (m_ActionSeen && m_ResponseSeen && !m_ResponseEmitted) {
+    m_ResponseEmitted = true;
+    if (m_OnResponse) {
+      m_OnResponse(m_Response);
+    }
+  }
+}
+
+ParsedResponse ResponseStreamParser::finish() {
+  ParsedResponse result;
+  if (!m_ActionSeen) {
+    result.response = std::move(m_Text);
+    return result;
+  }
+  result.action = std::move(m_Action);
+  if (m_ResponseSeen) {
+    result.response = std::move(m_Response);
+  } else {
+    // Response is text outside JSON
+    std::string text_response = m_Text.substr(0, m_ObjStart);
+    if (m_ObjEnd != std::string::npos && m_State == EState::DONE) {
+      text_response += m_Text.substr(m_ObjEnd);
+    }
+    result.response = text_response.empty() ? "Done." : text_response;
+    if (m_OnResponse) {
+      m_OnResponse(result.response);
     }
   }
   return result;
 }
 
-} // namespace solus
\ No newline at end of file
+ParsedResponse ResponseParser::parse_response(const std::string &response_text) {
+  ResponseStreamParser parser;
+  parser.feed(response_text);
+  return parser.finish();
+}
+
+std::string ResponseParser::action_type(const nlohmann::json &action) {
+  if (!action.is_object()) {
+    return action.dump();
+  }
+  auto type = action.find("type");
+  return type != action.end() && type->is_string() ? type->get<std::string>()
+                                                   : action.dump();
+}
+
+} // namespace solus
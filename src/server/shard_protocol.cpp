@@ -0,0 +1,368 @@
+#include "server/shard_protocol.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using json = nlohmann::json;
+
+namespace solus {
+
+namespace {
+
+constexpr size_t kHeaderSize = 9;
+// Imports travel as one frame; anything larger is a corrupt header.
+constexpr uint32_t kMaxBody = 512u << 20;
+
+bool read_exact(int fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = ::read(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    // MSG_NOSIGNAL: a peer that went away is an error, not SIGPIPE.
+    ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool make_address(const std::string &path, sockaddr_un &addr) {
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path too long: " << path << std::endl;
+    return false;
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+// splitmix64 finalizer; spreads FNV's weak low bits across the ring.
+uint64_t mix(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+} // namespace
+
+std::string encode_frame(const ShardFrame &frame) {
+  const uint32_t body_size = static_cast<uint32_t>(frame.body.size());
+  const uint16_t user_size = static_cast<uint16_t>(
+      std::min<size_t>(frame.user_id.size(), UINT16_MAX));
+  std::string out(kHeaderSize, '\0');
+  std::memcpy(out.data(), &body_size, 4);
+  std::memcpy(out.data() + 4, &user_size, 2);
+  std::memcpy(out.data() + 6, &frame.status, 2);
+  out[8] = static_cast<char>(frame.op);
+  out.append(frame.user_id, 0, user_size);
+  out.append(frame.body);
+  return out;
+}
+
+bool write_frame(int fd, const ShardFrame &frame) {
+  if (frame.body.size() > kMaxBody) {
+    std::cerr << "Shard frame too large: " << frame.body.size() << " bytes"
+              << std::endl;
+    return false;
+  }
+  const std::string data = encode_frame(frame);
+  return write_all(fd, data.data(), data.size());
+}
+
+bool read_frame(int fd, ShardFrame &frame) {
+  char header[kHeaderSize];
+  if (!read_exact(fd, header, kHeaderSize)) {
+    return false;
+  }
+  uint32_t body_size = 0;
+  uint16_t user_size = 0;
+  std::memcpy(&body_size, header, 4);
+  std::memcpy(&user_size, header + 4, 2);
+  std::memcpy(&frame.status, header + 6, 2);
+  const auto op = static_cast<uint8_t>(header[8]);
+  if (body_size > kMaxBody ||
+      op > static_cast<uint8_t>(EShardOp::MOVE_USER)) {
+    return false;
+  }
+  frame.op = static_cast<EShardOp>(op);
+  frame.user_id.resize(user_size);
+  frame.body.resize(body_size);
+  return read_exact(fd, frame.user_id.data(), user_size) &&
+         read_exact(fd, frame.body.data(), body_size);
+}
+
+int connect_unix(const std::string &path) {
+  sockaddr_un addr;
+  if (!make_address(path, addr)) {
+    return -1;
+  }
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    std::cerr << "socket: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+  if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int listen_unix(const std::string &path) {
+  sockaddr_un addr;
+  if (!make_address(path, addr)) {
+    return -1;
+  }
+  // A socket file left by a crashed process would make bind fail.
+  ::unlink(path.c_str());
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      ::listen(fd, SOMAXCONN) != 0) {
+    std::cerr << "Failed to listen on " << path << ": "
+              << std::strerror(errno) << std::endl;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+ShardFrame shard_request(const std::string &path, const ShardFrame &request) {
+  ShardFrame reply;
+  int fd = connect_unix(path);
+  if (fd >= 0 && write_frame(fd, request) && read_frame(fd, reply) &&
+      reply.op == EShardOp::REPLY) {
+    ::close(fd);
+    return reply;
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  reply.op = EShardOp::REPLY;
+  reply.status = 502;
+  reply.user_id.clear();
+  reply.body = json({{"error", "Shard unavailable: " + path}}).dump();
+  return reply;
+}
+
+ShardListener::ShardListener(std::string path, Handler handler)
+    : m_Path(std::move(path)), m_Handler(std::move(handler)) {}
+
+ShardListener::~ShardListener() { stop(); }
+
+bool ShardListener::start() {
+  m_ListenFd = listen_unix(m_Path);
+  if (m_ListenFd < 0) {
+    return false;
+  }
+  m_Acceptor = std::thread(&ShardListener::accept_loop, this);
+  return true;
+}
+
+void ShardListener::stop() {
+  if (m_Stopping.exchange(true)) {
+    return;
+  }
+  if (m_ListenFd >= 0) {
+    // Wakes accept(); the descriptor is closed once the acceptor is gone.
+    ::shutdown(m_ListenFd, SHUT_RDWR);
+  }
+  if (m_Acceptor.joinable()) {
+    m_Acceptor.join();
+  }
+  if (m_ListenFd >= 0) {
+    ::close(m_ListenFd);
+    ::unlink(m_Path.c_str());
+  }
+  std::vector<std::unique_ptr<Connection>> connections;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    for (const auto &connection : m_Connections) {
+      if (connection->fd >= 0) {
+        ::shutdown(connection->fd, SHUT_RDWR);
+      }
+    }
+    connections.swap(m_Connections);
+  }
+  for (auto &connection : connections) {
+    connection->thread.join();
+  }
+}
+
+void ShardListener::accept_loop() {
+  while (!m_Stopping) {
+    int fd = ::accept4(m_ListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_Stopping) {
+      ::close(fd);
+      return;
+    }
+    reap();
+    auto connection = std::make_unique<Connection>();
+    connection->fd = fd;
+    connection->thread =
+        std::thread(&ShardListener::serve, this, connection.get());
+    m_Connections.push_back(std::move(connection));
+  }
+}
+
+void ShardListener::reap() {
+  auto finished = std::partition(
+      m_Connections.begin(), m_Connections.end(),
+      [](const auto &connection) { return !connection->done; });
+  for (auto it = finished; it != m_Connections.end(); ++it) {
+    (*it)->thread.join();
+  }
+  m_Connections.erase(finished, m_Connections.end());
+}
+
+void ShardListener::serve(Connection *connection) {
+  const int fd = connection->fd;
+  ShardFrame request;
+  while (read_frame(fd, request)) {
+    ShardFrame reply;
+    try {
+      reply = m_Handler(request);
+    } catch (const std::exception &e) {
+      reply.status = 500;
+      reply.body = json({{"error", e.what()}}).dump();
+    }
+    reply.op = EShardOp::REPLY;
+    if (!write_frame(fd, reply)) {
+      break;
+    }
+  }
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  ::close(fd);
+  connection->fd = -1;
+  connection->done = true;
+}
+
+HashRing::HashRing(size_t shards, size_t replicas)
+    : m_Shards(std::max<size_t>(shards, 1)) {
+  m_Points.reserve(m_Shards * replicas);
+  for (size_t shard = 0; shard < m_Shards; shard++) {
+    for (size_t r = 0; r < replicas; r++) {
+      const std::string key =
+          "shard-" + std::to_string(shard) + "#" + std::to_string(r);
+      m_Points.emplace_back(hash(key), static_cast<uint32_t>(shard));
+    }
+  }
+  std::sort(m_Points.begin(), m_Points.end());
+}
+
+uint64_t HashRing::hash(std::string_view key) {
+  uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+  for (unsigned char c : key) {
+    h ^= c;
+    h *= 0x100000001b3ull;
+  }
+  return mix(h);
+}
+
+size_t HashRing::shard_for(std::string_view user_id) const {
+  if (m_Points.empty()) {
+    return 0;
+  }
+  const uint64_t h = hash(user_id);
+  auto it = std::lower_bound(
+      m_Points.begin(), m_Points.end(), h,
+      [](const auto &point, uint64_t value) { return point.first < value; });
+  return it == m_Points.end() ? m_Points.front().second : it->second;
+}
+
+size_t ShardMap::shard_for(std::string_view user_id) const {
+  if (!m_Overrides.empty()) {
+    auto it = m_Overrides.find(std::string(user_id));
+    if (it != m_Overrides.end()) {
+      return it->second;
+    }
+  }
+  return m_Ring.shard_for(user_id);
+}
+
+void ShardMap::assign(const std::string &user_id, size_t shard) {
+  if (shard == m_Ring.shard_for(user_id)) {
+    m_Overrides.erase(user_id);
+  } else {
+    m_Overrides[user_id] = shard;
+  }
+}
+
+bool ShardMap::save(const std::string &path) const {
+  json overrides = json::object();
+  for (const auto &[user, shard] : m_Overrides) {
+    overrides[user] = shard;
+  }
+  const std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::trunc);
+    if (!(out << json({{"shards", shards()}, {"overrides", overrides}})
+                     .dump(2))) {
+      std::cerr << "Failed to write shard map: " << tmp << std::endl;
+      return false;
+    }
+  }
+  return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool ShardMap::load(const std::string &path) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  try {
+    json j = json::parse(in);
+    m_Overrides.clear();
+    for (const auto &[user, shard] : j.at("overrides").items()) {
+      const size_t index = shard.get<size_t>();
+      if (index < shards()) {
+        assign(user, index);
+      } else {
+        std::cerr << "Shard map places " << user << " on missing shard "
+                  << index << "; using the ring" << std::endl;
+      }
+    }
+    return true;
+  } catch (const json::exception &e) {
+    std::cerr << "Failed to read shard map: " << e.what() << std::endl;
+    return false;
+  }
+}
+
+} // namespace solus
@@ -0,0 +1,608 @@
+#include "server/shard_router.h"
+#include "server/cpu_topology.h"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+using json = nlohmann::json;
+
+namespace solus {
+
+namespace {
+
+// A worker that keeps crashing is left down rather than restarted forever.
+constexpr int kMaxRestarts = 5;
+constexpr auto kSupervisePeriod = std::chrono::milliseconds(500);
+constexpr auto kSocketWait = std::chrono::seconds(30);
+// Beyond the drain grace period, how long a stopping worker gets to abort
+// its requests and save before it is killed.
+constexpr auto kWorkerExitWait = std::chrono::seconds(15);
+
+// Shard's share of n threads; false when there are fewer than shards.
+bool split_threads(int n, size_t shard, size_t shards, int &share) {
+  const size_t total = static_cast<size_t>(std::max(n, 0));
+  if (total < shards) {
+    return false;
+  }
+  share = static_cast<int>(total / shards + (shard < total % shards));
+  return true;
+}
+
+// Shard's slice of a CPU placement, minus the HTTP CPUs compute avoids. An
+// empty spec stays empty (unpinned).
+bool split_cpus(const std::string &spec, const std::vector<int> &http_cpus,
+                size_t shard, size_t shards, std::string &slice) {
+  std::vector<int> cpus;
+  if (!resolve_cpu_set(spec, cpus)) {
+    return false;
+  }
+  if (cpus.empty()) {
+    slice.clear();
+    return true;
+  }
+  cpus = cpu_set_slice(cpu_set_difference(cpus, http_cpus), shard, shards);
+  slice = format_cpu_list(cpus);
+  return !cpus.empty();
+}
+
+} // namespace
+
+ShardRouter::ShardRouter(const ServerConfig &config,
+                         std::vector<std::string> worker_args)
+    : m_Config(config), m_WorkerArgs(std::move(worker_args)),
+      m_Shards(static_cast<size_t>(std::max(config.shards, 1))),
+      m_MapPath(config.shard_dir + "/shards.json"), m_Map(m_Shards) {}
+
+ShardRouter::~ShardRouter() { shutdown(); }
+
+std::string ShardRouter::socket_path(const ServerConfig &config,
+                                     size_t shard) {
+  return config.shard_dir + "/shard-" + std::to_string(shard) + ".sock";
+}
+
+bool ShardRouter::worker_config(const ServerConfig &config, size_t shard,
+                                ServerConfig &worker) {
+  worker = config;
+  const std::string name = "shard-" + std::to_string(shard);
+  // Workers run side by side, so each gets its own share of the compute
+  // threads and CPUs rather than all of them contending for the same ones.
+  const size_t shards = static_cast<size_t>(std::max(config.shards, 1));
+  if (!split_threads(config.n_threads, shard, shards, worker.n_threads) ||
+      (config.n_threads_batch > 0 &&
+       !split_threads(config.n_threads_batch, shard, shards,
+                      worker.n_threads_batch))) {
+    std::cerr << "Cannot split " << config.n_threads << " decode and "
+              << config.n_threads_batch << " batch threads across " << shards
+              << " shards" << std::endl;
+    return false;
+  }
+  std::vector<int> http_cpus;
+  if (!resolve_cpu_set(config.cpus_http, http_cpus) ||
+      !split_cpus(config.cpus_decode, http_cpus, shard, shards,
+                  worker.cpus_decode) ||
+      !split_cpus(config.cpus_batch, http_cpus, shard, shards,
+                  worker.cpus_batch)) {
+    std::cerr << "Cannot split the compute CPU sets across " << shards
+              << " shards; each needs at least one CPU outside --cpus-http"
+              << std::endl;
+    return false;
+  }
+  worker.shards = 1;
+  worker.shard_socket = socket_path(config, shard);
+  worker.memory_db_path = config.memory_db_path + "/" + name;
+  if (!worker.warm_state_dir.empty()) {
+    worker.warm_state_dir += "/" + name;
+  }
+  if (!worker.trace_path.empty()) {
+    worker.trace_path += "." + name;
+  }
+  if (!worker.capture_path.empty()) {
+    worker.capture_path += "." + name;
+  }
+  return true;
+}
+
+bool ShardRouter::initialize() {
+  std::cout << "Starting " << m_Shards << " shard workers..." << std::endl;
+  std::error_code ec;
+  std::filesystem::create_directories(m_Config.shard_dir, ec);
+  if (std::filesystem::exists(m_MapPath) && !m_Map.load(m_MapPath)) {
+    return false;
+  }
+  // Checked here so a placement that cannot be split fails once, up front,
+  // rather than in every worker's restart loop.
+  for (size_t shard = 0; shard < m_Shards; shard++) {
+    ServerConfig worker;
+    if (!worker_config(m_Config, shard, worker)) {
+      return false;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_WorkersMutex);
+    m_Workers.resize(m_Shards);
+    for (size_t shard = 0; shard < m_Shards; shard++) {
+      if (!spawn(shard)) {
+        return false;
+      }
+    }
+  }
+  // Workers open their socket before loading the model, so this only waits
+  // for the processes to start; readiness shows up in /health.
+  const auto deadline = std::chrono::steady_clock::now() + kSocketWait;
+  for (size_t shard = 0; shard < m_Shards; shard++) {
+    int fd = -1;
+    while ((fd = connect_unix(socket_path(m_Config, shard))) < 0) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        std::cerr << "Shard " << shard << " did not start" << std::endl;
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    ::close(fd);
+  }
+  m_Control = std::make_unique<ShardListener>(
+      m_Config.shard_dir + "/front.sock",
+      [this](const ShardFrame &frame) { return handle_control(frame); });
+  if (!m_Control->start()) {
+    return false;
+  }
+  http::ServerConfig http_cfg;
+  http_cfg.is_multithreaded = m_Config.worker_threads > 1;
+  http_cfg.port = m_Config.port;
+  m_HttpServer = std::make_unique<http::Server>(http_cfg);
+  m_HttpServer->start();
+  m_HttpServer->route(
+      "/health", http::EMethod::GET,
+      [this](const http::Request &req) { return this->handle_health(req); });
+  m_HttpServer->route(
+      "/chat", http::EMethod::POST,
+      [this](const http::Request &req) { return this->handle_chat(req); });
+  m_HttpServer->route("/memory/import", http::EMethod::POST,
+                      [this](const http::Request &req) {
+                        return this->handle_memory_import(req);
+                      });
+  m_Supervisor = std::thread(&ShardRouter::supervise, this);
+  return true;
+}
+
+bool ShardRouter::spawn(size_t shard) {
+  std::vector<std::string> args = m_WorkerArgs;
+  args.push_back("--shard-worker");
+  args.push_back(std::to_string(shard));
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+  // Own process group: a terminal Ctrl-C reaches only the front, which
+  // then stops the workers in order.
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attr, 0);
+  pid_t pid = -1;
+  const int err = posix_spawn(&pid, "/proc/self/exe", nullptr, &attr,
+                              argv.data(), environ);
+  posix_spawnattr_destroy(&attr);
+  if (err != 0) {
+    std::cerr << "Failed to start shard " << shard << ": "
+              << std::strerror(err) << std::endl;
+    return false;
+  }
+  m_Workers[shard].pid = pid;
+  std::cout << "Shard " << shard << " running as pid " << pid << std::endl;
+  return true;
+}
+
+void ShardRouter::supervise() {
+  while (!m_Stopped) {
+    std::this_thread::sleep_for(kSupervisePeriod);
+    std::lock_guard<std::mutex> lock(m_WorkersMutex);
+    for (size_t shard = 0; shard < m_Workers.size(); shard++) {
+      Worker &worker = m_Workers[shard];
+      int status = 0;
+      if (worker.pid <= 0 || waitpid(worker.pid, &status, WNOHANG) <= 0) {
+        continue;
+      }
+      worker.pid = -1;
+      if (m_Draining) {
+        continue;
+      }
+      std::cerr << "Shard " << shard << " exited ("
+                << (WIFSIGNALED(status) ? "signal " : "status ")
+                << (WIFSIGNALED(status) ? WTERMSIG(status)
+                                        : WEXITSTATUS(status))
+                << ")" << std::endl;
+      if (worker.restarts++ < kMaxRestarts) {
+        spawn(shard);
+      } else {
+        std::cerr << "Shard " << shard << " keeps failing; leaving it down"
+                  << std::endl;
+      }
+    }
+  }
+}
+
+void ShardRouter::run() {
+  std::cout << "Routing " << m_Shards << " shards on " << m_Config.host << ":"
+            << m_Config.port << std::endl;
+  m_HttpServer->run();
+}
+
+void ShardRouter::shutdown() {
+  if (m_Draining.exchange(true)) {
+    return;
+  }
+  m_Stopped = true;
+  if (m_Supervisor.joinable()) {
+    m_Supervisor.join();
+  }
+  // Each worker drains its own in-flight requests on SIGTERM; the front's
+  // requests to it complete as they do.
+  std::lock_guard<std::mutex> lock(m_WorkersMutex);
+  for (const auto &worker : m_Workers) {
+    if (worker.pid > 0) {
+      kill(worker.pid, SIGTERM);
+    }
+  }
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::seconds(m_Config.drain_grace_s) +
+                        kWorkerExitWait;
+  for (auto &worker : m_Workers) {
+    if (worker.pid <= 0) {
+      continue;
+    }
+    while (waitpid(worker.pid, nullptr, WNOHANG) == 0) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        std::cerr << "Shard worker " << worker.pid
+                  << " did not exit; killing it" << std::endl;
+        kill(worker.pid, SIGKILL);
+        waitpid(worker.pid, nullptr, 0);
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    worker.pid = -1;
+  }
+  if (m_Control) {
+    m_Control->stop();
+  }
+  if (m_HttpServer) {
+    m_HttpServer->stop();
+  }
+}
+
+ShardFrame ShardRouter::forward(size_t shard,
+                                const ShardFrame &request) const {
+  return shard_request(socket_path(m_Config, shard), request);
+}
+
+http::Response ShardRouter::to_response(const ShardFrame &reply) {
+  http::Response res;
+  res.status_code = reply.status;
+  res.body = reply.body;
+  res.headers.set("Content-Type", "application/json");
+  return res;
+}
+
+http::Response ShardRouter::error_response(int status,
+                                           const std::string &error) {
+  ShardFrame reply;
+  reply.status = static_cast<uint16_t>(status);
+  reply.body = json({{"status", error}}).dump();
+  return to_response(reply);
+}
+
+bool ShardRouter::begin_user(const std::string &user_id, size_t &shard) {
+  std::lock_guard<std::mutex> lock(m_MapMutex);
+  if (m_Moving.count(user_id) != 0) {
+    return false;
+  }
+  shard = m_Map.shard_for(user_id);
+  m_UserInFlight[user_id]++;
+  return true;
+}
+
+void ShardRouter::end_user(const std::string &user_id) {
+  {
+    std::lock_guard<std::mutex> lock(m_MapMutex);
+    auto it = m_UserInFlight.find(user_id);
+    if (it != m_UserInFlight.end() && --it->second == 0) {
+      m_UserInFlight.erase(it);
+    }
+  }
+  m_MapCv.notify_all();
+}
+
+http::Response ShardRouter::handle_health(const http::Request &) {
+  if (m_Draining) {
+    return error_response(503, "draining");
+  }
+  ShardFrame request;
+  request.op = EShardOp::HEALTH;
+  json shards = json::array();
+  size_t memory_count = 0;
+  const char *status = "healthy";
+  for (size_t shard = 0; shard < m_Shards; shard++) {
+    ShardFrame reply = forward(shard, request);
+    json health = json::parse(reply.body, nullptr, false);
+    if (reply.status != 200) {
+      // One worker still loading makes the whole service "starting".
+      const bool starting =
+          health.is_object() && health.value("status", "") == "starting";
+      if (starting || std::string(status) == "healthy") {
+        status = starting ? "starting" : "degraded";
+      }
+    } else if (health.is_object()) {
+      memory_count += health.value("memory_count", size_t{0});
+    }
+    shards.push_back({{"shard", shard}, {"health", health}});
+  }
+  ShardFrame reply;
+  reply.status = std::string(status) == "healthy" ? 200 : 503;
+  reply.body = json({{"status", status},
+                     {"ready", reply.status == 200},
+                     {"memory_count", memory_count},
+                     {"shards", shards}})
+                   .dump();
+  return to_response(reply);
+}
+
+http::Response ShardRouter::handle_chat(const http::Request &req) {
+  if (m_Draining) {
+    return error_response(503, "draining");
+  }
+  ShardFrame request;
+  request.op = EShardOp::CHAT;
+  request.body = req.body;
+  json body = json::parse(req.body, nullptr, false);
+  if (body.is_object() && body.contains("user_id") &&
+      body["user_id"].is_string()) {
+    request.user_id = body["user_id"].get<std::string>();
+  }
+  if (request.user_id.empty()) {
+    // Any worker rejects it with the usual error.
+    return to_response(forward(0, request));
+  }
+  size_t shard = 0;
+  if (!begin_user(request.user_id, shard)) {
+    return error_response(503, "moving");
+  }
+  ShardFrame reply = forward(shard, request);
+  end_user(request.user_id);
+  return to_response(reply);
+}
+
+http::Response ShardRouter::handle_memory_import(const http::Request &req) {
+  if (m_Draining) {
+    return error_response(503, "draining");
+  }
+  // Split the NDJSON by owning shard and import the parts in parallel.
+  // Each shard reports line numbers within its part; lines maps them back.
+  const auto start_time = std::chrono::steady_clock::now();
+  std::shared_lock<std::shared_mutex> move_lock(m_MoveMutex);
+  std::vector<std::string> parts(m_Shards);
+  std::vector<std::vector<size_t>> lines(m_Shards);
+  std::string_view body(req.body);
+  size_t line_no = 0;
+  {
+    std::lock_guard<std::mutex> lock(m_MapMutex);
+    while (!body.empty()) {
+      const size_t eol = body.find('\n');
+      std::string_view line = body.substr(0, eol);
+      body.remove_prefix(eol == std::string_view::npos ? body.size()
+                                                       : eol + 1);
+      line_no++;
+      if (line.find_first_not_of(" \t\r") == std::string_view::npos) {
+        continue;
+      }
+      json record = json::parse(line.begin(), line.end(), nullptr, false);
+      size_t shard = 0;
+      if (record.is_object() && record.contains("user_id") &&
+          record["user_id"].is_string()) {
+        shard = m_Map.shard_for(record["user_id"].get<std::string>());
+      }
+      parts[shard].append(line);
+      parts[shard].push_back('\n');
+      lines[shard].push_back(line_no);
+    }
+  }
+  std::vector<std::future<ShardFrame>> replies(m_Shards);
+  for (size_t shard = 0; shard < m_Shards; shard++) {
+    if (parts[shard].empty()) {
+      continue;
+    }
+    ShardFrame request;
+    request.op = EShardOp::IMPORT;
+    request.body = std::move(parts[shard]);
+    replies[shard] =
+        std::async(std::launch::async,
+                   [this, shard, request = std::move(request)]() {
+                     return forward(shard, request);
+                   });
+  }
+  size_t total = 0, added = 0, merged = 0, failed = 0, memory_count = 0;
+  json errors = json::array();
+  for (size_t shard = 0; shard < m_Shards; shard++) {
+    if (!replies[shard].valid()) {
+      continue;
+    }
+    ShardFrame reply = replies[shard].get();
+    json result = json::parse(reply.body, nullptr, false);
+    if (reply.status != 200 || !result.is_object()) {
+      total += lines[shard].size();
+      failed += lines[shard].size();
+      errors.push_back({{"shard", shard}, {"error", result}});
+      continue;
+    }
+    total += result.value("total", size_t{0});
+    added += result.value("added", size_t{0});
+    merged += result.value("merged", size_t{0});
+    failed += result.value("failed", size_t{0});
+    memory_count += result.value("memory_count", size_t{0});
+    for (auto error : result.value("errors", json::array())) {
+      const size_t local = error.value("line", size_t{0});
+      if (local >= 1 && local <= lines[shard].size()) {
+        error["line"] = lines[shard][local - 1];
+      }
+      errors.push_back(std::move(error));
+    }
+  }
+  const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - start_time)
+                            .count();
+  ShardFrame reply;
+  reply.status = 200;
+  reply.body = json({{"total", total},
+                     {"added", added},
+                     {"merged", merged},
+                     {"failed", failed},
+                     {"errors", errors},
+                     {"duration_ms", duration},
+                     {"memory_count", memory_count}})
+                   .dump();
+  return to_response(reply);
+}
+
+ShardFrame ShardRouter::handle_control(const ShardFrame &frame) {
+  if (frame.op == EShardOp::PLACEMENT) {
+    return placement();
+  }
+  if (frame.op == EShardOp::MOVE_USER) {
+    json body = json::parse(frame.body, nullptr, false);
+    if (frame.user_id.empty() || !body.is_object() ||
+        !body.contains("shard") || !body["shard"].is_number_unsigned()) {
+      ShardFrame reply;
+      reply.status = 400;
+      reply.body = json({{"error", "Expected user_id and shard"}}).dump();
+      return reply;
+    }
+    return move_user(frame.user_id, body["shard"].get<size_t>());
+  }
+  ShardFrame reply;
+  reply.status = 400;
+  reply.body = json({{"error", "Unsupported control operation"}}).dump();
+  return reply;
+}
+
+ShardFrame ShardRouter::placement() {
+  json workers = json::array();
+  ShardFrame health;
+  health.op = EShardOp::HEALTH;
+  for (size_t shard = 0; shard < m_Shards; shard++) {
+    pid_t pid = -1;
+    {
+      std::lock_guard<std::mutex> lock(m_WorkersMutex);
+      pid = m_Workers[shard].pid;
+    }
+    ShardFrame reply = forward(shard, health);
+    workers.push_back({{"shard", shard},
+                       {"pid", pid},
+                       {"socket", socket_path(m_Config, shard)},
+                       {"health", json::parse(reply.body, nullptr, false)}});
+  }
+  json overrides = json::object();
+  {
+    std::lock_guard<std::mutex> lock(m_MapMutex);
+    for (const auto &[user, shard] : m_Map.overrides()) {
+      overrides[user] = shard;
+    }
+  }
+  ShardFrame reply;
+  reply.status = 200;
+  reply.body = json({{"shards", m_Shards},
+                     {"workers", workers},
+                     {"overrides", overrides}})
+                   .dump();
+  return reply;
+}
+
+ShardFrame ShardRouter::move_user(const std::string &user_id, size_t target) {
+  ShardFrame reply;
+  if (target >= m_Shards) {
+    reply.status = 400;
+    reply.body = json({{"error", "No such shard"}}).dump();
+    return reply;
+  }
+  std::unique_lock<std::shared_mutex> move_lock(m_MoveMutex);
+  size_t source = 0;
+  {
+    // New requests for the user get 503 "moving"; wait out the ones already
+    // on the source shard so the export sees their memories.
+    std::unique_lock<std::mutex> lock(m_MapMutex);
+    source = m_Map.shard_for(user_id);
+    if (source == target) {
+      reply.status = 200;
+      reply.body = json({{"user_id", user_id}, {"shard", target},
+                         {"moved", 0}})
+                       .dump();
+      return reply;
+    }
+    m_Moving.insert(user_id);
+    m_MapCv.wait(lock, [&] { return m_UserInFlight.count(user_id) == 0; });
+  }
+  auto finish = [&](bool moved) {
+    std::lock_guard<std::mutex> lock(m_MapMutex);
+    if (moved) {
+      m_Map.assign(user_id, target);
+      if (!m_Map.save(m_MapPath)) {
+        std::cerr << "Failed to persist shard map; the move of " << user_id
+                  << " lasts until restart" << std::endl;
+      }
+    }
+    m_Moving.erase(user_id);
+  };
+  auto request = [&](EShardOp op, std::string body) {
+    ShardFrame frame;
+    frame.op = op;
+    frame.user_id = user_id;
+    frame.body = std::move(body);
+    return frame;
+  };
+  ShardFrame exported = forward(source, request(EShardOp::EXPORT_USER, ""));
+  if (exported.status != 200) {
+    finish(false);
+    return exported;
+  }
+  const size_t records =
+      std::count(exported.body.begin(), exported.body.end(), '\n');
+  ShardFrame imported =
+      forward(target, request(EShardOp::IMPORT_USER, exported.body));
+  if (imported.status != 200) {
+    // Leave nothing half-copied on the target; the source still owns the
+    // user.
+    forward(target, request(EShardOp::DROP_USER, ""));
+    finish(false);
+    return imported;
+  }
+  // The map points at the target before the source copy is tombstoned, so
+  // a failure from here on leaves stale rows, never lost ones.
+  finish(true);
+  ShardFrame dropped = forward(source, request(EShardOp::DROP_USER, ""));
+  if (dropped.status != 200) {
+    std::cerr << "Moved " << user_id << " but shard " << source
+              << " kept its copy" << std::endl;
+  }
+  std::cout << "Moved " << user_id << " (" << records
+            << " memories) from shard " << source << " to " << target
+            << std::endl;
+  reply.status = 200;
+  reply.body = json({{"user_id", user_id},
+                     {"from", source},
+                     {"shard", target},
+                     {"moved", records}})
+                   .dump();
+  return reply;
+}
+
+} // namespace solus
@@ -1,46 +1,382 @@
 #include "server/solus_server.h"
 #include "net/http.h"
+#include "server/cpu_topology.h"
 #include "server/prompt_builder.h"
+#include "server/response_cache.h"
 #include "server/response_parser.h"
+#include "utils/tracing.h"
+#include <algorithm>
+#include <cctype>
 #include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <nlohmann/json.hpp>
+#include <random>
+#include <thread>
 
 using json = nlohmann::json;
 
 namespace solus {
 
-SolusServer::SolusServer(const ServerConfig &config) : m_Config(config) {}
+namespace {
 
-SolusServer::~SolusServer() {
-  if (m_MemoryDb) {
-    m_MemoryDb->save_index();
+// Counts a request as in flight for the drain on shutdown, and holds off
+// memory consolidation while it runs.
+class InFlightGuard {
+public:
+  InFlightGuard(std::atomic<int> &count, MemoryConsolidator *consolidator)
+      : m_Count(count), m_Consolidator(consolidator) {
+    m_Count++;
+    if (m_Consolidator) {
+      m_Consolidator->touch();
+    }
   }
-}
+  ~InFlightGuard() {
+    m_Count--;
+    if (m_Consolidator) {
+      m_Consolidator->touch();
+    }
+  }
+
+  InFlightGuard(const InFlightGuard &) = delete;
+  InFlightGuard &operator=(const InFlightGuard &) = delete;
+
+private:
+  std::atomic<int> &m_Count;
+  MemoryConsolidator *m_Consolidator;
+};
+
+// How long shutdown waits for requests to notice the abort before it warns
+// about the ones still running, e.g. in a prefill that cannot be cut short.
+constexpr auto kAbortWait = std::chrono::seconds(5);
+
+// A request the server cannot serve as given; answered with 400.
+class BadRequest : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// Instruction for consolidation; the cluster goes in the memories slot so
+// the system prompt prefix stays shared with chat requests.
+constexpr const char *kConsolidationRequest =
+    "Condense the memories above into one short note that keeps every fact, "
+    "preference and commitment about me worth remembering. Reply with the "
+    "note only, as plain text, without an action.";
+
+} // namespace
+
+SolusServer::SolusServer(const ServerConfig &config) : m_Config(config) {}
+
+SolusServer::~SolusServer() { stop(); }
 
 bool SolusServer::initialize() {
   std::cout << "Initializing Solus Server..." << std::endl;
-  m_Llama = std::make_unique<LlamaHandler>(m_Config);
-  if (!m_Llama->initialize()) {
-    std::cerr << "Failed to initialize LLM" << std::endl;
+  const auto start_time = std::chrono::steady_clock::now();
+  auto elapsed_ms = [](std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - since)
+        .count();
+  };
+  if (m_Config.prefetch_weights) {
+    LlamaHandler::prefetch_file(m_Config.model_path);
+  }
+  auto specs = ModelRegistry::specs_from_config(m_Config);
+  for (const auto &spec : specs) {
+    ModelRoute route;
+    if (!PromptBuilder::parse_format(spec.prompt_format, route.format)) {
+      std::cerr << "Unknown prompt format for model '" << spec.name
+                << "': " << spec.prompt_format << std::endl;
+      return false;
+    }
+    route.prompts = std::make_unique<PromptBuilder>();
+    m_Routes.emplace(spec.name, std::move(route));
+  }
+  // Serve /health while loading so orchestration sees "starting" rather than
+  // a refused connection. Other routes answer 503 until ready. A shard
+  // worker does the same on its socket instead.
+  if (!m_Config.shard_socket.empty()) {
+    m_ShardListener = std::make_unique<ShardListener>(
+        m_Config.shard_socket,
+        [this](const ShardFrame &frame) { return handle_shard_frame(frame); });
+    if (!m_ShardListener->start()) {
+      return false;
+    }
+  } else {
+    http::ServerConfig http_cfg;
+    http_cfg.is_multithreaded = m_Config.worker_threads > 1;
+    http_cfg.port = m_Config.port;
+    m_HttpServer = std::make_unique<http::Server>(http_cfg);
+    std::vector<int> http_cpus;
+    if (!resolve_cpu_set(m_Config.cpus_http, http_cpus)) {
+      std::cerr << "Invalid HTTP CPU set: " << m_Config.cpus_http
+                << std::endl;
+      return false;
+    }
+    // Worker threads inherit the affinity of the thread that creates them.
+    std::vector<int> previous_cpus;
+    const bool pinned =
+        !http_cpus.empty() && pin_current_thread(http_cpus, &previous_cpus);
+    m_HttpServer->start();
+    if (pinned) {
+      pin_current_thread(previous_cpus);
+    }
+    setup_routes();
+  }
+  auto fail = [this](const char *message) {
+    std::cerr << message << std::endl;
+    if (m_HttpServer) {
+      m_HttpServer->stop();
+    }
+    if (m_ShardListener) {
+      m_ShardListener->stop();
+    }
     return false;
+  };
+  if (m_Config.response_cache) {
+    m_ResponseCache = std::make_unique<ResponseCache>(
+        m_Config.response_cache_threshold,
+        std::chrono::seconds(m_Config.response_cache_ttl_s),
+        static_cast<size_t>(m_Config.response_cache_max_per_user));
+    m_Coalescer = std::make_unique<RequestCoalescer>();
+  }
+  if (!m_Config.trace_path.empty()) {
+    m_Tracer = std::make_unique<Tracer>(
+        m_Config.trace_sample_rate, m_Config.trace_slow_ms,
+        static_cast<size_t>(std::max(m_Config.trace_buffer, 1)));
+  }
+  m_Models = std::make_unique<ModelRegistry>(
+      std::move(specs), m_Config.model_memory_budget_mb * 1024 * 1024,
+      ModelRegistry::make_loader(m_Config));
+  // The memory database only needs the embedding size and vocabulary, which
+  // the GGUF header provides, so it loads while the weights do.
+  ModelInfo info;
+  std::future<bool> memory_ready;
+  if (LlamaHandler::read_model_info(m_Config.model_path, info)) {
+    m_Config.embedding_dim = info.n_embd;
+    m_Startup.parallel = true;
+    memory_ready = std::async(std::launch::async, [this, &info]() {
+      return initialize_memory(info.n_vocab);
+    });
+  }
+  const auto model_start = std::chrono::steady_clock::now();
+  const bool model_ok = m_Models->initialize();
+  m_Startup.model_ms = elapsed_ms(model_start);
+  const bool memory_ok = memory_ready.valid() ? memory_ready.get() : true;
+  if (!model_ok) {
+    return fail("Failed to initialize LLM");
+  }
+  m_Llama = m_Models->default_model();
+  if (!m_Startup.parallel) {
+    m_Config.embedding_dim = m_Llama->get_embedding_dim();
+    if (!initialize_memory(m_Llama->get_vocab_size())) {
+      return fail("Failed to initialize memory database");
+    }
+  } else if (!memory_ok) {
+    return fail("Failed to initialize memory database");
+  } else if (m_Llama->get_embedding_dim() != m_Config.embedding_dim ||
+             m_Llama->get_vocab_size() != info.n_vocab) {
+    return fail("Model metadata does not match the loaded model");
+  }
+  if (!m_Config.capture_path.empty()) {
+    // The memory state at capture start lets a replay begin from the same
+    // retrieval results.
+    CaptureHeader header;
+    header.started_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::system_clock::now().time_since_epoch())
+                            .count();
+    header.model_path = m_Config.model_path;
+    header.memory_snapshot = m_Config.capture_path + ".memory";
+    m_Capture = std::make_unique<TrafficCapture>();
+    if (!m_MemoryDb->save_snapshot(header.memory_snapshot) ||
+        !m_Capture->open(m_Config.capture_path, header)) {
+      return fail("Failed to start traffic capture");
+    }
+    std::cout << "Capturing /chat traffic to " << m_Config.capture_path
+              << std::endl;
   }
-  m_Config.embedding_dim = m_Llama->get_embedding_dim();
+  m_Startup.warm_state = restore_warm_state();
+  if (m_Config.warm_up) {
+    const auto warm_up_start = std::chrono::steady_clock::now();
+    warm_up();
+    m_Startup.warm_up_ms = elapsed_ms(warm_up_start);
+  }
+  if (m_Config.memory_consolidation) {
+    ConsolidationOptions options;
+    options.idle_for =
+        std::chrono::seconds(std::max(m_Config.consolidate_idle_s, 1));
+    options.min_age_s =
+        static_cast<int64_t>(m_Config.consolidate_min_age_h) * 3600;
+    options.similarity = m_Config.consolidate_similarity;
+    options.min_cluster =
+        static_cast<size_t>(std::max(m_Config.consolidate_min_cluster, 2));
+    options.max_cluster = static_cast<size_t>(
+        std::max(m_Config.consolidate_max_cluster,
+                 m_Config.consolidate_min_cluster));
+    m_Consolidator = std::make_unique<MemoryConsolidator>(
+        *m_MemoryDb, options,
+        [this](const MemoryCluster &cluster,
+               const MemoryConsolidator::KeepGoing &keep_going) {
+          return summarize_memories(cluster, keep_going);
+        },
+        [this](MemoryEntry &entry) {
+          entry.tokens = m_Llama->tokenize(entry.text, false, false);
+          return m_Llama->get_embedding(entry.text);
+        },
+        [this] { return m_InFlight == 0; });
+    m_Consolidator->start();
+  }
+  m_Startup.total_ms = elapsed_ms(start_time);
+  m_Ready = true;
+  std::cout << "Server initialization complete in " << m_Startup.total_ms
+            << "ms (model " << m_Startup.model_ms << "ms, memory "
+            << m_Startup.memory_ms << "ms"
+            << (m_Startup.parallel ? " in parallel" : "") << ", warm-up "
+            << m_Startup.warm_up_ms << "ms"
+            << (m_Startup.warm_state ? ", warm state restored" : "") << ")"
+            << std::endl;
+  return true;
+}
+
+MemoryDatabaseOptions SolusServer::memory_options(const ServerConfig &config,
+                                                 int vocab_size) {
+  MemoryDatabaseOptions options;
+  options.brute_force_threshold =
+      static_cast<size_t>(config.memory_brute_force_threshold);
+  options.dedup_threshold = config.memory_dedup_threshold;
+  options.hnsw_m = static_cast<size_t>(config.hnsw_m);
+  options.hnsw_ef_construction =
+      static_cast<size_t>(config.hnsw_ef_construction);
+  options.hnsw_ef_search = static_cast<size_t>(config.hnsw_ef_search);
+  options.background_indexing = config.memory_background_index;
+  options.mmap_storage = config.memory_mmap;
+  options.ivf_pq = config.memory_index == "ivfpq";
+  options.ivf.nlist = static_cast<size_t>(config.ivf_nlist);
+  options.ivf.m = static_cast<size_t>(config.ivf_m);
+  options.ivf.nprobe = static_cast<size_t>(config.ivf_nprobe);
+  options.ivf.rerank = static_cast<size_t>(config.ivf_rerank);
+  options.tokenizer_id =
+      std::filesystem::path(config.model_path).filename().string() + ":" +
+      std::to_string(vocab_size);
+  return options;
+}
+
+bool SolusServer::initialize_memory(int vocab_size) {
+  const auto start_time = std::chrono::steady_clock::now();
   m_MemoryDb = std::make_unique<MemoryDatabase>(
-      m_Config.memory_db_path, m_Config.embedding_dim, m_Config.max_memories);
-  if (!m_MemoryDb->initialize()) {
-    std::cerr << "Failed to initialize memory database" << std::endl;
+      m_Config.memory_db_path, m_Config.embedding_dim, m_Config.max_memories,
+      memory_options(m_Config, vocab_size));
+  const bool ok = m_MemoryDb->initialize();
+  m_Startup.memory_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - start_time)
+                            .count();
+  return ok;
+}
+
+void SolusServer::warm_up() {
+  // Touches the weights and fills the KV cache with the system prompt, which
+  // generate reuses as a prefix for the first real request.
+  m_Llama->get_embedding("warm up");
+  const auto &route = m_Routes.at(m_Models->default_name());
+  auto tokenize = [this](const std::string &str, bool add_special,
+                         bool parse_special) {
+    return m_Llama->tokenize(str, add_special, parse_special);
+  };
+  auto prompt = route.prompts->build_chat_tokens(
+      "", {}, route.format, tokenize,
+      m_Llama->get_context_size() - m_Config.max_tokens);
+  if (!prompt.fits) {
+    return;
+  }
+  GenerationParams params;
+  params.max_tokens = 1;
+  m_Llama->generate(prompt.tokens, params);
+}
+
+nlohmann::json SolusServer::warm_state_identity() const {
+  // KV state is only meaningful for the exact weights and cache layout.
+  std::error_code size_ec;
+  std::error_code time_ec;
+  const auto size = std::filesystem::file_size(m_Config.model_path, size_ec);
+  const auto mtime =
+      std::filesystem::last_write_time(m_Config.model_path, time_ec);
+  return {{"version", 1},
+          {"model_path", m_Config.model_path},
+          {"model_size", size_ec ? 0 : size},
+          {"model_mtime", time_ec ? 0 : mtime.time_since_epoch().count()},
+          {"n_ctx", m_Config.n_ctx},
+          {"cache_type_k", m_Config.cache_type_k},
+          {"cache_type_v", m_Config.cache_type_v}};
+}
+
+bool SolusServer::restore_warm_state() {
+  if (m_Config.warm_state_dir.empty()) {
     return false;
   }
-  m_PromptBuilder = std::make_unique<PromptBuilder>();
-  http::ServerConfig http_cfg;
-  http_cfg.is_multithreaded = m_Config.worker_threads > 1;
-  http_cfg.port = m_Config.port;
-  m_HttpServer = std::make_unique<http::Server>(http_cfg);
-  m_HttpServer->start();
-  setup_routes();
-  std::cout << "Server initialization complete!" << std::endl;
-  return true;
+  const std::filesystem::path dir(m_Config.warm_state_dir);
+  std::ifstream in(dir / "manifest.json");
+  if (!in) {
+    return false;
+  }
+  json manifest;
+  try {
+    manifest = json::parse(in);
+  } catch (const json::exception &e) {
+    std::cerr << "Ignoring unreadable warm state: " << e.what() << std::endl;
+    return false;
+  }
+  for (const auto &[key, value] : warm_state_identity().items()) {
+    if (!manifest.contains(key) || manifest[key] != value) {
+      std::cout << "Warm state was saved for a different model or "
+                   "configuration; starting cold"
+                << std::endl;
+      return false;
+    }
+  }
+  bool restored = false;
+  if (manifest.value("prefix_kv", false) &&
+      m_Llama->load_prefix_state((dir / "prefix.kv").string())) {
+    restored = true;
+  }
+  if (m_ResponseCache && manifest.value("response_cache", false) &&
+      m_ResponseCache->load((dir / "response_cache.bin").string())) {
+    restored = true;
+  }
+  return restored;
+}
+
+void SolusServer::save_warm_state() {
+  if (m_Config.warm_state_dir.empty() || !m_Llama) {
+    return;
+  }
+  const std::filesystem::path dir(m_Config.warm_state_dir);
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  // The manifest is removed first and written last, so an interrupted save
+  // leaves no manifest rather than one describing partial files.
+  std::filesystem::remove(dir / "manifest.json", ec);
+  json manifest = warm_state_identity();
+  manifest["prefix_kv"] =
+      m_Llama->save_prefix_state((dir / "prefix.kv").string());
+  manifest["response_cache"] =
+      m_ResponseCache != nullptr &&
+      m_ResponseCache->save((dir / "response_cache.bin").string());
+  std::ofstream out(dir / "manifest.json");
+  if (!(out << manifest.dump(2))) {
+    std::cerr << "Failed to save warm state to " << dir << std::endl;
+    return;
+  }
+  std::cout << "Saved warm state to " << dir << std::endl;
+}
+
+http::Response SolusServer::unavailable_response(const char *status) const {
+  json error = {{"status", status}};
+  http::Response res;
+  res.status_code = 503;
+  res.body = error.dump();
+  res.headers.set("Content-Type", "application/json");
+  return res;
 }
 
 void SolusServer::setup_routes() {
@@ -54,13 +390,53 @@ void SolusServer::setup_routes() {
                       [this](const http::Request &req) {
                         return this->handle_memory_clear(req);
                       });
+  m_HttpServer->route("/memory/import", http::EMethod::POST,
+                      [this](const http::Request &req) {
+                        return this->handle_memory_import(req);
+                      });
+  m_HttpServer->route("/traces/dump", http::EMethod::POST,
+                      [this](const http::Request &req) {
+                        return this->handle_traces_dump(req);
+                      });
 }
 
 http::Response SolusServer::handle_health(const http::Request &req) {
+  if (!m_Ready) {
+    return unavailable_response("starting");
+  }
+  if (m_Draining) {
+    return unavailable_response("draining");
+  }
+  json models = json::array();
+  for (const auto &model : m_Models->status()) {
+    models.push_back({{"name", model.name},
+                      {"loaded", model.loaded},
+                      {"pinned", model.pinned},
+                      {"size_bytes", model.size_bytes}});
+  }
   json response = {{"status", "healthy"},
+                   {"ready", true},
                    {"model_loaded", m_Llama->is_initialized()},
+                   {"models", models},
                    {"memory_count", m_MemoryDb->get_entry_count()},
-                   {"embedding_dim", m_Config.embedding_dim}};
+                   {"memory_pending", m_MemoryDb->get_pending_count()},
+                   {"embedding_dim", m_Config.embedding_dim},
+                   {"startup",
+                    {{"model_ms", m_Startup.model_ms},
+                     {"memory_ms", m_Startup.memory_ms},
+                     {"warm_up_ms", m_Startup.warm_up_ms},
+                     {"total_ms", m_Startup.total_ms},
+                     {"parallel", m_Startup.parallel},
+                     {"warm_state", m_Startup.warm_state}}}};
+  if (const AdapterCache *adapters = m_Llama->adapters()) {
+    response["adapters"] = {{"loaded", adapters->loaded()},
+                            {"bytes", adapters->loaded_bytes()}};
+  }
+  if (m_Consolidator) {
+    response["consolidation"] = {
+        {"summaries", m_Consolidator->consolidated()},
+        {"replaced", m_Consolidator->replaced()}};
+  }
   http::Response res;
   res.status_code = 200;
   res.body = response.dump();
@@ -69,6 +445,33 @@ http::Response SolusServer::handle_health(const http::Request &req) {
 }
 
 http::Response SolusServer::handle_chat(const http::Request &req) {
+  if (!m_Ready) {
+    return unavailable_response("starting");
+  }
+  InFlightGuard in_flight(m_InFlight, m_Consolidator.get());
+  if (m_Draining) {
+    return unavailable_response("draining");
+  }
+  RequestTrace trace(m_Tracer.get());
+  http::Response res;
+  if (!m_Capture) {
+    res = process_chat(req, nullptr);
+  } else {
+    CaptureRecord record;
+    record.arrival_ms = m_Capture->elapsed_ms();
+    res = process_chat(req, &record);
+    record.status = res.status_code;
+    record.latency_ms = m_Capture->elapsed_ms() - record.arrival_ms;
+    m_Capture->write(record);
+  }
+  if (trace.active()) {
+    res.headers.set("X-Trace-Id", trace.id_string());
+  }
+  return res;
+}
+
+http::Response SolusServer::process_chat(const http::Request &req,
+                                         CaptureRecord *capture) {
   auto start_time = std::chrono::high_resolution_clock::now();
   try {
     json body = json::parse(req.body);
@@ -76,40 +479,181 @@ http::Response SolusServer::handle_chat(const http::Request &req) {
     std::string user_id = body["user_id"].get<std::string>();
     std::string conversation_id = body.value(
         "conversation_id", user_id + "_" + std::to_string(std::time(nullptr)));
-    auto query_embedding = m_Llama->get_embedding(text);
-    if (query_embedding.empty()) {
-      throw std::runtime_error("Failed to generate embedding");
-    }
-    auto memories = m_MemoryDb->search_entries(query_embedding, user_id, 5);
-    std::string prompt = m_PromptBuilder->build_chat_prompt(
-        text, memories, PromptBuilder::EPromptFormat::QWEN);
-    GenerationParams gen_params;
-    gen_params.temperature = m_Config.temperature;
-    gen_params.top_p = m_Config.top_p;
-    gen_params.top_k = m_Config.top_k;
-    gen_params.max_tokens = m_Config.max_tokens;
-    gen_params.repeat_last_n = m_Config.repeat_last_n;
-    gen_params.repeat_penalty = m_Config.repeat_penalty;
-    std::string response_text = m_Llama->generate(prompt, gen_params);
-    if (response_text.empty()) {
-      throw std::runtime_error("Empty response from LLM");
-    }
-    auto parsed = ResponseParser::parse_response(response_text);
-    MemoryEntry new_memory(user_id, conversation_id,
-                           "User: " + text + "\nSolus: " + parsed.response,
-                           std::time(nullptr));
-    m_MemoryDb->add_entry(new_memory, query_embedding);
-    json result = {{"action", parsed.action.empty()
-                                  ? nullptr
-                                  : json::parse(parsed.action)},
+    std::string model_name =
+        body.value("model", m_Models->default_name());
+    const bool use_cache = body.value("cache", true);
+    // LLAMA_DEFAULT_SEED samples a fresh random seed; a capture needs the
+    // concrete value to replay it.
+    uint32_t seed = body.value("seed", LLAMA_DEFAULT_SEED);
+    if (capture && seed == LLAMA_DEFAULT_SEED) {
+      seed = std::random_device{}();
+    }
+    if (capture) {
+      capture->user_id = user_id;
+      capture->conversation_id = conversation_id;
+      capture->model = model_name;
+      capture->text = text;
+      capture->seed = seed;
+      capture->use_cache = use_cache;
+    }
+    auto route = m_Routes.find(model_name);
+    if (route == m_Routes.end()) {
+      json error = {{"error", "Unknown model: " + model_name}};
+      http::Response res;
+      res.status_code = 400;
+      res.body = error.dump();
+      res.headers.set("Content-Type", "application/json");
+      return res;
+    }
+    auto llm = m_Models->acquire(model_name);
+    if (!llm) {
+      json error = {{"error", "Model unavailable: " + model_name}};
+      http::Response res;
+      res.status_code = 503;
+      res.body = error.dump();
+      res.headers.set("Content-Type", "application/json");
+      return res;
+    }
+    // Runs retrieval, generation and the memory write for this turn.
+    bool cached = false;
+    auto produce = [&]() -> ParsedResponse {
+      TraceSpan embed_span("embed");
+      auto query_embedding = m_Llama->get_embedding(text);
+      embed_span.end();
+      if (query_embedding.empty()) {
+        throw std::runtime_error("Failed to generate embedding");
+      }
+      if (m_ResponseCache && use_cache) {
+        TraceSpan lookup_span("cache.lookup");
+        if (auto hit = m_ResponseCache->lookup(user_id, model_name,
+                                               query_embedding)) {
+          cached = true;
+          ParsedResponse reply;
+          reply.response = std::move(*hit);
+          return reply;
+        }
+      }
+      TraceSpan search_span("memory.search");
+      auto memories = m_MemoryDb->search_entries(query_embedding, user_id, 5);
+      search_span.end();
+      if (llm != m_Llama) {
+        // Stored memory tokens belong to the default model's vocabulary.
+        for (auto &mem : memories) {
+          mem.tokens = {};
+        }
+      }
+      auto tokenize = [&llm](const std::string &str, bool add_special,
+                             bool parse_special) {
+        return llm->tokenize(str, add_special, parse_special);
+      };
+      // Leave room in the context for the full reply.
+      TraceSpan prompt_span("prompt.build");
+      auto prompt = route->second.prompts->build_chat_tokens(
+          text, memories, route->second.format, tokenize,
+          llm->get_context_size() - m_Config.max_tokens);
+      prompt_span.set_count(static_cast<int64_t>(prompt.tokens.size()));
+      prompt_span.end();
+      if (!prompt.fits) {
+        throw BadRequest("System prompt does not fit the context");
+      }
+      if (prompt.truncated) {
+        std::cerr << "User message truncated to fit the context"
+                  << std::endl;
+      }
+      GenerationParams gen_params;
+      gen_params.temperature = m_Config.temperature;
+      gen_params.top_p = m_Config.top_p;
+      gen_params.top_k = m_Config.top_k;
+      gen_params.max_tokens = m_Config.max_tokens;
+      gen_params.repeat_last_n = m_Config.repeat_last_n;
+      gen_params.repeat_penalty = m_Config.repeat_penalty;
+      gen_params.n_keep = static_cast<int>(prompt.n_keep);
+      gen_params.seed = seed;
+      gen_params.adapter = user_id;
+      ResponseStreamParser stream;
+      if (m_Config.verbose) {
+        stream.on_action([&start_time](const json &action) {
+          auto elapsed =
+              std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::high_resolution_clock::now() - start_time)
+                  .count();
+          std::cout << "Action " << ResponseParser::action_type(action)
+                    << " ready after " << elapsed << "ms" << std::endl;
+        });
+      }
+      TraceSpan generate_span("generate");
+      std::string response_text = llm->generate(
+          prompt.tokens, gen_params, [this, &stream](std::string_view piece) {
+            stream.feed(piece);
+            return !m_Abort;
+          });
+      if (m_Abort) {
+        throw std::runtime_error("Server is shutting down");
+      }
+      if (response_text.empty()) {
+        throw std::runtime_error("Empty response from LLM");
+      }
+      auto parsed = stream.finish();
+      generate_span.end();
+      if (m_ResponseCache && use_cache) {
+        m_ResponseCache->insert(user_id, model_name, query_embedding, parsed);
+      }
+      TraceSpan insert_span("memory.insert");
+      MemoryEntry new_memory(user_id, conversation_id,
+                             "User: " + text + "\nSolus: " + parsed.response,
+                             std::time(nullptr));
+      new_memory.tokens = m_Llama->tokenize(new_memory.text, false, false);
+      m_MemoryDb->enqueue_entry(new_memory, query_embedding);
+      return parsed;
+    };
+    ParsedResponse parsed;
+    bool coalesced = false;
+    if (m_Coalescer && use_cache) {
+      // An explicit seed asks for that sample, so it is part of the key.
+      const std::string key =
+          user_id + '\n' + model_name + '\n' +
+          (body.contains("seed") ? std::to_string(seed) : "") + '\n' + text;
+      auto ticket = m_Coalescer->join(key);
+      if (ticket.leader) {
+        try {
+          parsed = produce();
+        } catch (...) {
+          m_Coalescer->fail(key, std::current_exception());
+          throw;
+        }
+        m_Coalescer->complete(key, parsed);
+      } else {
+        TraceSpan wait_span("coalesce.wait");
+        parsed = ticket.result.get();
+        wait_span.end();
+        coalesced = parsed.action.is_null();
+        if (!coalesced) {
+          // Like the response cache, never replay an action: this request
+          // gets a generation of its own.
+          parsed = produce();
+        }
+      }
+    } else {
+      parsed = produce();
+    }
+    if (capture) {
+      capture->response = parsed.response;
+      capture->action = parsed.action;
+    }
+    json result = {{"action", std::move(parsed.action)},
                    {"response", parsed.response},
-                   {"conversation_id", conversation_id}};
+                   {"conversation_id", conversation_id},
+                   {"model", model_name},
+                   {"cached", cached || coalesced}};
     auto end_time = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
                         end_time - start_time)
                         .count();
     if (m_Config.verbose) {
       std::cout << "Chat request processed in " << duration << "ms"
+                << (cached      ? " (cached)"
+                    : coalesced ? " (coalesced)"
+                                : "")
                 << std::endl;
     }
     http::Response res;
@@ -125,6 +669,13 @@ http::Response SolusServer::handle_chat(const http::Request &req) {
     res.body = error.dump();
     res.headers.set("Content-Type", "application/json");
     return res;
+  } catch (const BadRequest &e) {
+    json error = {{"error", e.what()}};
+    http::Response res;
+    res.status_code = 400;
+    res.body = error.dump();
+    res.headers.set("Content-Type", "application/json");
+    return res;
   } catch (const std::exception &e) {
     std::cerr << "Error processing chat: " << e.what() << std::endl;
     json error = {{"error", e.what()}};
@@ -136,6 +687,51 @@ http::Response SolusServer::handle_chat(const http::Request &req) {
   }
 }
 
+std::optional<std::string> SolusServer::summarize_memories(
+    const MemoryCluster &cluster,
+    const MemoryConsolidator::KeepGoing &keep_going) {
+  const ModelRoute &route = m_Routes.at(m_Models->default_name());
+  std::vector<MemoryView> memories(cluster.texts.size());
+  for (size_t i = 0; i < cluster.texts.size(); i++) {
+    memories[i].user_id = cluster.user_id;
+    memories[i].text = cluster.texts[i];
+  }
+  auto tokenize = [this](const std::string &str, bool add_special,
+                         bool parse_special) {
+    return m_Llama->tokenize(str, add_special, parse_special);
+  };
+  auto prompt = route.prompts->build_chat_tokens(
+      kConsolidationRequest, memories, route.format, tokenize,
+      m_Llama->get_context_size() - m_Config.max_tokens);
+  if (!prompt.fits || prompt.memories_used < cluster.texts.size()) {
+    return std::nullopt; // a summary must not drop members it never saw
+  }
+  GenerationParams params;
+  params.temperature = 0.2f;
+  params.top_p = m_Config.top_p;
+  params.top_k = m_Config.top_k;
+  params.max_tokens = m_Config.max_tokens;
+  params.repeat_last_n = m_Config.repeat_last_n;
+  params.repeat_penalty = m_Config.repeat_penalty;
+  params.n_keep = static_cast<int>(prompt.n_keep);
+  ResponseStreamParser stream;
+  bool cancelled = false;
+  m_Llama->generate(prompt.tokens, params,
+                    [&](std::string_view piece) {
+                      stream.feed(piece);
+                      cancelled = cancelled || !keep_going() || m_Abort;
+                      return !cancelled;
+                    });
+  if (cancelled) {
+    return std::nullopt;
+  }
+  ParsedResponse parsed = stream.finish();
+  if (!parsed.action.is_null() || parsed.response.empty()) {
+    return std::nullopt;
+  }
+  return parsed.response;
+}
+
 http::Response SolusServer::handle_memory_clear(const http::Request &) {
   json response = {{"status", "Memory clearing not implemented yet"},
                    {"message", "Feature coming soon"}};
@@ -146,20 +742,342 @@ http::Response SolusServer::handle_memory_clear(const http::Request &) {
   return res;
 }
 
+http::Response SolusServer::handle_memory_import(const http::Request &req) {
+  if (!m_Ready) {
+    return unavailable_response("starting");
+  }
+  InFlightGuard in_flight(m_InFlight, m_Consolidator.get());
+  if (m_Draining) {
+    return unavailable_response("draining");
+  }
+  // Body is NDJSON, one {user_id, conversation_id, text, timestamp} per line.
+  // Lines are consumed in place and flushed in batches: texts are embedded
+  // together and HNSW inserts run in parallel.
+  constexpr size_t kMaxReportedErrors = 100;
+  auto start_time = std::chrono::high_resolution_clock::now();
+  const size_t batch_size =
+      static_cast<size_t>(std::max(1, m_Config.import_batch_size));
+  std::vector<MemoryEntry> batch;
+  std::vector<std::string> texts;
+  std::vector<size_t> batch_lines;
+  batch.reserve(batch_size);
+  texts.reserve(batch_size);
+  size_t total = 0, added = 0, merged = 0, failed = 0;
+  json errors = json::array();
+  auto record_error = [&](size_t line, const std::string &message) {
+    failed++;
+    if (errors.size() < kMaxReportedErrors) {
+      errors.push_back({{"line", line}, {"error", message}});
+    }
+  };
+  auto flush = [&]() {
+    if (batch.empty()) {
+      return;
+    }
+    auto embeddings = m_Llama->get_embeddings(texts);
+    auto results =
+        m_MemoryDb->add_entries(batch, embeddings, m_Config.import_threads);
+    for (size_t i = 0; i < results.size(); i++) {
+      switch (results[i]) {
+      case MemoryDatabase::EInsertResult::ADDED:
+        added++;
+        break;
+      case MemoryDatabase::EInsertResult::MERGED:
+        merged++;
+        break;
+      case MemoryDatabase::EInsertResult::FAILED:
+        record_error(batch_lines[i], embeddings[i].empty()
+                                         ? "Failed to generate embedding"
+                                         : "Failed to add memory to index");
+        break;
+      }
+    }
+    batch.clear();
+    texts.clear();
+    batch_lines.clear();
+    if (m_Config.verbose) {
+      std::cout << "Memory import: " << total << " records (" << added
+                << " added, " << merged << " merged, " << failed
+                << " failed)" << std::endl;
+    }
+  };
+  std::string_view body(req.body);
+  size_t line_no = 0;
+  bool aborted = false;
+  while (!body.empty()) {
+    // Checked between batches, so every line up to line_no is stored.
+    if (batch.empty() && m_Abort) {
+      aborted = true;
+      break;
+    }
+    size_t eol = body.find('\n');
+    std::string_view line = body.substr(0, eol);
+    body.remove_prefix(eol == std::string_view::npos ? body.size() : eol + 1);
+    line_no++;
+    while (!line.empty() &&
+           std::isspace(static_cast<unsigned char>(line.back()))) {
+      line.remove_suffix(1);
+    }
+    if (line.empty()) {
+      continue;
+    }
+    total++;
+    try {
+      json record = json::parse(line.begin(), line.end());
+      if (!record.contains("user_id") || !record.contains("text")) {
+        record_error(line_no, "Missing user_id or text");
+        continue;
+      }
+      MemoryEntry entry(record["user_id"].get<std::string>(),
+                        record.value("conversation_id", std::string()),
+                        record["text"].get<std::string>(),
+                        record.value("timestamp",
+                                     static_cast<int64_t>(std::time(nullptr))));
+      if (entry.conversation_id.empty()) {
+        entry.conversation_id = entry.user_id + "_import";
+      }
+      entry.tokens = m_Llama->tokenize(entry.text, false, false);
+      texts.push_back(entry.text);
+      batch.push_back(std::move(entry));
+      batch_lines.push_back(line_no);
+    } catch (const json::exception &e) {
+      record_error(line_no, e.what());
+      continue;
+    }
+    if (batch.size() >= batch_size) {
+      flush();
+    }
+  }
+  if (aborted) {
+    http::Response res = unavailable_response("draining");
+    res.body = json({{"status", "draining"},
+                     {"lines_done", line_no},
+                     {"added", added},
+                     {"merged", merged},
+                     {"failed", failed}})
+                   .dump();
+    return res;
+  }
+  flush();
+  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::high_resolution_clock::now() - start_time)
+                      .count();
+  json response = {{"total", total},       {"added", added},
+                   {"merged", merged},     {"failed", failed},
+                   {"errors", errors},     {"duration_ms", duration},
+                   {"memory_count", m_MemoryDb->get_entry_count()}};
+  http::Response res;
+  res.status_code = 200;
+  res.body = response.dump();
+  res.headers.set("Content-Type", "application/json");
+  return res;
+}
+
+http::Response SolusServer::handle_traces_dump(const http::Request &) {
+  http::Response res;
+  res.headers.set("Content-Type", "application/json");
+  if (!m_Tracer) {
+    res.status_code = 404;
+    res.body = json({{"error", "Tracing is disabled"}}).dump();
+    return res;
+  }
+  const size_t kept = m_Tracer->kept();
+  if (!m_Tracer->dump(m_Config.trace_path)) {
+    res.status_code = 500;
+    res.body = json({{"error", "Failed to write traces"}}).dump();
+    return res;
+  }
+  res.status_code = 200;
+  res.body = json({{"path", m_Config.trace_path}, {"traces", kept}}).dump();
+  return res;
+}
+
+ShardFrame SolusServer::handle_shard_frame(const ShardFrame &frame) {
+  auto reply_with = [](const http::Response &res) {
+    ShardFrame reply;
+    reply.status = static_cast<uint16_t>(res.status_code);
+    reply.body = res.body;
+    return reply;
+  };
+  http::Request req;
+  req.body = frame.body;
+  switch (frame.op) {
+  case EShardOp::CHAT:
+    return reply_with(handle_chat(req));
+  case EShardOp::IMPORT:
+    return reply_with(handle_memory_import(req));
+  case EShardOp::HEALTH:
+    return reply_with(handle_health(req));
+  case EShardOp::EXPORT_USER:
+  case EShardOp::IMPORT_USER:
+  case EShardOp::DROP_USER:
+    break;
+  default: {
+    ShardFrame reply;
+    reply.status = 400;
+    reply.body = json({{"error", "Unsupported shard operation"}}).dump();
+    return reply;
+  }
+  }
+  if (!m_Ready) {
+    return reply_with(unavailable_response("starting"));
+  }
+  InFlightGuard in_flight(m_InFlight, m_Consolidator.get());
+  if (m_Draining) {
+    return reply_with(unavailable_response("draining"));
+  }
+  if (frame.op == EShardOp::EXPORT_USER) {
+    return handle_user_export(frame.user_id);
+  }
+  if (frame.op == EShardOp::IMPORT_USER) {
+    return handle_user_import(frame.body);
+  }
+  ShardFrame reply;
+  reply.status = 200;
+  reply.body =
+      json({{"removed", m_MemoryDb->remove_user(frame.user_id)}}).dump();
+  return reply;
+}
+
+ShardFrame SolusServer::handle_user_export(const std::string &user_id) {
+  // NDJSON with the stored vectors, so the receiving shard does not have to
+  // embed the texts again.
+  ShardFrame reply;
+  reply.status = 200;
+  for (const auto &[entry, vec] : m_MemoryDb->export_user(user_id)) {
+    json record = {{"user_id", entry.user_id},
+                   {"conversation_id", entry.conversation_id},
+                   {"text", entry.text},
+                   {"timestamp", entry.timestamp},
+                   {"hit_count", entry.hit_count},
+                   {"tokens", entry.tokens},
+                   {"embedding", vec}};
+    reply.body += record.dump();
+    reply.body.push_back('\n');
+  }
+  return reply;
+}
+
+ShardFrame SolusServer::handle_user_import(const std::string &body) {
+  std::vector<MemoryEntry> entries;
+  std::vector<std::vector<float>> embeddings;
+  ShardFrame reply;
+  std::string_view rest(body);
+  try {
+    while (!rest.empty()) {
+      const size_t eol = rest.find('\n');
+      std::string_view line = rest.substr(0, eol);
+      rest.remove_prefix(eol == std::string_view::npos ? rest.size()
+                                                       : eol + 1);
+      if (line.empty()) {
+        continue;
+      }
+      json record = json::parse(line.begin(), line.end());
+      MemoryEntry entry(record.at("user_id").get<std::string>(),
+                        record.at("conversation_id").get<std::string>(),
+                        record.at("text").get<std::string>(),
+                        record.at("timestamp").get<int64_t>());
+      entry.hit_count = record.value("hit_count", 1u);
+      entry.tokens = record.value("tokens", std::vector<int32_t>());
+      entries.push_back(std::move(entry));
+      embeddings.push_back(record.at("embedding").get<std::vector<float>>());
+    }
+  } catch (const json::exception &e) {
+    reply.status = 400;
+    reply.body = json({{"error", e.what()}}).dump();
+    return reply;
+  }
+  auto results =
+      m_MemoryDb->add_entries(entries, embeddings, m_Config.import_threads);
+  const auto failed =
+      std::count(results.begin(), results.end(),
+                 MemoryDatabase::EInsertResult::FAILED);
+  reply.status = failed == 0 ? 200 : 500;
+  reply.body = json({{"imported", results.size() - failed},
+                     {"failed", failed}})
+                   .dump();
+  return reply;
+}
+
 void SolusServer::run() {
+  if (m_ShardListener) {
+    std::cout << "Serving shard on " << m_Config.shard_socket << std::endl;
+    std::unique_lock<std::mutex> lock(m_StopMutex);
+    m_StopCv.wait(lock, [this] { return m_Stopped.load(); });
+    return;
+  }
   std::cout << "Starting server on " << m_Config.host << ":" << m_Config.port
             << std::endl;
+  std::vector<int> http_cpus;
+  if (resolve_cpu_set(m_Config.cpus_http, http_cpus) && !http_cpus.empty()) {
+    pin_current_thread(http_cpus);
+  }
   m_HttpServer->run();
 }
 
+void SolusServer::shutdown() {
+  if (m_Draining.exchange(true)) {
+    return;
+  }
+  std::cout << "Draining " << m_InFlight << " in-flight requests..."
+            << std::endl;
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::seconds(m_Config.drain_grace_s);
+  while (m_InFlight > 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  if (m_InFlight > 0) {
+    std::cerr << "Grace period expired; stopping " << m_InFlight
+              << " requests" << std::endl;
+    m_Abort = true;
+    const auto hard_deadline = std::chrono::steady_clock::now() + kAbortWait;
+    while (m_InFlight > 0 && std::chrono::steady_clock::now() < hard_deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    if (m_InFlight > 0) {
+      std::cerr << m_InFlight
+                << " requests have not seen the abort yet; waiting for them"
+                << std::endl;
+    }
+  }
+  stop();
+}
+
 void SolusServer::stop() {
+  if (m_Stopped.exchange(true)) {
+    return;
+  }
   std::cout << "Stopping server..." << std::endl;
   if (m_HttpServer) {
     m_HttpServer->stop();
   }
+  if (m_ShardListener) {
+    m_ShardListener->stop();
+  }
+  // Handlers still use the model and the database; saving or freeing them
+  // has to wait until the last one returns.
+  if (m_InFlight > 0) {
+    m_Abort = true;
+    while (m_InFlight > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+  }
+  if (m_Consolidator) {
+    m_Consolidator->stop();
+  }
   if (m_MemoryDb) {
     m_MemoryDb->save_index();
   }
+  if (m_Ready) {
+    save_warm_state();
+  }
+  if (m_Tracer) {
+    m_Tracer->dump(m_Config.trace_path);
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_StopMutex);
+  }
+  m_StopCv.notify_all();
 }
 
 } // namespace solus
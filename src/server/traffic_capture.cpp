@@ -0,0 +1,98 @@
+#include "server/traffic_capture.h"
+#include <algorithm>
+#include <iostream>
+
+using json = nlohmann::json;
+
+namespace solus {
+
+bool TrafficCapture::open(const std::string &path, CaptureHeader header) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  m_Out.open(path, std::ios::out | std::ios::trunc);
+  if (!m_Out) {
+    std::cerr << "Failed to open capture file: " << path << std::endl;
+    return false;
+  }
+  m_Start = std::chrono::steady_clock::now();
+  json j = {{"version", header.version},
+            {"started_ms", header.started_ms},
+            {"model_path", header.model_path},
+            {"memory_snapshot", header.memory_snapshot}};
+  m_Out << j.dump() << '\n';
+  m_Out.flush();
+  return true;
+}
+
+int64_t TrafficCapture::elapsed_ms() const {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - m_Start)
+      .count();
+}
+
+void TrafficCapture::write(const CaptureRecord &record) {
+  json j = {{"t", record.arrival_ms},    {"user_id", record.user_id},
+            {"conversation_id", record.conversation_id},
+            {"model", record.model},     {"text", record.text},
+            {"seed", record.seed},       {"cache", record.use_cache},
+            {"status", record.status},   {"latency_ms", record.latency_ms},
+            {"response", record.response}, {"action", record.action}};
+  std::string line = j.dump();
+  line.push_back('\n');
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  if (!m_Out) {
+    return;
+  }
+  m_Out << line;
+  m_Out.flush();
+}
+
+bool TrafficCapture::load(const std::string &path, CaptureHeader &header,
+                          std::vector<CaptureRecord> &records) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Failed to open capture file: " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  if (!std::getline(in, line)) {
+    return false;
+  }
+  try {
+    json h = json::parse(line);
+    header.version = h.value("version", 1);
+    header.started_ms = h.value("started_ms", static_cast<int64_t>(0));
+    header.model_path = h.value("model_path", std::string());
+    header.memory_snapshot = h.value("memory_snapshot", std::string());
+    while (std::getline(in, line)) {
+      if (line.empty()) {
+        continue;
+      }
+      json j = json::parse(line);
+      CaptureRecord record;
+      record.arrival_ms = j.value("t", static_cast<int64_t>(0));
+      record.user_id = j.value("user_id", std::string());
+      record.conversation_id = j.value("conversation_id", std::string());
+      record.model = j.value("model", std::string());
+      record.text = j.value("text", std::string());
+      record.seed = j.value("seed", 0u);
+      record.use_cache = j.value("cache", true);
+      record.status = j.value("status", 0);
+      record.latency_ms = j.value("latency_ms", static_cast<int64_t>(0));
+      record.response = j.value("response", std::string());
+      if (j.contains("action")) {
+        record.action = j["action"];
+      }
+      records.push_back(std::move(record));
+    }
+  } catch (const json::exception &e) {
+    std::cerr << "Malformed capture file: " << e.what() << std::endl;
+    return false;
+  }
+  std::stable_sort(records.begin(), records.end(),
+                   [](const CaptureRecord &a, const CaptureRecord &b) {
+                     return a.arrival_ms < b.arrival_ms;
+                   });
+  return true;
+}
+
+} // namespace solus
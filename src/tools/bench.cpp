@@ -0,0 +1,258 @@
+#include "llm/llama_handler.h"
+#include "llm/throughput_bench.h"
+#include "llm/tiny_model.h"
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+
+void print_usage(const char *program_name) {
+  std::cout << "Usage: " << program_name << " [options]\n"
+            << "Measures LlamaHandler throughput on a generated tiny model "
+               "(or --model)\n"
+            << "and optionally fails when it regressed against a baseline.\n"
+            << "Options:\n"
+            << "  --model PATH         Benchmark this GGUF instead of a tiny "
+               "random model\n"
+            << "  --save-model PATH    Keep the generated tiny model here\n"
+            << "  --weight-type T      Tiny model weights: f32, f16, q8_0, "
+               "q4_0, ... (default: q4_0)\n"
+            << "  --embd N             Tiny model embedding size (default: "
+               "256)\n"
+            << "  --layers N           Tiny model layers (default: 4)\n"
+            << "  --threads N          Compute threads (default: all cores)\n"
+            << "  --gpu-layers N       Layers to offload (default: 0)\n"
+            << "  --prompt-tokens N    Prefill prompt length (default: 512)\n"
+            << "  --decode-tokens N    Tokens per decode run (default: 128)\n"
+            << "  --concurrency LIST   Sequences per batch run (default: "
+               "1,2,4,8)\n"
+            << "  --reps N             Timed runs per metric, median kept "
+               "(default: 5)\n"
+            << "  --out FILE           Write results as JSON\n"
+            << "  --baseline FILE      Compare with stored results; exit 2 "
+               "on regression\n"
+            << "  --threshold F        Allowed relative slowdown (default: "
+               "0.10)\n"
+            << "  --compare FILE       Compare FILE with --baseline instead "
+               "of running\n"
+            << "  --help               Show this help message\n";
+}
+
+std::vector<size_t> parse_list(const std::string &arg) {
+  std::vector<size_t> values;
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) {
+      values.push_back(std::stoul(item));
+    }
+  }
+  return values;
+}
+
+bool read_json(const std::string &path, json &out) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Failed to open " << path << std::endl;
+    return false;
+  }
+  try {
+    out = json::parse(in);
+  } catch (const json::exception &e) {
+    std::cerr << "Invalid results in " << path << ": " << e.what()
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Prints the comparison and returns whether anything regressed.
+bool report_regressions(const json &current, const json &baseline,
+                        double threshold) {
+  auto deltas = solus::ThroughputBench::compare(current, baseline, threshold);
+  std::printf("\n%-18s %12s %12s %9s\n", "metric", "baseline", "current",
+              "change");
+  bool regressed = false;
+  for (const auto &delta : deltas) {
+    if (delta.missing) {
+      std::printf("%-18s %12.2f %12s %9s  REGRESSED\n", delta.name.c_str(),
+                  delta.baseline, "missing", "");
+    } else {
+      // Shown as improvement, so slower is negative whatever the unit.
+      std::printf("%-18s %12.2f %12.2f %+8.1f%%%s\n", delta.name.c_str(),
+                  delta.baseline, delta.current, -100.0 * delta.change,
+                  delta.regressed ? "  REGRESSED" : "");
+    }
+    regressed = regressed || delta.regressed;
+  }
+  std::printf("\n%s (threshold %.0f%%)\n",
+              regressed ? "Regression detected" : "No regression",
+              100.0 * threshold);
+  return regressed;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string model_path;
+  std::string save_model;
+  std::string out_path;
+  std::string baseline_path;
+  std::string compare_path;
+  std::string weight_type = "q4_0";
+  double threshold = 0.10;
+  int threads =
+      static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  int gpu_layers = 0;
+  solus::TinyModelSpec spec;
+  solus::BenchOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    } else if (arg == "--model" && i + 1 < argc) {
+      model_path = argv[++i];
+    } else if (arg == "--save-model" && i + 1 < argc) {
+      save_model = argv[++i];
+    } else if (arg == "--weight-type" && i + 1 < argc) {
+      weight_type = argv[++i];
+    } else if (arg == "--embd" && i + 1 < argc) {
+      spec.n_embd = std::stoi(argv[++i]);
+    } else if (arg == "--layers" && i + 1 < argc) {
+      spec.n_layer = std::stoi(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      threads = std::max(std::stoi(argv[++i]), 1);
+    } else if (arg == "--gpu-layers" && i + 1 < argc) {
+      gpu_layers = std::stoi(argv[++i]);
+    } else if (arg == "--prompt-tokens" && i + 1 < argc) {
+      options.prompt_tokens = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "--decode-tokens" && i + 1 < argc) {
+      options.decode_tokens = std::max<size_t>(std::stoul(argv[++i]), 2);
+    } else if (arg == "--concurrency" && i + 1 < argc) {
+      options.concurrency = parse_list(argv[++i]);
+    } else if (arg == "--reps" && i + 1 < argc) {
+      options.repetitions = std::max(std::stoi(argv[++i]), 1);
+    } else if (arg == "--out" && i + 1 < argc) {
+      out_path = argv[++i];
+    } else if (arg == "--baseline" && i + 1 < argc) {
+      baseline_path = argv[++i];
+    } else if (arg == "--threshold" && i + 1 < argc) {
+      threshold = std::stod(argv[++i]);
+    } else if (arg == "--compare" && i + 1 < argc) {
+      compare_path = argv[++i];
+    } else {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  json baseline;
+  if (!baseline_path.empty() && !read_json(baseline_path, baseline)) {
+    return 1;
+  }
+  if (!compare_path.empty()) {
+    json current;
+    if (baseline_path.empty() || !read_json(compare_path, current)) {
+      std::cerr << "--compare needs a results file and --baseline"
+                << std::endl;
+      return 1;
+    }
+    return report_regressions(current, baseline, threshold) ? 2 : 0;
+  }
+
+  // The tiny model's weight type reuses the KV cache type names.
+  const bool tiny = model_path.empty();
+  if (tiny) {
+    if (!solus::LlamaHandler::parse_cache_type(weight_type,
+                                               spec.weight_type)) {
+      std::cerr << "Unknown weight type: " << weight_type << std::endl;
+      return 1;
+    }
+    spec.n_head = std::max(spec.n_embd / 64, 1);
+    spec.n_head_kv = spec.n_head;
+    spec.n_ff = spec.n_embd * 3;
+    model_path = !save_model.empty()
+                     ? save_model
+                     : (std::filesystem::temp_directory_path() /
+                        ("solus_bench_" + std::to_string(getpid()) + ".gguf"))
+                           .string();
+    std::cout << "Writing tiny model (" << spec.n_layer << " layers, "
+              << spec.n_embd << " wide, " << weight_type << ") to "
+              << model_path << std::endl;
+    if (!solus::write_tiny_model(model_path, spec)) {
+      return 1;
+    }
+  }
+  size_t max_concurrency = 1;
+  for (size_t concurrency : options.concurrency) {
+    max_concurrency = std::max(max_concurrency, concurrency);
+  }
+  solus::ServerConfig config;
+  config.model_path = model_path;
+  config.n_threads = threads;
+  config.n_gpu_layers = gpu_layers;
+  config.n_parallel = static_cast<int>(max_concurrency);
+  config.context_shift = false;
+  // Room for the single-sequence runs and for every batch sequence at once.
+  const size_t needed = std::max(
+      options.prompt_tokens + options.decode_tokens + 1,
+      max_concurrency *
+          (options.batch_prompt_tokens + options.batch_decode_tokens + 1));
+  config.n_ctx = static_cast<int>((needed + 255) / 256 * 256);
+  solus::LlamaHandler llm(config);
+  const bool loaded = llm.initialize();
+  std::vector<solus::BenchMetric> metrics;
+  if (loaded) {
+    solus::ThroughputBench bench(llm);
+    metrics = bench.run(options);
+  }
+  if (tiny && save_model.empty()) {
+    std::filesystem::remove(model_path);
+  }
+  if (!loaded) {
+    std::cerr << "Failed to load " << model_path << std::endl;
+    return 1;
+  }
+
+  json results = solus::ThroughputBench::to_json(metrics);
+  results["model"] = {{"path", tiny ? "" : model_path},
+                      {"tiny", tiny},
+                      {"n_embd", llm.get_embedding_dim()},
+                      {"n_vocab", llm.get_vocab_size()}};
+  if (tiny) {
+    results["model"]["layers"] = spec.n_layer;
+    results["model"]["weight_type"] = weight_type;
+  }
+  results["threads"] = threads;
+  results["reps"] = options.repetitions;
+  results["system"] = llama_print_system_info();
+  std::printf("\n%-18s %12s %6s\n", "metric", "value", "unit");
+  for (const auto &metric : metrics) {
+    std::printf("%-18s %12.2f %6s\n", metric.name.c_str(), metric.value,
+                metric.unit.c_str());
+  }
+  if (!out_path.empty()) {
+    std::ofstream out(out_path);
+    out << results.dump(2) << '\n';
+    if (!out) {
+      std::cerr << "Failed to write " << out_path << std::endl;
+      return 1;
+    }
+  }
+  if (!baseline_path.empty() &&
+      report_regressions(results, baseline, threshold)) {
+    return 2;
+  }
+  return 0;
+}
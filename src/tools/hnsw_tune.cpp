@@ -0,0 +1,154 @@
+#include "memory/database.h"
+#include "memory/hnsw_tuner.h"
+#include "memory/vector_ops.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+void print_usage(const char *program_name) {
+  std::cout << "Usage: " << program_name << " [options]\n"
+            << "Options:\n"
+            << "  --db PATH            Memory database directory (default: "
+               "./memory_db)\n"
+            << "  --samples N          Stored vectors to index (default: "
+               "20000)\n"
+            << "  --queries N          Held-out stored vectors used as "
+               "queries (default: 500)\n"
+            << "  --k N                Neighbours per query (default: 5)\n"
+            << "  --m LIST             Comma-separated M values (default: "
+               "8,12,16,24,32)\n"
+            << "  --ef LIST            Comma-separated ef values (default: "
+               "10,16,32,64,128,256)\n"
+            << "  --ef-construction N  Build beam width (default: 200)\n"
+            << "  --target-recall F    Recall@k to meet (default: 0.95)\n"
+            << "  --seed N             Sampling seed (default: 42)\n"
+            << "  --help               Show this help message\n";
+}
+
+std::vector<size_t> parse_list(const std::string &arg) {
+  std::vector<size_t> values;
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) {
+      values.push_back(std::stoul(item));
+    }
+  }
+  return values;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string db_path = "./memory_db";
+  size_t n_samples = 20000;
+  size_t n_queries = 500;
+  double target_recall = 0.95;
+  unsigned seed = 42;
+  solus::HnswTuneOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    } else if (arg == "--db" && i + 1 < argc) {
+      db_path = argv[++i];
+    } else if (arg == "--samples" && i + 1 < argc) {
+      n_samples = std::stoul(argv[++i]);
+    } else if (arg == "--queries" && i + 1 < argc) {
+      n_queries = std::stoul(argv[++i]);
+    } else if (arg == "--k" && i + 1 < argc) {
+      options.k = std::stoi(argv[++i]);
+    } else if (arg == "--m" && i + 1 < argc) {
+      options.m_values = parse_list(argv[++i]);
+    } else if (arg == "--ef" && i + 1 < argc) {
+      options.ef_values = parse_list(argv[++i]);
+    } else if (arg == "--ef-construction" && i + 1 < argc) {
+      options.ef_construction = std::stoul(argv[++i]);
+    } else if (arg == "--target-recall" && i + 1 < argc) {
+      target_recall = std::stod(argv[++i]);
+    } else if (arg == "--seed" && i + 1 < argc) {
+      seed = static_cast<unsigned>(std::stoul(argv[++i]));
+    } else {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  const int dimension = solus::MemoryDatabase::stored_dimension(db_path);
+  if (dimension <= 0) {
+    std::cerr << "No memory index found in " << db_path << std::endl;
+    return 1;
+  }
+  // Read-only, so the tuner can run next to a live server. Any stored format
+  // works; the IVF-PQ parameters come from its file and nothing is trained.
+  solus::MemoryDatabaseOptions db_options;
+  db_options.read_only = true;
+  db_options.ivf.m = 1;
+  db_options.ivf_train_size = std::numeric_limits<size_t>::max();
+  solus::MemoryDatabase db(db_path, dimension, 1, db_options);
+  if (!db.initialize()) {
+    std::cerr << "Failed to open memory database: " << db_path << std::endl;
+    return 1;
+  }
+  // Removed memories and failed inserts have no vector to sample.
+  std::vector<size_t> ids = db.live_ids();
+  std::mt19937 rng(seed);
+  std::shuffle(ids.begin(), ids.end(), rng);
+  const size_t count = ids.size();
+  n_queries = std::min(n_queries, count / 2);
+  n_samples = std::min(n_samples, count - n_queries);
+  std::cout << "Sampling " << n_samples << " vectors and " << n_queries
+            << " queries (dim " << dimension << ") from " << count
+            << " stored memories" << std::endl;
+  std::vector<float> base;
+  std::vector<float> queries;
+  base.reserve(n_samples * dimension);
+  queries.reserve(n_queries * dimension);
+  std::vector<float> vec;
+  size_t taken = 0;
+  for (size_t i = 0; i < count && taken < n_queries + n_samples; i++) {
+    if (!db.get_vector(ids[i], vec)) {
+      continue;
+    }
+    // Older databases stored raw embeddings; compare on the unit sphere.
+    solus::l2_normalize(vec.data(), vec.size());
+    auto &dst = taken < n_queries ? queries : base;
+    dst.insert(dst.end(), vec.begin(), vec.end());
+    taken++;
+  }
+  n_queries = queries.size() / dimension;
+  n_samples = base.size() / dimension;
+  if (n_samples == 0 || n_queries == 0) {
+    std::cerr << "Not enough stored memories to tune" << std::endl;
+    return 1;
+  }
+  solus::HnswTuner tuner(dimension, std::move(base), std::move(queries));
+  auto results = tuner.run(options);
+  std::printf("%6s %6s %10s %10s %10s %10s\n", "M", "ef", "recall@k",
+              "p50(us)", "p99(us)", "build(ms)");
+  for (const auto &r : results) {
+    std::printf("%6zu %6zu %10.4f %10.1f %10.1f %10.0f\n", r.m, r.ef,
+                r.recall, r.p50_us, r.p99_us, r.build_ms);
+  }
+  const auto *best = solus::HnswTuner::recommend(results, target_recall);
+  if (!best) {
+    std::cout << "\nNo setting reached recall@" << options.k << " >= "
+              << target_recall << "; widen --m/--ef" << std::endl;
+    return 2;
+  }
+  std::cout << "\nRecommended (recall@" << options.k << " " << best->recall
+            << ", p50 " << best->p50_us << "us, p99 " << best->p99_us
+            << "us):\n"
+            << "  hnsw_m = " << best->m << "\n"
+            << "  hnsw_ef_construction = " << options.ef_construction << "\n"
+            << "  hnsw_ef_search = " << best->ef << std::endl;
+  return 0;
+}
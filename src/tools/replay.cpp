@@ -0,0 +1,314 @@
+#include "server/traffic_capture.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <netdb.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+
+void print_usage(const char *program_name) {
+  std::cout << "Usage: " << program_name << " --trace FILE [options]\n"
+            << "Replays a capture recorded with solus_server --capture.\n"
+            << "Start the server on a copy of the capture's memory snapshot\n"
+            << "(--memory-db) to reproduce retrieval.\n"
+            << "Options:\n"
+            << "  --trace FILE         Capture to replay\n"
+            << "  --host HOST          Server host (default: 127.0.0.1)\n"
+            << "  --port PORT          Server port (default: 8000)\n"
+            << "  --speed F            Time scale; 2 = twice as fast, 0 = "
+               "back to back (default: 1)\n"
+            << "  --concurrency N      Requests in flight at most; time "
+               "spent waiting\n"
+            << "                       for a slot counts as latency "
+               "(default: 8)\n"
+            << "  --limit N            Replay the first N requests only\n"
+            << "  --report FILE        Write per-request results as JSON\n"
+            << "  --help               Show this help message\n";
+}
+
+struct HttpResult {
+  int status = 0;
+  std::string body;
+};
+
+std::string decode_chunked(std::string_view data) {
+  std::string out;
+  while (!data.empty()) {
+    size_t eol = data.find("\r\n");
+    if (eol == std::string_view::npos) {
+      break;
+    }
+    size_t size = std::strtoul(std::string(data.substr(0, eol)).c_str(),
+                               nullptr, 16);
+    data.remove_prefix(eol + 2);
+    if (size == 0 || size > data.size()) {
+      break;
+    }
+    out.append(data.substr(0, size));
+    data.remove_prefix(std::min(size + 2, data.size()));
+  }
+  return out;
+}
+
+// Minimal blocking HTTP/1.1 POST over a fresh connection.
+bool http_post(const std::string &host, const std::string &port,
+               const std::string &path, const std::string &body,
+               HttpResult &result) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addrs = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) {
+    return false;
+  }
+  int fd = -1;
+  for (addrinfo *ai = addrs; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+  if (fd < 0) {
+    return false;
+  }
+  std::string request = "POST " + path + " HTTP/1.1\r\nHost: " + host +
+                        "\r\nContent-Type: application/json\r\n"
+                        "Content-Length: " +
+                        std::to_string(body.size()) +
+                        "\r\nConnection: close\r\n\r\n" + body;
+  size_t sent = 0;
+  while (sent < request.size()) {
+    ssize_t n = send(fd, request.data() + sent, request.size() - sent, 0);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      close(fd);
+      return false;
+    }
+    sent += static_cast<size_t>(n);
+  }
+  std::string response;
+  char buf[16384];
+  while (true) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    response.append(buf, static_cast<size_t>(n));
+  }
+  close(fd);
+  size_t header_end = response.find("\r\n\r\n");
+  if (header_end == std::string::npos ||
+      std::sscanf(response.c_str(), "HTTP/%*s %d", &result.status) != 1) {
+    return false;
+  }
+  std::string headers = response.substr(0, header_end);
+  std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+  std::string_view payload = std::string_view(response).substr(header_end + 4);
+  if (headers.find("transfer-encoding: chunked") != std::string::npos) {
+    result.body = decode_chunked(payload);
+  } else {
+    result.body = std::string(payload);
+  }
+  return true;
+}
+
+struct Outcome {
+  int status = 0;
+  int64_t latency_ms = 0; // from the scheduled arrival
+  int64_t wait_ms = 0;    // scheduled arrival to send, waiting for a slot
+  std::string response;
+  json action;
+};
+
+double percentile(std::vector<int64_t> values, double p) {
+  if (values.empty()) {
+    return 0.0;
+  }
+  std::sort(values.begin(), values.end());
+  size_t index = static_cast<size_t>(p * (values.size() - 1) + 0.5);
+  return static_cast<double>(values[std::min(index, values.size() - 1)]);
+}
+
+void print_distribution(const char *label, const std::vector<int64_t> &v) {
+  std::printf("%-10s %8zu %10.0f %10.0f %10.0f %10.0f\n", label, v.size(),
+              percentile(v, 0.5), percentile(v, 0.9), percentile(v, 0.99),
+              percentile(v, 1.0));
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string trace_path;
+  std::string host = "127.0.0.1";
+  std::string port = "8000";
+  std::string report_path;
+  double speed = 1.0;
+  size_t concurrency = 8;
+  size_t limit = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    } else if (arg == "--trace" && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (arg == "--host" && i + 1 < argc) {
+      host = argv[++i];
+    } else if (arg == "--port" && i + 1 < argc) {
+      port = argv[++i];
+    } else if (arg == "--speed" && i + 1 < argc) {
+      speed = std::stod(argv[++i]);
+    } else if (arg == "--concurrency" && i + 1 < argc) {
+      concurrency = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "--limit" && i + 1 < argc) {
+      limit = std::stoul(argv[++i]);
+    } else if (arg == "--report" && i + 1 < argc) {
+      report_path = argv[++i];
+    } else {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (trace_path.empty()) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  solus::CaptureHeader header;
+  std::vector<solus::CaptureRecord> records;
+  if (!solus::TrafficCapture::load(trace_path, header, records)) {
+    return 1;
+  }
+  if (limit > 0 && records.size() > limit) {
+    records.resize(limit);
+  }
+  std::cout << "Replaying " << records.size() << " requests from "
+            << trace_path << " at " << (speed > 0 ? speed : 0.0)
+            << "x (memory snapshot: " << header.memory_snapshot << ")"
+            << std::endl;
+  std::vector<Outcome> outcomes(records.size());
+  std::atomic<size_t> next{0};
+  const auto start = std::chrono::steady_clock::now();
+  auto worker = [&]() {
+    for (size_t i = next++; i < records.size(); i = next++) {
+      const auto &record = records[i];
+      // Latency counts from when the request was due, not from when a slot
+      // freed up to send it; otherwise a server that falls behind hides its
+      // queueing delay (coordinated omission).
+      auto due = std::chrono::steady_clock::now();
+      if (speed > 0) {
+        due = start + std::chrono::milliseconds(static_cast<int64_t>(
+                          record.arrival_ms / speed));
+        std::this_thread::sleep_until(due);
+      }
+      json body = {{"text", record.text},
+                   {"user_id", record.user_id},
+                   {"conversation_id", record.conversation_id},
+                   {"seed", record.seed},
+                   {"cache", record.use_cache}};
+      if (!record.model.empty()) {
+        body["model"] = record.model;
+      }
+      const auto sent_at = std::chrono::steady_clock::now();
+      HttpResult result;
+      bool ok = http_post(host, port, "/chat", body.dump(), result);
+      Outcome &outcome = outcomes[i];
+      outcome.latency_ms =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - due)
+              .count();
+      outcome.wait_ms = std::max<int64_t>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(sent_at - due)
+              .count(),
+          0);
+      outcome.status = ok ? result.status : 0;
+      if (ok && result.status == 200) {
+        try {
+          json reply = json::parse(result.body);
+          outcome.response = reply.value("response", std::string());
+          outcome.action = reply.value("action", json());
+        } catch (const json::exception &) {
+          outcome.status = -1;
+        }
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < std::min(concurrency, records.size()); t++) {
+    threads.emplace_back(worker);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  std::vector<int64_t> recorded_latency, replay_latency, replay_wait;
+  size_t compared = 0, same_output = 0, status_changed = 0, failed = 0;
+  json report = json::array();
+  for (size_t i = 0; i < records.size(); i++) {
+    const auto &record = records[i];
+    const auto &outcome = outcomes[i];
+    if (record.status == 200) {
+      recorded_latency.push_back(record.latency_ms);
+    }
+    if (outcome.status == 200) {
+      replay_latency.push_back(outcome.latency_ms);
+      replay_wait.push_back(outcome.wait_ms);
+    } else {
+      failed++;
+    }
+    if (outcome.status != record.status) {
+      status_changed++;
+    }
+    const bool same = record.status == 200 && outcome.status == 200 &&
+                      record.response == outcome.response &&
+                      record.action == outcome.action;
+    if (record.status == 200 && outcome.status == 200) {
+      compared++;
+      same_output += same ? 1 : 0;
+    }
+    if (!report_path.empty()) {
+      report.push_back({{"t", record.arrival_ms},
+                        {"recorded_status", record.status},
+                        {"status", outcome.status},
+                        {"recorded_latency_ms", record.latency_ms},
+                        {"latency_ms", outcome.latency_ms},
+                        {"wait_ms", outcome.wait_ms},
+                        {"same_output", same}});
+    }
+  }
+  std::printf("\n%-10s %8s %10s %10s %10s %10s\n", "latency", "n", "p50(ms)",
+              "p90(ms)", "p99(ms)", "max(ms)");
+  print_distribution("recorded", recorded_latency);
+  print_distribution("replay", replay_latency);
+  print_distribution("slot wait", replay_wait);
+  std::printf("\nidentical outputs: %zu/%zu, status changed: %zu, "
+              "failed: %zu\n",
+              same_output, compared, status_changed, failed);
+  if (!report_path.empty()) {
+    std::ofstream out(report_path);
+    out << report.dump(2) << '\n';
+  }
+  return failed > 0 ? 2 : 0;
+}
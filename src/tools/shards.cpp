@@ -0,0 +1,118 @@
+#include "server/shard_protocol.h"
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+
+void print_usage(const char *program_name) {
+  std::cout << "Usage: " << program_name << " [options] COMMAND\n"
+            << "Inspects and rebalances a solus_server started with "
+               "--shards.\n"
+            << "Commands:\n"
+            << "  list                 Workers, their memory counts and the "
+               "moved users\n"
+            << "  locate USER          Shard that owns USER\n"
+            << "  move USER SHARD      Move USER's memories to SHARD\n"
+            << "Options:\n"
+            << "  --shard-dir DIR      The server's --shard-dir (default: "
+               "./shards)\n"
+            << "  --help               Show this help message\n";
+}
+
+bool request(const std::string &dir, solus::EShardOp op,
+             const std::string &user_id, const std::string &body,
+             json &result) {
+  solus::ShardFrame frame;
+  frame.op = op;
+  frame.user_id = user_id;
+  frame.body = body;
+  solus::ShardFrame reply = solus::shard_request(dir + "/front.sock", frame);
+  result = json::parse(reply.body, nullptr, false);
+  if (reply.status != 200) {
+    std::cerr << "Request failed (" << reply.status << "): " << reply.body
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string dir = "./shards";
+  std::vector<std::string> command;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    } else if (arg == "--shard-dir" && i + 1 < argc) {
+      dir = argv[++i];
+    } else if (!arg.empty() && arg[0] == '-') {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    } else {
+      command.push_back(arg);
+    }
+  }
+  if (command.empty()) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  json result;
+  if (command[0] == "list" && command.size() == 1) {
+    if (!request(dir, solus::EShardOp::PLACEMENT, "", "", result)) {
+      return 1;
+    }
+    for (const auto &worker : result["workers"]) {
+      const json &health = worker["health"];
+      std::cout << "shard " << worker["shard"] << "  pid " << worker["pid"]
+                << "  "
+                << (health.is_object() ? health.value("status", "unknown")
+                                       : "unreachable");
+      if (health.is_object() && health.contains("memory_count")) {
+        std::cout << "  memories " << health["memory_count"];
+      }
+      std::cout << "\n";
+    }
+    for (const auto &[user, shard] : result["overrides"].items()) {
+      std::cout << "moved " << user << " -> shard " << shard << "\n";
+    }
+    return 0;
+  }
+  if (command[0] == "locate" && command.size() == 2) {
+    // The control socket has no lookup; the ring is deterministic, so the
+    // placement answers it together with any override.
+    if (!request(dir, solus::EShardOp::PLACEMENT, "", "", result)) {
+      return 1;
+    }
+    const json &overrides = result["overrides"];
+    size_t shard = 0;
+    if (overrides.contains(command[1])) {
+      shard = overrides[command[1]].get<size_t>();
+    } else {
+      shard = solus::HashRing(result["shards"].get<size_t>())
+                  .shard_for(command[1]);
+    }
+    std::cout << command[1] << " -> shard " << shard << std::endl;
+    return 0;
+  }
+  if (command[0] == "move" && command.size() == 3) {
+    const size_t shard = std::stoul(command[2]);
+    if (!request(dir, solus::EShardOp::MOVE_USER, command[1],
+                 json({{"shard", shard}}).dump(), result)) {
+      return 1;
+    }
+    std::cout << "Moved " << result.value("moved", size_t{0})
+              << " memories of " << command[1] << " to shard " << shard
+              << std::endl;
+    return 0;
+  }
+  print_usage(argv[0]);
+  return 1;
+}
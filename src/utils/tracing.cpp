@@ -0,0 +1,151 @@
+#include "utils/tracing.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+namespace solus {
+
+namespace {
+
+thread_local RequestTrace *s_CurrentTrace = nullptr;
+
+uint32_t thread_index() {
+  static std::atomic<uint32_t> s_NextThread{1};
+  thread_local uint32_t s_Thread = s_NextThread.fetch_add(1);
+  return s_Thread;
+}
+
+} // namespace
+
+Tracer::Tracer(double sample_rate, int64_t slow_ms, size_t capacity)
+    : m_SampleRate(sample_rate), m_SlowUs(slow_ms * 1000),
+      m_Rng(std::random_device{}()) {
+  std::random_device rd;
+  m_IdBase = (static_cast<uint64_t>(rd()) << 32) | rd();
+  m_Ring.resize(std::max<size_t>(capacity, 1));
+}
+
+int64_t Tracer::now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string Tracer::format_id(uint64_t id) {
+  char buf[17];
+  std::snprintf(buf, sizeof(buf), "%016llx",
+                static_cast<unsigned long long>(id));
+  return buf;
+}
+
+void Tracer::finish(TraceRecord &&trace, int64_t duration_us) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  const bool slow = m_SlowUs > 0 && duration_us >= m_SlowUs;
+  if (!slow && std::uniform_real_distribution<double>(0.0, 1.0)(m_Rng) >=
+                   m_SampleRate) {
+    return;
+  }
+  m_Ring[m_Next % m_Ring.size()] = std::move(trace);
+  m_Next++;
+}
+
+size_t Tracer::kept() const {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return std::min(m_Next, m_Ring.size());
+}
+
+std::string Tracer::to_chrome_json() const {
+  // Copied out under the lock and serialized after, so requests finishing
+  // during a dump wait for a copy rather than for JSON building.
+  std::vector<TraceRecord> traces;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    const size_t n = std::min(m_Next, m_Ring.size());
+    traces.reserve(n);
+    for (size_t i = m_Next - n; i < m_Next; i++) {
+      traces.push_back(m_Ring[i % m_Ring.size()]);
+    }
+  }
+  json events = json::array();
+  for (const TraceRecord &trace : traces) {
+    const std::string id = format_id(trace.id);
+    for (const auto &span : trace.spans) {
+      json args = {{"trace_id", id}};
+      if (span.count >= 0) {
+        args["count"] = span.count;
+      }
+      events.push_back({{"name", span.name},
+                        {"cat", "solus"},
+                        {"ph", "X"},
+                        {"ts", span.start_us},
+                        {"dur", span.duration_us},
+                        {"pid", 1},
+                        {"tid", span.thread},
+                        {"args", std::move(args)}});
+    }
+  }
+  json doc = {{"traceEvents", std::move(events)},
+              {"displayTimeUnit", "ms"}};
+  return doc.dump();
+}
+
+bool Tracer::dump(const std::string &path) const {
+  std::string contents = to_chrome_json();
+  std::ofstream out(path, std::ios::out | std::ios::trunc);
+  if (!out || !(out << contents)) {
+    std::cerr << "Failed to write traces to " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+RequestTrace::RequestTrace(Tracer *tracer)
+    : m_Tracer(tracer), m_Previous(s_CurrentTrace) {
+  if (!m_Tracer) {
+    return;
+  }
+  m_Trace.id = m_Tracer->next_id();
+  m_Trace.spans.reserve(16);
+  m_StartUs = Tracer::now_us();
+  s_CurrentTrace = this;
+}
+
+RequestTrace::~RequestTrace() {
+  if (!m_Tracer) {
+    return;
+  }
+  s_CurrentTrace = m_Previous;
+  const int64_t end_us = Tracer::now_us();
+  SpanRecord request;
+  request.name = "request";
+  request.start_us = m_StartUs;
+  request.duration_us = end_us - m_StartUs;
+  request.thread = thread_index();
+  m_Trace.spans.insert(m_Trace.spans.begin(), request);
+  m_Tracer->finish(std::move(m_Trace), request.duration_us);
+}
+
+RequestTrace *RequestTrace::current() { return s_CurrentTrace; }
+
+TraceSpan::TraceSpan(const char *name) : m_Trace(s_CurrentTrace) {
+  if (m_Trace) {
+    m_Span.name = name;
+    m_Span.start_us = Tracer::now_us();
+  }
+}
+
+void TraceSpan::end() {
+  if (!m_Trace) {
+    return;
+  }
+  m_Span.duration_us = Tracer::now_us() - m_Span.start_us;
+  m_Span.thread = thread_index();
+  m_Trace->add(m_Span);
+  m_Trace = nullptr;
+}
+
+} // namespace solus
@@ -0,0 +1,107 @@
+#include "llm/adapter_cache.h"
+#include "utils/helpers.h"
+#include <gtest/gtest.h>
+
+namespace solus::test {
+
+// Adapters are never really loaded; the loader hands out dummy handles and
+// counts loads and frees so the cache's bookkeeping can be checked.
+class AdapterCacheTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    m_TempDir = std::make_unique<TempDirectory>();
+    write("alice", 4096);
+    write("bob", 1024);
+    write("carol", 1024);
+  }
+
+  void write(const std::string &user_id, size_t size) {
+    MockFileCreator::create_bin_file(
+        m_TempDir->path() + "/" + user_id + ".gguf", size);
+  }
+
+  AdapterCache::Loader counting_loader() {
+    return [this](const std::string &path) -> AdapterCache::Handle {
+      m_Loads.push_back(path.substr(m_TempDir->path().size() + 1));
+      if (path.find("broken") != std::string::npos) {
+        return nullptr;
+      }
+      return AdapterCache::Handle(
+          reinterpret_cast<llama_adapter_lora *>(&m_Dummy),
+          [this](llama_adapter_lora *) { m_Frees++; });
+    };
+  }
+
+  std::unique_ptr<TempDirectory> m_TempDir;
+  std::vector<std::string> m_Loads;
+  int m_Frees = 0;
+  int m_Dummy = 0;
+};
+
+TEST_F(AdapterCacheTest, LoadsOnFirstUse) {
+  AdapterCache cache(m_TempDir->path(), 0, counting_loader());
+  EXPECT_TRUE(cache.has_adapter("bob"));
+  EXPECT_TRUE(m_Loads.empty());
+  auto bob = cache.acquire("bob");
+  ASSERT_NE(bob, nullptr);
+  EXPECT_EQ(cache.acquire("bob"), bob);
+  EXPECT_EQ(m_Loads, std::vector<std::string>{"bob.gguf"});
+  EXPECT_EQ(cache.loaded(), 1u);
+  EXPECT_EQ(cache.loaded_bytes(), 1024u);
+  EXPECT_FALSE(cache.has_adapter("dave"));
+  EXPECT_EQ(cache.acquire("dave"), nullptr);
+}
+
+TEST_F(AdapterCacheTest, RejectsUserIdsThatAreNotPlainNames) {
+  AdapterCache cache(m_TempDir->path(), 0, counting_loader());
+  for (const char *user_id : {"", "../bob", "a/b", ".hidden", "x\\y"}) {
+    EXPECT_EQ(cache.path_for(user_id), "") << user_id;
+    EXPECT_EQ(cache.acquire(user_id), nullptr) << user_id;
+  }
+  EXPECT_TRUE(m_Loads.empty());
+  EXPECT_NE(cache.path_for("user-1@example.com"), "");
+}
+
+TEST_F(AdapterCacheTest, EvictsLeastRecentlyUsedWithinBudget) {
+  AdapterCache cache(m_TempDir->path(), 4096 + 1024, counting_loader());
+  ASSERT_NE(cache.acquire("alice"), nullptr);
+  auto bob = cache.acquire("bob");
+  cache.acquire("alice"); // bob is now the least recently used
+  ASSERT_NE(cache.acquire("carol"), nullptr);
+  EXPECT_EQ(cache.loaded(), 2u);
+  EXPECT_EQ(cache.loaded_bytes(), 4096u + 1024u);
+  // An evicted adapter lives on while a context still applies it.
+  EXPECT_EQ(m_Frees, 0);
+  bob.reset();
+  EXPECT_EQ(m_Frees, 1);
+  ASSERT_NE(cache.acquire("bob"), nullptr);
+  EXPECT_EQ(m_Loads.size(), 4u);
+}
+
+TEST_F(AdapterCacheTest, ReloadsReplacedFilesAndDropsRemovedOnes) {
+  AdapterCache cache(m_TempDir->path(), 0, counting_loader());
+  ASSERT_NE(cache.acquire("bob"), nullptr);
+  write("bob", 2048);
+  ASSERT_NE(cache.acquire("bob"), nullptr);
+  EXPECT_EQ(m_Loads.size(), 2u);
+  EXPECT_EQ(m_Frees, 1);
+  EXPECT_EQ(cache.loaded_bytes(), 2048u);
+  std::filesystem::remove(cache.path_for("bob"));
+  EXPECT_EQ(cache.acquire("bob"), nullptr);
+  EXPECT_EQ(m_Frees, 2);
+  EXPECT_EQ(cache.loaded(), 0u);
+}
+
+TEST_F(AdapterCacheTest, FailedLoadIsNotRetriedUntilTheFileChanges) {
+  write("broken", 512);
+  AdapterCache cache(m_TempDir->path(), 0, counting_loader());
+  EXPECT_EQ(cache.acquire("broken"), nullptr);
+  EXPECT_EQ(cache.acquire("broken"), nullptr);
+  EXPECT_EQ(m_Loads.size(), 1u);
+  EXPECT_EQ(cache.loaded(), 0u);
+  write("broken", 768);
+  EXPECT_EQ(cache.acquire("broken"), nullptr);
+  EXPECT_EQ(m_Loads.size(), 2u);
+}
+
+} // namespace solus::test
@@ -0,0 +1,70 @@
+#include "server/cpu_topology.h"
+#include <gtest/gtest.h>
+
+namespace solus::test {
+
+TEST(CpuTopologyTest, ParsesRangesAndSingles) {
+  std::vector<int> cpus;
+  ASSERT_TRUE(parse_cpu_list("0-3,8,10-11\n", cpus));
+  EXPECT_EQ(cpus, (std::vector<int>{0, 1, 2, 3, 8, 10, 11}));
+}
+
+TEST(CpuTopologyTest, SortsAndDeduplicates) {
+  std::vector<int> cpus;
+  ASSERT_TRUE(parse_cpu_list("6,2-4,3", cpus));
+  EXPECT_EQ(cpus, (std::vector<int>{2, 3, 4, 6}));
+}
+
+TEST(CpuTopologyTest, RejectsMalformedLists) {
+  std::vector<int> cpus;
+  EXPECT_FALSE(parse_cpu_list("3-1", cpus));
+  EXPECT_FALSE(parse_cpu_list("a", cpus));
+  EXPECT_FALSE(parse_cpu_list("1,,2", cpus));
+  EXPECT_FALSE(parse_cpu_list("-1", cpus));
+}
+
+TEST(CpuTopologyTest, ResolvesSpecs) {
+  std::vector<int> cpus;
+  ASSERT_TRUE(resolve_cpu_set("", cpus));
+  EXPECT_TRUE(cpus.empty());
+  ASSERT_TRUE(resolve_cpu_set("1-2", cpus));
+  EXPECT_EQ(cpus, (std::vector<int>{1, 2}));
+  EXPECT_FALSE(resolve_cpu_set("node:x", cpus));
+  EXPECT_FALSE(resolve_cpu_set("node:100000", cpus));
+}
+
+TEST(CpuTopologyTest, FormatsWhatItParses) {
+  EXPECT_EQ(format_cpu_list({0, 1, 2, 3, 8, 10, 11}), "0-3,8,10-11");
+  EXPECT_EQ(format_cpu_list({}), "");
+  std::vector<int> cpus;
+  ASSERT_TRUE(parse_cpu_list(format_cpu_list({4, 6, 7}), cpus));
+  EXPECT_EQ(cpus, (std::vector<int>{4, 6, 7}));
+}
+
+TEST(CpuTopologyTest, SlicesCoverTheSetOnce) {
+  const std::vector<int> cpus = {0, 1, 2, 3, 4, 5, 6, 8, 9, 10};
+  EXPECT_EQ(cpu_set_slice(cpus, 0, 3), (std::vector<int>{0, 1, 2, 3}));
+  EXPECT_EQ(cpu_set_slice(cpus, 1, 3), (std::vector<int>{4, 5, 6}));
+  EXPECT_EQ(cpu_set_slice(cpus, 2, 3), (std::vector<int>{8, 9, 10}));
+  EXPECT_TRUE(cpu_set_slice({0, 1}, 0, 3).empty());
+  EXPECT_TRUE(cpu_set_slice(cpus, 3, 3).empty());
+}
+
+TEST(CpuTopologyTest, Difference) {
+  EXPECT_EQ(cpu_set_difference({0, 1, 2, 3, 4}, {1, 3}),
+            (std::vector<int>{0, 2, 4}));
+  EXPECT_EQ(cpu_set_difference({0, 1}, {}), (std::vector<int>{0, 1}));
+}
+
+TEST(CpuTopologyTest, ScopedAffinityRestoresThreadMask) {
+  const std::vector<int> original = current_thread_cpus();
+  ASSERT_FALSE(original.empty());
+  {
+    ScopedThreadAffinity affinity;
+    ASSERT_TRUE(pin_current_thread({original.front()}));
+    EXPECT_EQ(current_thread_cpus(), std::vector<int>{original.front()});
+  }
+  EXPECT_EQ(current_thread_cpus(), original);
+}
+
+} // namespace solus::test
@@ -0,0 +1,70 @@
+#include "llm/detokenizer.h"
+#include <gtest/gtest.h>
+#include <cstring>
+
+namespace solus::test {
+
+class DetokenizerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    // "é" is 0xC3 0xA9 and "€" is 0xE2 0x82 0xAC; both are split across
+    // tokens below.
+    pieces = {"Hello", " world", "\xC3", "\xA9", "\xE2\x82", "\xAC", "",
+              std::string(300, 'x')};
+    table.build(static_cast<int>(pieces.size()),
+                [this](int32_t token, char *buf, int size) {
+                  const std::string &piece = pieces[token];
+                  if (static_cast<int>(piece.size()) > size) {
+                    return -static_cast<int>(piece.size());
+                  }
+                  std::memcpy(buf, piece.data(), piece.size());
+                  return static_cast<int>(piece.size());
+                });
+  }
+
+  std::vector<std::string> pieces;
+  TokenPieceTable table;
+};
+
+TEST_F(DetokenizerTest, TableHoldsEveryPiece) {
+  ASSERT_EQ(table.size(), pieces.size());
+  for (size_t i = 0; i < pieces.size(); i++) {
+    EXPECT_EQ(table.piece(static_cast<int32_t>(i)), pieces[i]);
+  }
+  EXPECT_TRUE(table.piece(-1).empty());
+  EXPECT_TRUE(table.piece(static_cast<int32_t>(pieces.size())).empty());
+}
+
+TEST_F(DetokenizerTest, LongPiecesAreKept) {
+  EXPECT_EQ(table.piece(7).size(), 300u);
+}
+
+TEST_F(DetokenizerTest, HoldsBackSplitUtf8) {
+  IncrementalDetokenizer detok(table);
+  EXPECT_EQ(detok.push(0), "Hello");
+  EXPECT_EQ(detok.push(2), "");
+  EXPECT_EQ(detok.push(3), "\xC3\xA9");
+  EXPECT_EQ(detok.push(4), "");
+  EXPECT_EQ(detok.push(6), "");
+  EXPECT_EQ(detok.push(5), "\xE2\x82\xAC");
+  EXPECT_EQ(detok.push(1), " world");
+  EXPECT_EQ(detok.text(), "Hello\xC3\xA9\xE2\x82\xAC world");
+}
+
+TEST_F(DetokenizerTest, FlushReleasesIncompleteTail) {
+  IncrementalDetokenizer detok(table);
+  EXPECT_EQ(detok.push(0), "Hello");
+  EXPECT_EQ(detok.push(4), "");
+  EXPECT_EQ(detok.flush(), "\xE2\x82");
+  EXPECT_EQ(detok.flush(), "");
+}
+
+TEST_F(DetokenizerTest, CompletePrefix) {
+  EXPECT_EQ(utf8_complete_prefix(""), 0u);
+  EXPECT_EQ(utf8_complete_prefix("abc"), 3u);
+  EXPECT_EQ(utf8_complete_prefix("a\xF0\x9F\x98"), 1u);
+  EXPECT_EQ(utf8_complete_prefix("a\xF0\x9F\x98\x80"), 5u);
+  EXPECT_EQ(utf8_complete_prefix("\x80\x80"), 2u);
+}
+
+} // namespace solus::test
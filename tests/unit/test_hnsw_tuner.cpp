@@ -0,0 +1,52 @@
+#include "memory/hnsw_tuner.h"
+#include "utils/helpers.h"
+#include <gtest/gtest.h>
+
+namespace solus::test {
+
+class HnswTunerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    for (int i = 0; i < 500; i++) {
+      auto vec = RandomGenerator::embedding(32);
+      base.insert(base.end(), vec.begin(), vec.end());
+    }
+    for (int i = 0; i < 20; i++) {
+      auto vec = RandomGenerator::embedding(32);
+      queries.insert(queries.end(), vec.begin(), vec.end());
+    }
+  }
+
+  std::vector<float> base;
+  std::vector<float> queries;
+};
+
+TEST_F(HnswTunerTest, SweepsAllCombinations) {
+  HnswTuner tuner(32, base, queries);
+  HnswTuneOptions options;
+  options.m_values = {8, 16};
+  options.ef_values = {10, 100};
+  auto results = tuner.run(options);
+  ASSERT_EQ(results.size(), 4);
+  for (const auto &result : results) {
+    EXPECT_GE(result.recall, 0.0);
+    EXPECT_LE(result.recall, 1.0);
+    EXPECT_LE(result.p50_us, result.p99_us);
+  }
+  // A beam as wide as half the dataset is effectively exhaustive.
+  EXPECT_GT(results[1].recall, 0.9);
+}
+
+TEST_F(HnswTunerTest, RecommendPicksCheapestMeetingTarget) {
+  std::vector<HnswTuneResult> results(3);
+  results[0] = {16, 10, 0.80, 10.0, 20.0, 0.0};
+  results[1] = {16, 64, 0.97, 30.0, 50.0, 0.0};
+  results[2] = {32, 64, 0.99, 45.0, 70.0, 0.0};
+  const auto *best = HnswTuner::recommend(results, 0.95);
+  ASSERT_NE(best, nullptr);
+  EXPECT_EQ(best->ef, 64u);
+  EXPECT_EQ(best->m, 16u);
+  EXPECT_EQ(HnswTuner::recommend(results, 0.999), nullptr);
+}
+
+} // namespace solus::test
@@ -0,0 +1,160 @@
+#include "memory/ivf_pq.h"
+#include "memory/vector_ops.h"
+#include "utils/helpers.h"
+#include <gtest/gtest.h>
+#include <random>
+
+namespace solus::test {
+
+class IvfPqTest : public ::testing::Test {
+protected:
+  static constexpr size_t kDim = 64;
+  static constexpr size_t kCount = 2000;
+
+  void SetUp() override {
+    // Unit vectors around 20 cluster centres, so lists are meaningful.
+    std::mt19937 rng(7);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::vector<float> centres(20 * kDim);
+    for (float &v : centres) {
+      v = normal(rng);
+    }
+    base.resize(kCount * kDim);
+    for (size_t i = 0; i < kCount; i++) {
+      const float *centre = centres.data() + (i % 20) * kDim;
+      for (size_t j = 0; j < kDim; j++) {
+        base[i * kDim + j] = centre[j] + 0.5f * normal(rng);
+      }
+      l2_normalize(base.data() + i * kDim, kDim);
+    }
+  }
+
+  IvfPqIndex build(const IvfPqParams &params) const {
+    IvfPqIndex index(kDim, params);
+    EXPECT_TRUE(index.train(base.data(), kCount));
+    for (size_t i = 0; i < kCount; i++) {
+      index.add(i, base.data() + i * kDim);
+    }
+    return index;
+  }
+
+  IvfPqIndex::VectorSource exact() const {
+    return [this](size_t id) { return base.data() + id * kDim; };
+  }
+
+  std::vector<float> base;
+};
+
+TEST_F(IvfPqTest, FindsStoredVectorsWithRerank) {
+  IvfPqParams params;
+  params.nlist = 16;
+  params.m = 32;
+  params.nprobe = 4;
+  IvfPqIndex index = build(params);
+  EXPECT_EQ(index.size(), kCount);
+  // 32 codes of 4 bits and an ID instead of 64 floats.
+  EXPECT_LT(index.code_bytes(), kCount * kDim * sizeof(float) / 8);
+  size_t found = 0;
+  for (size_t i = 0; i < kCount; i += 20) {
+    auto hits = index.search(base.data() + i * kDim, 5, nullptr, exact());
+    ASSERT_FALSE(hits.empty());
+    if (hits[0].second == i) {
+      // Reranked distances are exact.
+      EXPECT_NEAR(hits[0].first, 0.0f, 1e-4f);
+      found++;
+    }
+    for (size_t h = 1; h < hits.size(); h++) {
+      EXPECT_LE(hits[h - 1].first, hits[h].first);
+    }
+  }
+  EXPECT_GE(found, 95u);
+}
+
+TEST_F(IvfPqTest, ApproximateScanRanksNearbyVectors) {
+  IvfPqParams params;
+  params.nlist = 16;
+  params.m = 16;
+  params.nprobe = 16;
+  params.rerank = 0;
+  IvfPqIndex index = build(params);
+  // Without rerank the stored vector should still be among the top few.
+  size_t found = 0;
+  for (size_t i = 0; i < kCount; i += 20) {
+    auto hits = index.search(base.data() + i * kDim, 10, nullptr, nullptr);
+    for (const auto &[dist, id] : hits) {
+      found += id == i ? 1 : 0;
+    }
+  }
+  EXPECT_GE(found, 70u);
+}
+
+TEST_F(IvfPqTest, FilterExcludesIds) {
+  IvfPqParams params;
+  params.nlist = 8;
+  params.m = 16;
+  params.nprobe = 8;
+  IvfPqIndex index = build(params);
+  auto even = [](size_t id) { return id % 2 == 0; };
+  auto hits = index.search(base.data() + 3 * kDim, 10, even, exact());
+  ASSERT_EQ(hits.size(), 10u);
+  for (const auto &[dist, id] : hits) {
+    EXPECT_EQ(id % 2, 0u);
+  }
+}
+
+TEST_F(IvfPqTest, SaveAndLoadKeepResults) {
+  TempDirectory dir;
+  const std::string path = dir.path() + "/ivfpq.bin";
+  IvfPqParams params;
+  params.nlist = 16;
+  params.m = 16;
+  IvfPqIndex index = build(params);
+  ASSERT_TRUE(index.save(path));
+
+  IvfPqIndex loaded(kDim, params);
+  ASSERT_TRUE(loaded.load(path));
+  EXPECT_TRUE(loaded.trained());
+  EXPECT_EQ(loaded.size(), kCount);
+  for (size_t i = 0; i < kCount; i += 100) {
+    const float *query = base.data() + i * kDim;
+    EXPECT_EQ(index.search(query, 5, nullptr, nullptr),
+              loaded.search(query, 5, nullptr, nullptr));
+  }
+  // The file's quantizer wins over the constructor's.
+  IvfPqParams other = params;
+  other.m = 8;
+  IvfPqIndex relabelled(kDim, other);
+  ASSERT_TRUE(relabelled.load(path));
+  EXPECT_EQ(relabelled.sub_quantizers(), 16u);
+  IvfPqIndex mismatched(kDim / 2, params);
+  EXPECT_FALSE(mismatched.load(path));
+}
+
+TEST_F(IvfPqTest, HandlesOddSubQuantizerCount) {
+  IvfPqParams params;
+  params.nlist = 4;
+  params.m = 5; // 64 has no divisor 5; rounds down to 4
+  IvfPqIndex even(kDim, params);
+  EXPECT_EQ(even.sub_quantizers(), 4u);
+
+  // 63 = 7 * 9: seven sub-quantizers leave a half-used byte per pair.
+  std::vector<float> odd;
+  for (size_t i = 0; i < 200; i++) {
+    odd.insert(odd.end(), base.begin() + i * kDim,
+               base.begin() + i * kDim + 63);
+    l2_normalize(odd.data() + i * 63, 63);
+  }
+  params.m = 7;
+  IvfPqIndex index(63, params);
+  EXPECT_EQ(index.sub_quantizers(), 7u);
+  ASSERT_TRUE(index.train(odd.data(), 200));
+  for (size_t i = 0; i < 200; i++) {
+    index.add(i, odd.data() + i * 63);
+  }
+  auto source = [&odd](size_t id) { return odd.data() + id * 63; };
+  auto hits = index.search(odd.data() + 42 * 63, 3, nullptr, source);
+  ASSERT_FALSE(hits.empty());
+  EXPECT_EQ(hits[0].second, 42u);
+}
+
+} // namespace solus::test
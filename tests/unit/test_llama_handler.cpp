@@ -0,0 +1,74 @@
+#include "llm/llama_handler.h"
+#include "llm/tiny_model.h"
+#include "utils/helpers.h"
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <memory>
+
+namespace solus::test {
+
+class LlamaHandlerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    TinyModelSpec spec;
+    spec.n_layer = 2;
+    const std::string path = dir.path() + "/tiny.gguf";
+    ASSERT_TRUE(write_tiny_model(path, spec));
+    ServerConfig config;
+    config.model_path = path;
+    config.n_ctx = 256;
+    config.n_threads = 2;
+    config.n_gpu_layers = 0;
+    config.embedding_batch_size = 0;
+    config.context_shift = true;
+    llm = std::make_unique<LlamaHandler>(config);
+    ASSERT_TRUE(llm->initialize());
+  }
+
+  // At least n valid tokens of plain text.
+  std::vector<llama_token> prompt(size_t n) {
+    std::string text;
+    std::vector<llama_token> tokens;
+    while (tokens.size() < n) {
+      text += "the quick brown fox jumps over the lazy dog ";
+      tokens = llm->tokenize(text, false);
+    }
+    tokens.resize(n);
+    return tokens;
+  }
+
+  TempDirectory dir;
+  std::unique_ptr<LlamaHandler> llm;
+};
+
+TEST_F(LlamaHandlerTest, ContextShiftGeneratesPastContextSize) {
+  const auto tokens = prompt(64);
+  GenerationParams params;
+  params.n_keep = 32;
+  params.max_tokens = 400; // more than the whole context
+  int n_generated = 0;
+  llm->generate(tokens, params, nullptr, &n_generated);
+  EXPECT_EQ(n_generated, params.max_tokens);
+  const auto &cached = llm->get_cached_tokens();
+  ASSERT_GE(cached.size(), 32u);
+  EXPECT_LE(cached.size(), static_cast<size_t>(llm->get_context_size()));
+  EXPECT_TRUE(std::equal(tokens.begin(), tokens.begin() + 32, cached.begin()));
+}
+
+TEST_F(LlamaHandlerTest, LongPromptKeepsPrefixAndNewestTokens) {
+  const auto tokens = prompt(400);
+  GenerationParams params;
+  params.n_keep = 32;
+  params.max_tokens = 16;
+  int n_generated = 0;
+  llm->generate(tokens, params, nullptr, &n_generated);
+  EXPECT_EQ(n_generated, params.max_tokens);
+  const auto &cached = llm->get_cached_tokens();
+  ASSERT_GT(cached.size(), 32u + params.max_tokens);
+  EXPECT_LE(cached.size(), static_cast<size_t>(llm->get_context_size()));
+  EXPECT_TRUE(std::equal(tokens.begin(), tokens.begin() + 32, cached.begin()));
+  // The prompt's last token directly precedes the generated ones.
+  EXPECT_EQ(cached[cached.size() - params.max_tokens - 1], tokens.back());
+}
+
+} // namespace solus::test
@@ -0,0 +1,163 @@
+#include "server/memory_consolidator.h"
+#include "utils/helpers.h"
+#include <gtest/gtest.h>
+#include <random>
+
+namespace solus::test {
+
+class MemoryConsolidatorTest : public ::testing::Test {
+protected:
+  static constexpr int kDim = 64;
+
+  void SetUp() override {
+    db = std::make_unique<MemoryDatabase>(dir.path(), kDim, 100);
+    ASSERT_TRUE(db->initialize());
+    topic = gaussian();
+    // Three close variations of one topic and two unrelated memories, all
+    // a year old, plus a fresh one on the same topic.
+    for (int i = 0; i < 3; i++) {
+      notes.push_back(near(topic));
+      db->add_entry(MemoryEntry("user1", "conv1",
+                                "Topic note " + std::to_string(i), old + i),
+                    notes.back());
+    }
+    db->add_entry(MemoryEntry("user1", "conv1", "Unrelated A", old),
+                  gaussian());
+    db->add_entry(MemoryEntry("user1", "conv1", "Unrelated B", old),
+                  gaussian());
+    db->add_entry(MemoryEntry("user1", "conv2", "Fresh note", now),
+                  near(topic));
+  }
+
+  std::vector<float> gaussian() {
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::vector<float> v(kDim);
+    for (float &x : v) {
+      x = normal(rng);
+    }
+    return v;
+  }
+
+  // Cosine around 0.95 to base and 0.9 to each other: related, but below
+  // the dedup threshold.
+  std::vector<float> near(const std::vector<float> &base) {
+    std::vector<float> noise = gaussian();
+    std::vector<float> v(kDim);
+    for (int i = 0; i < kDim; i++) {
+      v[i] = base[i] + 0.3f * noise[i];
+    }
+    return v;
+  }
+
+
+  TempDirectory dir;
+  std::unique_ptr<MemoryDatabase> db;
+  std::mt19937 rng{11};
+  std::vector<float> topic;
+  std::vector<std::vector<float>> notes;
+  MemoryCluster seen;
+  const int64_t now = std::time(nullptr);
+  const int64_t old = now - 365 * 24 * 3600;
+};
+
+TEST_F(MemoryConsolidatorTest, ReplacesOldRelatedMemoriesWithSummary) {
+  ConsolidationOptions options;
+  options.min_age_s = 24 * 3600;
+  MemoryConsolidator consolidator(
+      *db, options,
+      [this](const MemoryCluster &cluster,
+             const MemoryConsolidator::KeepGoing &) {
+        seen = cluster;
+        return std::optional<std::string>("Summary of the topic");
+      },
+      [this](MemoryEntry &) { return topic; });
+  ASSERT_TRUE(consolidator.run_once());
+  ASSERT_EQ(seen.ids.size(), 3u);
+  EXPECT_EQ(seen.texts.front(), "Topic note 0"); // oldest first
+  EXPECT_EQ(seen.timestamp, old + 2);
+  EXPECT_EQ(consolidator.consolidated(), 1u);
+  EXPECT_EQ(consolidator.replaced(), 3u);
+  EXPECT_EQ(db->get_entry_count(), 4u);
+
+  auto results = db->search_entries(topic, "user1", 10);
+  ASSERT_EQ(results.size(), 4u);
+  std::vector<std::string> texts;
+  for (const auto &result : results) {
+    texts.emplace_back(result.text);
+  }
+  EXPECT_NE(std::find(texts.begin(), texts.end(), "Summary of the topic"),
+            texts.end());
+  EXPECT_NE(std::find(texts.begin(), texts.end(), "Fresh note"), texts.end());
+  EXPECT_EQ(std::find(texts.begin(), texts.end(), "Topic note 1"),
+            texts.end());
+  // The unrelated memories never form a cluster.
+  EXPECT_FALSE(consolidator.run_once());
+
+  // The swap survives a reload.
+  db->save_index();
+  MemoryDatabase reloaded(dir.path(), kDim, 100);
+  ASSERT_TRUE(reloaded.initialize());
+  EXPECT_EQ(reloaded.get_entry_count(), 4u);
+}
+
+TEST_F(MemoryConsolidatorTest, CancelledSummaryChangesNothing) {
+  ConsolidationOptions options;
+  options.min_age_s = 24 * 3600;
+  MemoryConsolidator *self = nullptr;
+  MemoryConsolidator consolidator(
+      *db, options,
+      [&self](const MemoryCluster &,
+              const MemoryConsolidator::KeepGoing &keep_going) {
+        EXPECT_TRUE(keep_going());
+        self->touch(); // a request arrives mid-summary
+        EXPECT_FALSE(keep_going());
+        return std::optional<std::string>();
+      },
+      [this](MemoryEntry &) { return topic; });
+  self = &consolidator;
+  EXPECT_FALSE(consolidator.run_once());
+  EXPECT_EQ(consolidator.consolidated(), 0u);
+  EXPECT_EQ(db->get_entry_count(), 6u);
+}
+
+TEST_F(MemoryConsolidatorTest, WaitsForRequestsInFlight) {
+  ConsolidationOptions options;
+  options.min_age_s = 24 * 3600;
+  int in_flight = 1; // a request older than idle_for, so no recent touch
+  int summaries = 0;
+  MemoryConsolidator consolidator(
+      *db, options,
+      [&](const MemoryCluster &,
+          const MemoryConsolidator::KeepGoing &keep_going) {
+        summaries++;
+        EXPECT_TRUE(keep_going());
+        in_flight++; // another request starts mid-summary
+        EXPECT_FALSE(keep_going());
+        return std::optional<std::string>("Summary of the topic");
+      },
+      [this](MemoryEntry &) { return topic; },
+      [&in_flight] { return in_flight == 0; });
+  EXPECT_FALSE(consolidator.run_once());
+  EXPECT_EQ(summaries, 0);
+  in_flight = 0;
+  EXPECT_FALSE(consolidator.run_once());
+  EXPECT_EQ(summaries, 1);
+  EXPECT_EQ(consolidator.consolidated(), 0u);
+  EXPECT_EQ(db->get_entry_count(), 6u);
+}
+
+TEST_F(MemoryConsolidatorTest, StaleClusterIsNotReplaced) {
+  auto cluster = db->find_cluster(now - 24 * 3600, 0.8f, 3, 8);
+  ASSERT_TRUE(cluster.has_value());
+  // A near-duplicate merges into a member while the summary is written.
+  db->add_entry(MemoryEntry("user1", "conv1", "Topic note 0 again", old),
+                notes[0]);
+  MemoryEntry summary(cluster->user_id, "consolidated", "Summary", 0);
+  EXPECT_FALSE(db->replace_cluster(*cluster, summary, topic));
+  EXPECT_EQ(db->get_entry_count(), 6u);
+
+  db->remove_user("user1");
+  EXPECT_FALSE(db->find_cluster(now - 24 * 3600, 0.8f, 3, 8).has_value());
+}
+
+} // namespace solus::test
@@ -1,6 +1,13 @@
 #include <memory/database.h>
+#include <memory/mapped_hnsw.h>
 #include "utils/helpers.h"
+#include <algorithm>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <map>
 #include <gtest/gtest.h>
+#include <sys/resource.h>
 
 namespace solus::test {
 
@@ -102,6 +109,77 @@ TEST_F(MemoryDatabaseTest, SaveAndLoad) {
     EXPECT_EQ(new_db->get_entry_count(), original_count);
 }
 
+TEST_F(MemoryDatabaseTest, TokenCacheRoundTrips) {
+    MemoryDatabaseOptions options;
+    options.tokenizer_id = "vocab-a";
+    TempDirectory dir;
+    auto embedding = RandomGenerator::embedding(768);
+    {
+        MemoryDatabase saved(dir.path(), 768, 1000, options);
+        ASSERT_TRUE(saved.initialize());
+        MemoryEntry entry("user1", "conv1", "Tokenized", 1);
+        entry.tokens = {7, 8, 9};
+        saved.add_entry(entry, embedding);
+        saved.save_index();
+    }
+    EXPECT_FALSE(std::filesystem::exists(dir.path() + "/tokens.bin.tmp"));
+    MemoryDatabase loaded(dir.path(), 768, 1000, options);
+    ASSERT_TRUE(loaded.initialize());
+    auto results = loaded.search_entries(embedding, "user1", 1);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(std::vector<int32_t>(results[0].tokens.begin(),
+                                   results[0].tokens.end()),
+              (std::vector<int32_t>{7, 8, 9}));
+    // Another vocabulary's IDs would be wrong for this model.
+    options.tokenizer_id = "vocab-b";
+    MemoryDatabase other(dir.path(), 768, 1000, options);
+    ASSERT_TRUE(other.initialize());
+    results = other.search_entries(embedding, "user1", 1);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0].text, "Tokenized");
+    EXPECT_TRUE(results[0].tokens.empty());
+}
+
+TEST_F(MemoryDatabaseTest, CorruptTokenCacheIsIgnored) {
+    MemoryDatabaseOptions options;
+    options.tokenizer_id = "vocab-a";
+    options.ivf_pq = true;
+    options.ivf.nlist = 4;
+    options.ivf.m = 96;
+    TempDirectory dir;
+    auto embedding = RandomGenerator::embedding(768);
+    {
+        MemoryDatabase saved(dir.path(), 768, 1000, options);
+        ASSERT_TRUE(saved.initialize());
+        MemoryEntry entry("user1", "conv1", "Tokenized", 1);
+        entry.tokens = {7, 8, 9};
+        saved.add_entry(entry, embedding);
+        saved.save_index();
+    }
+    const std::string path = dir.path() + "/tokens.bin";
+    const auto size = std::filesystem::file_size(path);
+    std::string bytes(size, '\0');
+    std::ifstream(path, std::ios::binary).read(bytes.data(), size);
+    // A huge tokenizer ID length, a huge token count, and cut-off files.
+    std::string huge_id = bytes;
+    std::fill(huge_id.begin() + 4, huge_id.begin() + 12, '\xff');
+    std::string huge_count = bytes;
+    std::fill(huge_count.end() - 16, huge_count.end() - 12, '\xff');
+    std::vector<std::string> corrupt = {huge_id, huge_count,
+                                        bytes.substr(0, 2),
+                                        bytes.substr(0, size - 4)};
+    for (const auto &contents : corrupt) {
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << contents;
+        MemoryDatabase loaded(dir.path(), 768, 1000, options);
+        ASSERT_TRUE(loaded.initialize());
+        EXPECT_EQ(loaded.get_entry_count(), 1u);
+        auto results = loaded.search_entries(embedding, "user1", 1);
+        ASSERT_EQ(results.size(), 1);
+        EXPECT_EQ(results[0].text, "Tokenized");
+        EXPECT_TRUE(results[0].tokens.empty());
+    }
+}
+
 TEST_F(MemoryDatabaseTest, WrongEmbeddingDimension) {
     MemoryEntry entry("user1", "conv1", "Test", 123456);
     auto wrong_embedding = RandomGenerator::embedding(512); // Wrong size
@@ -136,4 +214,486 @@ TEST_F(MemoryDatabaseTest, LargeScaleMemories) {
     std::cout << "Search time: " << search_time << "ms" << std::endl;
 }
 
+TEST_F(MemoryDatabaseTest, ExactSearchReturnsNearestFirst) {
+    std::vector<std::vector<float>> embeddings;
+    for (int i = 0; i < 20; i++) {
+        MemoryEntry entry("user1", "conv1", "Memory " + std::to_string(i),
+                          123456 + i);
+        embeddings.push_back(RandomGenerator::embedding(768));
+        db->add_entry(entry, embeddings.back());
+    }
+    auto results = db->search_entries(embeddings[7], "user1", 5);
+    ASSERT_EQ(results.size(), 5);
+    EXPECT_EQ(results[0].text, "Memory 7");
+}
+
+TEST_F(MemoryDatabaseTest, HeavyUserFallsBackToIndex) {
+    MemoryDatabaseOptions options;
+    options.brute_force_threshold = 4;
+    TempDirectory dir;
+    MemoryDatabase small_db(dir.path(), 768, 1000, options);
+    ASSERT_TRUE(small_db.initialize());
+    std::vector<float> target;
+    for (int i = 0; i < 10; i++) {
+        auto embedding = RandomGenerator::embedding(768);
+        if (i == 3) {
+            target = embedding;
+        }
+        small_db.add_entry(
+            MemoryEntry("heavy", "conv1", "Heavy " + std::to_string(i), i),
+            embedding);
+        small_db.add_entry(
+            MemoryEntry("light", "conv2", "Light " + std::to_string(i), i),
+            RandomGenerator::embedding(768));
+    }
+    auto results = small_db.search_entries(target, "heavy", 5);
+    ASSERT_FALSE(results.empty());
+    EXPECT_EQ(results[0].text, "Heavy 3");
+    for (const auto& result : results) {
+        EXPECT_EQ(result.user_id, "heavy");
+    }
+}
+
+TEST_F(MemoryDatabaseTest, NearDuplicateMergesIntoExisting) {
+    auto embedding = RandomGenerator::embedding(768);
+    db->add_entry(MemoryEntry("user1", "conv1", "add milk to my list", 100),
+                  embedding);
+    db->add_entry(MemoryEntry("user1", "conv1", "add milk to my list", 200),
+                  embedding);
+    EXPECT_EQ(db->get_entry_count(), 1);
+    auto results = db->search_entries(embedding, "user1", 5);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0].hit_count, 2u);
+    EXPECT_EQ(results[0].timestamp, 200);
+}
+
+TEST_F(MemoryDatabaseTest, DuplicatesAcrossUsersAreKept) {
+    auto embedding = RandomGenerator::embedding(768);
+    db->add_entry(MemoryEntry("user1", "conv1", "Same", 100), embedding);
+    db->add_entry(MemoryEntry("user2", "conv2", "Same", 100), embedding);
+    EXPECT_EQ(db->get_entry_count(), 2);
+}
+
+TEST_F(MemoryDatabaseTest, DedupDisabled) {
+    MemoryDatabaseOptions options;
+    options.dedup_threshold = 0.0f;
+    TempDirectory dir;
+    MemoryDatabase plain_db(dir.path(), 768, 1000, options);
+    ASSERT_TRUE(plain_db.initialize());
+    auto embedding = RandomGenerator::embedding(768);
+    plain_db.add_entry(MemoryEntry("user1", "conv1", "Same", 100), embedding);
+    plain_db.add_entry(MemoryEntry("user1", "conv1", "Same", 200), embedding);
+    EXPECT_EQ(plain_db.get_entry_count(), 2);
+}
+
+TEST_F(MemoryDatabaseTest, BulkInsertReportsPerRecordResults) {
+    auto existing = RandomGenerator::embedding(768);
+    db->add_entry(MemoryEntry("user1", "conv1", "Existing", 100), existing);
+    std::vector<MemoryEntry> entries;
+    std::vector<std::vector<float>> embeddings;
+    for (int i = 0; i < 50; i++) {
+        entries.emplace_back("user" + std::to_string(i % 3), "conv1",
+                             "Imported " + std::to_string(i), 200 + i);
+        embeddings.push_back(RandomGenerator::embedding(768));
+    }
+    entries.emplace_back("user1", "conv1", "Existing", 300);
+    embeddings.push_back(existing);
+    entries.emplace_back("user1", "conv1", "Bad", 300);
+    embeddings.push_back(RandomGenerator::embedding(512));
+    auto results = db->add_entries(entries, embeddings, 4);
+    ASSERT_EQ(results.size(), entries.size());
+    for (int i = 0; i < 50; i++) {
+        EXPECT_EQ(results[i], MemoryDatabase::EInsertResult::ADDED);
+    }
+    EXPECT_EQ(results[50], MemoryDatabase::EInsertResult::MERGED);
+    EXPECT_EQ(results[51], MemoryDatabase::EInsertResult::FAILED);
+    EXPECT_EQ(db->get_entry_count(), 51);
+    auto found = db->search_entries(embeddings[7], "user1", 1);
+    ASSERT_EQ(found.size(), 1);
+    EXPECT_EQ(found[0].text, "Imported 7");
+}
+
+TEST_F(MemoryDatabaseTest, BulkInsertSpansSeveralChunks) {
+    std::vector<MemoryEntry> entries;
+    std::vector<std::vector<float>> embeddings;
+    for (int i = 0; i < 300; i++) {
+        entries.emplace_back("user" + std::to_string(i % 5), "conv1",
+                             "Imported " + std::to_string(i), 200 + i);
+        embeddings.push_back(RandomGenerator::embedding(768));
+    }
+    auto results = db->add_entries(entries, embeddings, 2);
+    for (const auto &result : results) {
+        EXPECT_EQ(result, MemoryDatabase::EInsertResult::ADDED);
+    }
+    EXPECT_EQ(db->get_entry_count(), 300);
+    auto found = db->search_entries(embeddings[297], "user2", 1);
+    ASSERT_EQ(found.size(), 1);
+    EXPECT_EQ(found[0].text, "Imported 297");
+}
+
+TEST_F(MemoryDatabaseTest, GrowsPastInitialCapacity) {
+    TempDirectory dir;
+    MemoryDatabase small_db(dir.path(), 768, 10);
+    ASSERT_TRUE(small_db.initialize());
+    for (int i = 0; i < 25; i++) {
+        small_db.add_entry(
+            MemoryEntry("user1", "conv1", "Memory " + std::to_string(i), i),
+            RandomGenerator::embedding(768));
+    }
+    EXPECT_EQ(small_db.get_entry_count(), 25);
+}
+
+TEST_F(MemoryDatabaseTest, QueuedEntriesAreSearchableBeforeIndexing) {
+    MemoryDatabaseOptions options;
+    options.background_indexing = true;
+    TempDirectory dir;
+    {
+        MemoryDatabase async_db(dir.path(), 768, 1000, options);
+        ASSERT_TRUE(async_db.initialize());
+        auto embedding = RandomGenerator::embedding(768);
+        async_db.enqueue_entry(
+            MemoryEntry("user1", "conv1", "Latest turn", 100), embedding);
+        auto results = async_db.search_entries(embedding, "user1", 5);
+        ASSERT_EQ(results.size(), 1);
+        EXPECT_EQ(results[0].text, "Latest turn");
+        async_db.enqueue_entry(
+            MemoryEntry("user1", "conv1", "Latest turn", 200), embedding);
+        async_db.flush();
+        EXPECT_EQ(async_db.get_pending_count(), 0u);
+        EXPECT_EQ(async_db.get_entry_count(), 1u);
+        results = async_db.search_entries(embedding, "user1", 5);
+        ASSERT_EQ(results.size(), 1);
+        EXPECT_EQ(results[0].hit_count, 2u);
+    }
+    MemoryDatabase reloaded(dir.path(), 768, 1000);
+    ASSERT_TRUE(reloaded.initialize());
+    EXPECT_EQ(reloaded.get_entry_count(), 1u);
+}
+
+TEST_F(MemoryDatabaseTest, QueuedDuplicatesMergeWithinABatch) {
+    MemoryDatabaseOptions options;
+    options.background_indexing = true;
+    TempDirectory dir;
+    MemoryDatabase async_db(dir.path(), 768, 1000, options);
+    ASSERT_TRUE(async_db.initialize());
+    auto embedding = RandomGenerator::embedding(768);
+    for (int i = 0; i < 10; i++) {
+        async_db.enqueue_entry(
+            MemoryEntry("user1", "conv1", "Repeated turn", i), embedding);
+    }
+    async_db.enqueue_entry(MemoryEntry("user2", "conv2", "Repeated turn", 0),
+                           embedding);
+    async_db.flush();
+    EXPECT_EQ(async_db.get_entry_count(), 2u);
+    auto results = async_db.search_entries(embedding, "user1", 5);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0].hit_count, 10u);
+    EXPECT_EQ(results[0].timestamp, 9);
+}
+
+TEST_F(MemoryDatabaseTest, MappedStorageGrowsAndReopens) {
+    MemoryDatabaseOptions options;
+    options.mmap_storage = true;
+    TempDirectory dir;
+    auto target = RandomGenerator::embedding(768);
+    {
+        MemoryDatabase mapped(dir.path(), 768, 10, options);
+        ASSERT_TRUE(mapped.initialize());
+        for (int i = 0; i < 24; i++) {
+            mapped.add_entry(
+                MemoryEntry("user1", "conv1", "Memory " + std::to_string(i), i),
+                RandomGenerator::embedding(768));
+        }
+        mapped.add_entry(MemoryEntry("user1", "conv1", "Target", 99), target);
+    }
+    EXPECT_FALSE(std::filesystem::exists(dir.path() + "/index.bin"));
+    EXPECT_TRUE(std::filesystem::exists(dir.path() + "/level0.bin"));
+    // Reopened without the option: the on-disk format decides.
+    MemoryDatabase reopened(dir.path(), 768, 10);
+    ASSERT_TRUE(reopened.initialize());
+    EXPECT_EQ(reopened.get_entry_count(), 25u);
+    auto results = reopened.search_entries(target, "user1", 1);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0].text, "Target");
+}
+
+TEST_F(MemoryDatabaseTest, MigratesIndexFileToMappedStorage) {
+    auto embedding = RandomGenerator::embedding(768);
+    db->add_entry(MemoryEntry("user1", "conv1", "Before migration", 1),
+                  embedding);
+    db->save_index();
+    db.reset();
+    MemoryDatabaseOptions options;
+    options.mmap_storage = true;
+    MemoryDatabase migrated(temp_dir->path(), 768, 1000, options);
+    ASSERT_TRUE(migrated.initialize());
+    EXPECT_FALSE(std::filesystem::exists(temp_dir->path() + "/index.bin"));
+    auto results = migrated.search_entries(embedding, "user1", 1);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0].text, "Before migration");
+}
+
+TEST_F(MemoryDatabaseTest, MappedIndexAllowsOneWriterOrManyReaders) {
+    TempDirectory dir;
+    hnswlib::InnerProductSpace space(768);
+    auto embedding = RandomGenerator::embedding(768);
+    {
+        auto writer = MappedHnswIndex::create(dir.path(), &space, 16, 16, 200);
+        ASSERT_NE(writer, nullptr);
+        writer->addPoint(embedding.data(), 0);
+        ASSERT_TRUE(writer->save(dir.path()));
+        EXPECT_EQ(MappedHnswIndex::open(dir.path(), &space), nullptr);
+        EXPECT_EQ(MappedHnswIndex::open_readonly(dir.path(), &space), nullptr);
+    }
+    auto first = MappedHnswIndex::open_readonly(dir.path(), &space);
+    auto second = MappedHnswIndex::open_readonly(dir.path(), &space);
+    ASSERT_NE(first, nullptr);
+    ASSERT_NE(second, nullptr);
+    EXPECT_EQ(MappedHnswIndex::open(dir.path(), &space), nullptr);
+    auto results = second->searchKnn(embedding.data(), 1);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results.top().second, 0u);
+    EXPECT_THROW(first->addPoint(embedding.data(), 1), std::runtime_error);
+    EXPECT_FALSE(first->save(dir.path()));
+}
+
+TEST_F(MemoryDatabaseTest, IvfPqTrainsAndReopens) {
+    MemoryDatabaseOptions options;
+    options.ivf_pq = true;
+    options.brute_force_threshold = 16; // user1 goes through the index
+    options.ivf.nlist = 4;
+    options.ivf.m = 96;
+    options.ivf_train_size = 100;
+    TempDirectory dir;
+    auto target = RandomGenerator::embedding(768);
+    {
+        MemoryDatabase ivf(dir.path(), 768, 10, options);
+        ASSERT_TRUE(ivf.initialize());
+        std::vector<MemoryEntry> entries;
+        std::vector<std::vector<float>> embeddings;
+        for (int i = 0; i < 150; i++) {
+            entries.emplace_back("user1", "conv1",
+                                 "Memory " + std::to_string(i), i);
+            embeddings.push_back(RandomGenerator::embedding(768));
+        }
+        ivf.add_entries(entries, embeddings);
+        ivf.add_entry(MemoryEntry("user1", "conv1", "Target", 99), target);
+        ivf.add_entry(MemoryEntry("user2", "conv2", "Other user", 1),
+                      RandomGenerator::embedding(768));
+        auto results = ivf.search_entries(target, "user1", 1);
+        ASSERT_EQ(results.size(), 1);
+        EXPECT_EQ(results[0].text, "Target");
+    }
+    EXPECT_TRUE(std::filesystem::exists(dir.path() + "/vectors.bin"));
+    EXPECT_TRUE(std::filesystem::exists(dir.path() + "/ivfpq.bin"));
+    // Reopened without the option: the on-disk format decides.
+    MemoryDatabase reopened(dir.path(), 768, 10);
+    ASSERT_TRUE(reopened.initialize());
+    EXPECT_EQ(reopened.get_entry_count(), 152u);
+    auto results = reopened.search_entries(target, "user1", 3);
+    ASSERT_EQ(results.size(), 3);
+    EXPECT_EQ(results[0].text, "Target");
+    for (const auto &result : results) {
+        EXPECT_EQ(result.user_id, "user1");
+    }
+}
+
+TEST_F(MemoryDatabaseTest, RejectsInvalidIvfPqParameters) {
+    MemoryDatabaseOptions options;
+    options.ivf_pq = true;
+    options.ivf.nlist = 0;
+    TempDirectory no_lists;
+    MemoryDatabase untrainable(no_lists.path(), 768, 10, options);
+    EXPECT_FALSE(untrainable.initialize());
+    options.ivf.nlist = 4;
+    options.ivf.m = 100; // does not divide 768
+    TempDirectory uneven;
+    MemoryDatabase unsplittable(uneven.path(), 768, 10, options);
+    EXPECT_FALSE(unsplittable.initialize());
+}
+
+TEST_F(MemoryDatabaseTest, FailedVectorFileGrowthFailsInserts) {
+    MemoryDatabaseOptions options;
+    options.ivf_pq = true;
+    options.dedup_threshold = 0.0f;
+    options.ivf.nlist = 4;
+    options.ivf.m = 96;
+    options.ivf_train_size = 100000;
+    TempDirectory dir;
+    MemoryDatabase ivf(dir.path(), 768, 10, options);
+    ASSERT_TRUE(ivf.initialize());
+    std::vector<MemoryEntry> entries;
+    std::vector<std::vector<float>> embeddings;
+    for (int i = 0; i < 1024; i++) {
+        entries.emplace_back("user1", "conv1", "Memory " + std::to_string(i),
+                             i);
+        embeddings.push_back(RandomGenerator::embedding(768));
+    }
+    // vectors.bin is created with room for 1024 rows; with a file size
+    // limit the next growth fails with EFBIG instead of a signal.
+    struct FileSizeLimit {
+        rlimit saved{};
+        FileSizeLimit() {
+            getrlimit(RLIMIT_FSIZE, &saved);
+            std::signal(SIGXFSZ, SIG_IGN);
+            rlimit limited = saved;
+            limited.rlim_cur = 1 << 20;
+            setrlimit(RLIMIT_FSIZE, &limited);
+        }
+        ~FileSizeLimit() {
+            setrlimit(RLIMIT_FSIZE, &saved);
+            std::signal(SIGXFSZ, SIG_DFL);
+        }
+    };
+    {
+        FileSizeLimit limit;
+        auto results = ivf.add_entries(entries, embeddings);
+        EXPECT_EQ(std::count(results.begin(), results.end(),
+                             MemoryDatabase::EInsertResult::ADDED),
+                  1024);
+        std::vector<MemoryEntry> more(3, MemoryEntry("user1", "conv1",
+                                                     "Overflow", 2000));
+        std::vector<std::vector<float>> more_embeddings;
+        for (size_t i = 0; i < more.size(); i++) {
+            more_embeddings.push_back(RandomGenerator::embedding(768));
+        }
+        EXPECT_NO_THROW(results = ivf.add_entries(more, more_embeddings));
+        for (auto result : results) {
+            EXPECT_EQ(result, MemoryDatabase::EInsertResult::FAILED);
+        }
+        EXPECT_NO_THROW(ivf.add_entry(MemoryEntry("user1", "conv1",
+                                                  "Overflow", 2001),
+                                      RandomGenerator::embedding(768)));
+        EXPECT_EQ(ivf.get_entry_count(), 1024u);
+    }
+    auto target = RandomGenerator::embedding(768);
+    ivf.add_entry(MemoryEntry("user1", "conv1", "After the limit", 3000),
+                  target);
+    EXPECT_EQ(ivf.get_entry_count(), 1025u);
+    auto results = ivf.search_entries(target, "user1", 1);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0].text, "After the limit");
+}
+
+TEST_F(MemoryDatabaseTest, MigratesIndexFileToIvfPq) {
+    auto embedding = RandomGenerator::embedding(768);
+    db->add_entry(MemoryEntry("user1", "conv1", "Before migration", 1),
+                  embedding);
+    db->save_index();
+    MemoryDatabaseOptions options;
+    options.ivf_pq = true;
+    MemoryDatabase migrated(temp_dir->path(), 768, 1000, options);
+    ASSERT_TRUE(migrated.initialize());
+    EXPECT_FALSE(std::filesystem::exists(temp_dir->path() + "/index.bin"));
+    auto results = migrated.search_entries(embedding, "user1", 1);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0].text, "Before migration");
+}
+
+TEST_F(MemoryDatabaseTest, ReadOnlyOpenLeavesFilesUntouched) {
+    // Contents and modification times: rewriting identical bytes still
+    // counts as a write.
+    auto snapshot = [](const std::string &dir) {
+        std::map<std::string,
+                 std::pair<std::string, std::filesystem::file_time_type>>
+            files;
+        for (const auto &file : std::filesystem::directory_iterator(dir)) {
+            std::ifstream in(file.path(), std::ios::binary);
+            files[file.path().filename().string()] = {
+                std::string(std::istreambuf_iterator<char>(in), {}),
+                file.last_write_time()};
+        }
+        return files;
+    };
+    MemoryDatabaseOptions mapped;
+    mapped.mmap_storage = true;
+    MemoryDatabaseOptions ivf;
+    ivf.ivf_pq = true;
+    ivf.ivf.nlist = 4;
+    ivf.ivf.m = 96;
+    for (const MemoryDatabaseOptions &options :
+         {MemoryDatabaseOptions(), mapped, ivf}) {
+        TempDirectory dir;
+        auto target = RandomGenerator::embedding(768);
+        {
+            MemoryDatabase writer(dir.path(), 768, 100, options);
+            ASSERT_TRUE(writer.initialize());
+            for (int i = 0; i < 20; i++) {
+                writer.add_entry(MemoryEntry("user1", "conv1",
+                                             "Memory " + std::to_string(i), i),
+                                 RandomGenerator::embedding(768));
+            }
+            writer.add_entry(MemoryEntry("user1", "conv1", "Target", 99),
+                             target);
+        }
+        const auto before = snapshot(dir.path());
+        {
+            MemoryDatabaseOptions read_only = options;
+            read_only.read_only = true;
+            MemoryDatabase reader(dir.path(), 768, 100, read_only);
+            ASSERT_TRUE(reader.initialize());
+            auto results = reader.search_entries(target, "user1", 1);
+            ASSERT_EQ(results.size(), 1);
+            EXPECT_EQ(results[0].text, "Target");
+            reader.add_entry(MemoryEntry("user1", "conv1", "Refused", 100),
+                             RandomGenerator::embedding(768));
+            EXPECT_EQ(reader.remove_user("user1"), 0u);
+            EXPECT_EQ(reader.get_entry_count(), 21u);
+        }
+        EXPECT_EQ(snapshot(dir.path()), before);
+    }
+}
+
+TEST_F(MemoryDatabaseTest, ExportAndRemoveUser) {
+    auto embedding = RandomGenerator::embedding(768);
+    db->add_entry(MemoryEntry("user1", "conv1", "Moving out", 1), embedding);
+    db->add_entry(MemoryEntry("user2", "conv2", "Staying", 2),
+                  RandomGenerator::embedding(768));
+    auto exported = db->export_user("user1");
+    ASSERT_EQ(exported.size(), 1u);
+    EXPECT_EQ(exported[0].first.text, "Moving out");
+    EXPECT_EQ(exported[0].second.size(), 768u);
+
+    EXPECT_EQ(db->remove_user("user1"), 1u);
+    EXPECT_EQ(db->get_entry_count(), 1u);
+    EXPECT_TRUE(db->search_entries(embedding, "user1", 5).empty());
+    db->save_index();
+
+    MemoryDatabase reloaded(temp_dir->path(), 768, 1000);
+    ASSERT_TRUE(reloaded.initialize());
+    EXPECT_EQ(reloaded.get_entry_count(), 1u);
+    EXPECT_TRUE(reloaded.search_entries(embedding, "user1", 5).empty());
+    EXPECT_TRUE(reloaded.export_user("user1").empty());
+}
+
+TEST_F(MemoryDatabaseTest, ReportsStoredDimensionAndLiveVectors) {
+    EXPECT_EQ(MemoryDatabase::stored_dimension(temp_dir->path()), 0);
+    MemoryDatabaseOptions ivf;
+    ivf.ivf_pq = true;
+    ivf.ivf.nlist = 4;
+    ivf.ivf.m = 96;
+    for (const auto &options : {MemoryDatabaseOptions{}, ivf}) {
+        TempDirectory dir;
+        {
+            MemoryDatabase saved(dir.path(), 768, 1000, options);
+            ASSERT_TRUE(saved.initialize());
+            saved.add_entry(MemoryEntry("user1", "conv1", "Removed", 1),
+                            RandomGenerator::embedding(768));
+            saved.add_entry(MemoryEntry("user2", "conv2", "Kept", 2),
+                            RandomGenerator::embedding(768));
+            saved.remove_user("user1");
+        }
+        EXPECT_EQ(MemoryDatabase::stored_dimension(dir.path()), 768);
+        MemoryDatabaseOptions read_only;
+        read_only.read_only = true;
+        MemoryDatabase loaded(dir.path(), 768, 1, read_only);
+        ASSERT_TRUE(loaded.initialize());
+        EXPECT_EQ(loaded.live_ids(), std::vector<size_t>{1});
+        std::vector<float> vec;
+        EXPECT_FALSE(loaded.get_vector(0, vec));
+        ASSERT_TRUE(loaded.get_vector(1, vec));
+        EXPECT_EQ(vec.size(), 768u);
+    }
+}
+
 } // namespace solus::test
\ No newline at end of file
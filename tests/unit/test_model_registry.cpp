@@ -0,0 +1,96 @@
+#include "llm/model_registry.h"
+#include "utils/helpers.h"
+#include <gtest/gtest.h>
+
+namespace solus::test {
+
+// Handlers are constructed but never initialized, so no model is loaded;
+// the registry only sizes models by file and tracks their lifetimes.
+class ModelRegistryTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    m_TempDir = std::make_unique<TempDirectory>();
+    for (const char *name : {"big", "small", "tiny"}) {
+      std::string path = m_TempDir->path() + "/" + name + ".gguf";
+      size_t size = std::string(name) == "big" ? 4096 : 1024;
+      MockFileCreator::create_bin_file(path, size);
+      m_Specs.push_back({name, path, "qwen"});
+    }
+  }
+
+  ModelRegistry::Loader counting_loader() {
+    return [this](const ModelSpec &spec) {
+      m_Loads.push_back(spec.name);
+      ServerConfig config;
+      config.model_path = spec.path;
+      return std::make_shared<LlamaHandler>(config);
+    };
+  }
+
+  std::unique_ptr<TempDirectory> m_TempDir;
+  std::vector<ModelSpec> m_Specs;
+  std::vector<std::string> m_Loads;
+};
+
+TEST_F(ModelRegistryTest, LoadsLazily) {
+  ModelRegistry registry(m_Specs, 0, counting_loader());
+  ASSERT_TRUE(registry.initialize());
+  EXPECT_EQ(m_Loads, std::vector<std::string>{"big"});
+  auto small = registry.acquire("small");
+  ASSERT_NE(small, nullptr);
+  EXPECT_EQ(registry.acquire("small"), small);
+  EXPECT_EQ(m_Loads.size(), 2u);
+  EXPECT_EQ(registry.acquire("missing"), nullptr);
+  EXPECT_EQ(registry.acquire(""), registry.default_model());
+}
+
+TEST_F(ModelRegistryTest, EvictsLeastRecentlyUsedWithinBudget) {
+  ModelRegistry registry(m_Specs, 4096 + 1024, counting_loader());
+  ASSERT_TRUE(registry.initialize());
+  auto small = registry.acquire("small");
+  std::weak_ptr<LlamaHandler> small_weak = small;
+  small.reset();
+  ASSERT_NE(registry.acquire("tiny"), nullptr);
+  // The pinned default stays; small was evicted to make room for tiny.
+  EXPECT_TRUE(small_weak.expired());
+  EXPECT_NE(registry.default_model(), nullptr);
+  EXPECT_EQ(registry.loaded_bytes(), 4096u + 1024u);
+  for (const auto &status : registry.status()) {
+    EXPECT_EQ(status.loaded, status.name != "small") << status.name;
+  }
+}
+
+TEST_F(ModelRegistryTest, ModelInUseIsNotEvicted) {
+  ModelRegistry registry(m_Specs, 4096 + 1024, counting_loader());
+  ASSERT_TRUE(registry.initialize());
+  auto small = registry.acquire("small");
+  ASSERT_NE(registry.acquire("tiny"), nullptr);
+  // Over budget rather than a second copy of small once it is acquired
+  // again.
+  EXPECT_EQ(registry.acquire("small"), small);
+  EXPECT_EQ(m_Loads.size(), 3u);
+  EXPECT_EQ(registry.loaded_bytes(), 4096u + 1024u + 1024u);
+}
+
+TEST_F(ModelRegistryTest, SamePathSharesOneModel) {
+  m_Specs.push_back({"alias", m_Specs[1].path, "chatml"});
+  ModelRegistry registry(m_Specs, 0, counting_loader());
+  ASSERT_TRUE(registry.initialize());
+  EXPECT_EQ(registry.acquire("small"), registry.acquire("alias"));
+  EXPECT_EQ(m_Loads.size(), 2u);
+}
+
+TEST_F(ModelRegistryTest, FailedLoadIsRetried) {
+  int attempts = 0;
+  ModelRegistry registry(m_Specs, 0, [&](const ModelSpec &spec) {
+    attempts++;
+    return spec.name == "small" && attempts == 2
+               ? nullptr
+               : std::make_shared<LlamaHandler>(ServerConfig{});
+  });
+  ASSERT_TRUE(registry.initialize());
+  EXPECT_EQ(registry.acquire("small"), nullptr);
+  EXPECT_NE(registry.acquire("small"), nullptr);
+}
+
+} // namespace solus::test
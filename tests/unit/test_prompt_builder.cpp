@@ -77,4 +77,143 @@ TEST_F(PromptBuilderTest, LongMessageHandling) {
   EXPECT_TRUE(StringUtils::contains(prompt, long_message));
 }
 
+// One token per byte; enough to check budgeting without a model.
+static std::vector<int32_t> byte_tokenize(const std::string &text, bool,
+                                          bool) {
+  return std::vector<int32_t>(text.begin(), text.end());
+}
+
+static std::string to_text(const std::vector<int32_t> &tokens) {
+  return std::string(tokens.begin(), tokens.end());
+}
+
+TEST_F(PromptBuilderTest, TokenPromptMatchesTextPrompt) {
+  std::vector<MemoryEntry> memories;
+  memories.emplace_back("user1", "conv1", "Previous conversation", 123456);
+  std::vector<MemoryView> views;
+  for (const auto &mem : memories) {
+    views.emplace_back(mem);
+  }
+  auto prompt = builder.build_chat_tokens(
+      "Hello", views, PromptBuilder::EPromptFormat::QWEN, byte_tokenize, 100000);
+  EXPECT_EQ(prompt.memories_used, 1u);
+  EXPECT_FALSE(prompt.truncated);
+  EXPECT_EQ(to_text(prompt.tokens),
+            builder.build_chat_prompt("Hello", memories,
+                                      PromptBuilder::EPromptFormat::QWEN));
+  // The kept prefix is the system prompt up to the memories.
+  std::string kept = to_text(prompt.tokens).substr(0, prompt.n_keep);
+  EXPECT_TRUE(kept.starts_with("<|im_start|>system\n"));
+  EXPECT_TRUE(kept.ends_with("Relevant memories:\n"));
+}
+
+TEST_F(PromptBuilderTest, TokenPromptUsesStoredTokens) {
+  MemoryEntry entry("user1", "conv1", "text form", 123456);
+  entry.tokens = byte_tokenize("token form", false, false);
+  std::vector<MemoryView> views{MemoryView(entry)};
+  auto prompt = builder.build_chat_tokens(
+      "Hi", views, PromptBuilder::EPromptFormat::QWEN, byte_tokenize, 100000);
+  std::string text = to_text(prompt.tokens);
+  EXPECT_TRUE(StringUtils::contains(text, "token form"));
+  EXPECT_FALSE(StringUtils::contains(text, "text form"));
+}
+
+TEST_F(PromptBuilderTest, TokenPromptRespectsBudget) {
+  auto base = builder.build_chat_tokens(
+      "Question", {}, PromptBuilder::EPromptFormat::QWEN, byte_tokenize, 100000);
+  std::vector<MemoryEntry> memories;
+  memories.emplace_back("user1", "conv1", std::string(100, 'a'), 1);
+  memories.emplace_back("user1", "conv1", std::string(10, 'b'), 2);
+  std::vector<MemoryView> views;
+  for (const auto &mem : memories) {
+    views.emplace_back(mem);
+  }
+  // Room for the short memory but not the long one.
+  const int budget = static_cast<int>(base.tokens.size()) + 60;
+  auto prompt = builder.build_chat_tokens(
+      "Question", views, PromptBuilder::EPromptFormat::QWEN, byte_tokenize,
+      budget);
+  EXPECT_LE(prompt.tokens.size(), static_cast<size_t>(budget));
+  EXPECT_EQ(prompt.memories_used, 1u);
+  EXPECT_TRUE(StringUtils::contains(to_text(prompt.tokens), "bbbbbbbbbb"));
+}
+
+TEST_F(PromptBuilderTest, TokenPromptTruncatesOversizedMessage) {
+  auto base = builder.build_chat_tokens(
+      "", {}, PromptBuilder::EPromptFormat::QWEN, byte_tokenize, 100000);
+  const int budget = static_cast<int>(base.tokens.size()) + 50;
+  auto prompt = builder.build_chat_tokens(
+      std::string(1000, 'x'), {}, PromptBuilder::EPromptFormat::QWEN,
+      byte_tokenize, budget);
+  EXPECT_TRUE(prompt.truncated);
+  EXPECT_EQ(prompt.tokens.size(), static_cast<size_t>(budget));
+}
+
+TEST_F(PromptBuilderTest, TokenPromptReportsFrameOverflow) {
+  auto base = builder.build_chat_tokens(
+      "", {}, PromptBuilder::EPromptFormat::QWEN, byte_tokenize, 100000);
+  EXPECT_TRUE(base.fits);
+  for (int budget : {static_cast<int>(base.tokens.size()) - 1, 0, -10}) {
+    auto prompt = builder.build_chat_tokens(
+        "Question", {}, PromptBuilder::EPromptFormat::QWEN, byte_tokenize,
+        budget);
+    EXPECT_FALSE(prompt.fits) << budget;
+    EXPECT_TRUE(prompt.tokens.empty()) << budget;
+  }
+}
+
+TEST_F(PromptBuilderTest, Llama3Format) {
+  std::vector<MemoryEntry> memories;
+  memories.emplace_back("user1", "conv1", "Likes tea", 1);
+  std::string prompt = builder.build_chat_prompt(
+      "Hi", memories, PromptBuilder::EPromptFormat::LLAMA3);
+  size_t system = prompt.find("<|start_header_id|>system<|end_header_id|>");
+  size_t memory = prompt.find("Likes tea");
+  size_t user = prompt.find("<|start_header_id|>user<|end_header_id|>\n\nHi");
+  size_t assistant = prompt.find("<|start_header_id|>assistant");
+  EXPECT_NE(system, std::string::npos);
+  EXPECT_LT(system, memory);
+  EXPECT_LT(memory, user);
+  EXPECT_LT(user, assistant);
+  EXPECT_FALSE(StringUtils::contains(prompt, "{memories}"));
+}
+
+TEST_F(PromptBuilderTest, MistralFormat) {
+  std::string prompt = builder.build_chat_prompt(
+      "Hi", std::vector<MemoryEntry>{}, PromptBuilder::EPromptFormat::MISTRAL);
+  EXPECT_EQ(prompt.rfind("[INST] ", 0), 0u);
+  EXPECT_TRUE(StringUtils::contains(prompt, "\n\nHi [/INST]"));
+  EXPECT_TRUE(StringUtils::contains(prompt, "No previous context"));
+}
+
+TEST_F(PromptBuilderTest, ChatmlMatchesQwen) {
+  std::vector<MemoryEntry> memories;
+  EXPECT_EQ(builder.build_chat_prompt("Hi", memories,
+                                      PromptBuilder::EPromptFormat::CHATML),
+            builder.build_chat_prompt("Hi", memories,
+                                      PromptBuilder::EPromptFormat::QWEN));
+}
+
+TEST_F(PromptBuilderTest, RenderReusesBuffer) {
+  std::vector<MemoryView> memories;
+  std::string buffer;
+  builder.render_chat_prompt(buffer, std::string(1000, 'x'), memories,
+                             PromptBuilder::EPromptFormat::QWEN);
+  const size_t capacity = buffer.capacity();
+  builder.render_chat_prompt(buffer, "short", memories,
+                             PromptBuilder::EPromptFormat::QWEN);
+  EXPECT_EQ(buffer.capacity(), capacity);
+  EXPECT_TRUE(StringUtils::contains(buffer, "short"));
+  EXPECT_FALSE(StringUtils::contains(buffer, "xxx"));
+}
+
+TEST_F(PromptBuilderTest, ParseFormat) {
+  PromptBuilder::EPromptFormat format = PromptBuilder::EPromptFormat::QWEN;
+  EXPECT_TRUE(PromptBuilder::parse_format("llama3", format));
+  EXPECT_EQ(format, PromptBuilder::EPromptFormat::LLAMA3);
+  EXPECT_TRUE(PromptBuilder::parse_format("mistral", format));
+  EXPECT_EQ(format, PromptBuilder::EPromptFormat::MISTRAL);
+  EXPECT_FALSE(PromptBuilder::parse_format("gpt", format));
+}
+
 } // namespace solus::test
\ No newline at end of file
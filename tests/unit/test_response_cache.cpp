@@ -0,0 +1,106 @@
+#include "server/response_cache.h"
+#include "utils/helpers.h"
+#include <gtest/gtest.h>
+#include <thread>
+
+namespace solus::test {
+
+class ResponseCacheTest : public ::testing::Test {
+protected:
+  static ParsedResponse reply(const std::string &text) {
+    ParsedResponse parsed;
+    parsed.response = text;
+    return parsed;
+  }
+
+  ResponseCache cache{0.95f, std::chrono::seconds(60), 4};
+  ResponseCache::Clock::time_point now = ResponseCache::Clock::now();
+};
+
+TEST_F(ResponseCacheTest, HitsOnSimilarQuery) {
+  cache.insert("u1", "default", {1.0f, 0.0f, 0.0f}, reply("Paris"), now);
+  auto hit = cache.lookup("u1", "default", {2.0f, 0.1f, 0.0f}, now);
+  ASSERT_TRUE(hit.has_value());
+  EXPECT_EQ(*hit, "Paris");
+  EXPECT_FALSE(cache.lookup("u1", "default", {0.0f, 1.0f, 0.0f}, now));
+}
+
+TEST_F(ResponseCacheTest, ScopedToUserAndModel) {
+  cache.insert("u1", "default", {1.0f, 0.0f}, reply("Paris"), now);
+  EXPECT_FALSE(cache.lookup("u2", "default", {1.0f, 0.0f}, now));
+  EXPECT_FALSE(cache.lookup("u1", "small", {1.0f, 0.0f}, now));
+}
+
+TEST_F(ResponseCacheTest, ExpiresAfterTtl) {
+  cache.insert("u1", "default", {1.0f, 0.0f}, reply("Paris"), now);
+  EXPECT_TRUE(cache.lookup("u1", "default", {1.0f, 0.0f},
+                           now + std::chrono::seconds(59)));
+  EXPECT_FALSE(cache.lookup("u1", "default", {1.0f, 0.0f},
+                            now + std::chrono::seconds(60)));
+  EXPECT_EQ(cache.size(), 0u);
+}
+
+TEST_F(ResponseCacheTest, NeverStoresActions) {
+  ParsedResponse with_action = reply("Added.");
+  with_action.action = {{"type", "todo_add"}};
+  cache.insert("u1", "default", {1.0f, 0.0f}, with_action, now);
+  EXPECT_EQ(cache.size(), 0u);
+}
+
+TEST_F(ResponseCacheTest, EvictsOldestPerUser) {
+  for (int i = 0; i < 5; i++) {
+    std::vector<float> embedding(5, 0.0f);
+    embedding[i] = 1.0f;
+    cache.insert("u1", "default", embedding, reply(std::to_string(i)), now);
+  }
+  EXPECT_EQ(cache.size(), 4u);
+  EXPECT_FALSE(cache.lookup("u1", "default", {1, 0, 0, 0, 0}, now));
+  EXPECT_EQ(cache.lookup("u1", "default", {0, 0, 0, 0, 1}, now), "4");
+}
+
+TEST_F(ResponseCacheTest, SurvivesSaveAndLoad) {
+  TempDirectory dir;
+  const std::string path = dir.path() + "/response_cache.bin";
+  cache.insert("u1", "default", {1.0f, 0.0f}, reply("Paris"), now);
+  cache.insert("u2", "default", {0.0f, 1.0f}, reply("Rome"),
+               now - std::chrono::seconds(50));
+  ASSERT_TRUE(cache.save(path, now));
+  ResponseCache restored{0.95f, std::chrono::seconds(60), 4};
+  auto later = now + std::chrono::hours(1);
+  ASSERT_TRUE(restored.load(path, later));
+  EXPECT_EQ(restored.size(), 2u);
+  EXPECT_EQ(restored.lookup("u1", "default", {1.0f, 0.0f}, later), "Paris");
+  // Remaining lifetimes carry over: Rome had 10s left when saved.
+  EXPECT_FALSE(restored.lookup("u2", "default", {0.0f, 1.0f},
+                               later + std::chrono::seconds(10)));
+  EXPECT_FALSE(restored.load(dir.path() + "/missing.bin", later));
+}
+
+TEST(RequestCoalescerTest, FollowersShareLeaderResult) {
+  RequestCoalescer coalescer;
+  auto leader = coalescer.join("key");
+  ASSERT_TRUE(leader.leader);
+  auto follower = coalescer.join("key");
+  ASSERT_FALSE(follower.leader);
+  EXPECT_TRUE(coalescer.join("other").leader);
+  std::thread worker([&coalescer]() {
+    ParsedResponse result;
+    result.response = "done";
+    coalescer.complete("key", result);
+  });
+  EXPECT_EQ(follower.result.get().response, "done");
+  worker.join();
+  // The key is free again once the leader finishes.
+  EXPECT_TRUE(coalescer.join("key").leader);
+}
+
+TEST(RequestCoalescerTest, FollowersSeeLeaderFailure) {
+  RequestCoalescer coalescer;
+  coalescer.join("key");
+  auto follower = coalescer.join("key");
+  coalescer.fail("key",
+                 std::make_exception_ptr(std::runtime_error("boom")));
+  EXPECT_THROW(follower.result.get(), std::runtime_error);
+}
+
+} // namespace solus::test
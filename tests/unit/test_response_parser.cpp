@@ -20,7 +20,7 @@ TEST_F(ResponseParserTest, ParseActionWithResponse) {
   auto parsed = ResponseParser::parse_response(response);
   EXPECT_FALSE(parsed.action.empty());
   EXPECT_EQ(parsed.response, "Done!");
-  auto action_json = nlohmann::json::parse(parsed.action);
+  const auto &action_json = parsed.action;
   EXPECT_EQ(action_json["type"], "todo_add");
 }
 
@@ -68,8 +68,80 @@ TEST_F(ResponseParserTest, ParseNestedJson) {
     })";
   auto parsed = ResponseParser::parse_response(response);
   EXPECT_FALSE(parsed.action.empty());
-  auto action_json = nlohmann::json::parse(parsed.action);
+  const auto &action_json = parsed.action;
   EXPECT_TRUE(action_json["params"].contains("nested"));
 }
 
+TEST_F(ResponseParserTest, StreamEmitsActionBeforeResponseEnds) {
+  ResponseStreamParser stream;
+  std::string action_type;
+  size_t fed_at_action = 0;
+  size_t fed = 0;
+  stream.on_action([&](const nlohmann::json &action) {
+    action_type = action["type"].get<std::string>();
+    fed_at_action = fed;
+  });
+  std::string text =
+      R"({"action": {"type": "todo_add", "params": {"title": "x"}}, "response": "Added it to your list."})";
+  for (char c : text) {
+    stream.feed(std::string_view(&c, 1));
+    fed++;
+  }
+  EXPECT_EQ(action_type, "todo_add");
+  EXPECT_LT(fed_at_action, text.find("response"));
+  auto parsed = stream.finish();
+  EXPECT_EQ(parsed.response, "Added it to your list.");
+}
+
+TEST_F(ResponseParserTest, StreamMatchesWholeParse) {
+  std::string text =
+      R"(Sure. {"note": 1} then {"action": {"type": "note_create", "params": {"content": "a } \" {"}}} ok)";
+  auto whole = ResponseParser::parse_response(text);
+  ResponseStreamParser stream;
+  for (size_t i = 0; i < text.size(); i += 3) {
+    stream.feed(std::string_view(text).substr(i, 3));
+  }
+  auto chunked = stream.finish();
+  EXPECT_EQ(whole.action, chunked.action);
+  EXPECT_EQ(whole.response, chunked.response);
+  EXPECT_EQ(whole.action["params"]["content"], "a } \" {");
+  EXPECT_EQ(whole.response, "Sure. {\"note\": 1} then  ok");
+}
+
+TEST_F(ResponseParserTest, RecoversAfterInvalidObject) {
+  std::string text = R"({oops} {"action": {"type": "app_open"}, "response": "Opening"})";
+  auto parsed = ResponseParser::parse_response(text);
+  EXPECT_EQ(parsed.action["type"], "app_open");
+  EXPECT_EQ(parsed.response, "Opening");
+}
+
+TEST_F(ResponseParserTest, EarlierObjectResponseIsNotReused) {
+  std::string text =
+      R"({"response": "stale"} then {"action": {"type": "app_open"}})";
+  ResponseStreamParser stream;
+  std::string reported;
+  stream.on_response([&](const std::string &response) { reported = response; });
+  stream.feed(text);
+  auto parsed = stream.finish();
+  EXPECT_EQ(parsed.action["type"], "app_open");
+  EXPECT_EQ(parsed.response, R"({"response": "stale"} then )");
+  EXPECT_EQ(reported, parsed.response);
+}
+
+TEST_F(ResponseParserTest, NonObjectActionsAreReported) {
+  for (const std::string action : {R"("app_open")", R"(["a", 1])", "42"}) {
+    ResponseStreamParser stream;
+    std::string reported;
+    stream.on_action([&](const nlohmann::json &value) {
+      reported = ResponseParser::action_type(value);
+    });
+    stream.feed(R"({"action": )" + action + R"(, "response": "Ok"})");
+    auto parsed = stream.finish();
+    EXPECT_EQ(reported, nlohmann::json::parse(action).dump());
+    EXPECT_EQ(parsed.response, "Ok");
+  }
+  EXPECT_EQ(ResponseParser::action_type({{"type", "todo_add"}}), "todo_add");
+  EXPECT_EQ(ResponseParser::action_type({{"type", 3}}), R"({"type":3})");
+}
+
 } // namespace solus::test
\ No newline at end of file
@@ -0,0 +1,97 @@
+#include "server/shard_protocol.h"
+#include "utils/helpers.h"
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace solus::test {
+
+TEST(ShardProtocolTest, FrameRoundTripsOverSocket) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  ShardFrame sent;
+  sent.op = EShardOp::CHAT;
+  sent.status = 0;
+  sent.user_id = "user1";
+  sent.body = std::string("{\"text\":\"hi\"}\n\0binary", 22);
+  ASSERT_TRUE(write_frame(fds[0], sent));
+  ShardFrame received;
+  ASSERT_TRUE(read_frame(fds[1], received));
+  EXPECT_EQ(received.op, EShardOp::CHAT);
+  EXPECT_EQ(received.user_id, "user1");
+  EXPECT_EQ(received.body, sent.body);
+  close(fds[0]);
+  EXPECT_FALSE(read_frame(fds[1], received));
+  close(fds[1]);
+}
+
+TEST(ShardProtocolTest, ListenerAnswersEachRequest) {
+  TempDirectory dir;
+  const std::string path = dir.path() + "/test.sock";
+  ShardListener listener(path, [](const ShardFrame &frame) {
+    ShardFrame reply;
+    reply.status = 200;
+    reply.body = frame.user_id + ":" + frame.body;
+    return reply;
+  });
+  ASSERT_TRUE(listener.start());
+  for (int i = 0; i < 3; i++) {
+    ShardFrame request;
+    request.op = EShardOp::HEALTH;
+    request.user_id = "user" + std::to_string(i);
+    request.body = "ping";
+    ShardFrame reply = shard_request(path, request);
+    EXPECT_EQ(reply.op, EShardOp::REPLY);
+    EXPECT_EQ(reply.status, 200);
+    EXPECT_EQ(reply.body, request.user_id + ":ping");
+  }
+  listener.stop();
+  ShardFrame request;
+  request.op = EShardOp::HEALTH;
+  EXPECT_EQ(shard_request(path, request).status, 502);
+}
+
+TEST(ShardProtocolTest, RingIsStableAndSpreadsUsers) {
+  HashRing ring(4);
+  HashRing same(4);
+  std::vector<size_t> counts(4, 0);
+  for (int i = 0; i < 4000; i++) {
+    const std::string user = "user" + std::to_string(i);
+    const size_t shard = ring.shard_for(user);
+    ASSERT_LT(shard, 4u);
+    EXPECT_EQ(shard, same.shard_for(user));
+    counts[shard]++;
+  }
+  for (size_t count : counts) {
+    EXPECT_GT(count, 600u);
+    EXPECT_LT(count, 1400u);
+  }
+  // A fifth shard only takes users; none move between the old four.
+  HashRing grown(5);
+  for (int i = 0; i < 4000; i++) {
+    const std::string user = "user" + std::to_string(i);
+    const size_t shard = grown.shard_for(user);
+    EXPECT_TRUE(shard == 4 || shard == ring.shard_for(user));
+  }
+}
+
+TEST(ShardProtocolTest, MapOverridesSurviveSaveAndLoad) {
+  TempDirectory dir;
+  const std::string path = dir.path() + "/shards.json";
+  ShardMap map(3);
+  const size_t home = map.shard_for("alice");
+  const size_t away = (home + 1) % 3;
+  map.assign("alice", away);
+  map.assign("bob", map.shard_for("bob")); // matches the ring
+  EXPECT_EQ(map.shard_for("alice"), away);
+  EXPECT_EQ(map.overrides().size(), 1u);
+  ASSERT_TRUE(map.save(path));
+
+  ShardMap loaded(3);
+  ASSERT_TRUE(loaded.load(path));
+  EXPECT_EQ(loaded.shard_for("alice"), away);
+  loaded.assign("alice", home);
+  EXPECT_TRUE(loaded.overrides().empty());
+}
+
+} // namespace solus::test
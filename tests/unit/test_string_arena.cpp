@@ -0,0 +1,53 @@
+#include "memory/string_arena.h"
+#include "utils/helpers.h"
+#include <gtest/gtest.h>
+
+namespace solus::test {
+
+TEST(StringArenaTest, ViewsSurviveChunkGrowth) {
+  StringArena arena(16);
+  std::vector<std::string_view> views;
+  for (int i = 0; i < 100; i++) {
+    views.push_back(arena.append("entry " + std::to_string(i)));
+  }
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(views[i], "entry " + std::to_string(i));
+  }
+}
+
+TEST(StringArenaTest, OversizedString) {
+  StringArena arena(16);
+  std::string big = RandomGenerator::string(1000);
+  auto small = arena.append("small");
+  auto stored = arena.append(big);
+  auto after = arena.append("after");
+  EXPECT_EQ(stored, big);
+  EXPECT_EQ(small, "small");
+  EXPECT_EQ(after, "after");
+  EXPECT_EQ(arena.bytes_used(), big.size() + 10);
+}
+
+TEST(StringArenaTest, TokenArenaKeepsRuns) {
+  TokenArena arena(8);
+  std::vector<int32_t> a = {1, 2, 3, 4, 5};
+  std::vector<int32_t> b = {6, 7, 8, 9, 10, 11};
+  auto sa = arena.append(a);
+  auto sb = arena.append(b);
+  EXPECT_TRUE(std::equal(sa.begin(), sa.end(), a.begin(), a.end()));
+  EXPECT_TRUE(std::equal(sb.begin(), sb.end(), b.begin(), b.end()));
+  EXPECT_EQ(arena.used(), 11u);
+}
+
+TEST(StringInternerTest, SameStringSameId) {
+  StringInterner interner;
+  uint32_t a = interner.intern("user1");
+  uint32_t b = interner.intern("user2");
+  EXPECT_NE(a, b);
+  EXPECT_EQ(interner.intern(std::string("user1")), a);
+  EXPECT_EQ(interner.find("user2"), b);
+  EXPECT_EQ(interner.find("user3"), StringInterner::kInvalidId);
+  EXPECT_EQ(interner.get(a), "user1");
+  EXPECT_EQ(interner.size(), 2u);
+}
+
+} // namespace solus::test
@@ -0,0 +1,110 @@
+#include "llm/throughput_bench.h"
+#include "llm/tiny_model.h"
+#include "utils/helpers.h"
+#include <gtest/gtest.h>
+
+namespace solus::test {
+
+namespace {
+
+nlohmann::json results(double decode_tok_s, double ttft_ms) {
+  return ThroughputBench::to_json(
+      {{"decode_tok_s", decode_tok_s, "tok/s", true},
+       {"ttft_ms", ttft_ms, "ms", false}});
+}
+
+} // namespace
+
+TEST(ThroughputBenchTest, CompareFlagsOnlySlowdownsBeyondThreshold) {
+  const auto baseline = results(100.0, 10.0);
+  // 5% slower decode and 5% longer TTFT stay within 10%.
+  for (const auto &delta :
+       ThroughputBench::compare(results(95.0, 10.5), baseline, 0.1)) {
+    EXPECT_FALSE(delta.regressed) << delta.name;
+  }
+  auto deltas = ThroughputBench::compare(results(80.0, 9.0), baseline, 0.1);
+  ASSERT_EQ(deltas.size(), 2u);
+  for (const auto &delta : deltas) {
+    if (delta.name == "decode_tok_s") {
+      EXPECT_TRUE(delta.regressed);
+      EXPECT_NEAR(delta.change, 0.2, 1e-9);
+    } else {
+      // Lower latency is an improvement.
+      EXPECT_FALSE(delta.regressed);
+      EXPECT_NEAR(delta.change, -0.1, 1e-9);
+    }
+  }
+  deltas = ThroughputBench::compare(results(100.0, 12.0), baseline, 0.1);
+  EXPECT_TRUE(deltas[0].regressed || deltas[1].regressed);
+}
+
+TEST(ThroughputBenchTest, MissingMetricIsARegression) {
+  auto baseline = results(100.0, 10.0);
+  auto current = ThroughputBench::to_json({{"ttft_ms", 10.0, "ms", false}});
+  auto deltas = ThroughputBench::compare(current, baseline, 0.1);
+  ASSERT_EQ(deltas.size(), 2u);
+  size_t missing = 0;
+  for (const auto &delta : deltas) {
+    missing += delta.missing ? 1 : 0;
+    EXPECT_EQ(delta.regressed, delta.missing) << delta.name;
+  }
+  EXPECT_EQ(missing, 1u);
+  // Metrics new since the baseline are not compared.
+  EXPECT_EQ(ThroughputBench::compare(baseline, current, 0.1).size(), 1u);
+}
+
+TEST(ThroughputBenchTest, TinyModelLoadsAndRunsEveryBenchmark) {
+  TempDirectory dir;
+  TinyModelSpec spec;
+  spec.n_layer = 2;
+  const std::string path = dir.path() + "/tiny.gguf";
+  ASSERT_TRUE(write_tiny_model(path, spec));
+  ModelInfo info;
+  ASSERT_TRUE(LlamaHandler::read_model_info(path, info));
+  EXPECT_EQ(info.n_embd, spec.n_embd);
+  EXPECT_EQ(info.n_vocab, spec.n_vocab);
+
+  ServerConfig config;
+  config.model_path = path;
+  config.n_ctx = 512;
+  config.n_threads = 2;
+  config.n_gpu_layers = 0;
+  config.n_parallel = 2;
+  config.embedding_ctx_size = 256;
+  config.embedding_batch_size = 2;
+  LlamaHandler llm(config);
+  ASSERT_TRUE(llm.initialize());
+  ASSERT_FALSE(llm.tokenize("hello world").empty());
+  GenerationParams params;
+  params.max_tokens = 8;
+  // Special and byte tokens are never sampled, so each token is text.
+  size_t pieces = 0;
+  llm.generate("hello world", params, [&pieces](std::string_view) {
+    pieces++;
+    return true;
+  });
+  EXPECT_EQ(pieces, 8u);
+  EXPECT_EQ(llm.get_embedding("hello world").size(),
+            static_cast<size_t>(spec.n_embd));
+
+  BenchOptions options;
+  options.prompt_tokens = 64;
+  options.decode_tokens = 8;
+  options.embed_words = 8;
+  options.concurrency = {1, 2};
+  options.batch_prompt_tokens = 16;
+  options.batch_decode_tokens = 4;
+  options.repetitions = 1;
+  ThroughputBench bench(llm);
+  auto metrics = bench.run(options);
+  ASSERT_EQ(metrics.size(), 7u);
+  for (const auto &metric : metrics) {
+    EXPECT_GT(metric.value, 0.0) << metric.name;
+  }
+  auto json = ThroughputBench::to_json(metrics);
+  for (const auto &delta : ThroughputBench::compare(json, json, 0.0)) {
+    EXPECT_FALSE(delta.regressed) << delta.name;
+  }
+}
+
+} // namespace solus::test
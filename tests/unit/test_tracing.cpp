@@ -0,0 +1,94 @@
+#include "utils/tracing.h"
+#include <gtest/gtest.h>
+#include <nlohmann/json.hpp>
+#include <thread>
+
+namespace solus::test {
+
+TEST(TracingTest, SpansAttachToCurrentRequest) {
+  Tracer tracer(1.0, 0, 8);
+  uint64_t id = 0;
+  {
+    RequestTrace trace(&tracer);
+    ASSERT_TRUE(trace.active());
+    id = trace.id();
+    EXPECT_EQ(RequestTrace::current(), &trace);
+    TraceSpan span("llm.decode");
+    span.set_count(12);
+  }
+  EXPECT_EQ(RequestTrace::current(), nullptr);
+  EXPECT_EQ(tracer.kept(), 1u);
+  auto doc = nlohmann::json::parse(tracer.to_chrome_json());
+  const auto &events = doc["traceEvents"];
+  ASSERT_EQ(events.size(), 2u);
+  EXPECT_EQ(events[0]["name"], "request");
+  EXPECT_EQ(events[1]["name"], "llm.decode");
+  EXPECT_EQ(events[1]["ph"], "X");
+  EXPECT_EQ(events[1]["args"]["count"], 12);
+  EXPECT_EQ(events[1]["args"]["trace_id"], Tracer::format_id(id));
+  EXPECT_GE(events[1]["ts"].get<int64_t>(), events[0]["ts"].get<int64_t>());
+}
+
+TEST(TracingTest, SpansWithoutRequestAreIgnored) {
+  Tracer tracer(1.0, 0, 8);
+  { TraceSpan span("orphan"); }
+  {
+    RequestTrace inert(nullptr);
+    EXPECT_FALSE(inert.active());
+    TraceSpan span("inert");
+  }
+  EXPECT_EQ(tracer.kept(), 0u);
+}
+
+TEST(TracingTest, SamplingKeepsSlowRequests) {
+  Tracer tracer(0.0, 1, 8);
+  { RequestTrace fast(&tracer); }
+  EXPECT_EQ(tracer.kept(), 0u);
+  {
+    RequestTrace slow(&tracer);
+    std::this_thread::sleep_for(std::chrono::milliseconds(3));
+  }
+  EXPECT_EQ(tracer.kept(), 1u);
+}
+
+TEST(TracingTest, RingBufferKeepsNewest) {
+  Tracer tracer(1.0, 0, 2);
+  std::vector<uint64_t> ids;
+  for (int i = 0; i < 3; i++) {
+    RequestTrace trace(&tracer);
+    ids.push_back(trace.id());
+  }
+  EXPECT_EQ(tracer.kept(), 2u);
+  auto doc = nlohmann::json::parse(tracer.to_chrome_json());
+  ASSERT_EQ(doc["traceEvents"].size(), 2u);
+  EXPECT_EQ(doc["traceEvents"][0]["args"]["trace_id"],
+            Tracer::format_id(ids[1]));
+  EXPECT_EQ(doc["traceEvents"][1]["args"]["trace_id"],
+            Tracer::format_id(ids[2]));
+}
+
+TEST(TracingTest, TracedLockRecordsOnlyContention) {
+  Tracer tracer(1.0, 0, 8);
+  std::mutex mutex;
+  {
+    RequestTrace trace(&tracer);
+    { auto lock = traced_lock(mutex, "uncontended"); }
+    std::atomic<bool> held{false};
+    std::thread holder([&]() {
+      std::lock_guard<std::mutex> lock(mutex);
+      held = true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    });
+    while (!held) {
+      std::this_thread::yield();
+    }
+    { auto lock = traced_lock(mutex, "contended"); }
+    holder.join();
+  }
+  auto doc = nlohmann::json::parse(tracer.to_chrome_json());
+  const auto &events = doc["traceEvents"];
+  ASSERT_EQ(events.size(), 2u);
+  EXPECT_EQ(events[1]["name"], "contended");
+}
+
+} // namespace solus::test
@@ -0,0 +1,59 @@
+#include "server/traffic_capture.h"
+#include "utils/helpers.h"
+#include <gtest/gtest.h>
+
+namespace solus::test {
+
+class TrafficCaptureTest : public ::testing::Test {
+protected:
+  void SetUp() override { m_TempDir = std::make_unique<TempDirectory>(); }
+
+  std::unique_ptr<TempDirectory> m_TempDir;
+};
+
+TEST_F(TrafficCaptureTest, RoundTripsSortedByArrival) {
+  const std::string path = m_TempDir->path() + "/capture.ndjson";
+  {
+    TrafficCapture capture;
+    CaptureHeader header;
+    header.started_ms = 1700000000000;
+    header.model_path = "model.gguf";
+    header.memory_snapshot = "snapshot";
+    ASSERT_TRUE(capture.open(path, header));
+    CaptureRecord late;
+    late.arrival_ms = 250;
+    late.user_id = "u2";
+    late.text = "second";
+    late.seed = 7;
+    late.status = 200;
+    late.action = {{"type", "todo_add"}};
+    capture.write(late);
+    CaptureRecord early;
+    early.arrival_ms = 100;
+    early.user_id = "u1";
+    early.text = "first \"quoted\"\nline";
+    early.use_cache = false;
+    early.response = "ok";
+    capture.write(early);
+  }
+  CaptureHeader header;
+  std::vector<CaptureRecord> records;
+  ASSERT_TRUE(TrafficCapture::load(path, header, records));
+  EXPECT_EQ(header.started_ms, 1700000000000);
+  EXPECT_EQ(header.memory_snapshot, "snapshot");
+  ASSERT_EQ(records.size(), 2u);
+  EXPECT_EQ(records[0].text, "first \"quoted\"\nline");
+  EXPECT_FALSE(records[0].use_cache);
+  EXPECT_TRUE(records[0].action.is_null());
+  EXPECT_EQ(records[1].seed, 7u);
+  EXPECT_EQ(records[1].action["type"], "todo_add");
+}
+
+TEST_F(TrafficCaptureTest, RejectsMissingFile) {
+  CaptureHeader header;
+  std::vector<CaptureRecord> records;
+  EXPECT_FALSE(TrafficCapture::load(m_TempDir->path() + "/missing", header,
+                                    records));
+}
+
+} // namespace solus::test